@@ -6,14 +6,146 @@
 
 #include "latypus.h"
 
+#include <sys/resource.h>
+
 #define NUM_REQUESTS_DEFAULT        1
 #define KEEPALIVE_REQUESTS_DEFAULT  0
+#define HISTOGRAM_MAX_USECS         3600000000LL
+#define HISTOGRAM_SIG_FIGS          3
+#define SCHEDULE_SPIN_USECS         200
+#define REPLAY_SPEED_DEFAULT        1.0
+#define IDLE_TRICKLE_RATE_DEFAULT   100.0
+#define IDLE_SETTLE_MSECS           1000
+#define IDLE_RESERVED_FDS           64
 
 #define expand(s) quote(s)
 #define quote(s) #s
 
 using namespace std::chrono;
 
+struct netb_histograms
+{
+    hdr_histogram latency;      /* intended start to response finished */
+    hdr_histogram service;      /* request started on a connection to response finished */
+    hdr_histogram connect;      /* tcp connect, connection rate and idle hold modes */
+    hdr_histogram handshake;    /* tls handshake, connection rate and idle hold modes */
+    
+    netb_histograms() :
+        latency(HISTOGRAM_MAX_USECS, HISTOGRAM_SIG_FIGS),
+        service(HISTOGRAM_MAX_USECS, HISTOGRAM_SIG_FIGS),
+        connect(HISTOGRAM_MAX_USECS, HISTOGRAM_SIG_FIGS),
+        handshake(HISTOGRAM_MAX_USECS, HISTOGRAM_SIG_FIGS) {}
+};
+
+typedef std::unique_ptr<netb_histograms> netb_histograms_ptr;
+
+
+/*
+ * netb_template
+ *
+ * String with {rand:N} and {seq} placeholders, expanding to a random
+ * integer below N and the request sequence number.
+ */
+
+struct netb_template
+{
+    std::vector<std::string>    literals;   /* one more literal than placeholders */
+    std::vector<uint64_t>       bounds;     /* 0 for {seq} */
+    
+    bool parse(std::string str);
+    bool is_constant() const { return bounds.size() == 0; }
+    std::string render(xorshift64star &rng, uint64_t seq) const;
+};
+
+
+/*
+ * netb_workload
+ *
+ * Weighted request mix read from a workload file:
+ *
+ *   request {
+ *       weight  10;
+ *       method  POST;
+ *       url     "/api/items/{rand:1000}";
+ *       header  Content-Type application/json;
+ *       body    1024;
+ *   }
+ *
+ * url may be absolute or a path relative to the benchmark url. body is a
+ * size in bytes, body_file sends the contents of a file. A Host header
+ * replaces the one taken from the url.
+ */
+
+struct netb_workload_entry
+{
+    double                      weight;
+    HTTPMethod                  method;
+    url_ptr                     url;
+    netb_template               path;
+    std::string                 host;
+    std::vector<std::pair<std::string,netb_template>> headers;
+    std::string                 body;
+    
+    netb_workload_entry() : weight(1), method(HTTPMethodGET) {}
+};
+
+struct netb_workload : config_parser
+{
+    std::string                         base_url;
+    std::vector<netb_workload_entry>    entries;
+    alias_sampler                       sampler;
+    std::vector<std::string>            line;
+    std::string                         url_string;
+    bool                                in_request;
+    bool                                error;
+    
+    netb_workload() : in_request(false), error(false) {}
+    
+    bool read(std::string workload_file, url_ptr bench_url);
+    bool fail(const char *fmt, ...);
+    
+    void symbol(const char *value, size_t length);
+    void start_block();
+    void end_block();
+    void end_statement();
+    void config_done();
+};
+
+
+/*
+ * netb_replay_record
+ *
+ * Request taken from an access log, binary or common/combined text.
+ */
+
+struct netb_replay_record
+{
+    uint64_t                    offset_usecs;   /* from the first record */
+    HTTPMethod                  method;
+    std::string                 path;
+    std::string                 host;
+};
+
+/*
+ * netb_socket
+ *
+ * Blocking connection for the connection rate and idle hold modes,
+ * which time each connect and handshake themselves.
+ */
+
+struct netb_socket
+{
+    int fd;
+    SSL *ssl;
+    
+    netb_socket() : fd(-1), ssl(nullptr) {}
+    
+    bool write_all(const char *buf, size_t len);
+    ssize_t read(char *buf, size_t len);
+    void close();
+};
+
+
 struct netb
 {
     static cmdline_option options[];
@@ -21,50 +153,173 @@ struct netb
     protocol_engine engine;
     
     std::atomic<int>    processed_requests;
+    std::atomic<int>    finished_requests;
+    std::atomic<int>    failed_requests;
     std::atomic<size_t> bytes_transfered;
+    std::atomic<int>    handshakes_started;
+    std::atomic<int>    handshakes_resumed;
+    std::atomic<int>    handshake_errors;
+    std::atomic<unsigned long> handshake_usecs;
+    std::atomic<int>    next_slot;
+    std::atomic<int>    connections_opened;
+    std::atomic<int>    connection_errors;
+    std::atomic<int>    reconnects;
     int                 client_connections;
     int                 connection_timeout;
     int                 keepalive_requests;
     int                 keepalive_timeout;
+    int                 pipeline_depth;
     int                 header_buffer_size;
     int                 io_buffer_size;
     int                 num_requests;
     int                 num_threads;
+    double              request_rate;
+    double              replay_speed;
+    double              connection_rate;
+    int                 idle_connections;
+    bool                tls_resume;
     bool                per_request_stats;
     bool                help_or_error;
     int                 debug_level;
     std::string         tls_ca_file;
+    std::string         tls_cipher_list;
+    std::string         tls_curves;
+    std::string         handshake_mode;
+    std::string         json_report;
+    std::string         pollset_type;
     std::string         bench_url;
+    std::string         workload_file;
+    std::string         replay_file;
+    std::string         stats_url;
+    std::vector<socket_addr> source_addrs;
+    
+    url_ptr             req_url;
+    netb_workload       workload;
+    std::vector<netb_replay_record> replay_records;
+    xorshift64star      rng;
+    uint64_t            request_seq;
+    socket_addr         server_addr;
+    steady_clock::time_point schedule_start;
+    std::vector<netb_socket> idle_sockets;
+    int                 idle_opened;
+    long long           server_rss_before;
+    long long           server_rss_opened;
+    long long           server_rss_after;
+    
+    std::mutex          histograms_mutex;
+    std::vector<netb_histograms_ptr> histograms_all;
 
     netb();
     bool process_cmdline(int argc, const char *argv[]);
+    netb_histograms* thread_histograms();
+    void finish_request();
+    bool read_replay(std::string log_file);
+    bool read_replay_binary(FILE *file);
+    bool read_replay_text(FILE *file);
+    bool parse_replay_line(char *line);
+    void wait_until(steady_clock::time_point intended);
+    void submit_request(steady_clock::time_point intended);
+    void submit_replay(const netb_replay_record &rec, steady_clock::time_point intended);
+    void start_request(http_client_request_ptr request);
+    void report(double secs);
     void run();
+    void run_handshakes();
+    void handshake_thread(SSL_CTX *ctx, socket_addr addr, std::string host);
+    bool parse_source_addrs(std::string spec);
+    SSL_CTX* create_tls_context();
+    int connect_socket(const socket_addr &addr, size_t source_index);
+    bool open_socket(netb_socket &sock, size_t source_index, SSL_CTX *ctx, SSL_SESSION **session);
+    bool exchange(netb_socket &sock, const std::string &request, size_t &bytes, std::string *body = nullptr);
+    std::string format_request(url_ptr u, bool close);
+    long long fetch_server_rss();
+    SSL_CTX* resolve_server();
+    void run_connection_rate();
+    void connection_rate_thread(SSL_CTX *ctx, std::string request);
+    void run_idle_hold();
+    void idle_open_thread(SSL_CTX *ctx, size_t begin, size_t end);
+    void idle_trickle_thread(SSL_CTX *ctx, std::string request, int thread_num, int thread_count);
 };
 
 struct netb_client_handler_file : http_client_handler_file
 {
     netb *client;
-    std::chrono::high_resolution_clock::time_point t1;
-    std::chrono::high_resolution_clock::time_point t2;
+    const netb_workload_entry *entry;
+    uint64_t seq;
+    size_t body_offset;
+    steady_clock::time_point intended;
+    steady_clock::time_point t1;
+    steady_clock::time_point t2;
+    bool completed;
     
-    netb_client_handler_file(netb *client) : client(client) {}
+    netb_client_handler_file(netb *client, steady_clock::time_point intended) :
+        client(client), entry(nullptr), seq(0), body_offset(0), intended(intended), completed(false) {}
     
     void init();
+    bool populate_request();
+    io_result write_request_body();
     bool end_request();
+    void abort_request();
 };
 
 void netb_client_handler_file::init()
 {
-    t1 = high_resolution_clock::now();
+    t1 = steady_clock::now();
+    body_offset = 0;
     http_client_handler_file::init();
 }
 
+bool netb_client_handler_file::populate_request()
+{
+    http_client_handler_file::populate_request();
+    if (!entry) {
+        return true;
+    }
+    
+    // header templates expand on the worker thread so the submitter only samples
+    static thread_local xorshift64star rng(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    for (auto &header : entry->headers) {
+        std::string value = header.second.is_constant() ? header.second.literals[0] : header.second.render(rng, seq);
+        if (!http_conn->request.set_header_field(header.first, value)) {
+            return false;
+        }
+    }
+    if (entry->body.size() > 0 || request_method == HTTPMethodPOST || request_method == HTTPMethodPUT) {
+        http_conn->request.set_header_field(kHTTPHeaderContentLength, std::to_string(entry->body.size()));
+    }
+    http_conn->request_has_body = entry->body.size() > 0;
+    return true;
+}
+
+io_result netb_client_handler_file::write_request_body()
+{
+    if (!entry) {
+        return io_result(0);
+    }
+    while (body_offset < entry->body.size()) {
+        io_result result = http_conn->conn.write((void*)(entry->body.data() + body_offset),
+                                                 entry->body.size() - body_offset);
+        if (result.has_error()) {
+            return result;
+        }
+        body_offset += result.size();
+    }
+    return io_result(0);
+}
+
 bool netb_client_handler_file::end_request()
 {
+    completed = true;
     http_client_handler_file::end_request();
-    t2 = high_resolution_clock::now();
+    t2 = steady_clock::now();
     client->processed_requests++;
     client->bytes_transfered += total_read;
+    
+    // latency counts from the scheduled start so a stalled server
+    // is charged for the requests it delayed (coordinated omission)
+    netb_histograms *h = client->thread_histograms();
+    h->latency.record(duration_cast<microseconds>(t2 - intended).count());
+    h->service.record(duration_cast<microseconds>(t2 - t1).count());
+    
     double secs = duration_cast<microseconds>(t2 - t1).count() / 1000000.0;
     if (client->per_request_stats) {
         printf("%9.6lf secs,  %ld bytes transferred,  %lf MB/sec\n",
@@ -72,26 +327,283 @@ bool netb_client_handler_file::end_request()
                total_read,
                total_read / secs / (1 << 20));
     }
-    if (client->processed_requests == client->num_requests) {
-        client->engine.stop();
+    client->finish_request();
+    return true;
+}
+
+void netb_client_handler_file::abort_request()
+{
+    // dropped by a failed or closed connection, still counts towards the run
+    if (completed) {
+        return;
+    }
+    completed = true;
+    client->failed_requests++;
+    client->finish_request();
+}
+
+/* netb_template */
+
+bool netb_template::parse(std::string str)
+{
+    literals.clear();
+    bounds.clear();
+    std::string literal;
+    size_t pos = 0;
+    while (pos < str.length()) {
+        size_t open = str.find('{', pos);
+        if (open == std::string::npos) break;
+        size_t close = str.find('}', open);
+        if (close == std::string::npos) break;
+        std::string var = str.substr(open + 1, close - open - 1);
+        uint64_t bound;
+        if (var == "seq") {
+            bound = 0;
+        } else if (var.compare(0, 5, "rand:") == 0 && (bound = strtoull(var.c_str() + 5, nullptr, 10)) > 0) {
+            // bound set
+        } else {
+            return false;
+        }
+        literals.push_back(literal + str.substr(pos, open - pos));
+        bounds.push_back(bound);
+        literal.clear();
+        pos = close + 1;
+    }
+    literals.push_back(literal + str.substr(pos));
+    return true;
+}
+
+std::string netb_template::render(xorshift64star &rng, uint64_t seq) const
+{
+    std::string str = literals[0];
+    for (size_t i = 0; i < bounds.size(); i++) {
+        // multiply shift maps the random number into [0, bound) without a division
+        uint64_t value = bounds[i] ? rng.next(bounds[i]) : seq;
+        str.append(std::to_string(value));
+        str.append(literals[i + 1]);
+    }
+    return str;
+}
+
+
+/* netb_workload */
+
+bool netb_workload::read(std::string workload_file, url_ptr bench_url)
+{
+    FILE *file = fopen(workload_file.c_str(), "r");
+    if (!file) {
+        return fail("%s: %s", workload_file.c_str(), strerror(errno));
+    }
+    std::vector<char> buf;
+    char chunk[4096];
+    size_t len;
+    while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        buf.insert(buf.end(), chunk, chunk + len);
+    }
+    fclose(file);
+    buf.push_back('\n');
+    buf.push_back('\0');
+    
+    std::stringstream ss;
+    ss << bench_url->scheme << "://" << bench_url->host << ":" << bench_url->port;
+    base_url = ss.str();
+    if (!parse(buf.data(), buf.size() - 1)) {
+        return fail("%s: parse error", workload_file.c_str());
+    }
+    if (error) {
+        return false;
+    }
+    if (entries.size() == 0) {
+        return fail("%s: no requests", workload_file.c_str());
+    }
+    
+    std::vector<double> weights;
+    for (auto &entry : entries) {
+        weights.push_back(entry.weight);
+    }
+    if (!sampler.init(weights)) {
+        return fail("%s: invalid weights", workload_file.c_str());
+    }
+    return true;
+}
+
+bool netb_workload::fail(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "error: workload: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return !(error = true);
+}
+
+void netb_workload::symbol(const char *value, size_t length)
+{
+    line.push_back(std::string(value, length));
+}
+
+void netb_workload::start_block()
+{
+    if (in_request || line.size() != 1 || line[0] != "request") {
+        fail("unexpected block: %s", line.size() > 0 ? line[0].c_str() : "");
+    }
+    entries.push_back(netb_workload_entry());
+    url_string.clear();
+    in_request = true;
+    line.clear();
+}
+
+void netb_workload::end_block()
+{
+    if (!in_request) return;
+    in_request = false;
+    auto &entry = entries.back();
+    if (url_string.length() == 0) {
+        fail("request %lu: missing url", entries.size());
+        return;
+    }
+    entry.url = url_ptr(new url(url_string[0] == '/' ? base_url + url_string : url_string));
+    if (!entry.url->valid) {
+        fail("request %lu: invalid url: %s", entries.size(), url_string.c_str());
+    } else if (!entry.path.parse(entry.url->path)) {
+        fail("request %lu: invalid template: %s", entries.size(), entry.url->path.c_str());
+    }
+}
+
+void netb_workload::end_statement()
+{
+    if (line.size() == 0) return;
+    if (!in_request) {
+        fail("directive outside request block: %s", line[0].c_str());
+        line.clear();
+        return;
+    }
+    auto &entry = entries.back();
+    if (line[0] == "weight" && line.size() == 2) {
+        entry.weight = atof(line[1].c_str());
+    } else if (line[0] == "method" && line.size() == 2) {
+        entry.method = http_constants::get_method_type(line[1].c_str());
+        if (entry.method == HTTPMethodNone) {
+            fail("unknown method: %s", line[1].c_str());
+        }
+    } else if (line[0] == "url" && line.size() == 2) {
+        url_string = line[1];
+    } else if (line[0] == "header" && line.size() >= 3) {
+        if (strcasecmp(line[1].c_str(), kHTTPHeaderHost) == 0) {
+            entry.host = line[2];
+        } else {
+            netb_template value;
+            if (!value.parse(config::join(line, " ").substr(line[0].length() + line[1].length() + 2))) {
+                fail("invalid template: %s", line[2].c_str());
+            }
+            entry.headers.push_back(std::pair<std::string,netb_template>(line[1], value));
+        }
+    } else if (line[0] == "body" && line.size() == 2) {
+        entry.body = std::string(strtoul(line[1].c_str(), nullptr, 10), 'x');
+    } else if (line[0] == "body_file" && line.size() == 2) {
+        FILE *file = fopen(line[1].c_str(), "r");
+        if (!file) {
+            fail("%s: %s", line[1].c_str(), strerror(errno));
+        } else {
+            char chunk[4096];
+            size_t len;
+            entry.body.clear();
+            while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+                entry.body.append(chunk, len);
+            }
+            fclose(file);
+        }
+    } else {
+        fail("invalid directive: %s", config::join(line, " ").c_str());
+    }
+    line.clear();
+}
+
+void netb_workload::config_done() {}
+
+
+/* netb_socket */
+
+bool netb_socket::write_all(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = ssl ? SSL_write(ssl, buf, (int)len) : ::write(fd, buf, len);
+        if (ret <= 0) {
+            if (!ssl && ret < 0 && errno == EINTR) continue;
+            return false;
+        }
+        buf += ret;
+        len -= ret;
     }
     return true;
 }
 
+ssize_t netb_socket::read(char *buf, size_t len)
+{
+    if (ssl) {
+        int ret = SSL_read(ssl, buf, (int)len);
+        if (ret > 0) return ret;
+        int err = SSL_get_error(ssl, ret);
+        return (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && ret == 0)) ? 0 : -1;
+    }
+    ssize_t ret;
+    do {
+        ret = ::read(fd, buf, len);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+void netb_socket::close()
+{
+    if (ssl) {
+        // a session freed without close_notify is not resumable
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        ssl = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+
 netb::netb() :
     processed_requests(0),
+    finished_requests(0),
+    failed_requests(0),
     bytes_transfered(0),
+    handshakes_started(0),
+    handshakes_resumed(0),
+    handshake_errors(0),
+    handshake_usecs(0),
+    next_slot(0),
+    connections_opened(0),
+    connection_errors(0),
+    reconnects(0),
     client_connections(CLIENT_CONNECTIONS_DEFAULT),
     connection_timeout(CONNETION_TIMEOUT_DEFAULT),
     keepalive_requests(KEEPALIVE_REQUESTS_DEFAULT),
     keepalive_timeout(KEEPALIVE_TIMEOUT_DEFAULT),
+    pipeline_depth(CLIENT_PIPELINE_DEPTH_DEFAULT),
     header_buffer_size(HEADER_BUFFER_SIZE_DEFAULT),
     io_buffer_size(IO_BUFFER_SIZE_DEFAULT),
     num_requests(NUM_REQUESTS_DEFAULT),
     num_threads(std::thread::hardware_concurrency()),
+    request_rate(0),
+    replay_speed(REPLAY_SPEED_DEFAULT),
+    connection_rate(0),
+    idle_connections(0),
+    tls_resume(false),
     per_request_stats(false),
     help_or_error(false),
-    debug_level(0)
+    debug_level(0),
+    request_seq(0),
+    idle_opened(0),
+    server_rss_before(-1),
+    server_rss_opened(-1),
+    server_rss_after(-1)
 {}
 
 bool netb::process_cmdline(int argc, const char *argv[])
@@ -116,6 +628,16 @@ bool netb::process_cmdline(int argc, const char *argv[])
         { "-K", "--keepalive-timeout", cmdline_arg_type_int,
             "Keepalive timeout seconds (default " expand(KEEPALIVE_TIMEOUT_DEFAULT) ")",
             [&](std::string s) { keepalive_timeout = atoi(s.c_str()); return true; } },
+        { "-N", "--pipeline", cmdline_arg_type_int,
+            "Requests written ahead on each connection (default " expand(CLIENT_PIPELINE_DEPTH_DEFAULT) ")",
+            [&](std::string s) {
+                pipeline_depth = atoi(s.c_str());
+                if (pipeline_depth < 1) {
+                    fprintf(stderr, "%s: invalid pipeline depth: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                return true;
+            } },
         { "-H", "--header-buffer-size", cmdline_arg_type_int,
             "Header Buffer Size (default " expand(HEADER_BUFFER_SIZE_DEFAULT) ")",
             [&](std::string s) { io_buffer_size = atoi(s.c_str()); return true; } },
@@ -128,12 +650,95 @@ bool netb::process_cmdline(int argc, const char *argv[])
         { "-t", "--num-threads", cmdline_arg_type_int,
             "Number of threads (default hardware concurrency)",
             [&](std::string s) { num_threads = atoi(s.c_str()); return true; } },
+        { "-r", "--rate", cmdline_arg_type_string,
+            "Open loop: start requests at this many per second regardless of responses",
+            [&](std::string s) {
+                request_rate = atof(s.c_str());
+                if (request_rate <= 0) {
+                    fprintf(stderr, "%s: invalid rate: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                return true;
+            } },
+        { "-w", "--workload", cmdline_arg_type_string,
+            "Workload file with a weighted mix of request templates",
+            [&](std::string s) { workload_file = s; return true; } },
+        { "-R", "--replay", cmdline_arg_type_string,
+            "Replay the requests and timing of an access log (binary or text)",
+            [&](std::string s) { replay_file = s; return true; } },
+        { "-s", "--replay-speed", cmdline_arg_type_string,
+            "Replay speed multiplier (default " expand(REPLAY_SPEED_DEFAULT) ")",
+            [&](std::string s) {
+                replay_speed = atof(s.c_str());
+                if (replay_speed <= 0) {
+                    fprintf(stderr, "%s: invalid replay speed: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                return true;
+            } },
+        { "-J", "--json", cmdline_arg_type_string,
+            "Write a JSON report to this file",
+            [&](std::string s) { json_report = s; return true; } },
         { "-p", "--per-request-stats", cmdline_arg_type_none,
             "Print statistics for every request",
             [&](std::string s) { return (per_request_stats = true); } },
+        { "-P", "--pollset", cmdline_arg_type_string,
+            "Pollset type: poll, epoll, kqueue or uring_poll (default platform)",
+            [&](std::string s) { pollset_type = s; return true; } },
         { "-X", "--cacert", cmdline_arg_type_string,
             "CA certificate file",
             [&](std::string s) { tls_ca_file = s.c_str(); return true; } },
+        { "-L", "--cipher-list", cmdline_arg_type_string,
+            "TLS cipher list",
+            [&](std::string s) { tls_cipher_list = s; return true; } },
+        { "-E", "--curves", cmdline_arg_type_string,
+            "TLS curve list (default " TLS_CURVES_DEFAULT ")",
+            [&](std::string s) { tls_curves = s; return true; } },
+        { "-S", "--handshakes", cmdline_arg_type_string,
+            "Measure TLS handshakes per second: full or resume",
+            [&](std::string s) {
+                if (s != "full" && s != "resume") {
+                    fprintf(stderr, "%s: unknown handshake mode: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                handshake_mode = s;
+                return true;
+            } },
+        { "-Z", "--connection-rate", cmdline_arg_type_string,
+            "Open this many new connections per second with one request each",
+            [&](std::string s) {
+                connection_rate = atof(s.c_str());
+                if (connection_rate <= 0) {
+                    fprintf(stderr, "%s: invalid connection rate: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                return true;
+            } },
+        { "-I", "--idle-hold", cmdline_arg_type_int,
+            "Hold this many keepalive connections open and trickle requests over them",
+            [&](std::string s) {
+                idle_connections = atoi(s.c_str());
+                if (idle_connections < 1) {
+                    fprintf(stderr, "%s: invalid idle connection count: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                return true;
+            } },
+        { "-U", "--tls-resume", cmdline_arg_type_none,
+            "Resume TLS sessions in connection rate and idle hold modes",
+            [&](std::string s) { return (tls_resume = true); } },
+        { "-b", "--bind", cmdline_arg_type_string,
+            "Local source addresses, comma separated, IPv4 ranges as a.b.c.d-e",
+            [&](std::string s) {
+                if (!parse_source_addrs(s)) {
+                    fprintf(stderr, "%s: invalid source addresses: %s\n", argv[0], s.c_str());
+                    return (help_or_error = true);
+                }
+                return true;
+            } },
+        { "-m", "--stats-url", cmdline_arg_type_string,
+            "Server stats url to read resident memory from in idle hold mode",
+            [&](std::string s) { stats_url = s; return true; } },
         { nullptr, nullptr, cmdline_arg_type_none, nullptr, nullptr }
     };
     
@@ -150,19 +755,555 @@ bool netb::process_cmdline(int argc, const char *argv[])
         return false;
     }
     bench_url = result.first[0];
+    if (workload_file.length() > 0 && replay_file.length() > 0) {
+        fprintf(stderr, "%s: --workload and --replay are exclusive\n", argv[0]);
+        return false;
+    }
+    if (connection_rate > 0 && idle_connections > 0) {
+        fprintf(stderr, "%s: --connection-rate and --idle-hold are exclusive\n", argv[0]);
+        return false;
+    }
+    return true;
+}
+
+void netb::handshake_thread(SSL_CTX *ctx, socket_addr addr, std::string host)
+{
+    SSL_SESSION *session = nullptr;
+    int i;
+    while ((i = handshakes_started++) < num_requests) {
+        int fd = connect_socket(addr, i);
+        if (fd < 0) {
+            fprintf(stderr, "error: connect: %s\n", strerror(errno));
+            handshake_errors++;
+            continue;
+        }
+        
+        // time only the handshake, connect is excluded
+        SSL *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        if (session) {
+            SSL_set_session(ssl, session);
+        }
+        const auto t1 = high_resolution_clock::now();
+        int ret = SSL_connect(ssl);
+        const auto t2 = high_resolution_clock::now();
+        if (ret == 1) {
+            processed_requests++;
+            handshake_usecs += duration_cast<microseconds>(t2 - t1).count();
+            if (SSL_session_reused(ssl)) {
+                handshakes_resumed++;
+            } else if (handshake_mode == "resume") {
+                if (session) SSL_SESSION_free(session);
+                session = SSL_get1_session(ssl);
+            }
+            if (per_request_stats) {
+                printf("%9.6lf secs,  %s,  %s\n",
+                       duration_cast<microseconds>(t2 - t1).count() / 1000000.0,
+                       SSL_session_reused(ssl) ? "resumed" : "full",
+                       SSL_get_cipher_name(ssl));
+            }
+            SSL_shutdown(ssl);
+        } else {
+            ERR_print_errors_fp(stderr);
+            handshake_errors++;
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+}
+
+void netb::run_handshakes()
+{
+    url_ptr req_url(new url(bench_url));
+    if (!req_url->valid || req_url->scheme != "https") {
+        fprintf(stderr, "error: handshake benchmark requires an https url: %s\n", bench_url.c_str());
+        exit(1);
+    }
+    socket_addr addr;
+    if (!resolver().lookup(addr, req_url->host, req_url->port)) {
+        fprintf(stderr, "error: unable to resolve host: %s\n", req_url->host.c_str());
+        exit(1);
+    }
+    
+    SSL_CTX *ctx = create_tls_context();
+    
+    const auto t1 = high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::max(num_threads, 1); i++) {
+        threads.push_back(std::thread(&netb::handshake_thread, this, ctx, addr, req_url->host));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto t2 = high_resolution_clock::now();
+    SSL_CTX_free(ctx);
+    
+    int completed = processed_requests.load();
+    double secs = duration_cast<microseconds>(t2 - t1).count() / 1000000.0;
+    printf("%9.6lf secs,  %d handshakes (%d full, %d resumed, %d errors),  %lf handshakes/sec,  %lf msecs avg\n",
+           secs,
+           completed,
+           completed - handshakes_resumed.load(),
+           handshakes_resumed.load(),
+           handshake_errors.load(),
+           completed / secs,
+           completed ? handshake_usecs.load() / 1000.0 / completed : 0.0);
+}
+
+SSL_CTX* netb::create_tls_context()
+{
+    // a client context of our own so curves and ciphers can be varied per run
+    SSL_library_init();
+    SSL_load_error_strings();
+    SSL_CTX *ctx = SSL_CTX_new(TLSv1_2_client_method());
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+#if defined (SSL_OP_IGNORE_UNEXPECTED_EOF)
+    // a server closing without close_notify must not invalidate the session we resume
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if (tls_cipher_list.length() > 0 && !SSL_CTX_set_cipher_list(ctx, tls_cipher_list.c_str())) {
+        fprintf(stderr, "error: invalid cipher list: %s\n", tls_cipher_list.c_str());
+        exit(1);
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L || defined(OPENSSL_IS_BORINGSSL)
+    std::string curves = tls_curves.length() > 0 ? tls_curves : TLS_CURVES_DEFAULT;
+    if (!SSL_CTX_set1_curves_list(ctx, curves.c_str())) {
+        fprintf(stderr, "error: invalid curve list: %s\n", curves.c_str());
+        exit(1);
+    }
+#endif
+    if (tls_ca_file.length() > 0) {
+        if (!SSL_CTX_load_verify_locations(ctx, tls_ca_file.c_str(), NULL)) {
+            fprintf(stderr, "error: unable to load cacert: %s\n", tls_ca_file.c_str());
+            exit(1);
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+    return ctx;
+}
+
+bool netb::parse_source_addrs(std::string spec)
+{
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        socket_addr addr;
+        memset(&addr, 0, sizeof(addr));
+        size_t dash = item.find('-');
+        if (inet_pton(AF_INET6, item.c_str(), &addr.ip6addr.sin6_addr) == 1) {
+            addr.saddr.sa_family = AF_INET6;
+            source_addrs.push_back(addr);
+            continue;
+        }
+        // IPv4 address or a range in the last octet
+        addr.saddr.sa_family = AF_INET;
+        if (inet_pton(AF_INET, item.substr(0, dash).c_str(), &addr.ip4addr.sin_addr) != 1) {
+            return false;
+        }
+        uint32_t first = ntohl(addr.ip4addr.sin_addr.s_addr);
+        uint32_t last = first;
+        if (dash != std::string::npos) {
+            int last_octet = atoi(item.substr(dash + 1).c_str());
+            if (last_octet < (int)(first & 0xff) || last_octet > 255) {
+                return false;
+            }
+            last = (first & ~0xffU) | last_octet;
+        }
+        for (uint32_t ip = first; ip <= last; ip++) {
+            addr.ip4addr.sin_addr.s_addr = htonl(ip);
+            source_addrs.push_back(addr);
+        }
+    }
+    return source_addrs.size() > 0;
+}
+
+int netb::connect_socket(const socket_addr &addr, size_t source_index)
+{
+    int fd = socket(addr.saddr.sa_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    // spread connections over the source addresses as one address runs out of ports
+    if (source_addrs.size() > 0) {
+        const socket_addr &source = source_addrs[source_index % source_addrs.size()];
+#if defined (IP_BIND_ADDRESS_NO_PORT)
+        int no_port = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &no_port, sizeof(no_port));
+#endif
+        if (bind(fd, &source.saddr, source.saddr.sa_family == AF_INET6 ?
+                 sizeof(source.ip6addr) : sizeof(source.ip4addr)) < 0)
+        {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+    if (connect(fd, &addr.saddr, socket_addr::len(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    struct timeval timeout = { connection_timeout, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+bool netb::open_socket(netb_socket &sock, size_t source_index, SSL_CTX *ctx, SSL_SESSION **session)
+{
+    netb_histograms *h = thread_histograms();
+    const auto t1 = steady_clock::now();
+    sock.fd = connect_socket(server_addr, source_index);
+    if (sock.fd < 0) {
+        fprintf(stderr, "error: connect: %s\n", strerror(errno));
+        return false;
+    }
+    const auto t2 = steady_clock::now();
+    h->connect.record(duration_cast<microseconds>(t2 - t1).count());
+    connections_opened++;
+    if (!ctx) {
+        return true;
+    }
+    
+    handshakes_started++;
+    sock.ssl = SSL_new(ctx);
+    SSL_set_fd(sock.ssl, sock.fd);
+    SSL_set_tlsext_host_name(sock.ssl, req_url->host.c_str());
+    if (session && *session) {
+        SSL_set_session(sock.ssl, *session);
+    }
+    int ret = SSL_connect(sock.ssl);
+    const auto t3 = steady_clock::now();
+    if (ret != 1) {
+        ERR_print_errors_fp(stderr);
+        handshake_errors++;
+        return false;
+    }
+    h->handshake.record(duration_cast<microseconds>(t3 - t2).count());
+    handshake_usecs += duration_cast<microseconds>(t3 - t2).count();
+    if (SSL_session_reused(sock.ssl)) {
+        handshakes_resumed++;
+    } else if (session) {
+        if (*session) SSL_SESSION_free(*session);
+        *session = SSL_get1_session(sock.ssl);
+    }
     return true;
 }
 
+bool netb::exchange(netb_socket &sock, const std::string &request, size_t &bytes, std::string *body)
+{
+    static thread_local http_response response;
+    static thread_local std::vector<char> buffer;
+    if (buffer.size() == 0) {
+        response.resize(header_buffer_size, MAX_HEADERS_DEFAULT);
+        buffer.resize(io_buffer_size);
+    }
+    response.reset();
+    bytes = 0;
+    if (!sock.write_all(request.data(), request.length())) {
+        return false;
+    }
+    
+    // the response ends at its content length, or at close if it has none
+    bool headers_done = false;
+    long long content_length = -1;
+    for (;;) {
+        ssize_t len = sock.read(buffer.data(), buffer.size());
+        if (len <= 0) {
+            return len == 0 && headers_done && content_length < 0;
+        }
+        const char *data = buffer.data();
+        if (!headers_done) {
+            response.parse(buffer.data(), len);
+            if (response.has_error() || response.has_overflow()) {
+                return false;
+            }
+            if (!response.is_finished()) {
+                continue;
+            }
+            headers_done = true;
+            const char *content_length_str = response.get_header_string(kHTTPHeaderContentLength);
+            if (content_length_str) {
+                content_length = strtoll(content_length_str, nullptr, 10);
+            } else if (response.get_status_code() == HTTPStatusCodeNoContent ||
+                       response.get_status_code() == HTTPStatusCodeNotModified) {
+                content_length = 0;
+            }
+            data = response.body_start.data;
+            len = response.body_start.length;
+        }
+        bytes += len;
+        if (body) {
+            body->append(data, len);
+        }
+        if (content_length >= 0 && (long long)bytes >= content_length) {
+            return true;
+        }
+    }
+}
+
+std::string netb::format_request(url_ptr u, bool close)
+{
+    std::string request = "GET " + (u->path.length() > 0 ? u->path : std::string("/")) + " HTTP/1.1\r\n";
+    request += "Host: " + u->host + "\r\n";
+    request += "User-Agent: netb\r\n";
+    if (close) {
+        request += "Connection: close\r\n";
+    }
+    return request + "\r\n";
+}
+
+long long netb::fetch_server_rss()
+{
+    if (stats_url.length() == 0) {
+        return -1;
+    }
+    url_ptr u(new url(stats_url));
+    socket_addr addr;
+    if (!u->valid || u->scheme != "http" || !resolver().lookup(addr, u->host, u->port)) {
+        fprintf(stderr, "error: invalid stats url: %s\n", stats_url.c_str());
+        return -1;
+    }
+    netb_socket sock;
+    sock.fd = connect_socket(addr, 0);
+    std::string body;
+    size_t bytes;
+    bool ok = sock.fd >= 0 && exchange(sock, format_request(u, true), bytes, &body);
+    sock.close();
+    
+    // from the process section of the stats handler
+    size_t pos = body.find("\n  rss ");
+    if (!ok || pos == std::string::npos) {
+        fprintf(stderr, "error: no rss in server stats: %s\n", stats_url.c_str());
+        return -1;
+    }
+    return strtoll(body.c_str() + pos + 7, nullptr, 10);
+}
+
+SSL_CTX* netb::resolve_server()
+{
+    req_url = url_ptr(new url(bench_url));
+    if (!req_url->valid || (req_url->scheme != "http" && req_url->scheme != "https")) {
+        fprintf(stderr, "error: invalid url: %s\n", bench_url.c_str());
+        exit(1);
+    }
+    if (!resolver().lookup(server_addr, req_url->host, req_url->port)) {
+        fprintf(stderr, "error: unable to resolve host: %s\n", req_url->host.c_str());
+        exit(1);
+    }
+    
+    // the blocking modes write to sockets the server may have closed
+    signal(SIGPIPE, SIG_IGN);
+    return req_url->scheme == "https" ? create_tls_context() : nullptr;
+}
+
+void netb::connection_rate_thread(SSL_CTX *ctx, std::string request)
+{
+    SSL_SESSION *session = nullptr;
+    netb_histograms *h = thread_histograms();
+    const duration<double> interval(1.0 / connection_rate);
+    int i;
+    while ((i = next_slot++) < num_requests) {
+        auto intended = schedule_start + duration_cast<steady_clock::duration>(interval * i);
+        wait_until(intended);
+        const auto t1 = steady_clock::now();
+        netb_socket sock;
+        size_t bytes = 0;
+        if (open_socket(sock, i, ctx, tls_resume ? &session : nullptr) && exchange(sock, request, bytes)) {
+            const auto t2 = steady_clock::now();
+            h->latency.record(duration_cast<microseconds>(t2 - intended).count());
+            h->service.record(duration_cast<microseconds>(t2 - t1).count());
+            processed_requests++;
+            bytes_transfered += bytes;
+            
+            // wait for the server to close first so TIME_WAIT is not held on our ports
+            char c;
+            while (sock.read(&c, sizeof(c)) > 0) {}
+        } else {
+            connection_errors++;
+        }
+        sock.close();
+    }
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+}
+
+void netb::run_connection_rate()
+{
+    SSL_CTX *ctx = resolve_server();
+    std::string request = format_request(req_url, true);
+    
+    schedule_start = steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::max(num_threads, 1); i++) {
+        threads.push_back(std::thread(&netb::connection_rate_thread, this, ctx, request));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto t2 = steady_clock::now();
+    if (ctx) {
+        SSL_CTX_free(ctx);
+    }
+    report(duration_cast<microseconds>(t2 - schedule_start).count() / 1000000.0);
+}
+
+void netb::idle_open_thread(SSL_CTX *ctx, size_t begin, size_t end)
+{
+    SSL_SESSION *session = nullptr;
+    for (size_t i = begin; i < end; i++) {
+        if (!open_socket(idle_sockets[i], i, ctx, tls_resume ? &session : nullptr)) {
+            idle_sockets[i].close();
+            connection_errors++;
+        }
+    }
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+}
+
+void netb::idle_trickle_thread(SSL_CTX *ctx, std::string request, int thread_num, int thread_count)
+{
+    // each thread owns a slice of the connections so requests never share one
+    SSL_SESSION *session = nullptr;
+    netb_histograms *h = thread_histograms();
+    size_t begin = idle_sockets.size() * thread_num / thread_count;
+    size_t end = idle_sockets.size() * (thread_num + 1) / thread_count;
+    const duration<double> interval(1.0 / request_rate);
+    size_t k = 0;
+    for (int i = thread_num; i < num_requests; i += thread_count, k++) {
+        size_t index = begin + k % (end - begin);
+        auto &sock = idle_sockets[index];
+        auto intended = schedule_start + duration_cast<steady_clock::duration>(interval * i);
+        wait_until(intended);
+        const auto t1 = steady_clock::now();
+        size_t bytes = 0;
+        bool ok = sock.fd >= 0 && exchange(sock, request, bytes);
+        if (!ok) {
+            // the server may have timed out the idle connection
+            sock.close();
+            reconnects++;
+            ok = open_socket(sock, index, ctx, tls_resume ? &session : nullptr) && exchange(sock, request, bytes);
+        }
+        if (ok) {
+            const auto t2 = steady_clock::now();
+            h->latency.record(duration_cast<microseconds>(t2 - intended).count());
+            h->service.record(duration_cast<microseconds>(t2 - t1).count());
+            processed_requests++;
+            bytes_transfered += bytes;
+        } else {
+            sock.close();
+            connection_errors++;
+        }
+    }
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+}
+
+void netb::run_idle_hold()
+{
+    SSL_CTX *ctx = resolve_server();
+    std::string request = format_request(req_url, false);
+    
+    // every held connection needs a descriptor
+    rlim_t fds_needed = (rlim_t)idle_connections + IDLE_RESERVED_FDS;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < fds_needed) {
+        limit.rlim_cur = std::min(limit.rlim_max, fds_needed);
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < fds_needed) {
+            fprintf(stderr, "error: open file limit %llu is too low for %d connections\n",
+                    (unsigned long long)limit.rlim_cur, idle_connections);
+            exit(1);
+        }
+    }
+    
+    // open the connections then let the server settle before sampling its memory
+    server_rss_before = fetch_server_rss();
+    idle_sockets.resize(idle_connections);
+    int thread_count = std::max(std::min(num_threads, idle_connections), 1);
+    const auto t1 = steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++) {
+        threads.push_back(std::thread(&netb::idle_open_thread, this, ctx,
+                                      idle_sockets.size() * i / thread_count,
+                                      idle_sockets.size() * (i + 1) / thread_count));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto t2 = steady_clock::now();
+    idle_opened = idle_connections - connection_errors.load();
+    double open_secs = duration_cast<microseconds>(t2 - t1).count() / 1000000.0;
+    printf("%9.6lf secs,  %d connections opened,  %d errors,  %lf connections/sec\n",
+           open_secs, idle_opened, connection_errors.load(), idle_opened / open_secs);
+    std::this_thread::sleep_for(milliseconds(IDLE_SETTLE_MSECS));
+    server_rss_opened = fetch_server_rss();
+    
+    // trickle requests over the held connections
+    if (request_rate <= 0) {
+        request_rate = IDLE_TRICKLE_RATE_DEFAULT;
+    }
+    threads.clear();
+    schedule_start = steady_clock::now();
+    for (int i = 0; i < thread_count; i++) {
+        threads.push_back(std::thread(&netb::idle_trickle_thread, this, ctx, request, i, thread_count));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const auto t3 = steady_clock::now();
+    server_rss_after = fetch_server_rss();
+    
+    for (auto &sock : idle_sockets) {
+        sock.close();
+    }
+    if (ctx) {
+        SSL_CTX_free(ctx);
+    }
+    report(duration_cast<microseconds>(t3 - schedule_start).count() / 1000000.0);
+}
+
 void netb::run()
 {
+    if (handshake_mode.length() > 0) {
+        run_handshakes();
+        return;
+    }
+    if (connection_rate > 0) {
+        run_connection_rate();
+        return;
+    }
+    if (idle_connections > 0) {
+        run_idle_hold();
+        return;
+    }
+    
+    // a pipeline needs at least its depth of requests queued on each connection
+    if (pipeline_depth > 1) {
+        keepalive_requests = std::max(keepalive_requests, pipeline_depth);
+    }
+    
     // setup default config
     engine.cfg = std::make_shared<config>();
     engine.cfg->client_connections = client_connections;
     engine.cfg->connection_timeout = connection_timeout;
     engine.cfg->keepalive_timeout = keepalive_timeout;
+    engine.cfg->client_pipeline_depth = pipeline_depth;
     engine.cfg->header_buffer_size = header_buffer_size;
     engine.cfg->io_buffer_size = io_buffer_size;
     engine.cfg->tls_ca_file = tls_ca_file;
+    engine.cfg->pollset_type = pollset_type;
     engine.cfg->proto_threads.push_back(std::pair<std::string,size_t>("http_client/connect", 1));
     engine.cfg->proto_threads.push_back(std::pair<std::string,size_t>("http_client/worker,http_client/keepalive", num_threads));
     
@@ -176,29 +1317,355 @@ void netb::run()
     }
     
     // parse benchmark url
-    url_ptr req_url(new url(bench_url));
+    req_url = url_ptr(new url(bench_url));
     if (!req_url->valid) {
         fprintf(stderr, "error: invalid url: %s\n", bench_url.c_str());
         exit(1);
     }
     
+    // load request mix or access log to replay
+    if (workload_file.length() > 0 && !workload.read(workload_file, req_url)) {
+        exit(1);
+    }
+    if (replay_file.length() > 0) {
+        if (!read_replay(replay_file)) {
+            exit(1);
+        }
+        num_requests = (int)replay_records.size();
+    }
+    
     // run client
-    const auto t1 = high_resolution_clock::now();
+    const auto t1 = steady_clock::now();
     engine.run();
-    for (int i = 0; i < num_requests; i++) {
-        auto handler = std::make_shared<netb_client_handler_file>(this);
-        auto request = std::make_shared<http_client_request>(HTTPMethodGET, req_url, handler);
-        http_client::submit_request(&engine, request, keepalive_requests);
+    if (replay_records.size() > 0) {
+        // replay at the logged offsets, scaled by the replay speed
+        for (auto &rec : replay_records) {
+            auto intended = t1 + duration_cast<steady_clock::duration>(microseconds(rec.offset_usecs) / replay_speed);
+            wait_until(intended);
+            submit_replay(rec, intended);
+        }
+    } else if (request_rate > 0) {
+        // open loop, each request has a fixed start time on the schedule
+        const duration<double> interval(1.0 / request_rate);
+        for (int i = 0; i < num_requests; i++) {
+            auto intended = t1 + duration_cast<steady_clock::duration>(interval * i);
+            wait_until(intended);
+            submit_request(intended);
+        }
+    } else {
+        // closed loop, submit_request does not block so keep at most what
+        // the connections can hold in flight rather than failing the rest
+        const int window = client_connections * std::max(keepalive_requests, 1);
+        auto client_state = http_client::get_engine_state(&engine);
+        for (int i = 0; i < num_requests; i++) {
+            while (i - finished_requests >= window ||
+                   (keepalive_requests == 0 && !client_state->has_free_connections())) {
+                std::this_thread::sleep_for(microseconds(20));
+            }
+            submit_request(steady_clock::now());
+        }
     }
     engine.join();
-    const auto t2 = high_resolution_clock::now();
-    double secs = duration_cast<microseconds>(t2 - t1).count() / 1000000.0;
+    const auto t2 = steady_clock::now();
+    report(duration_cast<microseconds>(t2 - t1).count() / 1000000.0);
+}
+
+netb_histograms* netb::thread_histograms()
+{
+    static thread_local netb_histograms *histograms = nullptr;
+    if (!histograms) {
+        histograms = new netb_histograms();
+        std::lock_guard<std::mutex> lock(histograms_mutex);
+        histograms_all.push_back(netb_histograms_ptr(histograms));
+    }
+    return histograms;
+}
+
+void netb::finish_request()
+{
+    if (++finished_requests == num_requests) {
+        engine.stop();
+    }
+}
+
+void netb::wait_until(steady_clock::time_point intended)
+{
+    // sleep most of the way then spin for an accurate start
+    auto wake = intended - microseconds(SCHEDULE_SPIN_USECS);
+    if (steady_clock::now() < wake) {
+        std::this_thread::sleep_until(wake);
+    }
+    while (steady_clock::now() < intended) {}
+}
+
+void netb::submit_request(steady_clock::time_point intended)
+{
+    auto handler = std::make_shared<netb_client_handler_file>(this, intended);
+    if (workload.entries.size() == 0) {
+        start_request(std::make_shared<http_client_request>(HTTPMethodGET, req_url, handler));
+        return;
+    }
+    
+    // O(1) weighted choice, only templated paths cost an allocation
+    auto &entry = workload.entries[workload.sampler.sample(rng.next())];
+    handler->entry = &entry;
+    handler->seq = request_seq++;
+    auto request = std::make_shared<http_client_request>(entry.method, entry.url, handler);
+    if (!entry.path.is_constant()) {
+        request->path = entry.path.render(rng, handler->seq);
+    }
+    request->host = entry.host;
+    start_request(request);
+}
+
+void netb::submit_replay(const netb_replay_record &rec, steady_clock::time_point intended)
+{
+    auto handler = std::make_shared<netb_client_handler_file>(this, intended);
+    auto request = std::make_shared<http_client_request>(rec.method, req_url, handler);
+    request->path = rec.path;
+    request->host = rec.host;
+    start_request(request);
+}
+
+void netb::start_request(http_client_request_ptr request)
+{
+    // the closed loop waits for a connection to come free, open loops count a failure
+    bool closed_loop = request_rate == 0 && replay_records.size() == 0;
+    while (!http_client::submit_request(&engine, request, keepalive_requests)) {
+        if (!closed_loop) {
+            failed_requests++;
+            finish_request();
+            return;
+        }
+        std::this_thread::sleep_for(microseconds(20));
+    }
+}
+
+bool netb::read_replay(std::string log_file)
+{
+    FILE *file = fopen(log_file.c_str(), "r");
+    if (!file) {
+        fprintf(stderr, "error: %s: %s\n", log_file.c_str(), strerror(errno));
+        return false;
+    }
+    
+    // binary logs start with the record magic
+    uint32_t magic = 0;
+    size_t len = fread(&magic, 1, sizeof(magic), file);
+    rewind(file);
+    bool ret = (len == sizeof(magic) && magic == HTTP_ACCESS_LOG_MAGIC) ?
+        read_replay_binary(file) : read_replay_text(file);
+    fclose(file);
+    if (!ret) {
+        fprintf(stderr, "error: %s: invalid access log\n", log_file.c_str());
+        return false;
+    }
+    if (replay_records.size() == 0) {
+        fprintf(stderr, "error: %s: no requests to replay\n", log_file.c_str());
+        return false;
+    }
+    
+    // logs are written at completion so start times can be slightly out of order
+    std::stable_sort(replay_records.begin(), replay_records.end(),
+                     [](const netb_replay_record &a, const netb_replay_record &b) {
+                         return a.offset_usecs < b.offset_usecs;
+                     });
+    uint64_t first = replay_records[0].offset_usecs;
+    for (auto &rec : replay_records) {
+        rec.offset_usecs -= first;
+    }
+    return true;
+}
+
+bool netb::read_replay_binary(FILE *file)
+{
+    char buf[HTTP_ACCESS_LOG_RECORD_MAX];
+    while (true) {
+        size_t len = fread(buf, 1, sizeof(http_access_log_record), file);
+        if (len == 0) break;
+        if (len < sizeof(http_access_log_record)) return false;
+        auto hdr = reinterpret_cast<http_access_log_record*>(buf);
+        if (hdr->magic != HTTP_ACCESS_LOG_MAGIC || hdr->length < sizeof(http_access_log_record) ||
+            hdr->length > sizeof(buf))
+        {
+            return false;
+        }
+        size_t remaining = hdr->length - sizeof(http_access_log_record);
+        if (fread(buf + sizeof(http_access_log_record), 1, remaining, file) != remaining) return false;
+        auto rec = http_access_log_record::decode(buf, hdr->length);
+        if (!rec) return false;
+        
+        http_header_string method = rec->get_string(http_access_log_string_method);
+        http_header_string uri = rec->get_string(http_access_log_string_uri);
+        http_header_string host = rec->get_string(http_access_log_string_host);
+        if (uri.length == 0 || uri.data[0] != '/') continue;
+        netb_replay_record replay;
+        replay.offset_usecs = rec->time_usecs;
+        replay.method = http_constants::get_method_type(std::string(method.data, method.length).c_str());
+        replay.path = std::string(uri.data, uri.length);
+        replay.host = std::string(host.data, host.length);
+        if (replay.method == HTTPMethodNone) continue;
+        replay_records.push_back(replay);
+    }
+    return true;
+}
+
+bool netb::parse_replay_line(char *line)
+{
+    char *date_start = strchr(line, '[');
+    char *date_end = date_start ? strchr(date_start, ']') : nullptr;
+    char *req_start = date_end ? strchr(date_end, '"') : nullptr;
+    char *req_end = req_start ? strchr(req_start + 1, '"') : nullptr;
+    if (!req_end) return false;
+    
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    *date_end = '\0';
+    if (!strptime(date_start + 1, "%d/%b/%Y:%H:%M:%S", &tm)) return false;
+    *req_end = '\0';
+    char *method = req_start + 1;
+    char *uri = strchr(method, ' ');
+    if (!uri) return false;
+    *uri++ = '\0';
+    char *version = strchr(uri, ' ');
+    if (version) *version = '\0';
+    if (uri[0] != '/') return false;
+    
+    netb_replay_record replay;
+    replay.offset_usecs = (uint64_t)timegm(&tm) * 1000000ULL;
+    replay.method = http_constants::get_method_type(method);
+    replay.path = uri;
+    if (replay.method == HTTPMethodNone) return false;
+    replay_records.push_back(replay);
+    return true;
+}
+
+bool netb::read_replay_text(FILE *file)
+{
+    // common or combined: addr ident user [date] "method uri version" ...
+    // lines that can't be replayed are skipped, real logs have a few
+    char line[HTTP_ACCESS_LOG_RECORD_MAX];
+    unsigned long line_num = 0, skipped = 0, first_skipped = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_num++;
+        size_t line_len = strlen(line);
+        bool truncated = line_len > 0 && line[line_len - 1] != '\n' && !feof(file);
+        if (truncated) {
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n') {}
+        }
+        if (!truncated && parse_replay_line(line)) continue;
+        if (skipped++ == 0) first_skipped = line_num;
+    }
+    if (skipped > 0) {
+        fprintf(stderr, "warning: access log: skipped %lu lines that could not be replayed, first at line %lu\n",
+                skipped, first_skipped);
+    }
+    
+    // text logs have one second resolution, spread each second evenly
+    size_t start = 0;
+    for (size_t i = 1; i <= replay_records.size(); i++) {
+        if (i < replay_records.size() && replay_records[i].offset_usecs == replay_records[start].offset_usecs) continue;
+        for (size_t j = start; j < i; j++) {
+            replay_records[j].offset_usecs += (j - start) * 1000000ULL / (i - start);
+        }
+        start = i;
+    }
+    return true;
+}
+
+static const double report_percentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+static const char* report_percentile_names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+
+void netb::report(double secs)
+{
+    // merge per thread histograms
+    netb_histograms merged;
+    {
+        std::lock_guard<std::mutex> lock(histograms_mutex);
+        for (auto &h : histograms_all) {
+            merged.latency.merge(h->latency);
+            merged.service.merge(h->service);
+            merged.connect.merge(h->connect);
+            merged.handshake.merge(h->handshake);
+        }
+    }
+    
     printf("%9.6lf secs,  %d requests,  %lf reqs/sec,  %ld bytes transferred,  %lf MB/sec\n",
            secs,
            processed_requests.load(),
            processed_requests.load() / secs,
            bytes_transfered.load(),
            bytes_transfered.load() / secs / (1 << 20));
+    if (failed_requests > 0) {
+        printf("%d requests failed\n", failed_requests.load());
+    }
+    if (connection_rate > 0) {
+        printf("%d connections,  %lf connections/sec,  %d errors\n",
+               connections_opened.load(), connections_opened.load() / secs, connection_errors.load());
+    } else if (idle_connections > 0) {
+        printf("%d idle connections,  %d errors,  %d reconnects\n",
+               idle_opened, connection_errors.load(), reconnects.load());
+    }
+    if (handshakes_started > 0) {
+        printf("%d handshakes (%d full, %d resumed, %d errors)\n",
+               handshakes_started.load(),
+               handshakes_started.load() - handshakes_resumed.load() - handshake_errors.load(),
+               handshakes_resumed.load(),
+               handshake_errors.load());
+    }
+    if (server_rss_before >= 0 && server_rss_opened >= 0) {
+        printf("server rss %lld before,  %lld opened,  %lld after,  %lld bytes per idle connection\n",
+               server_rss_before, server_rss_opened, server_rss_after,
+               (server_rss_opened - server_rss_before) / std::max(idle_opened, 1));
+    }
+    printf("%-8s %10s", "usecs", "min");
+    for (auto name : report_percentile_names) printf(" %10s", name);
+    printf(" %10s %10s\n", "max", "mean");
+    std::vector<std::pair<const char*,hdr_histogram*>> rows = {
+        { "latency", &merged.latency }, { "service", &merged.service }
+    };
+    if (merged.connect.total_count > 0) {
+        rows.push_back(std::pair<const char*,hdr_histogram*>("connect", &merged.connect));
+    }
+    if (merged.handshake.total_count > 0) {
+        rows.push_back(std::pair<const char*,hdr_histogram*>("handshake", &merged.handshake));
+    }
+    for (auto &row : rows) {
+        printf("%-8s %10lld", row.first, (long long)row.second->min());
+        for (auto p : report_percentiles) printf(" %10lld", (long long)row.second->value_at_percentile(p));
+        printf(" %10lld %10.1lf\n", (long long)row.second->max(), row.second->mean());
+    }
+    
+    if (json_report.length() == 0) return;
+    FILE *file = fopen(json_report.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "error: %s: %s\n", json_report.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(file, "{\"url\":\"%s\",\"rate\":%lf,\"connections\":%d,\"pipeline\":%d,\"threads\":%d,"
+                  "\"secs\":%lf,\"requests\":%d,\"failed\":%d,\"requests_per_sec\":%lf,\"bytes\":%ld",
+            bench_url.c_str(), request_rate, client_connections, pipeline_depth, num_threads,
+            secs, processed_requests.load(), failed_requests.load(),
+            processed_requests.load() / secs, bytes_transfered.load());
+    if (connection_rate > 0 || idle_connections > 0) {
+        fprintf(file, ",\"connection_rate\":%lf,\"idle_connections\":%d,\"connections_opened\":%d,"
+                      "\"connection_errors\":%d,\"reconnects\":%d,\"handshakes_resumed\":%d,"
+                      "\"server_rss_before\":%lld,\"server_rss_opened\":%lld,\"server_rss_after\":%lld",
+                connection_rate, idle_opened, connections_opened.load(),
+                connection_errors.load(), reconnects.load(), handshakes_resumed.load(),
+                server_rss_before, server_rss_opened, server_rss_after);
+    }
+    for (auto &row : rows) {
+        fprintf(file, ",\"%s_usecs\":{\"min\":%lld", row.first, (long long)row.second->min());
+        for (size_t i = 0; i < sizeof(report_percentiles) / sizeof(report_percentiles[0]); i++) {
+            fprintf(file, ",\"%s\":%lld", report_percentile_names[i],
+                    (long long)row.second->value_at_percentile(report_percentiles[i]));
+        }
+        fprintf(file, ",\"max\":%lld,\"mean\":%.1lf}", (long long)row.second->max(), row.second->mean());
+    }
+    fprintf(file, "}\n");
+    fclose(file);
 }
 
 
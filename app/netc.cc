@@ -188,7 +188,10 @@ void netc::run()
     engine.run();
     auto handler = std::make_shared<netc_client_handler_file>(this, out_fd);
     auto request = std::make_shared<http_client_request>(HTTPMethodGET, req_url, handler);
-    http_client::submit_request(&engine, request, keepalive_requests);
+    if (!http_client::submit_request(&engine, request, keepalive_requests)) {
+        log_error("submit_request: no available connections: %s", req_url->to_string().c_str());
+        engine.stop();
+    }
     engine.join();
     const auto t2 = high_resolution_clock::now();
     double secs = duration_cast<microseconds>(t2 - t1).count() / 1000000.0;
@@ -0,0 +1,130 @@
+//
+//  netl.cc
+//
+//  binary access log formatter
+//
+
+#include "latypus.h"
+
+struct netl
+{
+    http_access_log_format  format;
+    bool                    help_or_error;
+    std::vector<std::string> log_files;
+
+    netl();
+    bool process_cmdline(int argc, const char *argv[]);
+    bool format_file(FILE *file, const char *name);
+    int run();
+};
+
+netl::netl() :
+    format(http_access_log_format_combined),
+    help_or_error(false)
+{}
+
+bool netl::process_cmdline(int argc, const char *argv[])
+{
+    cmdline_option options[] =
+    {
+        { "-f", "--format", cmdline_arg_type_string,
+            "Output format: common, combined or json (default combined)",
+            [&](std::string s) {
+                if (s == "common") format = http_access_log_format_common;
+                else if (s == "combined") format = http_access_log_format_combined;
+                else if (s == "json") format = http_access_log_format_json;
+                else {
+                    fprintf(stderr, "%s: unknown format: %s\n", argv[0], s.c_str());
+                    help_or_error = true;
+                    return false;
+                }
+                return true;
+            } },
+        { "-h", "--help", cmdline_arg_type_none,
+            "Show help",
+            [&](std::string s) { return (help_or_error = true); } },
+        { nullptr, nullptr, cmdline_arg_type_none, nullptr, nullptr }
+    };
+
+    auto result = cmdline_option::process_options(options, argc, argv);
+    if (!result.second) {
+        help_or_error = true;
+    }
+    if (help_or_error) {
+        fprintf(stderr, "usage: %s [options] [access_log ...]\n", argv[0]);
+        cmdline_option::print_options(options);
+        return false;
+    }
+    log_files.assign(result.first.begin(), result.first.end());
+    return true;
+}
+
+bool netl::format_file(FILE *file, const char *name)
+{
+    char buf[HTTP_ACCESS_LOG_RECORD_MAX];
+    size_t record_num = 0;
+    while (true) {
+        size_t len = fread(buf, 1, sizeof(http_access_log_record), file);
+        if (len == 0) break;
+        if (len < sizeof(http_access_log_record)) {
+            fprintf(stderr, "%s: truncated record %lu\n", name, record_num);
+            return false;
+        }
+        auto hdr = reinterpret_cast<http_access_log_record*>(buf);
+        if (hdr->magic != HTTP_ACCESS_LOG_MAGIC || hdr->length < sizeof(http_access_log_record) ||
+            hdr->length > sizeof(buf))
+        {
+            fprintf(stderr, "%s: invalid record %lu\n", name, record_num);
+            return false;
+        }
+        size_t remaining = hdr->length - sizeof(http_access_log_record);
+        if (fread(buf + sizeof(http_access_log_record), 1, remaining, file) != remaining) {
+            fprintf(stderr, "%s: truncated record %lu\n", name, record_num);
+            return false;
+        }
+        auto rec = http_access_log_record::decode(buf, hdr->length);
+        if (!rec) {
+            fprintf(stderr, "%s: invalid record %lu\n", name, record_num);
+            return false;
+        }
+        printf("%s\n", rec->to_string(format).c_str());
+        record_num++;
+    }
+    return true;
+}
+
+int netl::run()
+{
+    if (log_files.size() == 0) {
+        return format_file(stdin, "stdin") ? 0 : 1;
+    }
+    int ret = 0;
+    for (auto &log_file : log_files) {
+        FILE *file = fopen(log_file.c_str(), "r");
+        if (!file) {
+            fprintf(stderr, "%s: %s\n", log_file.c_str(), strerror(errno));
+            ret = 1;
+            continue;
+        }
+        if (!format_file(file, log_file.c_str())) {
+            ret = 1;
+        }
+        fclose(file);
+    }
+    return ret;
+}
+
+
+/* main */
+
+int main(int argc, const char *argv[])
+{
+    netl formatter;
+
+    // parse command line arguments
+    if (!formatter.process_cmdline(argc, argv)) {
+        exit(1);
+    }
+
+    return formatter.run();
+}
@@ -0,0 +1,60 @@
+//
+//  alias_sampler.cc
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "alias_sampler.h"
+
+
+/* alias_sampler */
+
+bool alias_sampler::init(const std::vector<double> &weights)
+{
+    threshold.clear();
+    alias.clear();
+
+    double total = 0;
+    for (double w : weights) {
+        if (!(w >= 0)) return false;
+        total += w;
+    }
+    if (weights.size() == 0 || weights.size() > UINT32_MAX || total <= 0) return false;
+
+    // scale so the mean column height is one
+    size_t n = weights.size();
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        scaled[i] = weights[i] * n / total;
+        (scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+    }
+
+    // fill each short column from a tall one
+    threshold.resize(n);
+    alias.resize(n);
+    while (small.size() > 0 && large.size() > 0) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        threshold[s] = (uint32_t)(scaled[s] * 4294967296.0);
+        alias[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // whatever remains is full height up to rounding error
+    for (uint32_t i : large) {
+        threshold[i] = UINT32_MAX;
+        alias[i] = i;
+    }
+    for (uint32_t i : small) {
+        threshold[i] = UINT32_MAX;
+        alias[i] = i;
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+//
+//  alias_sampler.h
+//
+
+#ifndef alias_sampler_h
+#define alias_sampler_h
+
+/*
+ * alias_sampler
+ *
+ * Weighted discrete sampling with Vose's alias method. Building the table
+ * is O(n), each sample is O(1) and costs one 64 bit random number, one
+ * multiply and one table lookup with no division or search.
+ */
+
+struct alias_sampler
+{
+    std::vector<uint32_t>   threshold;      /* probability of keeping the column, scaled to 2^32 */
+    std::vector<uint32_t>   alias;
+
+    bool init(const std::vector<double> &weights);
+    size_t size() const { return alias.size(); }
+
+    size_t sample(uint64_t r) const
+    {
+        // high half picks the column, low half flips the biased coin
+        size_t column = (size_t)(((r >> 32) * alias.size()) >> 32);
+        return (uint32_t)r < threshold[column] ? column : alias[column];
+    }
+};
+
+
+/*
+ * xorshift64star
+ *
+ * Small fast generator for sampling, not for anything security related.
+ */
+
+struct xorshift64star
+{
+    uint64_t state;
+
+    xorshift64star(uint64_t seed = 0x9e3779b97f4a7c15ULL) : state(seed ? seed : 1) {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dULL;
+    }
+
+    uint64_t next(uint64_t bound)
+    {
+        // high 64 bits of next() * bound, multiplied in 32 bit halves
+        uint64_t r = next();
+        uint64_t r_lo = r & 0xffffffff, r_hi = r >> 32;
+        uint64_t b_lo = bound & 0xffffffff, b_hi = bound >> 32;
+        uint64_t lo_lo = r_lo * b_lo, hi_lo = r_hi * b_lo, lo_hi = r_lo * b_hi;
+        uint64_t mid = (lo_lo >> 32) + (hi_lo & 0xffffffff) + (lo_hi & 0xffffffff);
+        return r_hi * b_hi + (hi_lo >> 32) + (lo_hi >> 32) + (mid >> 32);
+    }
+};
+
+#endif
@@ -34,17 +34,42 @@
 
 config::config() :
     client_connections(CLIENT_CONNECTIONS_DEFAULT),
+    client_pipeline_depth(CLIENT_PIPELINE_DEPTH_DEFAULT),
+    client_host_connections(CLIENT_HOST_CONNECTIONS_DEFAULT),
     server_connections(SERVER_CONNECTIONS_DEFAULT),
     listen_backlog(LISTEN_BACKLOG_DEFAULT),
     max_headers(MAX_HEADERS_DEFAULT),
     header_buffer_size(HEADER_BUFFER_SIZE_DEFAULT),
     io_buffer_size(IO_BUFFER_SIZE_DEFAULT),
     ipc_buffer_size(IPC_BUFFER_SIZE_DEFAULT),
+    proxy_buffer_size(PROXY_BUFFER_SIZE_DEFAULT),
+    proxy_splice(PROXY_SPLICE_DEFAULT),
+    cache_size(CACHE_SIZE_DEFAULT),
+    cache_max_entry_size(CACHE_MAX_ENTRY_SIZE_DEFAULT),
     log_buffers(LOG_BUFFERS_DEFAULT),
+    log_overflow(LOG_OVERFLOW_DEFAULT),
+    log_threads(LOG_THREADS_DEFAULT),
     keepalive_timeout(KEEPALIVE_TIMEOUT_DEFAULT),
     connection_timeout(CONNETION_TIMEOUT_DEFAULT),
+    edge_triggered(EDGE_TRIGGERED_DEFAULT),
+    sendfile(SENDFILE_DEFAULT),
     tls_session_timeout(TLS_SESSION_TIMEOUT_DEFAULT),
-    tls_session_count(TLS_SESSION_COUNT_DEFAULT)
+    tls_session_count(TLS_SESSION_COUNT_DEFAULT),
+    tls_session_tickets(TLS_SESSION_TICKETS_DEFAULT),
+    tls_ticket_rotation(TLS_TICKET_ROTATION_DEFAULT),
+    tls_curves(TLS_CURVES_DEFAULT),
+    tls_prefer_server_ciphers(TLS_PREFER_SERVER_CIPHERS_DEFAULT),
+    tls_dhe(TLS_DHE_DEFAULT),
+    tls_ktls(TLS_KTLS_DEFAULT),
+    tls_record_size(TLS_RECORD_SIZE_DEFAULT),
+    tls_record_boost(TLS_RECORD_BOOST_DEFAULT),
+    tls_record_idle(TLS_RECORD_IDLE_DEFAULT),
+    resolver_timeout(RESOLVER_TIMEOUT_DEFAULT),
+    resolver_ipv6(RESOLVER_IPV6_DEFAULT),
+    access_log_format(ACCESS_LOG_FORMAT_DEFAULT),
+    access_log_sample(ACCESS_LOG_SAMPLE_DEFAULT),
+    access_log_slow(ACCESS_LOG_SLOW_DEFAULT),
+    access_log_errors(ACCESS_LOG_ERRORS_DEFAULT)
 {    
     config_fn_map["os_user"] =             {2,  2,  [&] (config *cfg, config_line &line) { os_user = line[1]; }};
     config_fn_map["os_group"] =            {2,  2,  [&] (config *cfg, config_line &line) { os_group = line[1]; }};
@@ -56,16 +81,129 @@ config::config() :
     config_fn_map["tls_cipher_list"] =     {2,  2,  [&] (config *cfg, config_line &line) { tls_cipher_list = line[1]; }};
     config_fn_map["tls_session_timeout"] = {2,  2,  [&] (config *cfg, config_line &line) { tls_session_timeout = atoi(line[1].c_str()); }};
     config_fn_map["tls_session_count"] =   {2,  2,  [&] (config *cfg, config_line &line) { tls_session_count = atoi(line[1].c_str()); }};
+    config_fn_map["tls_session_tickets"] = {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") tls_session_tickets = true;
+        else if (line[1] == "off") tls_session_tickets = false;
+        else log_fatal_exit("configuration error: tls_session_tickets: expected on or off: %s", line[1].c_str());
+    }};
+    config_fn_map["tls_curves"] =          {2,  2,  [&] (config *cfg, config_line &line) { tls_curves = line[1]; }};
+    config_fn_map["tls_prefer_server_ciphers"] = {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") tls_prefer_server_ciphers = true;
+        else if (line[1] == "off") tls_prefer_server_ciphers = false;
+        else log_fatal_exit("configuration error: tls_prefer_server_ciphers: expected on or off: %s", line[1].c_str());
+    }};
+    config_fn_map["tls_dhe"] =             {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") tls_dhe = true;
+        else if (line[1] == "off") tls_dhe = false;
+        else log_fatal_exit("configuration error: tls_dhe: expected on or off: %s", line[1].c_str());
+    }};
+    config_fn_map["tls_ticket_rotation"] = {2,  2,  [&] (config *cfg, config_line &line) {
+        tls_ticket_rotation = atoi(line[1].c_str());
+        if (tls_ticket_rotation <= 0) {
+            log_fatal_exit("configuration error: tls_ticket_rotation: expected seconds: %s", line[1].c_str());
+        }
+    }};
     config_fn_map["client_connections"] =  {2,  2,  [&] (config *cfg, config_line &line) { client_connections = atoi(line[1].c_str()); }};
+    config_fn_map["client_pipeline_depth"] = {2,  2,  [&] (config *cfg, config_line &line) {
+        client_pipeline_depth = atoi(line[1].c_str());
+        if (client_pipeline_depth < 1) {
+            log_fatal_exit("configuration error: client_pipeline_depth: expected at least 1: %s", line[1].c_str());
+        }
+    }};
+    config_fn_map["client_host_connections"] = {2,  2,  [&] (config *cfg, config_line &line) {
+        client_host_connections = atoi(line[1].c_str());
+        if (client_host_connections < 0) {
+            log_fatal_exit("configuration error: client_host_connections: expected 0 (unlimited) or more: %s", line[1].c_str());
+        }
+    }};
     config_fn_map["server_connections"] =  {2,  2,  [&] (config *cfg, config_line &line) { server_connections = atoi(line[1].c_str()); }};
     config_fn_map["listen_backlog"] =      {2,  2,  [&] (config *cfg, config_line &line) { listen_backlog = atoi(line[1].c_str()); }};
     config_fn_map["max_headers"] =         {2,  2,  [&] (config *cfg, config_line &line) { max_headers = atoi(line[1].c_str()); }};
     config_fn_map["header_buffer_size"] =  {2,  2,  [&] (config *cfg, config_line &line) { header_buffer_size = atoi(line[1].c_str()); }};
     config_fn_map["io_buffer_size"] =      {2,  2,  [&] (config *cfg, config_line &line) { io_buffer_size = atoi(line[1].c_str()); }};
     config_fn_map["ipc_buffer_size"] =     {2,  2,  [&] (config *cfg, config_line &line) { ipc_buffer_size = atoi(line[1].c_str()); }};
+    config_fn_map["proxy_buffer_size"] =   {2,  2,  [&] (config *cfg, config_line &line) {
+        proxy_buffer_size = atoi(line[1].c_str());
+        if (proxy_buffer_size < 1024) {
+            log_fatal_exit("configuration error: proxy_buffer_size: expected at least 1024: %s", line[1].c_str());
+        }
+    }};
+    config_fn_map["proxy_splice"] =        {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") proxy_splice = true;
+        else if (line[1] == "off") proxy_splice = false;
+        else log_fatal_exit("configuration error: proxy_splice: invalid value: %s", line[1].c_str());
+    }};
+    config_fn_map["cache_size"] =          {2,  2,  [&] (config *cfg, config_line &line) {
+        cache_size = strtoull(line[1].c_str(), nullptr, 10);
+        if (cache_size < 65536) {
+            log_fatal_exit("configuration error: cache_size: expected at least 65536: %s", line[1].c_str());
+        }
+    }};
+    config_fn_map["cache_max_entry_size"] = {2, 2,  [&] (config *cfg, config_line &line) {
+        cache_max_entry_size = strtoull(line[1].c_str(), nullptr, 10);
+        if (cache_max_entry_size < 1024) {
+            log_fatal_exit("configuration error: cache_max_entry_size: expected at least 1024: %s", line[1].c_str());
+        }
+    }};
     config_fn_map["log_buffers"] =         {2,  2,  [&] (config *cfg, config_line &line) { log_buffers = atoi(line[1].c_str()); }};
+    config_fn_map["log_overflow"] =        {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] != "drop" && line[1] != "block") {
+            log_fatal_exit("configuration error: log_overflow: expected drop or block: %s", line[1].c_str());
+        }
+        log_overflow = line[1];
+    }};
+    config_fn_map["log_threads"] =         {2,  2,  [&] (config *cfg, config_line &line) { log_threads = atoi(line[1].c_str()); }};
     config_fn_map["keepalive_timeout"] =   {2,  2,  [&] (config *cfg, config_line &line) { keepalive_timeout = atoi(line[1].c_str()); }};
     config_fn_map["connection_timeout"] =  {2,  2,  [&] (config *cfg, config_line &line) { connection_timeout = atoi(line[1].c_str()); }};
+    config_fn_map["edge_triggered"] =      {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") edge_triggered = true;
+        else if (line[1] == "off") edge_triggered = false;
+        else log_fatal_exit("configuration error: edge_triggered: invalid value: %s", line[1].c_str());
+    }};
+    config_fn_map["sendfile"] =            {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") sendfile = true;
+        else if (line[1] == "off") sendfile = false;
+        else log_fatal_exit("configuration error: sendfile: invalid value: %s", line[1].c_str());
+    }};
+    config_fn_map["tls_ktls"] =            {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") tls_ktls = true;
+        else if (line[1] == "off") tls_ktls = false;
+        else log_fatal_exit("configuration error: tls_ktls: invalid value: %s", line[1].c_str());
+    }};
+    config_fn_map["tls_record_size"] =     {2,  2,  [&] (config *cfg, config_line &line) {
+        tls_record_size = atoi(line[1].c_str());
+        if (tls_record_size < 0 || tls_record_size > 16384) {
+            log_fatal_exit("configuration error: tls_record_size: expected 0 to 16384 bytes: %s", line[1].c_str());
+        }
+    }};
+    config_fn_map["tls_record_boost"] =    {2,  2,  [&] (config *cfg, config_line &line) { tls_record_boost = atoi(line[1].c_str()); }};
+    config_fn_map["tls_record_idle"] =     {2,  2,  [&] (config *cfg, config_line &line) { tls_record_idle = atoi(line[1].c_str()); }};
+    config_fn_map["resolver"] =            {2, -1,  [&] (config *cfg, config_line &line) {
+        for (size_t i = 1; i < line.size(); i++) {
+            socket_addr addr;
+            if (!resolver::parse_nameserver(line[i], addr)) {
+                log_fatal_exit("configuration error: resolver: expected address or address:port: %s", line[i].c_str());
+            }
+            resolver_nameservers.push_back(line[i]);
+        }
+    }};
+    config_fn_map["resolver_timeout"] =    {2,  2,  [&] (config *cfg, config_line &line) {
+        resolver_timeout = atoi(line[1].c_str());
+        if (resolver_timeout <= 0) {
+            log_fatal_exit("configuration error: resolver_timeout: expected milliseconds: %s", line[1].c_str());
+        }
+    }};
+    config_fn_map["resolver_ipv6"] =       {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] == "on") resolver_ipv6 = true;
+        else if (line[1] == "off") resolver_ipv6 = false;
+        else log_fatal_exit("configuration error: resolver_ipv6: invalid value: %s", line[1].c_str());
+    }};
+    config_fn_map["pollset_type"] =        {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] != "poll" && line[1] != "epoll" && line[1] != "kqueue" && line[1] != "uring_poll") {
+            log_fatal_exit("configuration error: pollset_type: invalid type: %s", line[1].c_str());
+        }
+        pollset_type = line[1];
+    }};
     config_fn_map["client_threads"] =      {3,  3,  [&] (config *cfg, config_line &line) {
         client_threads.push_back(std::pair<std::string,size_t>(line[1], atoi(line[2].c_str())));
     }};
@@ -75,7 +213,7 @@ config::config() :
     config_fn_map["proto_threads"] =      {3,  3,  [&] (config *cfg, config_line &line) {
         proto_threads.push_back(std::pair<std::string,size_t>(line[1], atoi(line[2].c_str())));
     }};
-    config_fn_map["proto_listener"] =     {3,  4,  [&] (config *cfg, config_line &line) {
+    config_fn_map["proto_listener"] =     {3, -1,  [&] (config *cfg, config_line &line) {
         auto proto = (*protocol::get_map())[line[1]];
         if (!proto) {
             log_fatal_exit("configuration error: proto_listener: invalid protocol: %s", line[1].c_str());
@@ -84,14 +222,16 @@ config::config() :
         if (socket_addr::string_to_addr(line[2], addr) < 0) {
             log_fatal_exit("configuration error: proto_listener: invalid address: %s", line[2].c_str());
         }
-        if (line.size() == 4) {
-            if (line[3] != "tls") {
-                log_fatal_exit("configuration error: proto_listener: invalid option: %s", line[3].c_str());
+        socket_mode mode = socket_mode_plain;
+        socket_listen_options opts;
+        for (size_t i = 3; i < line.size(); i++) {
+            if (line[i] == "tls") {
+                mode = socket_mode_tls;
+            } else if (!opts.parse(line[i])) {
+                log_fatal_exit("configuration error: proto_listener: invalid option: %s", line[i].c_str());
             }
-            proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode>(proto, addr, socket_mode_tls));
-        } else {
-            proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode>(proto, addr, socket_mode_plain));
         }
+        proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode,socket_listen_options>(proto, addr, mode, opts));
     }};
     config_fn_map["mime_type"] =           {3, -1,  [&] (config *cfg, config_line &line) {
         for (size_t s = 2; s < line.size(); s++) {
@@ -209,17 +349,34 @@ std::string config::to_string()
 {
     std::stringstream ss;
     ss << "client_connections  " << client_connections << ";" << std::endl;
+    ss << "client_pipeline_depth " << client_pipeline_depth << ";" << std::endl;
+    ss << "client_host_connections " << client_host_connections << ";" << std::endl;
     ss << "server_connections  " << server_connections << ";" << std::endl;
     ss << "listen_backlog      " << listen_backlog << ";" << std::endl;
     ss << "max_headers         " << max_headers << ";" << std::endl;
     ss << "header_buffer_size  " << header_buffer_size << ";" << std::endl;
     ss << "io_buffer_size      " << io_buffer_size << ";" << std::endl;
     ss << "ipc_buffer_size     " << ipc_buffer_size << ";" << std::endl;
+    ss << "proxy_buffer_size   " << proxy_buffer_size << ";" << std::endl;
+    ss << "proxy_splice        " << (proxy_splice ? "on" : "off") << ";" << std::endl;
+    ss << "cache_size          " << cache_size << ";" << std::endl;
+    ss << "cache_max_entry_size " << cache_max_entry_size << ";" << std::endl;
     ss << "log_buffers         " << log_buffers << ";" << std::endl;
+    ss << "log_overflow        " << log_overflow << ";" << std::endl;
+    ss << "log_threads         " << log_threads << ";" << std::endl;
     ss << "keepalive_timeout   " << keepalive_timeout << ";" << std::endl;
     ss << "connection_timeout  " << connection_timeout << ";" << std::endl;
+    ss << "edge_triggered      " << (edge_triggered ? "on" : "off") << ";" << std::endl;
+    ss << "sendfile            " << (sendfile ? "on" : "off") << ";" << std::endl;
+    if (pollset_type.length() > 0) {
+        ss << "pollset_type        " << pollset_type << ";" << std::endl;
+    }
     ss << "error_log           " << error_log << ";" << std::endl;
     ss << "access_log          " << access_log << ";" << std::endl;
+    ss << "access_log_format   " << access_log_format << ";" << std::endl;
+    ss << "access_log_sample   " << access_log_sample << ";" << std::endl;
+    ss << "access_log_slow     " << access_log_slow << ";" << std::endl;
+    ss << "access_log_errors   " << (access_log_errors ? "on" : "off") << ";" << std::endl;
     ss << "pid_file            " << pid_file << ";" << std::endl;
     ss << "tls_ca_file         " << tls_ca_file << ";" << std::endl;
     ss << "tls_key_file        " << tls_key_file << ";" << std::endl;
@@ -227,6 +384,20 @@ std::string config::to_string()
     ss << "tls_cipher_list     " << tls_cipher_list << ";" << std::endl;
     ss << "tls_session_timeout " << tls_session_timeout << ";" << std::endl;
     ss << "tls_session_count   " << tls_session_count << ";" << std::endl;
+    ss << "tls_session_tickets " << (tls_session_tickets ? "on" : "off") << ";" << std::endl;
+    ss << "tls_ticket_rotation " << tls_ticket_rotation << ";" << std::endl;
+    ss << "tls_curves          " << tls_curves << ";" << std::endl;
+    ss << "tls_prefer_server_ciphers " << (tls_prefer_server_ciphers ? "on" : "off") << ";" << std::endl;
+    ss << "tls_dhe             " << (tls_dhe ? "on" : "off") << ";" << std::endl;
+    ss << "tls_ktls            " << (tls_ktls ? "on" : "off") << ";" << std::endl;
+    ss << "tls_record_size     " << tls_record_size << ";" << std::endl;
+    ss << "tls_record_boost    " << tls_record_boost << ";" << std::endl;
+    ss << "tls_record_idle     " << tls_record_idle << ";" << std::endl;
+    if (resolver_nameservers.size() > 0) {
+        ss << "resolver            " << join(resolver_nameservers) << ";" << std::endl;
+    }
+    ss << "resolver_timeout    " << resolver_timeout << ";" << std::endl;
+    ss << "resolver_ipv6       " << (resolver_ipv6 ? "on" : "off") << ";" << std::endl;
     ss << "root                " << root << ";" << std::endl;
     for (auto thread : client_threads) {
         ss << "client_threads      " << thread.first << " " << thread.second << ";" << std::endl;
@@ -238,7 +409,8 @@ std::string config::to_string()
         std::string proto = std::get<0>(proto_listener)->name;
         std::string addr = socket_addr::addr_to_string(std::get<1>(proto_listener));
         std::string mode = std::get<2>(proto_listener) == socket_mode_tls ? " tls" : "";
-        ss << "proto_listener      " << proto << " " << addr << mode << ";" << std::endl;
+        std::string opts = std::get<3>(proto_listener).to_string();
+        ss << "proto_listener      " << proto << " " << addr << mode << opts << ";" << std::endl;
     }
     for (auto mime_type_ent : mime_types) {
         ss << "mime_type           " << mime_type_ent.first << " " << mime_type_ent.second << ";" << std::endl;
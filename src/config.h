@@ -6,17 +6,42 @@
 #define config_h
 
 #define CLIENT_CONNECTIONS_DEFAULT  128
+#define CLIENT_PIPELINE_DEPTH_DEFAULT 1
+#define CLIENT_HOST_CONNECTIONS_DEFAULT 0
 #define SERVER_CONNECTIONS_DEFAULT  1024
 #define LISTEN_BACKLOG_DEFAULT      128
 #define MAX_HEADERS_DEFAULT         128
 #define HEADER_BUFFER_SIZE_DEFAULT  8192
 #define IO_BUFFER_SIZE_DEFAULT      8192
 #define IPC_BUFFER_SIZE_DEFAULT     1048576
+#define PROXY_BUFFER_SIZE_DEFAULT   65536
+#define PROXY_SPLICE_DEFAULT        true
+#define CACHE_SIZE_DEFAULT          67108864
+#define CACHE_MAX_ENTRY_SIZE_DEFAULT 1048576
 #define LOG_BUFFERS_DEFAULT         1024
+#define LOG_OVERFLOW_DEFAULT        "drop"
+#define LOG_THREADS_DEFAULT         1
+#define ACCESS_LOG_FORMAT_DEFAULT   "text"
+#define ACCESS_LOG_SAMPLE_DEFAULT   1
+#define ACCESS_LOG_SLOW_DEFAULT     0
+#define ACCESS_LOG_ERRORS_DEFAULT   true
 #define CONNETION_TIMEOUT_DEFAULT   60
 #define KEEPALIVE_TIMEOUT_DEFAULT   5
 #define TLS_SESSION_TIMEOUT_DEFAULT 7200
 #define TLS_SESSION_COUNT_DEFAULT   32768
+#define TLS_SESSION_TICKETS_DEFAULT true
+#define TLS_TICKET_ROTATION_DEFAULT 3600
+#define TLS_CURVES_DEFAULT          "X25519:P-256"
+#define TLS_PREFER_SERVER_CIPHERS_DEFAULT true
+#define TLS_DHE_DEFAULT             false
+#define EDGE_TRIGGERED_DEFAULT      false
+#define SENDFILE_DEFAULT            false
+#define TLS_KTLS_DEFAULT            false
+#define TLS_RECORD_SIZE_DEFAULT     1369
+#define TLS_RECORD_BOOST_DEFAULT    65536
+#define TLS_RECORD_IDLE_DEFAULT     1000
+#define RESOLVER_TIMEOUT_DEFAULT    1000
+#define RESOLVER_IPV6_DEFAULT       true
 
 struct config;
 struct config_record;
@@ -81,15 +106,26 @@ struct config : config_parser
     }
     
     int client_connections;
+    int client_pipeline_depth;
+    int client_host_connections;
     int server_connections;
     int listen_backlog;
     int max_headers;
     int header_buffer_size;
     int io_buffer_size;
     int ipc_buffer_size;
+    int proxy_buffer_size;
+    bool proxy_splice;
+    size_t cache_size;
+    size_t cache_max_entry_size;
     int log_buffers;
+    std::string log_overflow;
+    int log_threads;
     int keepalive_timeout;
     int connection_timeout;
+    bool edge_triggered;
+    bool sendfile;
+    std::string pollset_type;
 
     std::string tls_ca_file;
     std::string tls_key_file;
@@ -97,18 +133,35 @@ struct config : config_parser
     std::string tls_cipher_list;
     int tls_session_timeout;
     int tls_session_count;
+    bool tls_session_tickets;
+    int tls_ticket_rotation;
+    std::string tls_curves;
+    bool tls_prefer_server_ciphers;
+    bool tls_dhe;
+    bool tls_ktls;
+    int tls_record_size;
+    int tls_record_boost;
+    int tls_record_idle;
+
+    std::vector<std::string> resolver_nameservers;
+    int resolver_timeout;
+    bool resolver_ipv6;
 
     std::string os_user;
     std::string os_group;
     std::string error_log;
     std::string access_log;
+    std::string access_log_format;
+    int access_log_sample;
+    int access_log_slow;
+    bool access_log_errors;
     std::string pid_file;
     std::string root;
 
     std::vector<std::pair<std::string,size_t>> client_threads;
     std::vector<std::pair<std::string,size_t>> server_threads;
     std::vector<std::pair<std::string,size_t>> proto_threads;
-    std::vector<std::tuple<protocol*,socket_addr,socket_mode>> proto_listeners;
+    std::vector<std::tuple<protocol*,socket_addr,socket_mode,socket_listen_options>> proto_listeners;
     std::map<std::string,std::string> mime_types;
     std::vector<std::string> index_files;
     
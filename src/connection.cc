@@ -41,7 +41,7 @@
 
 /* connection */
 
-connection::connection() : conn_id(-1), last_activity(0), local_addr(), peer_addr(), nopush(0), nodelay(0) {}
+connection::connection() : conn_id(-1), last_activity(0), local_addr(), peer_addr(), bytes_read(0), bytes_written(0), nopush(0), nodelay(0), would_block(0) {}
 
 connection::~connection() {}
 
@@ -49,6 +49,8 @@ void connection::reset()
 {
     close();
     last_activity = 0;
+    bytes_read = 0;
+    bytes_written = 0;
     memset(&local_addr, 0, sizeof(local_addr));
     memset(&peer_addr, 0, sizeof(peer_addr));
 }
@@ -130,6 +132,16 @@ void connection::start_lingering_close()
     }
 }
 
+int connection::do_handshake()
+{
+    if (!sock) {
+        return -1;
+    }
+    int ret = sock->do_handshake();
+    would_block = (ret == socket_error_want_read || ret == socket_error_want_write);
+    return ret;
+}
+
 void connection::close()
 {
     if (sock) {
@@ -143,7 +155,10 @@ io_result connection::read(void *buf, size_t len)
     if (!sock) {
         return io_result(io_error(EIO));
     }
-    return sock->read(buf, len);
+    io_result result = sock->read(buf, len);
+    would_block = result.would_block();
+    if (!result.has_error()) bytes_read += result.size();
+    return result;
 }
 
 io_result connection::write(void *buf, size_t len)
@@ -151,7 +166,53 @@ io_result connection::write(void *buf, size_t len)
     if (!sock) {
         return io_result(io_error(EIO));
     }
-    return sock->write(buf, len);
+    io_result result = sock->write(buf, len);
+    would_block = result.would_block();
+    if (!result.has_error()) bytes_written += result.size();
+    return result;
+}
+
+bool connection::can_sendfile()
+{
+    return sock && sock->can_sendfile();
+}
+
+io_result connection::sendfile(int in_fd, off_t offset, size_t len)
+{
+    if (!sock) {
+        return io_result(io_error(EIO));
+    }
+    io_result result = sock->sendfile(in_fd, offset, len);
+    would_block = result.would_block();
+    if (!result.has_error()) bytes_written += result.size();
+    return result;
+}
+
+bool connection::can_splice()
+{
+    return sock && sock->can_splice();
+}
+
+io_result connection::splice_in(int pipe_fd, size_t len)
+{
+    if (!sock) {
+        return io_result(io_error(EIO));
+    }
+    io_result result = sock->splice_in(pipe_fd, len);
+    would_block = result.would_block();
+    if (!result.has_error()) bytes_read += result.size();
+    return result;
+}
+
+io_result connection::splice_out(int pipe_fd, size_t len)
+{
+    if (!sock) {
+        return io_result(io_error(EIO));
+    }
+    io_result result = sock->splice_out(pipe_fd, len);
+    would_block = result.would_block();
+    if (!result.has_error()) bytes_written += result.size();
+    return result;
 }
 
 time_t connection::get_last_activity() { return last_activity; }
@@ -12,8 +12,11 @@ struct connection : io_reader, io_writer
     socket_addr             local_addr;
     socket_addr             peer_addr;
     connected_socket_ptr    sock;
+    uint64_t                bytes_read;
+    uint64_t                bytes_written;
     int                     nopush : 1;
     int                     nodelay : 1;
+    int                     would_block : 1;
     
     connection();
     virtual ~connection();
@@ -30,10 +33,16 @@ struct connection : io_reader, io_writer
     void set_nopush(int nopush);
     void set_nodelay(int nodelay);
     void start_lingering_close();
+    int do_handshake();
     void close();
     
     io_result read(void *buf, size_t len);
     io_result write(void *buf, size_t len);
+    bool can_sendfile();
+    io_result sendfile(int in_fd, off_t offset, size_t len);
+    bool can_splice();
+    io_result splice_in(int pipe_fd, size_t len);
+    io_result splice_out(int pipe_fd, size_t len);
 
     time_t get_last_activity();
     void set_last_activity(time_t current_time);
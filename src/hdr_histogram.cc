@@ -0,0 +1,134 @@
+//
+//  hdr_histogram.cc
+//
+
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "hdr_histogram.h"
+
+
+/* hdr_histogram */
+
+hdr_histogram::hdr_histogram(int64_t highest_trackable, int significant_figures) :
+    highest_trackable(std::max(highest_trackable, (int64_t)2)),
+    significant_figures(std::min(std::max(significant_figures, 1), 5)),
+    total_count(0),
+    min_value(INT64_MAX),
+    max_value(0)
+{
+    // enough linear sub buckets to resolve one part in 10^significant_figures
+    int64_t largest_single_unit = 2 * (int64_t)pow(10, this->significant_figures);
+    int sub_bucket_count_magnitude = (int)ceil(log2((double)largest_single_unit));
+    sub_bucket_half_count_magnitude = std::max(sub_bucket_count_magnitude, 1) - 1;
+    sub_bucket_count = 1 << (sub_bucket_half_count_magnitude + 1);
+    sub_bucket_half_count = sub_bucket_count / 2;
+    sub_bucket_mask = sub_bucket_count - 1;
+
+    // each further bucket doubles the range at the same precision
+    int64_t smallest_untrackable = sub_bucket_count;
+    bucket_count = 1;
+    while (smallest_untrackable <= this->highest_trackable) {
+        if (smallest_untrackable > INT64_MAX / 2) {
+            bucket_count++;
+            break;
+        }
+        smallest_untrackable <<= 1;
+        bucket_count++;
+    }
+    counts.resize((size_t)(bucket_count + 1) * sub_bucket_half_count);
+}
+
+size_t hdr_histogram::counts_index(int64_t value) const
+{
+    int pow2_ceiling = 64 - __builtin_clzll((uint64_t)(value | sub_bucket_mask));
+    int bucket_index = pow2_ceiling - (sub_bucket_half_count_magnitude + 1);
+    int sub_bucket_index = (int)(value >> bucket_index);
+    return ((size_t)(bucket_index + 1) << sub_bucket_half_count_magnitude) +
+           (sub_bucket_index - sub_bucket_half_count);
+}
+
+int64_t hdr_histogram::value_at_index(size_t index) const
+{
+    int bucket_index = (int)(index >> sub_bucket_half_count_magnitude) - 1;
+    int sub_bucket_index = (int)(index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+    if (bucket_index < 0) {
+        sub_bucket_index -= sub_bucket_half_count;
+        bucket_index = 0;
+    }
+    return (int64_t)sub_bucket_index << bucket_index;
+}
+
+int64_t hdr_histogram::highest_equivalent_value(int64_t value) const
+{
+    int pow2_ceiling = 64 - __builtin_clzll((uint64_t)(value | sub_bucket_mask));
+    int bucket_index = pow2_ceiling - (sub_bucket_half_count_magnitude + 1);
+    return value_at_index(counts_index(value)) + ((int64_t)1 << bucket_index) - 1;
+}
+
+void hdr_histogram::record(int64_t value, uint64_t count)
+{
+    if (value < 0) value = 0;
+    size_t index = counts_index(std::min(value, highest_trackable));
+    counts[std::min(index, counts.size() - 1)] += count;
+    total_count += count;
+    if (value < min_value) min_value = value;
+    if (value > max_value) max_value = value;
+}
+
+void hdr_histogram::merge(const hdr_histogram &other)
+{
+    // add counts bucket by bucket so the exact extremes are kept rather than bucket values
+    bool same_layout = counts.size() == other.counts.size() &&
+                       sub_bucket_half_count_magnitude == other.sub_bucket_half_count_magnitude;
+    for (size_t i = 0; i < other.counts.size(); i++) {
+        if (other.counts[i] == 0) continue;
+        size_t index = same_layout ? i : counts_index(std::min(other.value_at_index(i), highest_trackable));
+        counts[std::min(index, counts.size() - 1)] += other.counts[i];
+    }
+    total_count += other.total_count;
+    if (other.total_count > 0) {
+        min_value = std::min(min_value, other.min_value);
+        max_value = std::max(max_value, other.max_value);
+    }
+}
+
+void hdr_histogram::reset()
+{
+    std::fill(counts.begin(), counts.end(), 0);
+    total_count = 0;
+    min_value = INT64_MAX;
+    max_value = 0;
+}
+
+int64_t hdr_histogram::value_at_percentile(double percentile) const
+{
+    if (total_count == 0) return 0;
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    uint64_t target = (uint64_t)ceil(percentile / 100.0 * total_count);
+    target = std::max(target, (uint64_t)1);
+    uint64_t running = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        running += counts[i];
+        if (running >= target) {
+            return std::min(highest_equivalent_value(value_at_index(i)), max_value);
+        }
+    }
+    return max_value;
+}
+
+double hdr_histogram::mean() const
+{
+    if (total_count == 0) return 0;
+    double total = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] == 0) continue;
+        int64_t lowest = value_at_index(i);
+        int64_t highest = highest_equivalent_value(lowest);
+        total += (double)counts[i] * (lowest + highest) / 2.0;
+    }
+    return total / total_count;
+}
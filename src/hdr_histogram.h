@@ -0,0 +1,47 @@
+//
+//  hdr_histogram.h
+//
+
+#ifndef hdr_histogram_h
+#define hdr_histogram_h
+
+/*
+ * hdr_histogram
+ *
+ * High dynamic range histogram with log-linear buckets. Values from 0 to
+ * highest_trackable are recorded with significant_figures decimal digits
+ * of precision, larger values are clamped. Recording is O(1) and not
+ * thread safe, use one histogram per thread and merge them.
+ */
+
+struct hdr_histogram
+{
+    int64_t                 highest_trackable;
+    int                     significant_figures;
+    int                     sub_bucket_half_count_magnitude;
+    int                     sub_bucket_count;
+    int                     sub_bucket_half_count;
+    int64_t                 sub_bucket_mask;
+    int                     bucket_count;
+    std::vector<uint64_t>   counts;
+    uint64_t                total_count;
+    int64_t                 min_value;
+    int64_t                 max_value;
+
+    hdr_histogram(int64_t highest_trackable, int significant_figures = 3);
+
+    void record(int64_t value, uint64_t count = 1);
+    void merge(const hdr_histogram &other);
+    void reset();
+
+    int64_t value_at_percentile(double percentile) const;
+    int64_t min() const { return total_count ? min_value : 0; }
+    int64_t max() const { return max_value; }
+    double mean() const;
+
+    size_t counts_index(int64_t value) const;
+    int64_t value_at_index(size_t index) const;
+    int64_t highest_equivalent_value(int64_t value) const;
+};
+
+#endif
@@ -0,0 +1,185 @@
+//
+//  http_access_log.cc
+//
+
+#include "plat_net.h"
+
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+
+#include "io.h"
+#include "socket.h"
+#include "http_common.h"
+#include "http_date.h"
+#include "http_access_log.h"
+
+static_assert(sizeof(http_access_log_record) == 96, "http_access_log_record must be 96 bytes");
+
+
+/* http_access_log_record */
+
+size_t http_access_log_record::encode(char *buf, size_t buf_len, const http_access_log_record &hdr,
+                                      const http_header_string strings[http_access_log_string_count])
+{
+    size_t limit = std::min(buf_len, (size_t)HTTP_ACCESS_LOG_RECORD_MAX) & ~(size_t)7;
+    if (limit < sizeof(http_access_log_record)) return 0;
+
+    // copy strings truncating them to the space remaining
+    auto rec = reinterpret_cast<http_access_log_record*>(buf);
+    *rec = hdr;
+    rec->magic = HTTP_ACCESS_LOG_MAGIC;
+    rec->version = HTTP_ACCESS_LOG_VERSION;
+    size_t offset = sizeof(http_access_log_record);
+    for (size_t i = 0; i < http_access_log_string_count; i++) {
+        size_t len = std::min(strings[i].data ? strings[i].length : 0, limit - offset);
+        memcpy(buf + offset, strings[i].data, len);
+        rec->strings[i].offset = (uint16_t)offset;
+        rec->strings[i].length = (uint16_t)len;
+        offset += len;
+    }
+    size_t padded = (offset + 7) & ~(size_t)7;
+    memset(buf + offset, 0, padded - offset);
+    rec->length = (uint16_t)padded;
+    return padded;
+}
+
+const http_access_log_record* http_access_log_record::decode(const char *buf, size_t len)
+{
+    if (len < sizeof(http_access_log_record)) return nullptr;
+    auto rec = reinterpret_cast<const http_access_log_record*>(buf);
+    if (rec->magic != HTTP_ACCESS_LOG_MAGIC || rec->version != HTTP_ACCESS_LOG_VERSION ||
+        rec->length < sizeof(http_access_log_record) || rec->length > len)
+    {
+        return nullptr;
+    }
+    for (size_t i = 0; i < http_access_log_string_count; i++) {
+        if ((size_t)rec->strings[i].offset + rec->strings[i].length > rec->length) return nullptr;
+    }
+    return rec;
+}
+
+http_header_string http_access_log_record::get_string(http_access_log_string_index idx) const
+{
+    return http_header_string((const char*)this + strings[idx].offset, strings[idx].length);
+}
+
+socket_addr http_access_log_record::get_peer_addr() const
+{
+    socket_addr addr;
+    memset(&addr, 0, sizeof(addr));
+    if (addr_family == 4) {
+        addr.ip4addr.sin_family = AF_INET;
+        addr.ip4addr.sin_port = htons(peer_port);
+        memcpy(&addr.ip4addr.sin_addr, peer_addr, sizeof(addr.ip4addr.sin_addr));
+    } else if (addr_family == 6) {
+        addr.ip6addr.sin6_family = AF_INET6;
+        addr.ip6addr.sin6_port = htons(peer_port);
+        memcpy(&addr.ip6addr.sin6_addr, peer_addr, sizeof(addr.ip6addr.sin6_addr));
+    }
+    return addr;
+}
+
+void http_access_log_record::set_peer_addr(const socket_addr &addr)
+{
+    memset(peer_addr, 0, sizeof(peer_addr));
+    if (addr.saddr.sa_family == AF_INET) {
+        addr_family = 4;
+        peer_port = ntohs(addr.ip4addr.sin_port);
+        memcpy(peer_addr, &addr.ip4addr.sin_addr, sizeof(addr.ip4addr.sin_addr));
+    } else if (addr.saddr.sa_family == AF_INET6) {
+        addr_family = 6;
+        peer_port = ntohs(addr.ip6addr.sin6_port);
+        memcpy(peer_addr, &addr.ip6addr.sin6_addr, sizeof(addr.ip6addr.sin6_addr));
+    } else {
+        addr_family = 0;
+        peer_port = 0;
+    }
+}
+
+static void escape_string(std::stringstream &ss, http_header_string str, bool json)
+{
+    if (str.length == 0 && !json) {
+        ss << "-";
+        return;
+    }
+    for (size_t i = 0; i < str.length; i++) {
+        unsigned char c = str.data[i];
+        if (c == '"' || c == '\\') {
+            ss << '\\' << c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), json ? "\\u%04x" : "\\x%02X", c);
+            ss << hex;
+        } else {
+            ss << c;
+        }
+    }
+}
+
+std::string http_access_log_record::to_string(http_access_log_format fmt) const
+{
+    std::stringstream ss;
+    char addr_buf[64] = "-";
+    if (addr_family == 4) {
+        inet_ntop(AF_INET, peer_addr, addr_buf, sizeof(addr_buf));
+    } else if (addr_family == 6) {
+        inet_ntop(AF_INET6, peer_addr, addr_buf, sizeof(addr_buf));
+    }
+
+    if (fmt == http_access_log_format_json) {
+        char date_buf[32];
+        ss << "{\"time\":\"" << http_date((time_t)(time_usecs / 1000000)).to_iso_string(date_buf, sizeof(date_buf)).data << "\""
+           << ",\"time_usecs\":" << time_usecs
+           << ",\"addr\":\"" << addr_buf << "\""
+           << ",\"port\":" << peer_port
+           << ",\"method\":\"";
+        escape_string(ss, get_string(http_access_log_string_method), true);
+        ss << "\",\"uri\":\"";
+        escape_string(ss, get_string(http_access_log_string_uri), true);
+        ss << "\",\"version\":\"";
+        escape_string(ss, get_string(http_access_log_string_version), true);
+        ss << "\",\"host\":\"";
+        escape_string(ss, get_string(http_access_log_string_host), true);
+        ss << "\",\"referer\":\"";
+        escape_string(ss, get_string(http_access_log_string_referer), true);
+        ss << "\",\"user_agent\":\"";
+        escape_string(ss, get_string(http_access_log_string_user_agent), true);
+        ss << "\",\"status\":" << status_code
+           << ",\"bytes_read\":" << bytes_read
+           << ",\"bytes_written\":" << bytes_written
+           << ",\"header_usecs\":" << header_usecs
+           << ",\"handler_usecs\":" << handler_usecs
+           << ",\"total_usecs\":" << total_usecs
+           << "}";
+        return ss.str();
+    }
+
+    char date_buf[32];
+    ss << addr_buf << " - - "
+       << http_date((time_t)(time_usecs / 1000000)).to_log_string(date_buf, sizeof(date_buf)).data
+       << " \"";
+    escape_string(ss, get_string(http_access_log_string_method), false);
+    ss << " ";
+    escape_string(ss, get_string(http_access_log_string_uri), false);
+    ss << " ";
+    escape_string(ss, get_string(http_access_log_string_version), false);
+    ss << "\" " << status_code << " " << bytes_written;
+    if (fmt == http_access_log_format_combined) {
+        ss << " \"";
+        escape_string(ss, get_string(http_access_log_string_referer), false);
+        ss << "\" \"";
+        escape_string(ss, get_string(http_access_log_string_user_agent), false);
+        ss << "\"";
+    }
+    return ss.str();
+}
@@ -0,0 +1,74 @@
+//
+//  http_access_log.h
+//
+
+#ifndef http_access_log_h
+#define http_access_log_h
+
+#define HTTP_ACCESS_LOG_MAGIC       0x4c41544c  /* "LTAL" */
+#define HTTP_ACCESS_LOG_VERSION     1
+#define HTTP_ACCESS_LOG_RECORD_MAX  4096
+
+enum http_access_log_format
+{
+    http_access_log_format_common,
+    http_access_log_format_combined,
+    http_access_log_format_json
+};
+
+enum http_access_log_string_index
+{
+    http_access_log_string_method,
+    http_access_log_string_uri,
+    http_access_log_string_version,
+    http_access_log_string_referer,
+    http_access_log_string_user_agent,
+    http_access_log_string_host,
+    http_access_log_string_count
+};
+
+struct http_access_log_string
+{
+    uint16_t    offset;             /* offset from the start of the record */
+    uint16_t    length;
+};
+
+
+/*
+ * http_access_log_record
+ *
+ * Binary access log record in host byte order. The fixed size header
+ * is followed by the string section. Records are padded to 8 bytes.
+ */
+
+struct http_access_log_record
+{
+    uint32_t                magic;
+    uint16_t                version;
+    uint16_t                length;             /* record length including strings and padding */
+    uint64_t                time_usecs;         /* request start, microseconds since the epoch */
+    uint64_t                bytes_read;
+    uint64_t                bytes_written;
+    uint32_t                header_usecs;       /* request start to request headers parsed */
+    uint32_t                handler_usecs;      /* request headers parsed to response headers ready */
+    uint32_t                total_usecs;        /* request start to response finished */
+    uint16_t                status_code;
+    uint8_t                 addr_family;        /* 4 or 6 */
+    uint8_t                 flags;
+    uint8_t                 peer_addr[16];
+    uint16_t                peer_port;
+    uint16_t                reserved;
+    http_access_log_string  strings[http_access_log_string_count];
+    uint32_t                reserved2;
+
+    static size_t encode(char *buf, size_t buf_len, const http_access_log_record &hdr,
+                         const http_header_string strings[http_access_log_string_count]);
+    static const http_access_log_record* decode(const char *buf, size_t len);
+
+    http_header_string get_string(http_access_log_string_index idx) const;
+    socket_addr get_peer_addr() const;
+    void set_peer_addr(const socket_addr &addr);
+    std::string to_string(http_access_log_format fmt) const;
+};
+
+#endif
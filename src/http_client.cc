@@ -20,6 +20,7 @@
 #include <functional>
 #include <deque>
 #include <map>
+#include <unordered_map>
 #include <atomic>
 #include <memory>
 #include <thread>
@@ -66,6 +67,10 @@ protocol_action http_client::action_process_next_request
     (get_proto(), "process_next_request", &process_next_request);
 protocol_action http_client::action_keepalive_wait_connection
     (get_proto(), "keepalive_wait_connection", &keepalive_wait_connection);
+protocol_action http_client::action_wake_connection
+    (get_proto(), "wake_connection", &wake_connection);
+protocol_action http_client::action_resume_connection
+    (get_proto(), "resume_connection", &resume_connection);
 
 // threads
 protocol_mask http_client::thread_mask_connect
@@ -99,6 +104,17 @@ http_client_request::http_client_request(HTTPMethod method, url_ptr url,
 : method(method), url(url), handler(handler) {}
 
 
+/* http_client_host_pool */
+
+http_client_host_pool::http_client_host_pool(std::string key, size_t num_stacks, std::atomic<uint32_t> *links)
+: key(key), connections(0), filling(nullptr), idle(num_stacks)
+{
+    for (auto &stack : idle) {
+        stack.init(links);
+    }
+}
+
+
 /* http_client_connection */
 
 int http_client_connection::get_poll_fd()
@@ -114,18 +130,23 @@ poll_object_type http_client_connection::get_poll_type()
 bool http_client_connection::init(protocol_engine_delegate *delegate)
 {
     buffer.reset();
+    request_buffer.reset();
     conn.reset();
     request.reset();
     response.reset();
     request_has_body = false;
     response_has_body = false;
+    response_pending = false;
     connection_close = true;
     state = &http_client::connection_state_free;
     handler = http_client_handler_ptr();
+    request_handler = http_client_handler_ptr();
     requests_processed = 0;
+    requests_written = 0;
     if (buffer.size() == 0) {
         const auto &cfg = delegate->get_config();
         buffer.resize(cfg->io_buffer_size);
+        request_buffer.resize(cfg->header_buffer_size);
         request.resize(cfg->header_buffer_size, cfg->max_headers);
         response.resize(cfg->header_buffer_size, cfg->max_headers);
     } else {
@@ -140,6 +161,24 @@ bool http_client_connection::free(protocol_engine_delegate *delegate)
 {
     state = &http_client::connection_state_free;
     handler = http_client_handler_ptr();
+    request_handler = http_client_handler_ptr();
+    http_client_request_list dropped_requests;
+    connection_mutex.lock();
+    if (pool) {
+        http_client_connection *self = this;
+        pool->filling.compare_exchange_strong(self, nullptr);
+        pool->connections--;
+        pool = nullptr;
+    }
+    dropped_requests.swap(url_requests);
+    connection_mutex.unlock();
+    keepalive_thread = nullptr;
+    pool_state = http_client_pool_none;
+    
+    // requests still queued when a connection closes never get a response
+    for (auto &url_req : dropped_requests) {
+        url_req->handler->abort_request();
+    }
     return true;
 }
 
@@ -157,6 +196,37 @@ std::string http_client_config::to_string()
 }
 
 
+/* http_client_engine_state */
+
+http_client_engine_state::~http_client_engine_state()
+{
+    for (size_t i = 0; i < host_pools_size; i++) {
+        delete host_pools[i].load();
+    }
+}
+
+http_client_host_pool* http_client_engine_state::get_host_pool(std::string key)
+{
+    // lock-free open addressing, returns null if the table is full
+    size_t hash = std::hash<std::string>()(key);
+    for (size_t i = 0; i < host_pools_size; i++) {
+        auto &slot = host_pools[(hash + i) & (host_pools_size - 1)];
+        http_client_host_pool *pool = slot.load(std::memory_order_acquire);
+        if (!pool) {
+            auto new_pool = new http_client_host_pool(key, pool_stacks, connections_links.get());
+            if (slot.compare_exchange_strong(pool, new_pool, std::memory_order_acq_rel)) {
+                return new_pool;
+            }
+            delete new_pool;
+        }
+        if (pool->key == key) {
+            return pool;
+        }
+    }
+    return nullptr;
+}
+
+
 /* http_client */
 
 const char* http_client::ClientName = "latypus";
@@ -223,6 +293,20 @@ void http_client::engine_init(protocol_engine_delegate *delegate) const
     // initialize connection table
     get_engine_state(delegate)->init(delegate, cfg->client_connections);
 
+    // one idle stack per keepalive thread in each host pool
+    engine_state->pool_stacks = 0;
+    for (auto thread : cfg->proto_threads) {
+        if (protocol_thread::string_to_thread_mask(thread.first) & thread_mask_keepalive.mask) {
+            engine_state->pool_stacks += thread.second;
+        }
+    }
+    engine_state->pool_stacks = (std::max)(engine_state->pool_stacks, (size_t)1);
+    engine_state->host_pools_size = 64;
+    while (engine_state->host_pools_size < (size_t)cfg->client_connections * 4) {
+        engine_state->host_pools_size <<= 1;
+    }
+    engine_state->host_pools.reset(new std::atomic<http_client_host_pool*>[engine_state->host_pools_size]());
+
     // initialize TLS
     engine_state->ssl_ctx = http_tls_shared::init_client(get_proto(), cfg,
                                                          cfg->tls_cipher_list,
@@ -271,6 +355,12 @@ void http_client::handle_connection(protocol_thread_delegate *delegate, protocol
     auto &conn = http_conn->conn;
     time_t current_time = delegate->get_current_time();
     
+    // parked connections may be claimed concurrently by submit_request
+    if (http_conn->state == &connection_state_waiting) {
+        handle_state_waiting(delegate, obj);
+        return;
+    }
+    
     if (revents & poll_event_hup) {
         if (delegate->get_debug_mask() & protocol_debug_socket) {
             int socket_error = conn.get_sock_error();
@@ -296,7 +386,14 @@ void http_client::handle_connection(protocol_thread_delegate *delegate, protocol
     } else {
         conn.set_last_activity(current_time);
         if (http_conn->state->callback) {
-            http_conn->state->callback(delegate, obj);
+            // with edge triggered events keep running the state handlers until
+            // the socket would block or the connection leaves this thread
+            bool edge_triggered = delegate->get_config()->edge_triggered;
+            do {
+                conn.would_block = 0;
+                http_conn->state->callback(delegate, obj);
+            } while (edge_triggered && delegate->has_events(http_conn) &&
+                     !conn.would_block && http_conn->state->callback);
         } else {
             delegate->log_error("%s: invalid connection state: state=%d",
                                 obj->to_string().c_str(), http_conn->state);
@@ -339,8 +436,7 @@ void http_client::timeout_connection(protocol_thread_delegate *delegate, protoco
                 delegate->log_debug("%s: keepalive timeout reached: closing connection",
                                     obj->to_string().c_str());
             }
-            delegate->remove_events(http_conn);
-            close_connection(delegate, http_conn);
+            handle_state_waiting(delegate, obj);
         }
     }
 }
@@ -353,7 +449,7 @@ void http_client::handle_state_tls_handshake(protocol_thread_delegate *delegate,
     auto http_conn = static_cast<http_client_connection*>(obj);
     auto &conn = http_conn->conn;
     
-    int ret = conn.sock->do_handshake();
+    int ret = conn.do_handshake();
     switch (ret) {
         case socket_error_none:
             if (delegate->get_debug_mask() & protocol_debug_tls)
@@ -395,12 +491,13 @@ void http_client::handle_state_client_request(protocol_thread_delegate *delegate
 {
     auto http_conn = static_cast<http_client_connection*>(obj);
     auto &conn = http_conn->conn;
-    auto &buffer = http_conn->buffer;
+    auto &request_buffer = http_conn->request_buffer;
 
     // write request and request headers
-    // TODO - if response has body then populate io_buffer and write in write_response_body
-    io_result result = buffer.buffer_write(conn);
-    if (result.has_error()) {
+    io_result result = request_buffer.buffer_write(conn);
+    if (result.would_block()) {
+        return;
+    } else if (result.has_error()) {
         delegate->log_error("%s: write exception: aborting connection: %s",
                             obj->to_string().c_str(), result.error_string().c_str());
         delegate->remove_events(http_conn);
@@ -410,22 +507,20 @@ void http_client::handle_state_client_request(protocol_thread_delegate *delegate
     
     // if there is any request header data still to be written then
     // enter poll loop waiting for another poll_event_out event
-    if (buffer.bytes_readable() > 0) {
+    if (request_buffer.bytes_readable() > 0) {
         return;
     }
     
     // clear buffers
-    buffer.reset();
+    request_buffer.reset();
     
     // if request has a body then enter http_client_connection_state_client_body
-    // otherwise enter http_client_connection_state_server_response to read response
+    // otherwise the request is written
     if (http_conn->request_has_body) {
         http_conn->state = &connection_state_client_body;
         get_proto()->handle_connection(delegate, obj, poll_event_in); // restart processing in the new state
     } else {
-        delegate->remove_events(http_conn);
-        delegate->add_events(http_conn, poll_event_in);
-        http_conn->state = &connection_state_server_response;
+        finished_request_write(delegate, http_conn);
     }
 }
 
@@ -434,16 +529,16 @@ void http_client::handle_state_client_body(protocol_thread_delegate *delegate, p
     auto http_conn = static_cast<http_client_connection*>(obj);
 
     // write request body e.g. POST
-    io_result result = http_conn->handler->write_request_body();
-    if (result.has_error()) {
+    io_result result = http_conn->request_handler->write_request_body();
+    if (result.would_block()) {
+        return;
+    } else if (result.has_error()) {
         delegate->log_error("%s: handler write_request_body failed: aborting connection: %s",
                             obj->to_string().c_str(), result.error_string().c_str());
         delegate->remove_events(http_conn);
         abort_connection(delegate, http_conn);
     } else if (result.size() == 0) {
-        delegate->remove_events(http_conn);
-        delegate->add_events(http_conn, poll_event_in);
-        http_conn->state = &connection_state_server_response;
+        finished_request_write(delegate, http_conn);
     }
 }
 
@@ -452,27 +547,44 @@ void http_client::handle_state_server_response(protocol_thread_delegate *delegat
     auto http_conn = static_cast<http_client_connection*>(obj);
     auto &conn = http_conn->conn;
     auto &buffer = http_conn->buffer;
+    ssize_t length;
 
-    // read server response and response headers
-    if (buffer.bytes_writable() <= 0) {
-        delegate->log_error("%s: header buffer full: aborting connection",
-                            obj->to_string().c_str());
-        delegate->remove_events(http_conn);
-        abort_connection(delegate, http_conn);
-        return;
-    }
-    io_result result = buffer.buffer_read(conn);
-    if (result.has_error()) {
-        delegate->log_error("%s: read exception: aborting connection: %s",
-                            obj->to_string().c_str(), result.error_string().c_str());
-        delegate->remove_events(http_conn);
-        abort_connection(delegate, http_conn);
-        return;
+    if (http_conn->response_pending) {
+        // pipelined response bytes that arrived with the previous response
+        http_conn->response_pending = false;
+        length = buffer.bytes_readable();
+    } else {
+        // read server response and response headers
+        if (buffer.bytes_writable() <= 0) {
+            delegate->log_error("%s: header buffer full: aborting connection",
+                                obj->to_string().c_str());
+            delegate->remove_events(http_conn);
+            abort_connection(delegate, http_conn);
+            return;
+        }
+        io_result result = buffer.buffer_read(conn);
+        if (result.would_block()) {
+            return;
+        } else if (result.has_error()) {
+            delegate->log_error("%s: read exception: aborting connection: %s",
+                                obj->to_string().c_str(), result.error_string().c_str());
+            delegate->remove_events(http_conn);
+            abort_connection(delegate, http_conn);
+            return;
+        }
+
+        // Close connection if we get EOF reading headers
+        if (result.size() == 0) {
+            delegate->remove_events(http_conn);
+            close_connection(delegate, http_conn);
+            return;
+        }
+        length = result.size();
     }
 
     // incrementally parse headers
-    /* size_t bytes_parsed = */ http_conn->response.parse(buffer.data() + buffer.back - result.size(), result.size());
-    buffer.front += result.size();
+    /* size_t bytes_parsed = */ http_conn->response.parse(buffer.data() + buffer.back - length, length);
+    buffer.front += length;
     
     // switch state if response processing is finished
     if (http_conn->response.is_finished()) {
@@ -484,39 +596,9 @@ void http_client::handle_state_server_response(protocol_thread_delegate *delegat
             http_conn->state = &connection_state_server_body;
             get_proto()->handle_connection(delegate, obj, poll_event_in); // restart processing in the new state
         } else {
-            if (!http_conn->handler->end_request()) {
-                delegate->log_error("%s: handler end_request failed: aborting connection",
-                                    obj->to_string().c_str());
-                delegate->remove_events(http_conn);
-                abort_connection(delegate, http_conn);
-            } else if (http_conn->connection_close) {
-                if (delegate->get_debug_mask() & protocol_debug_socket) {
-                    delegate->log_debug("%s: closing connection", obj->to_string().c_str());
-                }
-                delegate->remove_events(http_conn);
-                close_connection(delegate, http_conn);
-            } else {
-                // remove last request from the connections request list
-                delegate->remove_events(http_conn);
-                http_conn->handler = http_client_handler_ptr();
-                http_conn->requests_processed++;
-                http_conn->connection_mutex.lock();
-                http_conn->url_requests.pop_front();
-                
-                // check the request list for pending requests
-                if (http_conn->url_requests.size() > 0) {
-                    http_conn->connection_mutex.unlock();
-                    process_connection(delegate, http_conn);
-                } else {
-                    http_conn->connection_mutex.unlock();
-                    // TODO - consider keeping connection in keepalive state
-#if 1
-                    close_connection(delegate, http_conn);
-#else
-                    keepalive_connection(delegate, http_conn);
-#endif
-                }
-            }
+            // anything after the headers belongs to the next pipelined response
+            buffer.set(http_conn->response.body_start.data, http_conn->response.body_start.length);
+            finished_response(delegate, http_conn);
         }
     } else if (http_conn->response.has_error() || http_conn->response.is_finished()) {
         delegate->log_error("%90s:%p: %s: header parse error: aborting connection",
@@ -533,54 +615,37 @@ void http_client::handle_state_server_body(protocol_thread_delegate *delegate, p
     // read server response and when finished close the connection
     // or forward the connection to the keepalive thread
     io_result result = http_conn->handler->read_response_body();
-    if (result.has_error()) {
+    if (result.would_block()) {
+        return;
+    } else if (result.has_error()) {
         delegate->log_error("%s: handler read_response_body failed: aborting connection: %s",
                             obj->to_string().c_str(), result.error_string().c_str());
         delegate->remove_events(http_conn);
         abort_connection(delegate, http_conn);
     } else if (result.size() == 0) {
-        if (!http_conn->handler->end_request()) {
-            delegate->log_error("%s: handler end_request failed: aborting connection",
-                                obj->to_string().c_str());
-            delegate->remove_events(http_conn);
-            abort_connection(delegate, http_conn);
-        } else if (http_conn->connection_close) {
-            if (delegate->get_debug_mask() & protocol_debug_socket) {
-                delegate->log_debug("%s: closing connection", obj->to_string().c_str());
-            }
-            delegate->remove_events(http_conn);
-            close_connection(delegate, http_conn);
-        } else {
-            // remove last request from the connections request list
-            delegate->remove_events(http_conn);
-            http_conn->handler = http_client_handler_ptr();
-            http_conn->requests_processed++;
-            http_conn->connection_mutex.lock();
-            http_conn->url_requests.pop_front();
-            
-            // check the request list for pending requests
-            if (http_conn->url_requests.size() > 0) {
-                http_conn->connection_mutex.unlock();
-                process_connection(delegate, http_conn);
-            } else {
-                http_conn->connection_mutex.unlock();
-                // TODO - consider keeping connection in keepalive state
-#if 1
-                close_connection(delegate, http_conn);
-#else
-                keepalive_connection(delegate, http_conn);
-#endif
-            }
-        }
+        finished_response(delegate, http_conn);
     }
 }
 
 void http_client::handle_state_waiting(protocol_thread_delegate *delegate, protocol_object *obj)
 {
-    // TODO - keepalive currently not reached
-    // timed out on keepalive so we close the connection
+    // the server closed or timed out a parked connection, unless a submitter
+    // claimed it first in which case the wake message is already on its way
     auto http_conn = static_cast<http_client_connection*>(obj);
-    close_connection(delegate, http_conn);
+    int expected = http_client_pool_idle;
+    delegate->remove_events(http_conn);
+    if (!http_conn->pool_state.compare_exchange_strong(expected, http_client_pool_closing)) {
+        return;
+    }
+    
+    // the connection stays on the idle stack until it is swept or popped
+    http_client_host_pool *pool = http_conn->pool;
+    http_conn->conn.close();
+    http_conn->pool_state.store(http_client_pool_dead, std::memory_order_release);
+    if (delegate->get_debug_mask() & protocol_debug_socket) {
+        delegate->log_debug("%s: closing idle connection", obj->to_string().c_str());
+    }
+    sweep_idle_connections(delegate, pool);
 }
 
 
@@ -597,39 +662,51 @@ void http_client::process_tls_handshake(protocol_thread_delegate *delegate, prot
 void http_client::connect_host(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     auto http_conn = static_cast<http_client_connection*>(obj);
-    auto &conn = http_conn->conn;
 
-    // connect to host
+    // resolve the host without blocking, the callback may run before this returns
     http_conn->connection_mutex.lock();
     auto current_request = http_conn->url_requests.front();
     http_conn->connection_mutex.unlock();
-    if (delegate->get_resolver()->lookup(conn.get_peer_addr(), current_request->url->host, current_request->url->port)) {
-        if (current_request->url->scheme == "https") {
-            auto engine_state = get_engine_state(delegate);
-            if (!engine_state->ssl_ctx) {
-                log_fatal_exit("%s no SSL context", get_proto()->name.c_str());
-            }
-            if (conn.connect_to_host_tls(conn.get_peer_addr(), engine_state->ssl_ctx)) {
-                
-                // Set TLS SNI extension hostname
-                SSL *ssl = static_cast<tls_connected_socket*>(conn.sock.get())->ssl;
-                if (!SSL_set_tlsext_host_name(ssl, current_request->url->host.c_str())) {
-                   ERR_print_errors_cb(http_tls_shared::tls_log_errors, NULL);
-                }
-                
-                process_connection_tls(delegate, http_conn);
-            } else {
-                abort_connection(delegate, http_conn);
-            }
-        } else if (current_request->url->scheme == "http") {
-            if (conn.connect_to_host(conn.get_peer_addr())) {
-                process_connection(delegate, http_conn);
-            } else {
-                abort_connection(delegate, http_conn);
+    delegate->get_resolver()->lookup_async(current_request->url->host, current_request->url->port,
+                                           [delegate, http_conn, current_request] (bool found, const socket_addr &addr) {
+        if (found) {
+            http_conn->conn.get_peer_addr() = addr;
+            connect_resolved(delegate, http_conn, current_request);
+        } else {
+            abort_connection(delegate, http_conn);
+        }
+    });
+}
+
+void http_client::connect_resolved(protocol_thread_delegate *delegate, protocol_object *obj, http_client_request_ptr current_request)
+{
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    auto &conn = http_conn->conn;
+
+    // connect to host
+    if (current_request->url->scheme == "https") {
+        auto engine_state = get_engine_state(delegate);
+        if (!engine_state->ssl_ctx) {
+            log_fatal_exit("%s no SSL context", get_proto()->name.c_str());
+        }
+        if (conn.connect_to_host_tls(conn.get_peer_addr(), engine_state->ssl_ctx)) {
+            
+            // Set TLS SNI extension hostname
+            SSL *ssl = static_cast<tls_connected_socket*>(conn.sock.get())->ssl;
+            if (!SSL_set_tlsext_host_name(ssl, current_request->url->host.c_str())) {
+               ERR_print_errors_cb(http_tls_shared::tls_log_errors, NULL);
             }
+            
+            process_connection_tls(delegate, http_conn);
+        } else {
+            abort_connection(delegate, http_conn);
+        }
+    } else if (current_request->url->scheme == "http") {
+        if (conn.connect_to_host(conn.get_peer_addr())) {
+            process_connection(delegate, http_conn);
+        } else {
+            abort_connection(delegate, http_conn);
         }
-    } else {
-        abort_connection(delegate, http_conn);
     }
 }
 
@@ -641,32 +718,41 @@ void http_client::process_next_request(protocol_thread_delegate *delegate, proto
     
     // process the request at the head of this connections request queue
     socklen_t addrlen = sizeof(sockaddr_storage);
-    if (getsockname(http_conn->get_poll_fd(), (sockaddr*)&conn.get_local_addr().storage, &addrlen) < 0) {
+    if (http_conn->requests_written == 0 &&
+        getsockname(http_conn->get_poll_fd(), (sockaddr*)&conn.get_local_addr().storage, &addrlen) < 0)
+    {
         delegate->log_error("%s: getsockname: %s", obj->to_string().c_str(), strerror(errno));
     }
-    if (http_conn->requests_processed == 0 && delegate->get_debug_mask() & protocol_debug_socket) {
+    if (http_conn->requests_processed == 0 && http_conn->requests_written == 0 &&
+        delegate->get_debug_mask() & protocol_debug_socket)
+    {
         delegate->log_debug("%s: connected %s -> %s", obj->to_string().c_str(),
                             socket_addr::addr_to_string(conn.get_local_addr()).c_str(),
                             socket_addr::addr_to_string(conn.get_peer_addr()).c_str());
     }
+    // with pipelining earlier requests may still be waiting for their responses
     http_conn->connection_mutex.lock();
-    auto current_request = http_conn->url_requests.front();
+    auto current_request = http_conn->url_requests[http_conn->requests_written];
     http_conn->connection_mutex.unlock();
     
-    http_conn->handler = current_request->handler;
-    http_conn->handler->init();
-    http_conn->handler->set_delegate(delegate);
-    http_conn->handler->set_connection(http_conn);
-    http_conn->handler->set_current_time(current_time);
+    http_conn->request_handler = current_request->handler;
+    if (http_conn->requests_written == 0) {
+        http_conn->handler = current_request->handler;
+    }
+    http_conn->request_handler->init();
+    http_conn->request_handler->set_delegate(delegate);
+    http_conn->request_handler->set_connection(http_conn);
+    http_conn->request_handler->set_current_time(current_time);
     
-    http_conn->response.reset();
     http_conn->request.reset();
     http_conn->request.set_http_version(http_constants::get_version_text(HTTPVersion11));
     http_conn->request.set_request_method(http_constants::get_method_text(current_request->method));
     
     // TODO - handle canonical escaping of path
-    http_conn->request.set_request_uri(current_request->url->path);
-    http_conn->request.set_header_field(kHTTPHeaderHost, current_request->url->host);
+    http_conn->request.set_request_uri(current_request->path.length() > 0 ?
+                                       current_request->path : current_request->url->path);
+    http_conn->request.set_header_field(kHTTPHeaderHost, current_request->host.length() > 0 ?
+                                        current_request->host : current_request->url->host);
     http_conn->request.set_header_field(kHTTPHeaderUserAgent, ClientString);
     
     // TODO - handle option to close connection
@@ -682,31 +768,59 @@ void http_client::process_next_request(protocol_thread_delegate *delegate, proto
 
 void http_client::keepalive_wait_connection(protocol_thread_delegate *delegate, protocol_object *obj)
 {    
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    auto engine_state = get_engine_state(delegate);
+    
     if (delegate->get_debug_mask() & protocol_debug_event) {
         delegate->log_debug("%s: connection keepalive", obj->to_string().c_str());
     }
-
-    // TODO - consider waking up connections waiting in keepalive
     
-    // keepalive state is not currently used by the client as
-    // connections are closed if there are no pending url_requests
+    // park on this thread's idle stack, reads only detect the server closing
+    http_conn->state = &connection_state_waiting;
+    http_conn->keepalive_thread = delegate;
+    http_conn->conn.set_last_activity(delegate->get_current_time());
+    delegate->add_events(http_conn, poll_event_in);
+    http_conn->pool_state.store(http_client_pool_idle, std::memory_order_release);
+    auto &stack = http_conn->pool->idle[delegate->get_thread_num() % engine_state->pool_stacks];
+    stack.push((uint32_t)http_conn->conn.get_id());
 }
 
+void http_client::wake_connection(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    // a submitter claimed this parked connection and queued a request on it
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    delegate->remove_events(http_conn);
+    http_conn->keepalive_thread = nullptr;
+    process_connection(delegate, http_conn);
+}
+
+void http_client::resume_connection(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    // a handler that parked its connection while streaming a body can continue
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    if (http_conn->state == &connection_state_client_body) {
+        delegate->add_events(http_conn, poll_event_out);
+        get_proto()->handle_connection(delegate, obj, poll_event_out);
+    } else if (http_conn->state == &connection_state_server_body) {
+        delegate->add_events(http_conn, poll_event_in);
+        get_proto()->handle_connection(delegate, obj, poll_event_in);
+    }
+}
 
 /* http_client internal */
 
 ssize_t http_client::populate_request_headers(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     auto http_conn = static_cast<http_client_connection*>(obj);
-    auto &buffer = http_conn->buffer;
+    auto &request_buffer = http_conn->request_buffer;
     
-    if (!http_conn->handler->populate_request()) {
+    if (!http_conn->request_handler->populate_request()) {
         abort_connection(delegate, http_conn);
     }
     
-    // copy headers to io buffer
-    buffer.reset();
-    ssize_t length =  http_conn->request.to_buffer(buffer.data(), buffer.size());
+    // copy headers to request buffer
+    request_buffer.reset();
+    ssize_t length =  http_conn->request.to_buffer(request_buffer.data(), request_buffer.size());
     // check headers fit into available buffer space
     if (length < 0) {
         delegate->log_error("%s: header buffer overflow", obj->to_string().c_str());
@@ -715,7 +829,7 @@ ssize_t http_client::populate_request_headers(protocol_thread_delegate *delegate
         abort_connection(delegate, http_conn);
         return length;
     }
-    buffer.back = length;
+    request_buffer.set_length(length);
 
     // debug request
     if (delegate->get_debug_mask() & protocol_debug_headers) {
@@ -725,6 +839,109 @@ ssize_t http_client::populate_request_headers(protocol_thread_delegate *delegate
     return length;
 }
 
+void http_client::finished_request_write(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    size_t pipeline_depth = delegate->get_config()->client_pipeline_depth;
+    
+    http_conn->request_handler = http_client_handler_ptr();
+    http_conn->requests_written++;
+    
+    // keep writing ahead while the pipeline has room and requests are queued
+    http_conn->connection_mutex.lock();
+    bool write_next = http_conn->requests_written < pipeline_depth &&
+                      http_conn->url_requests.size() > http_conn->requests_written;
+    http_conn->connection_mutex.unlock();
+    if (write_next) {
+        delegate->remove_events(http_conn);
+        process_next_request(delegate, http_conn);
+    } else {
+        read_next_response(delegate, http_conn);
+    }
+}
+
+void http_client::read_next_response(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    
+    http_conn->response.reset();
+    delegate->remove_events(http_conn);
+    delegate->add_events(http_conn, poll_event_in);
+    http_conn->state = &connection_state_server_response;
+    if (http_conn->response_pending) {
+        get_proto()->handle_connection(delegate, obj, poll_event_in); // parse the buffered response
+    }
+}
+
+void http_client::finished_response(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    auto http_conn = static_cast<http_client_connection*>(obj);
+    auto &buffer = http_conn->buffer;
+    size_t pipeline_depth = delegate->get_config()->client_pipeline_depth;
+    
+    // the finished request is taken off the list before closing so it isn't aborted
+    bool ended = http_conn->handler->end_request();
+    if (!ended || http_conn->connection_close) {
+        http_conn->connection_mutex.lock();
+        http_conn->url_requests.pop_front();
+        http_conn->connection_mutex.unlock();
+    }
+    if (!ended) {
+        delegate->log_error("%s: handler end_request failed: aborting connection",
+                            obj->to_string().c_str());
+        delegate->remove_events(http_conn);
+        abort_connection(delegate, http_conn);
+        return;
+    } else if (http_conn->connection_close) {
+        if (delegate->get_debug_mask() & protocol_debug_socket) {
+            delegate->log_debug("%s: closing connection", obj->to_string().c_str());
+        }
+        delegate->remove_events(http_conn);
+        close_connection(delegate, http_conn);
+        return;
+    }
+    
+    // remove last request from the connections request list
+    delegate->remove_events(http_conn);
+    http_conn->handler = http_client_handler_ptr();
+    http_conn->requests_processed++;
+    http_conn->requests_written--;
+    
+    // keep bytes read past the end of this response for the next one
+    if (http_conn->requests_written > 0 && buffer.bytes_readable() > 0) {
+        buffer.set(buffer.data() + (buffer.front & buffer.mask), buffer.bytes_readable());
+        http_conn->response_pending = true;
+    } else {
+        buffer.reset();
+    }
+    
+    // check the request list for pending requests
+    http_conn->connection_mutex.lock();
+    http_conn->url_requests.pop_front();
+    size_t requests_queued = http_conn->url_requests.size();
+    if (http_conn->requests_written > 0) {
+        http_conn->handler = http_conn->url_requests.front()->handler;
+    }
+    http_conn->connection_mutex.unlock();
+    
+    // a busy connection with room for another request takes the next submit
+    if (http_conn->pool && requests_queued > 0) {
+        http_conn->pool->filling.store(http_conn, std::memory_order_release);
+    }
+    
+    if (http_conn->requests_written == 0 && requests_queued > 0) {
+        process_connection(delegate, http_conn);
+    } else if (requests_queued > http_conn->requests_written && http_conn->requests_written < pipeline_depth) {
+        process_next_request(delegate, http_conn);
+    } else if (http_conn->requests_written > 0) {
+        read_next_response(delegate, http_conn);
+    } else if (http_conn->pool) {
+        keepalive_connection(delegate, http_conn);
+    } else {
+        close_connection(delegate, http_conn);
+    }
+}
+
 void http_client::process_response_headers(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     auto http_conn = static_cast<http_client_connection*>(obj);
@@ -790,63 +1007,104 @@ void http_client::close_connection(protocol_thread_delegate *delegate, protocol_
     get_engine_state(delegate)->close_connection(delegate->get_engine_delegate(), obj);
 }
 
-http_client_connection* http_client::get_new_connection_for_url(protocol_engine_delegate *delegate, url_ptr url)
+void http_client::sweep_idle_connections(protocol_thread_delegate *delegate, http_client_host_pool *pool)
 {
-    http_client_engine_state *state = get_engine_state(delegate);
-    http_client_connection *http_conn = nullptr;
-    
-    state->connections_mutex.lock();
-    if (state->connections_free.size() > 0) {
-        http_conn = state->connections_free.back();
-        state->connections_free.pop_back();
-    }
-    if (http_conn) {
-        // initialize connection
-        http_conn->init(delegate);
-        // set host on connection
-        http_conn->remote_host = url->host;
-        // find connection list in host map
-        auto cli = state->connections_host_map.find(url->host);
-        if (cli == state->connections_host_map.end()) {
-            // add connection to a new connection list
-            state->connections_host_map.insert(http_client_engine_state::connection_host_entry(url->host, http_client_engine_state::connection_queue{http_conn}));
+    // free dead connections on this thread's stack and put the rest back
+    auto engine_state = get_engine_state(delegate);
+    auto &stack = pool->idle[delegate->get_thread_num() % engine_state->pool_stacks];
+    std::vector<uint32_t> keep;
+    uint32_t conn_id = stack.take_all();
+    while (conn_id != protocol_connection_stack::none) {
+        uint32_t next_id = stack.next(conn_id);
+        stack.taken(1);
+        auto http_conn = &engine_state->connections_all[conn_id];
+        int expected = http_client_pool_dead;
+        if (http_conn->pool_state.compare_exchange_strong(expected, http_client_pool_none)) {
+            engine_state->free_connection(delegate->get_engine_delegate(), http_conn);
         } else {
-            // add connection to the existing connection list
-            (*cli).second.push_back(http_conn);
+            keep.push_back(conn_id);
         }
+        conn_id = next_id;
+    }
+    for (auto ki = keep.rbegin(); ki != keep.rend(); ki++) {
+        stack.push(*ki);
+    }
+}
+
+http_client_connection* http_client::get_new_connection_for_url(protocol_engine_delegate *delegate, http_client_host_pool *pool, url_ptr url)
+{
+    http_client_engine_state *state = get_engine_state(delegate);
+    int host_limit = delegate->get_config()->client_host_connections;
+    
+    if (pool && host_limit > 0 && pool->connections.fetch_add(1) >= host_limit) {
+        pool->connections--;
+        return nullptr;
+    } else if (pool && host_limit == 0) {
+        pool->connections++;
     }
-    state->connections_mutex.unlock();
+    http_client_connection *http_conn = state->new_connection(delegate);
+    if (!http_conn) {
+        if (pool) pool->connections--;
+        return nullptr;
+    }
+    http_conn->connection_mutex.lock();
+    http_conn->remote_host = url->host;
+    http_conn->pool = pool;
+    http_conn->connection_mutex.unlock();
     return http_conn;
 }
 
-http_client_connection* http_client::get_existing_connection_for_url(protocol_engine_delegate *delegate, url_ptr url, size_t max_requests_per_connection)
+http_client_connection* http_client::get_idle_connection(protocol_engine_delegate *delegate, http_client_host_pool *pool)
 {
     http_client_engine_state *state = get_engine_state(delegate);
+    static thread_local size_t next_stack = 0;
     http_client_connection *http_conn = nullptr;
     
-    state->connections_mutex.lock();
-    auto cli = state->connections_host_map.find(url->host);
-    if (cli != state->connections_host_map.end()) {
-        auto &connection_queue = (*cli).second;
-        auto ci = std::find_if(connection_queue.begin(), connection_queue.end(), [=](http_client_connection *c) {
-            //c->connection_mutex.lock();
-            size_t outstanding_requests = c->url_requests.size(); // TODO - check atomicity?
-            //c->connection_mutex.unlock();
-            return outstanding_requests < max_requests_per_connection;
-        });
-        
-        if (ci != connection_queue.end()) {
-            http_conn = *ci;
-            if (connection_queue.size() > 1) {
-                connection_queue.push_back(connection_queue.front());
-                connection_queue.pop_front();
+    // start on a different keepalive thread's stack for each request
+    size_t start = next_stack++;
+    for (size_t i = 0; i < pool->idle.size() && !http_conn; i++) {
+        auto &stack = pool->idle[(start + i) % pool->idle.size()];
+        uint32_t conn_id;
+        while (!http_conn && stack.pop(conn_id)) {
+            auto candidate = &state->connections_all[conn_id];
+            int expected = http_client_pool_idle;
+            if (candidate->pool_state.compare_exchange_strong(expected, http_client_pool_none)) {
+                http_conn = candidate;
+            } else if (expected == http_client_pool_dead &&
+                       candidate->pool_state.compare_exchange_strong(expected, http_client_pool_none)) {
+                state->free_connection(delegate, candidate);
+            } else {
+                // its keepalive thread is closing it and will sweep it
+                stack.push(conn_id);
+                break;
             }
         }
     }
-    state->connections_mutex.unlock();
     return http_conn;
 }
 
+bool http_client::queue_on_filling_connection(http_client_host_pool *pool, http_client_request_ptr url_req,
+                                              size_t max_requests_per_connection)
+{
+    // the connection may have finished or been reused since it was published
+    http_client_connection *http_conn = pool->filling.load(std::memory_order_acquire);
+    if (!http_conn) {
+        return false;
+    }
+    http_conn->connection_mutex.lock();
+    size_t outstanding_requests = http_conn->url_requests.size();
+    bool queued = http_conn->pool == pool && outstanding_requests > 0 &&
+                  outstanding_requests < max_requests_per_connection;
+    if (queued) {
+        http_conn->url_requests.push_back(url_req);
+    }
+    http_conn->connection_mutex.unlock();
+    if (!queued) {
+        pool->filling.compare_exchange_strong(http_conn, nullptr);
+    }
+    return queued;
+}
+
 
 /* public interface */
 
@@ -854,6 +1112,8 @@ bool http_client::submit_request(protocol_engine_delegate *delegate,
                                           http_client_request_ptr url_req,
                                           size_t max_requests_per_connection)
 {
+    http_client_engine_state *state = get_engine_state(delegate);
+    http_client_host_pool *pool = nullptr;
     http_client_connection *http_conn = nullptr;
     
     if (url_req->url->scheme != "http" && url_req->url->scheme != "https") {
@@ -863,33 +1123,42 @@ bool http_client::submit_request(protocol_engine_delegate *delegate,
         return false;
     }
     
+    // queue behind the connection still filling, else wake a parked one
     if (max_requests_per_connection > 0) {
-        http_conn = get_existing_connection_for_url(delegate, url_req->url, max_requests_per_connection);
+        pool = state->get_host_pool(url_req->url->scheme + "://" + url_req->url->host + ":" +
+                                    std::to_string(url_req->url->port));
     }
-    if (http_conn) {
-        // make sure the connection still has an active url_requests list as the last request
-        // may been finished and the connection closed inbetween the time we found it and now
-        // TODO - consider waking up connections waiting in a keepalive state
-        http_conn->connection_mutex.lock();
-        if (http_conn->url_requests.size() > 0) {
+    if (pool) {
+        if (queue_on_filling_connection(pool, url_req, max_requests_per_connection)) {
+            return true;
+        }
+        http_conn = get_idle_connection(delegate, pool);
+        if (http_conn) {
+            http_conn->connection_mutex.lock();
             http_conn->url_requests.push_back(url_req);
             http_conn->connection_mutex.unlock();
+            pool->filling.store(http_conn, std::memory_order_release);
+            http_conn->keepalive_thread->post_message(protocol_message(action_wake_connection.action, http_conn->conn.get_id()));
             return true;
-        } else {
-            http_conn->connection_mutex.unlock();
         }
     }
-    http_conn = get_new_connection_for_url(delegate, url_req->url);
-    if (http_conn) {
+    
+    http_conn = get_new_connection_for_url(delegate, pool, url_req->url);
+    protocol_thread *connect_thread = delegate->choose_thread(thread_mask_connect.mask);
+    if (http_conn && connect_thread) {
         http_conn->connection_mutex.lock();
         http_conn->url_requests.push_back(url_req);
         http_conn->connection_mutex.unlock();
-        protocol_thread_delegate *thread_delegate = delegate->choose_thread(thread_mask_connect.mask);
-        forward_connection(thread_delegate, http_conn, thread_mask_connect, action_connect_host);
+        if (pool) {
+            pool->filling.store(http_conn, std::memory_order_release);
+        }
+        connect_thread->post_message(protocol_message(action_connect_host.action, http_conn->conn.get_id()));
         return true;
     } else {
-        log_error("%s: submit_request: no available connections: %s",
-                  get_proto()->name.c_str(), url_req->url->to_string().c_str());
+        // callers decide whether to retry or count a failure
+        if (http_conn) {
+            state->free_connection(delegate, http_conn);
+        }
         return false;
     }
 }
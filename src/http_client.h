@@ -20,6 +20,7 @@ typedef std::shared_ptr<http_client_request> http_client_request_ptr;
 typedef std::deque<http_client_request_ptr> http_client_request_list;
 
 struct http_client_connection;
+struct http_client_host_pool;
 
 
 /* http_client_request */
@@ -29,6 +30,8 @@ struct http_client_request
     HTTPMethod                  method;
     url_ptr                     url;
     http_client_handler_ptr     handler;
+    std::string                 path;       /* request uri, defaults to the url path */
+    std::string                 host;       /* Host header, defaults to the url host */
     
     http_client_request(HTTPMethod method, url_ptr url, http_client_handler_ptr handler);
 };
@@ -52,6 +55,34 @@ struct http_client_handler
     virtual bool handle_response() = 0;
     virtual io_result read_response_body() = 0;
     virtual bool end_request() = 0;
+    virtual void abort_request() {}     /* dropped without a response */
+};
+
+
+/*
+ * http_client_host_pool
+ *
+ * Connections to one scheme, host and port. Idle keepalive connections are
+ * parked on a lock-free stack per keepalive thread and the connection that
+ * is still accepting queued requests is published in filling, so attaching
+ * a request to a warm connection takes no shared lock.
+ */
+
+enum http_client_pool_state {
+    http_client_pool_none,      /* owned by a thread, not on an idle stack */
+    http_client_pool_idle,      /* parked on an idle stack, may be claimed */
+    http_client_pool_closing,   /* being closed by its keepalive thread */
+    http_client_pool_dead,      /* closed while parked, freed by whoever pops it */
+};
+
+struct http_client_host_pool
+{
+    const std::string                           key;
+    std::atomic<int>                            connections;
+    std::atomic<http_client_connection*>        filling;
+    std::vector<protocol_connection_stack>      idle;
+
+    http_client_host_pool(std::string key, size_t num_stacks, std::atomic<uint32_t> *links);
 };
 
 
@@ -61,22 +92,29 @@ struct http_client_connection : protocol_object
 {
     connection                  conn;
     io_ring_buffer              buffer;
+    io_buffer                   request_buffer;
     protocol_state              *state;
     http_request                request;
     http_response               response;
-    http_client_handler_ptr     handler;
+    http_client_handler_ptr     handler;            /* handler for the response being read */
+    http_client_handler_ptr     request_handler;    /* handler for the request being written */
     unsigned int                request_has_body : 1;
     unsigned int                response_has_body : 1;
+    unsigned int                response_pending : 1;   /* buffer holds unparsed pipelined response bytes */
     unsigned int                connection_close : 1;
     std::string                 remote_host;
     http_client_request_list    url_requests;
     std::mutex                  connection_mutex;
     int                         requests_processed;
+    size_t                      requests_written;   /* requests at the front of url_requests awaiting responses */
+    http_client_host_pool       *pool;
+    protocol_thread_delegate    *keepalive_thread;  /* thread whose pollset holds the parked connection */
+    std::atomic<int>            pool_state;
     
     // TODO add stats
     
-    http_client_connection() : state(nullptr) {}
-    http_client_connection(const http_client_connection&) : state(nullptr) {}
+    http_client_connection() : state(nullptr), pool(nullptr), keepalive_thread(nullptr), pool_state(http_client_pool_none) {}
+    http_client_connection(const http_client_connection&) : state(nullptr), pool(nullptr), keepalive_thread(nullptr), pool_state(http_client_pool_none) {}
     
     int get_poll_fd();
     poll_object_type get_poll_type();    
@@ -112,6 +150,8 @@ struct http_client : protocol
     static protocol_action action_process_tls_handshake;
     static protocol_action action_process_next_request;
     static protocol_action action_keepalive_wait_connection;
+    static protocol_action action_wake_connection;
+    static protocol_action action_resume_connection;
     
     /* threads */
     static protocol_mask thread_mask_connect;
@@ -168,9 +208,12 @@ struct http_client : protocol
     /* http_client messages */
 
     static void connect_host(protocol_thread_delegate *, protocol_object *);
+    static void connect_resolved(protocol_thread_delegate *, protocol_object *, http_client_request_ptr);
     static void process_tls_handshake(protocol_thread_delegate *, protocol_object *);
     static void process_next_request(protocol_thread_delegate *, protocol_object *);
     static void keepalive_wait_connection(protocol_thread_delegate *, protocol_object *);
+    static void wake_connection(protocol_thread_delegate *, protocol_object *);
+    static void resume_connection(protocol_thread_delegate *, protocol_object *);
 
     /* http_server state handlers */
 
@@ -184,6 +227,9 @@ struct http_client : protocol
     /* http_client internal */
     
     static ssize_t populate_request_headers(protocol_thread_delegate *, protocol_object *);
+    static void finished_request_write(protocol_thread_delegate *, protocol_object *);
+    static void finished_response(protocol_thread_delegate *, protocol_object *);
+    static void read_next_response(protocol_thread_delegate *, protocol_object *);
     static void process_response_headers(protocol_thread_delegate *, protocol_object *);
     static void connect_connection(protocol_thread_delegate *, protocol_object *);
     static void process_connection(protocol_thread_delegate *, protocol_object *);
@@ -194,10 +240,12 @@ struct http_client : protocol
     static void abort_connection(protocol_thread_delegate*, protocol_object *);
     static void close_connection(protocol_thread_delegate*, protocol_object *);
 
-    static http_client_connection* get_new_connection_for_url(protocol_engine_delegate *, url_ptr url);
-    static http_client_connection* get_existing_connection_for_url(protocol_engine_delegate *, url_ptr url, size_t max_requests_per_connection);
+    static void sweep_idle_connections(protocol_thread_delegate *, http_client_host_pool *pool);
+    static http_client_connection* get_new_connection_for_url(protocol_engine_delegate *, http_client_host_pool *pool, url_ptr url);
+    static http_client_connection* get_idle_connection(protocol_engine_delegate *, http_client_host_pool *pool);
+    static bool queue_on_filling_connection(http_client_host_pool *pool, http_client_request_ptr url_req, size_t max_requests_per_connection);
 
-    /* public interface */
+    /* public interface, submit_request returns false when no connection is available */
     
     static bool submit_request(protocol_engine_delegate *,
                                http_client_request_ptr url_req,
@@ -211,11 +259,17 @@ struct http_client_engine_state : protocol_engine_state, protocol_connection_sta
 {
     config_ptr                                  cfg;
     SSL_CTX*                                    ssl_ctx;
+    std::unique_ptr<std::atomic<http_client_host_pool*>[]> host_pools;
+    size_t                                      host_pools_size;    /* open addressed, pools are never removed */
+    size_t                                      pool_stacks;
     
-    http_client_engine_state(config_ptr cfg) : cfg(cfg), ssl_ctx(nullptr) {}
+    http_client_engine_state(config_ptr cfg) : cfg(cfg), ssl_ctx(nullptr), host_pools_size(0), pool_stacks(1) {}
+    ~http_client_engine_state();
 
     protocol* get_proto() const { return http_client::get_proto(); }
 
+    http_client_host_pool* get_host_pool(std::string key);
+
     void bind_function(config_ptr cfg, std::string path, typename http_client::function_type)
     {
         log_error("%s bind_function not implemented", get_proto()->name.c_str());
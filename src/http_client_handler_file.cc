@@ -122,6 +122,10 @@ bool http_client_handler_file::handle_response()
             break;
     }
     
+    // set response body presence here as pipelined requests may have been populated since
+    http_conn->response_has_body = request_method != HTTPMethodHEAD && status_code >= HTTPStatusCodeOK &&
+        status_code != HTTPStatusCodeNoContent && status_code != HTTPStatusCodeNotModified;
+    
     // get content length
     const char* content_length_str = http_conn->response.get_header_string(kHTTPHeaderContentLength);
     content_length = content_length_str ? strtoll(content_length_str, NULL, 10) : -1;
@@ -134,45 +138,34 @@ io_result http_client_handler_file::read_response_body()
 {
     auto &buffer = http_conn->buffer;
     
-    // handle body fragment in the buffer
-    if (buffer.bytes_readable() > 0) {
-        ssize_t bytes_readable = buffer.bytes_readable();
-        if (file_resource.get_fd() >= 0) {
-            io_result result = buffer.buffer_write(file_resource);
-            if (result.has_error()) {
-                log_error("http_client_handler_file: write: %s", strerror(result.error().errcode));
-            } else if (result.size() != bytes_readable) {
-                log_error("http_client_handler_file: short_write");
-            }
-        }
-        total_read += bytes_readable;
-        buffer.reset();
-        
-        // return bytes available or -1 if content length not present
-        if (content_length >= 0) {
-            return io_result(content_length - total_read);
-        } else {
-            return io_result(-1);
+    // read data from socket once the body fragment in the buffer is consumed
+    if (buffer.bytes_readable() == 0) {
+        if (total_read == content_length) return io_result(0);
+        io_result result = buffer.buffer_read(http_conn->conn);
+        if (result.has_error()) {
+            return result;
+        } else if (result.size() == 0) {
+            // EOF ends a body delimited by connection close, otherwise it is truncated
+            return content_length < 0 ? io_result(0) : io_result(io_error(ECONNRESET));
         }
     }
     
-    if (total_read == content_length) return io_result(0);
-    
-    // read data from socket
-    io_result result = buffer.buffer_read(http_conn->conn);
-    if (result.has_error()) {
-        return io_result(io_error(errno));
-    } else if (buffer.bytes_readable() > 0) {
-        ssize_t bytes_readable = buffer.bytes_readable();
-        if (file_resource.get_fd() >= 0) {
-            io_result result = buffer.buffer_write(file_resource);
-            if (result.has_error()) {
-                log_error("http_client_handler_file: write: %s", strerror(result.error().errcode));
-            } else if (result.size() != bytes_readable) {
-                log_error("http_client_handler_file: short_write");
-            }
+    // consume no more than the rest of this body, a pipelined response may follow it
+    ssize_t bytes_readable = buffer.bytes_readable();
+    if (content_length >= 0) {
+        bytes_readable = std::min(bytes_readable, content_length - total_read);
+    }
+    if (file_resource.get_fd() >= 0) {
+        io_result result = file_resource.write(buffer.data() + (buffer.front & buffer.mask), bytes_readable);
+        if (result.has_error()) {
+            log_error("http_client_handler_file: write: %s", strerror(result.error().errcode));
+        } else if (result.size() != bytes_readable) {
+            log_error("http_client_handler_file: short_write");
         }
-        total_read += bytes_readable;
+    }
+    total_read += bytes_readable;
+    buffer.front += bytes_readable;
+    if (buffer.bytes_readable() == 0) {
         buffer.reset();
     }
     
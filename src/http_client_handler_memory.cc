@@ -0,0 +1,288 @@
+//
+//  http_client_handler_memory.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+
+#include "io.h"
+#include "url.h"
+#include "log.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_date.h"
+#include "http_client.h"
+#include "http_client_handler_memory.h"
+
+
+/* http_client_body_buffer */
+
+bool http_client_body_buffer::append(const char *buf, size_t len)
+{
+    if (data.size() + len > limit) {
+        return false;
+    }
+    data.insert(data.end(), buf, buf + len);
+    return true;
+}
+
+
+/* http_client_handler_memory */
+
+http_client_handler_memory::http_client_handler_memory(size_t limit)
+    : completed(false), body(std::make_shared<http_client_body_buffer>(limit))
+{
+    http_conn = nullptr;
+    init();
+}
+
+http_client_handler_memory::http_client_handler_memory(http_client_body_buffer_ptr body)
+    : completed(false), body(body)
+{
+    http_conn = nullptr;
+    init();
+}
+
+http_client_handler_memory::http_client_handler_memory(http_client_body_function body_fn)
+    : completed(false), body_fn(body_fn)
+{
+    http_conn = nullptr;
+    init();
+}
+
+http_client_handler_memory::~http_client_handler_memory() {}
+
+const http_response& http_client_handler_memory::get_response() const
+{
+    return http_conn->response;
+}
+
+http_header_string http_client_handler_memory::get_header(const char *name) const
+{
+    if (!http_conn) {
+        return http_header_string();
+    }
+    auto &header_map = http_conn->response.header_map;
+    auto hi = header_map.find(http_header_string(name));
+    return hi == header_map.end() ? http_header_string() : hi->second;
+}
+
+void http_client_handler_memory::init()
+{
+    http_version = HTTPVersion11;
+    status_code = HTTPStatusCodeNone;
+    request_method = HTTPMethodNone;
+    content_length = -1;
+    total_read = 0;
+    chunked = false;
+    chunked_decoder.reset();
+}
+
+bool http_client_handler_memory::populate_request()
+{
+    // get request http version and request method
+    http_version = http_constants::get_version_type(http_conn->request.get_http_version());
+    request_method = http_constants::get_method_type(http_conn->request.get_request_method());
+    
+    // set request/response body
+    switch (request_method) {
+        case HTTPMethodPOST:
+            http_conn->request_has_body = true;
+            http_conn->response_has_body = true;
+            break;
+        case HTTPMethodHEAD:
+            http_conn->request_has_body = false;
+            http_conn->response_has_body = false;
+            break;
+        case HTTPMethodGET:
+        default:
+            http_conn->request_has_body = false;
+            http_conn->response_has_body = true;
+            break;
+    }
+    
+    return true;
+}
+
+io_result http_client_handler_memory::write_request_body()
+{
+    return io_result(0);
+}
+
+bool http_client_handler_memory::handle_response()
+{
+    // set connection close
+    http_version = http_constants::get_version_type(http_conn->response.get_http_version());
+    status_code = (HTTPStatusCode)http_conn->response.get_status_code();
+    const char* connection_str = http_conn->response.get_header_string(kHTTPHeaderConnection);
+    bool connection_keepalive_present = (connection_str && strcasecmp(connection_str, kHTTPTokenKeepalive) == 0);
+    bool connection_close_present = (connection_str && strcasecmp(connection_str, kHTTPTokenClose) == 0);
+    switch (http_version) {
+        case HTTPVersion10:
+            http_conn->connection_close = !connection_keepalive_present;
+            break;
+        case HTTPVersion11:
+            http_conn->connection_close = connection_close_present;
+            break;
+        default:
+            http_conn->connection_close = true;
+            break;
+    }
+    
+    // set response body presence here as pipelined requests may have been populated since
+    http_conn->response_has_body = request_method != HTTPMethodHEAD && status_code >= HTTPStatusCodeOK &&
+        status_code != HTTPStatusCodeNoContent && status_code != HTTPStatusCodeNotModified;
+    
+    // chunked takes precedence over content length, without either the body ends at close
+    const char* transfer_encoding_str = http_conn->response.get_header_string(kHTTPHeaderTransferEncoding);
+    const char* content_length_str = http_conn->response.get_header_string(kHTTPHeaderContentLength);
+    if (transfer_encoding_str) {
+        size_t len = strlen(transfer_encoding_str);
+        chunked = len >= 7 && strcasecmp(transfer_encoding_str + len - 7, "chunked") == 0;
+        content_length = -1;
+    } else {
+        content_length = content_length_str ? strtoll(content_length_str, NULL, 10) : -1;
+    }
+    if (http_conn->response_has_body && !chunked && content_length < 0) {
+        http_conn->connection_close = true;
+    }
+    total_read = 0;
+    chunked_decoder.reset();
+    if (body) {
+        body->clear();
+    }
+    
+    return true;
+}
+
+io_result http_client_handler_memory::read_response_body()
+{
+    auto &buffer = http_conn->buffer;
+    
+    while (!body_finished()) {
+        
+        // read data from socket once the body fragment in the buffer is consumed
+        if (buffer.bytes_readable() == 0) {
+            io_result result = buffer.buffer_read(http_conn->conn);
+            if (result.has_error()) {
+                return result;
+            } else if (result.size() == 0) {
+                // EOF ends a body delimited by connection close, otherwise it is truncated
+                return !chunked && content_length < 0 ? io_result(0) : io_result(io_error(ECONNRESET));
+            }
+        }
+        
+        // consume no more than the rest of this body, a pipelined response may follow it
+        const char *buf = buffer.data() + (buffer.front & buffer.mask);
+        size_t len = buffer.bytes_readable(), consumed = 0;
+        if (chunked) {
+            while (consumed < len && !chunked_decoder.is_done()) {
+                const char *data;
+                size_t data_len;
+                consumed += chunked_decoder.decode(buf + consumed, len - consumed, data, data_len);
+                if (chunked_decoder.has_error()) {
+                    return io_result(io_error(EPROTO));
+                }
+                io_result result = consume_body(data, data_len);
+                if (result.has_error()) {
+                    return result;
+                }
+            }
+        } else {
+            consumed = content_length >= 0 ? std::min((ssize_t)len, content_length - total_read) : len;
+            io_result result = consume_body(buf, consumed);
+            if (result.has_error()) {
+                return result;
+            }
+        }
+        buffer.front += consumed;
+        if (buffer.bytes_readable() == 0) {
+            buffer.reset();
+        }
+    }
+    
+    return io_result(0);
+}
+
+bool http_client_handler_memory::end_request()
+{
+    complete(true);
+    return true;
+}
+
+void http_client_handler_memory::abort_request()
+{
+    complete(false);
+}
+
+bool http_client_handler_memory::body_finished() const
+{
+    return chunked ? chunked_decoder.is_done() : total_read == content_length;
+}
+
+io_result http_client_handler_memory::consume_body(const char *buf, size_t len)
+{
+    if (len == 0) {
+        return io_result(0);
+    }
+    total_read += len;
+    if (body_fn) {
+        if (!body_fn(buf, len)) {
+            return io_result(io_error(ECANCELED));
+        }
+    } else if (body && !body->append(buf, len)) {
+        log_error("http_client_handler_memory: response body exceeds %lu bytes", body->limit);
+        return io_result(io_error(EFBIG));
+    }
+    return io_result(len);
+}
+
+void http_client_handler_memory::complete(bool success)
+{
+    // a request completes once, a response that closed its connection is not aborted again
+    if (completed) {
+        return;
+    }
+    completed = true;
+    if (complete_fn) {
+        complete_fn(this, success);
+    }
+    promise.set_value(success);
+}
@@ -0,0 +1,91 @@
+//
+//  http_client_handler_memory.h
+//
+
+#ifndef http_client_handler_memory_h
+#define http_client_handler_memory_h
+
+#define HTTP_CLIENT_BODY_LIMIT_DEFAULT  (16 * 1024 * 1024)
+
+struct http_client_handler_memory;
+typedef std::shared_ptr<http_client_handler_memory> http_client_handler_memory_ptr;
+typedef std::function<bool(const char *data, size_t len)> http_client_body_function;
+typedef std::function<void(http_client_handler_memory *handler, bool success)> http_client_complete_function;
+
+
+/*
+ * http_client_body_buffer
+ *
+ * Bounded response body storage that keeps its capacity when cleared.
+ * Responses on a connection arrive in order so the handlers of requests
+ * sent on one connection can share a buffer, each body being valid until
+ * the next response starts.
+ */
+
+struct http_client_body_buffer
+{
+    std::vector<char>   data;
+    size_t              limit;
+    
+    http_client_body_buffer(size_t limit = HTTP_CLIENT_BODY_LIMIT_DEFAULT) : limit(limit) {}
+    
+    void clear() { data.clear(); }
+    bool append(const char *buf, size_t len);
+};
+
+typedef std::shared_ptr<http_client_body_buffer> http_client_body_buffer_ptr;
+
+
+/*
+ * http_client_handler_memory
+ *
+ * Reads the response body into a body buffer, or hands it to a body
+ * function as views of the connection buffer without copying. Bodies may
+ * be delimited by Content-Length, chunked or the connection closing.
+ *
+ * Completion is reported once per request through the complete function
+ * and the future. The complete function runs on the connection's thread,
+ * and the response headers returned by get_response and get_header are
+ * views that are only valid until it returns.
+ */
+
+struct http_client_handler_memory : http_client_handler
+{
+    HTTPVersion                     http_version;
+    HTTPStatusCode                  status_code;
+    HTTPMethod                      request_method;
+    ssize_t                         content_length;
+    ssize_t                         total_read;
+    bool                            chunked;
+    bool                            completed;
+    http_chunked_decoder            chunked_decoder;
+    http_client_body_buffer_ptr     body;
+    http_client_body_function       body_fn;
+    http_client_complete_function   complete_fn;
+    std::promise<bool>              promise;
+    
+    http_client_handler_memory(size_t limit = HTTP_CLIENT_BODY_LIMIT_DEFAULT);
+    http_client_handler_memory(http_client_body_buffer_ptr body);
+    http_client_handler_memory(http_client_body_function body_fn);
+    ~http_client_handler_memory();
+    
+    std::future<bool> get_future() { return promise.get_future(); }
+    const http_response& get_response() const;
+    http_header_string get_header(const char *name) const;
+    const char* get_body() const { return body ? body->data.data() : nullptr; }
+    size_t get_body_length() const { return body ? body->data.size() : 0; }
+    
+    virtual void init();
+    virtual bool populate_request();
+    virtual io_result write_request_body();
+    virtual bool handle_response();
+    virtual io_result read_response_body();
+    virtual bool end_request();
+    virtual void abort_request();
+    
+    bool body_finished() const;
+    io_result consume_body(const char *buf, size_t len);
+    void complete(bool success);
+};
+
+#endif
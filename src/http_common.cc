@@ -3,6 +3,7 @@
 //
 
 #include <cstring>
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <string>
@@ -49,3 +50,90 @@ int http_common::sanitize_path(char *s)
     *w = 0;
     return 0;
 }
+
+size_t http_chunked_decoder::decode(const char *buf, size_t len, const char *&data, size_t &data_len)
+{
+    size_t i = 0;
+    data = nullptr;
+    data_len = 0;
+    while (i < len && state != state_done && state != state_error) {
+        char c = buf[i];
+        switch (state) {
+            case state_size_start:
+            case state_size:
+            {
+                int digit = (c >= '0' && c <= '9') ? c - '0' :
+                            (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                            (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+                if (digit >= 0) {
+                    // leave a spare digit so the size can't overflow
+                    if (++size_digits >= sizeof(size_t) * 2) {
+                        state = state_error;
+                        break;
+                    }
+                    chunk_remaining = (chunk_remaining << 4) | digit;
+                    state = state_size;
+                } else if (state == state_size_start) {
+                    state = state_error;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    state = state_extension;
+                } else if (c == '\r') {
+                    state = state_size_lf;
+                } else if (c == '\n') {
+                    state = chunk_remaining > 0 ? state_data : state_trailer;
+                } else {
+                    state = state_error;
+                }
+                i++;
+                break;
+            }
+            case state_extension:
+                if (c == '\r') {
+                    state = state_size_lf;
+                } else if (c == '\n') {
+                    state = chunk_remaining > 0 ? state_data : state_trailer;
+                }
+                i++;
+                break;
+            case state_size_lf:
+                state = c != '\n' ? state_error : chunk_remaining > 0 ? state_data : state_trailer;
+                i++;
+                break;
+            case state_data:
+                data = buf + i;
+                data_len = std::min(len - i, chunk_remaining);
+                chunk_remaining -= data_len;
+                if (chunk_remaining == 0) {
+                    state = state_data_cr;
+                }
+                return i + data_len;
+            case state_data_cr:
+                state = c == '\r' ? state_data_lf : c == '\n' ? state_size_start : state_error;
+                size_digits = 0;
+                i++;
+                break;
+            case state_data_lf:
+                state = c == '\n' ? state_size_start : state_error;
+                i++;
+                break;
+            case state_trailer:
+                // an empty line ends the trailers, other lines are skipped
+                state = c == '\r' ? state_trailer_lf : c == '\n' ? state_done : state_trailer_line;
+                i++;
+                break;
+            case state_trailer_line:
+                if (c == '\n') {
+                    state = state_trailer;
+                }
+                i++;
+                break;
+            case state_trailer_lf:
+                state = c == '\n' ? state_done : state_error;
+                i++;
+                break;
+            default:
+                break;
+        }
+    }
+    return i;
+}
@@ -61,4 +61,43 @@ struct http_common
     static int sanitize_path(char *s);
 };
 
+
+/*
+ * http_chunked_decoder
+ *
+ * Incremental decoder for the chunked transfer coding. decode consumes
+ * framing bytes until it reaches chunk data, which it returns in place,
+ * and stops after the trailers so a pipelined response is left unread.
+ */
+
+struct http_chunked_decoder
+{
+    enum state_type {
+        state_size_start,
+        state_size,
+        state_extension,
+        state_size_lf,
+        state_data,
+        state_data_cr,
+        state_data_lf,
+        state_trailer,
+        state_trailer_line,
+        state_trailer_lf,
+        state_done,
+        state_error
+    };
+    
+    state_type state;
+    size_t chunk_remaining;
+    size_t size_digits;
+    
+    http_chunked_decoder() { reset(); }
+    
+    void reset() { state = state_size_start; chunk_remaining = 0; size_digits = 0; }
+    bool is_done() const { return state == state_done; }
+    bool has_error() const { return state == state_error; }
+    
+    size_t decode(const char *buf, size_t len, const char *&data, size_t &data_len);
+};
+
 #endif
@@ -231,7 +231,7 @@ const char* kHTTPHeaderTimeout =            "Timeout";              // Timeout:
 /* response headers */
 
 const char* kHTTPHeaderServer =             "Server";               // Server: objstore/0.0
-const char* kHTTPHeaderSetCookie =          "SetCookie";            // Set-Cookie: name2=value2; Expires=Wed, 09 Jun 2021 10:18:14 GMT
+const char* kHTTPHeaderSetCookie =          "Set-Cookie";           // Set-Cookie: name2=value2; Expires=Wed, 09 Jun 2021 10:18:14 GMT
 const char* kHTTPHeaderAcceptRanges =       "Accept-Ranges";        // Accept-Ranges: bytes
 const char* kHTTPHeaderWWWAuthenticate =    "WWW-Authenticate";     // Basic realm="myRealm"                  (included in 401 Unauthorized response messages)
 const char* kHTTPHeaderAge =                "Age";                  // Age: 60                                (age in seconds sent by caches)
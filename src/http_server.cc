@@ -21,6 +21,8 @@
 #include <functional>
 #include <deque>
 #include <map>
+#include <list>
+#include <unordered_map>
 #include <atomic>
 #include <memory>
 #include <thread>
@@ -28,9 +30,11 @@
 #include <condition_variable>
 
 #include "io.h"
+#include "os.h"
 #include "url.h"
 #include "log.h"
 #include "log_thread.h"
+#include "hdr_histogram.h"
 #include "trie.h"
 #include "socket.h"
 #include "socket_unix.h"
@@ -53,11 +57,16 @@
 #include "http_request.h"
 #include "http_response.h"
 #include "http_date.h"
+#include "http_access_log.h"
 #include "http_server.h"
+#include "http_server_cache.h"
+#include "http_server_handler_cache.h"
+#include "http_client.h"
 #include "http_tls_shared.h"
 #include "http_server_handler_file.h"
 #include "http_server_handler_func.h"
 #include "http_server_handler_stats.h"
+#include "http_server_handler_proxy.h"
 
 #define USE_NODELAY
 
@@ -68,8 +77,8 @@ protocol_sock http_server::server_sock_tcp_connection
     (get_proto(), "tcp_connection", protocol_sock_tcp_connection);
 
 // actions
-protocol_action http_server::action_router_tls_handshake
-    (get_proto(), "router_tls_handshake", &router_tls_handshake);
+protocol_action http_server::action_tls_handshake_start
+    (get_proto(), "tls_handshake_start", &tls_handshake_start);
 protocol_action http_server::action_router_process_headers
     (get_proto(), "router_process_headers", &router_process_headers);
 protocol_action http_server::action_worker_process_request
@@ -78,10 +87,16 @@ protocol_action http_server::action_keepalive_wait_connection
     (get_proto(), "keepalive_wait_connection", &keepalive_wait_connection);
 protocol_action http_server::action_linger_read_connection
     (get_proto(), "linger_read_connection", &linger_read_connection);
+protocol_action http_server::action_listener_resume
+    (get_proto(), "listener_resume", &listener_resume);
+protocol_action http_server::action_worker_resume_connection
+    (get_proto(), "worker_resume_connection", &worker_resume_connection);
 
 // threads
 protocol_mask http_server::thread_mask_listener
     (get_proto(), "listener");
+protocol_mask http_server::thread_mask_tls_handshake
+    (get_proto(), "tls_handshake");
 protocol_mask http_server::thread_mask_router
     (get_proto(), "router");
 protocol_mask http_server::thread_mask_keepalive
@@ -93,7 +108,7 @@ protocol_mask http_server::thread_mask_worker
 protocol_state http_server::connection_state_free
     (get_proto(), "free");
 protocol_state http_server::connection_state_tls_handshake
-    (get_proto(), "client_request", &handle_state_tls_handshake);
+    (get_proto(), "tls_handshake", &handle_state_tls_handshake);
 protocol_state http_server::connection_state_client_request
     (get_proto(), "client_request", &handle_state_client_request);
 protocol_state http_server::connection_state_client_body
@@ -102,6 +117,8 @@ protocol_state http_server::connection_state_server_response
     (get_proto(), "server_response", &handle_state_server_response);
 protocol_state http_server::connection_state_server_body
     (get_proto(), "server_body", &handle_state_server_body);
+protocol_state http_server::connection_state_handler_wait
+    (get_proto(), "handler_wait");
 protocol_state http_server::connection_state_waiting
     (get_proto(), "waiting", &handle_state_waiting);
 protocol_state http_server::connection_state_lingering_close
@@ -123,12 +140,20 @@ poll_object_type http_server_connection::get_poll_type()
 bool http_server_connection::init(protocol_engine_delegate *delegate)
 {
     buffer.reset();
+    pipeline_buffer.reset();
     conn.reset();
     request.reset();
     response.reset();
     request_has_body = false;
     response_has_body = false;
+    request_pending = false;
     connection_close = true;
+    cache_store = false;
+    cache_invalidate = false;
+    cache_key.clear();
+    cache_fill = http_server_cache_fill_ptr();
+    request_start_usecs = request_headers_usecs = response_start_usecs = 0;
+    request_bytes_read = request_bytes_written = 0;
     state = &http_server::connection_state_free;
     if (buffer.size() == 0) {
         const auto &cfg = delegate->get_config();
@@ -147,6 +172,7 @@ bool http_server_connection::free(protocol_engine_delegate *delegate)
 {
     state = &http_server::connection_state_free;
     handler = http_server_handler_ptr();
+    cache_fill = http_server_cache_fill_ptr();
     return true;
 }
 
@@ -178,6 +204,20 @@ http_server_config::http_server_config() : ssl_ctx(nullptr)
         }
         current_location = http_server_location_ptr();
     }};
+    block_start_fn_map["upstream"] =        {2, 2, nullptr, [&] (config *cfg, config_line &line) {
+        if (upstream_map.find(line[1]) != upstream_map.end()) {
+            log_fatal_exit("configuration error: upstream: duplicate name: %s", line[1].c_str());
+        }
+        current_upstream = std::make_shared<http_server_upstream>(line[1]);
+        upstream_map[line[1]] = current_upstream;
+    }};
+    block_end_fn_map["upstream"] =          {0, 0, nullptr, [&] (config *cfg, config_line &line) {
+        if (current_upstream->servers.size() == 0) {
+            log_fatal_exit("configuration error: upstream \"%s\" must contain one or more \"server\" directives", line[1].c_str());
+        }
+        current_upstream->init();
+        current_upstream = http_server_upstream_ptr();
+    }};
 
     config_fn_map["error_log"] =           {2,  2,  [&] (config *cfg, config_line &line) {
         if (cfg->block.size() == 0) {
@@ -197,6 +237,57 @@ http_server_config::http_server_config() : ssl_ctx(nullptr)
             log_fatal_exit("configuration error: access_log must be defined at the toplevel or in a http_server block", line[0].c_str());
         }
     }};
+    config_fn_map["access_log_format"] =   {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] != "text" && line[1] != "binary") {
+            log_fatal_exit("configuration error: access_log_format: expected text or binary: %s", line[1].c_str());
+        }
+        if (cfg->block.size() == 0) {
+            cfg->access_log_format = line[1];
+        } else if (cfg->block.size() > 0 && cfg->block.back()[0] == "http_server") {
+            current_vhost->access_log_format = line[1];
+        } else {
+            log_fatal_exit("configuration error: access_log_format must be defined at the toplevel or in a http_server block", line[0].c_str());
+        }
+    }};
+    config_fn_map["access_log_sample"] =   {2,  2,  [&] (config *cfg, config_line &line) {
+        int sample = atoi(line[1].c_str());
+        if (sample < 1) {
+            log_fatal_exit("configuration error: access_log_sample: expected a positive integer: %s", line[1].c_str());
+        }
+        if (cfg->block.size() == 0) {
+            cfg->access_log_sample = sample;
+        } else if (cfg->block.back()[0] == "http_server") {
+            current_vhost->access_log_policy.sample = sample;
+        } else if (cfg->block.back()[0] == "location") {
+            current_location->access_log_policy.sample = sample;
+        }
+    }};
+    config_fn_map["access_log_slow"] =     {2,  2,  [&] (config *cfg, config_line &line) {
+        int slow_msecs = atoi(line[1].c_str());
+        if (slow_msecs < 0) {
+            log_fatal_exit("configuration error: access_log_slow: expected milliseconds: %s", line[1].c_str());
+        }
+        if (cfg->block.size() == 0) {
+            cfg->access_log_slow = slow_msecs;
+        } else if (cfg->block.back()[0] == "http_server") {
+            current_vhost->access_log_policy.slow_msecs = slow_msecs;
+        } else if (cfg->block.back()[0] == "location") {
+            current_location->access_log_policy.slow_msecs = slow_msecs;
+        }
+    }};
+    config_fn_map["access_log_errors"] =   {2,  2,  [&] (config *cfg, config_line &line) {
+        if (line[1] != "on" && line[1] != "off") {
+            log_fatal_exit("configuration error: access_log_errors: expected on or off: %s", line[1].c_str());
+        }
+        bool errors = (line[1] == "on");
+        if (cfg->block.size() == 0) {
+            cfg->access_log_errors = errors;
+        } else if (cfg->block.back()[0] == "http_server") {
+            current_vhost->access_log_policy.errors = errors;
+        } else if (cfg->block.back()[0] == "location") {
+            current_location->access_log_policy.errors = errors;
+        }
+    }};
     config_fn_map["tls_key_file"] =        {2,  2,  [&] (config *cfg, config_line &line) {
         if (cfg->block.size() == 0) {
             cfg->tls_key_file = line[1];
@@ -224,20 +315,44 @@ http_server_config::http_server_config() : ssl_ctx(nullptr)
             log_fatal_exit("configuration error: tls_cipher_list must be defined at the toplevel or in a http_server block", line[0].c_str());
         }
     }};
-    config_fn_map["listen"] =               {2,  3,  [&] (config *cfg, config_line &line) {
+    config_fn_map["tls_curves"] =            {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() == 0) {
+            cfg->tls_curves = line[1];
+        } else if (cfg->block.size() > 0 && cfg->block.back()[0] == "http_server") {
+            current_vhost->tls_curves = line[1];
+        } else {
+            log_fatal_exit("configuration error: tls_curves must be defined at the toplevel or in a http_server block", line[0].c_str());
+        }
+    }};
+    config_fn_map["tls_prefer_server_ciphers"] = {2,  2,  [&] (config *cfg, config_line &line) {
+        bool prefer = false;
+        if (line[1] == "on") prefer = true;
+        else if (line[1] == "off") prefer = false;
+        else log_fatal_exit("configuration error: tls_prefer_server_ciphers: expected on or off: %s", line[1].c_str());
+        if (cfg->block.size() == 0) {
+            cfg->tls_prefer_server_ciphers = prefer;
+        } else if (cfg->block.size() > 0 && cfg->block.back()[0] == "http_server") {
+            current_vhost->tls_prefer_server_ciphers = prefer;
+        } else {
+            log_fatal_exit("configuration error: tls_prefer_server_ciphers must be defined at the toplevel or in a http_server block", line[0].c_str());
+        }
+    }};
+    config_fn_map["listen"] =               {2, -1,  [&] (config *cfg, config_line &line) {
         if (cfg->block.size() > 0 && cfg->block.back()[0] == "http_server") {
             socket_addr addr;
             if (socket_addr::string_to_addr(line[1], addr) < 0) {
                 log_fatal_exit("configuration error: proto_listener: invalid address: %s", line[1].c_str());
             }
-            if (line.size() == 3) {
-                if (line[2] != "tls") {
-                    log_fatal_exit("configuration error: proto_listener: invalid option: %s", line[2].c_str());
+            socket_mode mode = socket_mode_plain;
+            socket_listen_options opts;
+            for (size_t i = 2; i < line.size(); i++) {
+                if (line[i] == "tls") {
+                    mode = socket_mode_tls;
+                } else if (!opts.parse(line[i])) {
+                    log_fatal_exit("configuration error: proto_listener: invalid option: %s", line[i].c_str());
                 }
-                current_vhost->listens.push_back(http_server_listen_spec(addr, socket_mode_tls));
-            } else {
-                current_vhost->listens.push_back(http_server_listen_spec(addr, socket_mode_plain));
             }
+            current_vhost->listens.push_back(http_server_listen_spec(addr, mode, opts));
         } else {
             log_fatal_exit("configuration error: listen must be defined at the toplevel or in a http_server block", line[0].c_str());
         }
@@ -289,8 +404,102 @@ http_server_config::http_server_config() : ssl_ctx(nullptr)
             log_fatal_exit("configuration error: handler must be defined at the toplevel or in a location block", line[0].c_str());
         }
     }};
+    config_fn_map["server"] =               {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "upstream") {
+            url_ptr server_url = std::make_shared<url>("http://" + line[1] + "/");
+            if (!server_url->valid || server_url->host.length() == 0 || server_url->port <= 0) {
+                log_fatal_exit("configuration error: server: expected host:port: %s", line[1].c_str());
+            }
+            current_upstream->servers.push_back(std::make_shared<http_server_upstream_server>(server_url));
+        } else {
+            log_fatal_exit("configuration error: server must be defined in an upstream block", line[0].c_str());
+        }
+    }};
+    config_fn_map["balance"] =              {2,  4,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "upstream") {
+            if (!http_server_upstream::parse_policy(line[1], current_upstream->policy)) {
+                log_fatal_exit("configuration error: balance: expected round_robin, least_outstanding, p2c_ewma or hash: %s",
+                               line[1].c_str());
+            }
+            if (current_upstream->policy != http_upstream_policy_hash && line.size() > 2) {
+                log_fatal_exit("configuration error: balance: only hash takes a key: %s", line[2].c_str());
+            } else if (line.size() == 2 || (line.size() == 3 && line[2] == "path")) {
+                current_upstream->hash_key = http_upstream_hash_key_path;
+            } else if (line.size() == 3 && line[2] == "ip") {
+                current_upstream->hash_key = http_upstream_hash_key_ip;
+            } else if (line.size() == 4 && line[2] == "header") {
+                current_upstream->hash_key = http_upstream_hash_key_header;
+                current_upstream->hash_header = line[3];
+            } else {
+                log_fatal_exit("configuration error: balance: expected hash path, hash ip or hash header <name>: %s",
+                               line[2].c_str());
+            }
+        } else {
+            log_fatal_exit("configuration error: balance must be defined in an upstream block", line[0].c_str());
+        }
+    }};
+    config_fn_map["max_fails"] =            {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "upstream") {
+            current_upstream->max_fails = atoi(line[1].c_str());
+            if (current_upstream->max_fails < 0) {
+                log_fatal_exit("configuration error: max_fails: expected 0 (never eject) or more: %s", line[1].c_str());
+            }
+        } else {
+            log_fatal_exit("configuration error: max_fails must be defined in an upstream block", line[0].c_str());
+        }
+    }};
+    config_fn_map["fail_timeout"] =         {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "upstream") {
+            current_upstream->fail_timeout = atoi(line[1].c_str());
+            if (current_upstream->fail_timeout <= 0) {
+                log_fatal_exit("configuration error: fail_timeout: expected at least 1: %s", line[1].c_str());
+            }
+        } else {
+            log_fatal_exit("configuration error: fail_timeout must be defined in an upstream block", line[0].c_str());
+        }
+    }};
+    config_fn_map["proxy_pass"] =           {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "location") {
+            if (line[1].compare(0, 7, "http://") != 0) {
+                log_fatal_exit("configuration error: proxy_pass: expected http://host[:port][/uri]: %s", line[1].c_str());
+            }
+            current_location->proxy_pass = line[1];
+            current_location->handler = "proxy";
+        } else {
+            log_fatal_exit("configuration error: proxy_pass must be defined in a location block", line[0].c_str());
+        }
+    }};
+    config_fn_map["cache"] =                {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "location") {
+            if (line[1] == "on") current_location->cache = true;
+            else if (line[1] == "off") current_location->cache = false;
+            else log_fatal_exit("configuration error: cache: invalid value: %s", line[1].c_str());
+        } else {
+            log_fatal_exit("configuration error: cache must be defined in a location block", line[0].c_str());
+        }
+    }};
+    config_fn_map["cache_valid"] =          {2,  2,  [&] (config *cfg, config_line &line) {
+        if (cfg->block.size() > 0 && cfg->block.back()[0] == "location") {
+            current_location->cache_valid = atoi(line[1].c_str());
+            if (current_location->cache_valid < 0) {
+                log_fatal_exit("configuration error: cache_valid: expected seconds: %s", line[1].c_str());
+            }
+        } else {
+            log_fatal_exit("configuration error: cache_valid must be defined in a location block", line[0].c_str());
+        }
+    }};
+}
+
+/* http_server_log_policy */
+
+void http_server_log_policy::inherit(const http_server_log_policy &parent)
+{
+    if (sample == 0) sample = parent.sample;
+    if (slow_msecs < 0) slow_msecs = parent.slow_msecs;
+    if (errors < 0) errors = parent.errors;
 }
 
+
 std::string http_server_config::to_string()
 {
     std::stringstream ss;
@@ -323,6 +532,7 @@ void http_server::proto_init()
         http_constants::init();
         http_server_handler_file::init_handler();
         http_server_handler_stats::init_handler();
+        http_server_handler_proxy::init_handler();
     });
 }
 
@@ -341,21 +551,31 @@ void http_server::make_default_config(config_ptr cfg) const
     cfg->io_buffer_size = IO_BUFFER_SIZE_DEFAULT;
     cfg->ipc_buffer_size = IPC_BUFFER_SIZE_DEFAULT;
     cfg->log_buffers = LOG_BUFFERS_DEFAULT;
+    cfg->log_overflow = LOG_OVERFLOW_DEFAULT;
+    cfg->access_log_format = ACCESS_LOG_FORMAT_DEFAULT;
     cfg->tls_session_timeout = TLS_SESSION_TIMEOUT_DEFAULT;
     cfg->tls_session_count = TLS_SESSION_COUNT_DEFAULT;
+    cfg->tls_session_tickets = TLS_SESSION_TICKETS_DEFAULT;
+    cfg->tls_ticket_rotation = TLS_TICKET_ROTATION_DEFAULT;
+    cfg->tls_record_size = TLS_RECORD_SIZE_DEFAULT;
+    cfg->tls_record_boost = TLS_RECORD_BOOST_DEFAULT;
+    cfg->tls_record_idle = TLS_RECORD_IDLE_DEFAULT;
+    cfg->tls_curves = TLS_CURVES_DEFAULT;
+    cfg->tls_prefer_server_ciphers = TLS_PREFER_SERVER_CIPHERS_DEFAULT;
+    cfg->tls_dhe = TLS_DHE_DEFAULT;
     socket_addr ipv4_localhost;
     if (socket_addr::string_to_addr(ipv4_localhost_addr, ipv4_localhost) < 0) {
         log_error("configuration error: unable to decode address: %s", ipv4_localhost);
     } else {
-        cfg->proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode>
-                                       (http_server::get_proto(), ipv4_localhost, socket_mode_plain));
+        cfg->proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode,socket_listen_options>
+                                       (http_server::get_proto(), ipv4_localhost, socket_mode_plain, socket_listen_options()));
     }
     socket_addr ipv6_localhost;
     if (socket_addr::string_to_addr(ipv6_localhost_addr, ipv6_localhost) < 0) {
         log_error("configuration error: unable to decode address: %s", ipv6_localhost);
     } else {
-        cfg->proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode>
-                                       (http_server::get_proto(), ipv6_localhost, socket_mode_plain));
+        cfg->proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode,socket_listen_options>
+                                       (http_server::get_proto(), ipv6_localhost, socket_mode_plain, socket_listen_options()));
     }
     cfg->proto_threads.push_back(std::pair<std::string,size_t>("http_server/listener", 1));
     cfg->proto_threads.push_back(std::pair<std::string,size_t>("http_server/router,http_server/worker,http_server/keepalive", std::thread::hardware_concurrency()));
@@ -454,9 +674,40 @@ void http_server::engine_init(protocol_engine_delegate *delegate) const
         server_cfg->vhost_list[0]->server_names.push_back("default");
     }
 
+    // create log writer pool
+    server_cfg->log_pool = std::make_shared<log_writer_pool>(cfg->log_threads);
+
     // initialize virtual hosts
+    bool have_proxy = false;
+    bool have_cache = false;
+    std::map<std::string,bool> log_binary_map;
     for (auto &vhost : server_cfg->vhost_list) {
         for (auto &location : vhost->location_list) {
+            // proxy_pass names an upstream or a single host:port
+            if (location->proxy_pass.length() > 0 && !location->upstream) {
+                std::string host_port_path = location->proxy_pass.substr(7);
+                size_t path_pos = host_port_path.find('/');
+                std::string host_port = host_port_path.substr(0, path_pos);
+                if (path_pos != std::string::npos) {
+                    location->proxy_uri = host_port_path.substr(path_pos);
+                }
+                auto ui = server_cfg->upstream_map.find(host_port);
+                if (ui != server_cfg->upstream_map.end()) {
+                    location->upstream = ui->second;
+                } else {
+                    url_ptr server_url = std::make_shared<url>("http://" + host_port + "/");
+                    if (!server_url->valid || server_url->host.length() == 0 || server_url->port <= 0) {
+                        log_fatal_exit("configuration error: proxy_pass: expected an upstream or host:port: %s",
+                                       location->proxy_pass.c_str());
+                    }
+                    location->upstream = std::make_shared<http_server_upstream>(host_port);
+                    location->upstream->servers.push_back(std::make_shared<http_server_upstream_server>(server_url));
+                    location->upstream->init();
+                    server_cfg->upstream_map[host_port] = location->upstream;
+                }
+            }
+            have_proxy |= (bool)location->upstream;
+            have_cache |= location->cache;
             if (!location->handler_factory) {
                 std::string handler_name;
                 if (location->handler.length() == 0) {
@@ -478,10 +729,24 @@ void http_server::engine_init(protocol_engine_delegate *delegate) const
             server_cfg->vhost_map.insert(http_server_vhost_entry(server_name, vhost.get()));
         }
         for (auto &listen : vhost->listens) {
-            auto proto_listen = std::tuple<protocol*,socket_addr,socket_mode>(get_proto(), listen.first, listen.second);
+            auto &addr = std::get<0>(listen);
+            auto &mode = std::get<1>(listen);
+            auto &opts = std::get<2>(listen);
             auto &proto_listeners = cfg->proto_listeners;
-            if (std::find(proto_listeners.begin(), proto_listeners.end(), proto_listen) == proto_listeners.end()) {
-                proto_listeners.push_back(proto_listen);
+            auto li = std::find_if(proto_listeners.begin(), proto_listeners.end(),
+                                   [&] (const std::tuple<protocol*,socket_addr,socket_mode,socket_listen_options> &proto_listen)
+                                   { return std::get<0>(proto_listen) == get_proto() && std::get<1>(proto_listen) == addr &&
+                                            std::get<2>(proto_listen) == mode; });
+            if (li == proto_listeners.end()) {
+                proto_listeners.push_back(std::tuple<protocol*,socket_addr,socket_mode,socket_listen_options>
+                                          (get_proto(), addr, mode, opts));
+            } else if (opts != socket_listen_options()) {
+                // listen options may only be given once per address
+                if (std::get<3>(*li) != socket_listen_options() && std::get<3>(*li) != opts) {
+                    log_fatal_exit("configuration error: listen: conflicting options for: %s",
+                                   socket_addr::addr_to_string(addr).c_str());
+                }
+                std::get<3>(*li) = opts;
             }
         }
         // set defaults from root context
@@ -494,37 +759,84 @@ void http_server::engine_init(protocol_engine_delegate *delegate) const
         if (vhost->tls_cipher_list.length() == 0) {
             vhost->tls_cipher_list = cfg->tls_cipher_list;
         }
+        if (vhost->tls_curves.length() == 0) {
+            vhost->tls_curves = cfg->tls_curves;
+        }
+        if (vhost->tls_prefer_server_ciphers < 0) {
+            vhost->tls_prefer_server_ciphers = cfg->tls_prefer_server_ciphers;
+        }
         if (vhost->access_log.length() == 0) {
             vhost->access_log = cfg->access_log;
         }
+        if (vhost->access_log_format.length() == 0) {
+            vhost->access_log_format = cfg->access_log_format;
+        }
+        vhost->access_log_binary = (vhost->access_log_format == "binary");
+        http_server_log_policy toplevel_policy;
+        toplevel_policy.sample = cfg->access_log_sample;
+        toplevel_policy.slow_msecs = cfg->access_log_slow;
+        toplevel_policy.errors = cfg->access_log_errors;
+        vhost->access_log_policy.inherit(toplevel_policy);
+        for (auto &location : vhost->location_list) {
+            location->access_log_policy.inherit(vhost->access_log_policy);
+        }
         if (vhost->error_log.length() == 0) {
             vhost->error_log = cfg->error_log;
         }
-        // open log files
+        // open log files, vhosts sharing a path share a sink so its records must share a format
+        log_overflow_policy log_overflow = cfg->log_overflow == "block" ? log_overflow_block : log_overflow_drop;
+        std::vector<std::pair<std::string,bool>> log_formats;
+        if (vhost->access_log.size() > 0 && vhost->access_log != "off") {
+            log_formats.push_back(std::pair<std::string,bool>(vhost->access_log, vhost->access_log_binary));
+        }
+        if (vhost->error_log.size() > 0 && vhost->error_log != "off") {
+            log_formats.push_back(std::pair<std::string,bool>(vhost->error_log, false));
+        }
+        for (auto &log_format : log_formats) {
+            auto bi = log_binary_map.insert(log_format).first;
+            if (bi->second != log_format.second) {
+                log_fatal_exit("configuration error: text and binary logs share a file: %s", log_format.first.c_str());
+            }
+        }
         if (vhost->access_log.size() > 0 && vhost->access_log != "off") {
-            int log_fd = open(vhost->access_log.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0755);
-            if (log_fd < 0) {
+            vhost->access_log_sink = server_cfg->log_pool->open_sink(vhost->access_log, cfg->log_buffers, log_overflow);
+            if (!vhost->access_log_sink) {
                 log_fatal_exit("unable to open log file: %s: %s",
                                vhost->access_log.c_str(), strerror(errno));
             } else {
                 log_info("opened access log file: %s", vhost->access_log.c_str());
             }
-            vhost->access_log_file.set_fd(log_fd);
-            vhost->access_log_thread = std::make_shared<log_thread>(log_fd, cfg->log_buffers);
         }
         if (vhost->error_log.size() > 0 && vhost->error_log != "off") {
-            int log_fd = open(vhost->error_log.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0755);
-            if (log_fd < 0) {
+            vhost->error_log_sink = server_cfg->log_pool->open_sink(vhost->error_log, cfg->log_buffers, log_overflow);
+            if (!vhost->error_log_sink) {
                 log_fatal_exit("unable to open log file: %s: %s",
                                vhost->error_log.c_str(), strerror(errno));
             } else {
                 log_info("opened error log file: %s", vhost->error_log.c_str());
             }
-            vhost->error_log_file.set_fd(log_fd);
-            vhost->error_log_thread = std::make_shared<log_thread>(log_fd, cfg->log_buffers);
         }
     }
 
+    // proxied requests are sent by the http_client protocol in this engine
+    if (have_proxy) {
+        int thread_mask = 0;
+        for (auto thread : cfg->proto_threads) {
+            thread_mask |= protocol_thread::string_to_thread_mask(thread.first);
+        }
+        int client_mask = http_client::thread_mask_connect.mask | http_client::thread_mask_worker.mask |
+                          http_client::thread_mask_keepalive.mask;
+        if ((thread_mask & client_mask) != client_mask) {
+            log_fatal_exit("configuration error: proxy_pass requires http_client/connect, "
+                           "http_client/worker and http_client/keepalive threads");
+        }
+    }
+
+    // one response cache is shared by all vhosts
+    if (have_cache) {
+        engine_state->cache = std::make_shared<http_server_cache>(cfg->cache_size, cfg->cache_max_entry_size);
+    }
+
     // initialize connection table
     engine_state->init(delegate, cfg->server_connections);
 
@@ -545,23 +857,32 @@ void http_server::engine_init(protocol_engine_delegate *delegate) const
     if (have_tls) {
         server_cfg->ssl_ctx = http_tls_shared::init_server(get_proto(), cfg,
                                                            cfg->tls_cipher_list,
+                                                           cfg->tls_curves,
+                                                           cfg->tls_prefer_server_ciphers,
                                                            cfg->tls_key_file,
                                                            cfg->tls_cert_file);
         // initialize per virtual host TLS contexts
         for (auto &vhost : server_cfg->vhost_list) {
             bool vhost_has_tls_listen = false;
             for (auto &listen : vhost->listens) {
-                if (listen.second == socket_mode_tls) {
+                if (std::get<1>(listen) == socket_mode_tls) {
                     vhost_has_tls_listen = true;
                     break;
                 }
             }
+            bool vhost_has_tls_params =
+                vhost->tls_cipher_list != cfg->tls_cipher_list ||
+                vhost->tls_curves != cfg->tls_curves ||
+                (bool)vhost->tls_prefer_server_ciphers != cfg->tls_prefer_server_ciphers;
             if (vhost_has_tls_listen &&
-                vhost->tls_key_file.length() > 0 && vhost->tls_key_file != cfg->tls_key_file &&
-                vhost->tls_cert_file.length() > 0 && vhost->tls_cert_file != cfg->tls_cert_file)
+                vhost->tls_key_file.length() > 0 && vhost->tls_cert_file.length() > 0 &&
+                ((vhost->tls_key_file != cfg->tls_key_file && vhost->tls_cert_file != cfg->tls_cert_file) ||
+                 vhost_has_tls_params))
             {
                 vhost->ssl_ctx = http_tls_shared::init_server(get_proto(), cfg,
                                                               vhost->tls_cipher_list,
+                                                              vhost->tls_curves,
+                                                              vhost->tls_prefer_server_ciphers,
                                                               vhost->tls_key_file,
                                                               vhost->tls_cert_file);
             }
@@ -575,13 +896,17 @@ void http_server::engine_init(protocol_engine_delegate *delegate) const
         if (proto != get_proto()) continue;
         socket_addr addr = std::get<1>(proto_listener);
         socket_mode mode = std::get<2>(proto_listener);
+        socket_listen_options opts = std::get<3>(proto_listener);
+        if (opts.backlog <= 0) {
+            opts.backlog = cfg->listen_backlog;
+        }
         if (mode == socket_mode_tls) {
             server_cfg->listens.push_back(connected_socket_ptr(new tls_connected_socket()));
         } else {
             server_cfg->listens.push_back(connected_socket_ptr(new tcp_connected_socket()));
         }
-        auto &listen = server_cfg->listens[i];
-        if (listen->start_listening(addr, cfg->listen_backlog)) {
+        auto &listen = server_cfg->listens.back();
+        if (listen->start_listening(addr, opts)) {
             log_info("%s listening on: %s%s",
                      get_proto()->name.c_str(), listen->to_string().c_str(),
                      (mode == socket_mode_tls ? " tls" : ""));
@@ -589,6 +914,13 @@ void http_server::engine_init(protocol_engine_delegate *delegate) const
             log_fatal_exit("%s can't listen on: %s",
                            get_proto()->name.c_str(), listen->to_string().c_str());
         }
+        
+        // index listen socket by fd for handle_accept
+        int listen_fd = listen->get_fd();
+        if (listen_fd >= (int)server_cfg->listens_by_fd.size()) {
+            server_cfg->listens_by_fd.resize(listen_fd + 1, nullptr);
+        }
+        server_cfg->listens_by_fd[listen_fd] = listen.get();
     }
 }
 
@@ -602,14 +934,9 @@ void http_server::engine_shutdown(protocol_engine_delegate *delegate) const
         listen->close_connection();
     }
     
-    // shutdown log threads
-    for (auto vhost : server_cfg->vhost_list) {
-        if (vhost->access_log_thread) {
-            vhost->access_log_thread->shutdown();
-        }
-        if (vhost->error_log_thread) {
-            vhost->error_log_thread->shutdown();
-        }
+    // shutdown log writers
+    if (server_cfg->log_pool) {
+        server_cfg->log_pool->shutdown();
     }
     
     // free SSL context
@@ -646,6 +973,12 @@ void http_server::thread_shutdown(protocol_thread_delegate *delegate) const
 
 void http_server::handle_message(protocol_thread_delegate *delegate, protocol_message &msg) const
 {
+    // listener messages are not associated with a connection
+    if (msg.action == action_listener_resume.action) {
+        listener_resume(delegate, nullptr);
+        return;
+    }
+    
     auto http_conn = get_connection(delegate, msg.connection_num);
     auto &conn = http_conn->conn;
     auto action = (*protocol_action::get_table())[msg.action];
@@ -658,65 +991,97 @@ void http_server::handle_message(protocol_thread_delegate *delegate, protocol_me
     action->callback(delegate, http_conn);
 }
 
+static int accept_nonblock(int listen_fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+#if defined (__APPLE__)
+    int fd = accept(listen_fd, addr, addrlen);
+    if (fd >= 0) {
+        if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            log_error("accept: fcntl: %s", strerror(errno));
+        }
+    }
+    return fd;
+#else
+    return accept4(listen_fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
+}
+
 void http_server::handle_accept(protocol_thread_delegate *delegate, const protocol_sock *proto_sock, int listen_fd) const
 {
     const auto &cfg = delegate->get_config();
     auto server_cfg = cfg->get_config<http_server>();
+    auto engine_state = get_engine_state(delegate);
     
-    // accept new connections
+    // find listen socket
+    if (listen_fd < 0 || listen_fd >= (int)server_cfg->listens_by_fd.size() ||
+        server_cfg->listens_by_fd[listen_fd] == nullptr)
+    {
+        delegate->log_error("accept: unknown listen socket: %d", listen_fd);
+        return;
+    }
+    auto listen = server_cfg->listens_by_fd[listen_fd];
+    socket_mode listen_mode = listen->get_mode();
+    socket_addr listen_addr = listen->get_addr();
+    
+    // accept new connections until the backlog is drained
+    unsigned long accepted = 0;
     while (true) {
-        int fd;
-        struct sockaddr_storage addr;
-        memset(&addr, 0, sizeof(sockaddr_storage));
-        socklen_t addrlen = sizeof(sockaddr_storage);
-        if ((fd = accept(listen_fd, (sockaddr*)&addr, &addrlen)) < 0) {
-            if (errno == EAGAIN) return;
-            delegate->log_error("accept: %s", strerror(errno));
-            return;
-        }
-        
-        // get a free connection
+        // get a free connection first so the backlog holds connections
+        // we can't serve instead of accepting and closing them
         auto http_conn = new_connection(delegate);
         if (http_conn == nullptr) {
-            delegate->log_error("accept: no free connections");
-            // TODO - queue accept
-            close(fd);
-            continue;
+            if (delegate->get_debug_mask() & protocol_debug_socket) {
+                delegate->log_debug("accept: no free connections: pausing listeners");
+            }
+            pause_listeners(delegate);
+            break;
         }
-
-        // find listen socket
-        auto it = std::find_if(server_cfg->listens.begin(), server_cfg->listens.end(),
-                               [listen_fd](const connected_socket_ptr& listen)
-                               { return listen->get_fd() == listen_fd; });
-        auto &listen = *it;
+        
+        int fd;
+        socket_addr addr;
+        memset(&addr, 0, sizeof(addr));
+        socklen_t addrlen = sizeof(addr.storage);
+        if ((fd = accept_nonblock(listen_fd, &addr.saddr, &addrlen)) < 0) {
+            int accept_errno = errno;
+            engine_state->free_connection(delegate->get_engine_delegate(), http_conn);
+            if (accept_errno == EINTR || accept_errno == ECONNABORTED) continue;
+            if (accept_errno == EAGAIN || accept_errno == EWOULDBLOCK) break;
+            delegate->log_error("accept: %s", strerror(accept_errno));
+            if (accept_errno == EMFILE || accept_errno == ENFILE) {
+                pause_listeners(delegate, true);
+            }
+            break;
+        }
+        accepted++;
 
         // assign file descriptor
         auto &conn = http_conn->conn;
-        switch (listen->get_mode()) {
+        switch (listen_mode) {
             case socket_mode_plain:
                 conn.accept(fd);
                 break;
             case socket_mode_tls:
+            {
                 conn.accept_tls(fd, server_cfg->ssl_ctx);
+                tls_record_sizing sizing = { (size_t)cfg->tls_record_size, (size_t)cfg->tls_record_boost, cfg->tls_record_idle };
+                static_cast<tls_connected_socket*>(conn.sock.get())->set_record_sizing(sizing);
                 break;
+            }
         }
         if (delegate->get_debug_mask() & protocol_debug_socket) {
             delegate->log_debug("%s: accepted%s connection",
                                 http_conn->to_string().c_str(),
-                                listen->get_mode() == socket_mode_tls ? " tls" : "");
+                                listen_mode == socket_mode_tls ? " tls" : "");
         }
         
-        // copy local address into connection and get peer address
-        memcpy(&conn.get_peer_addr().storage, &addr, sizeof(sockaddr_storage));
-        addrlen = sizeof(sockaddr_storage);
-        if (getsockname(fd, (sockaddr*)&conn.get_local_addr().storage, &addrlen) < 0) {
-            delegate->log_error("getpeername: %s", strerror(errno));
-        }
+        // copy peer address and take the local address from the listener
+        conn.get_peer_addr() = addr;
+        conn.get_local_addr() = listen_addr;
         
-        get_engine_state(delegate)->stats.connections_accepted++;
+        engine_state->stats.connections_accepted++;
         
-        // send connection to a router
-        switch (listen->get_mode()) {
+        // send connection to a router, tls connections handshake first
+        switch (listen_mode) {
             case socket_mode_plain:
                 dispatch_connection(delegate, http_conn);
                 break;
@@ -725,6 +1090,13 @@ void http_server::handle_accept(protocol_thread_delegate *delegate, const protoc
                 break;
         }
     }
+    
+    if (accepted > 0) {
+        engine_state->stats.accept_bursts++;
+        unsigned long burst_max = engine_state->stats.accept_burst_max;
+        while (accepted > burst_max &&
+               !engine_state->stats.accept_burst_max.compare_exchange_weak(burst_max, accepted)) {}
+    }
 }
 
 void http_server::handle_connection(protocol_thread_delegate *delegate, protocol_object *obj, int revents) const
@@ -739,6 +1111,9 @@ void http_server::handle_connection(protocol_thread_delegate *delegate, protocol
             delegate->log_debug("%s: %s", obj->to_string().c_str(),
                                 socket_error ? strerror(socket_error) : "connection closed");
         }
+        if (http_conn->state == &connection_state_tls_handshake) {
+            finished_handshake(delegate, http_conn, false);
+        }
         delegate->remove_events(http_conn);
         close_connection(delegate, http_conn);
         return;
@@ -746,6 +1121,9 @@ void http_server::handle_connection(protocol_thread_delegate *delegate, protocol
         if (delegate->get_debug_mask() & protocol_debug_socket) {
             delegate->log_debug("%s: socket exception", obj->to_string().c_str());
         }
+        if (http_conn->state == &connection_state_tls_handshake) {
+            finished_handshake(delegate, http_conn, false);
+        }
         delegate->remove_events(http_conn);
         close_connection(delegate, http_conn);
         return;
@@ -753,12 +1131,22 @@ void http_server::handle_connection(protocol_thread_delegate *delegate, protocol
         if (delegate->get_debug_mask() & protocol_debug_socket) {
             delegate->log_debug("%s: invalid socket", obj->to_string().c_str());
         }
+        if (http_conn->state == &connection_state_tls_handshake) {
+            finished_handshake(delegate, http_conn, false);
+        }
         delegate->remove_events(http_conn);
         close_connection(delegate, http_conn);
     } else {
         conn.set_last_activity(current_time);
         if (http_conn->state->callback) {
-            http_conn->state->callback(delegate, obj);
+            // with edge triggered events keep running the state handlers until
+            // the socket would block or the connection leaves this thread
+            bool edge_triggered = delegate->get_config()->edge_triggered;
+            do {
+                conn.would_block = 0;
+                http_conn->state->callback(delegate, obj);
+            } while (edge_triggered && delegate->has_events(http_conn) &&
+                     !conn.would_block && http_conn->state->callback);
         } else {
             delegate->log_error("%s: invalid connection state: state=%d",
                                 obj->to_string().c_str(), http_conn->state);
@@ -794,6 +1182,16 @@ void http_server::timeout_connection(protocol_thread_delegate *delegate, protoco
             delegate->remove_events(http_conn);
             linger_connection(delegate, http_conn);
         }
+    } else if (http_conn->state == &connection_state_tls_handshake) {
+        if (current_time - last_activity > cfg->connection_timeout) {
+            if (delegate->get_debug_mask() & protocol_debug_timeout) {
+                delegate->log_debug("%s: tls handshake timeout reached: aborting connection",
+                                    obj->to_string().c_str());
+            }
+            finished_handshake(delegate, http_conn, false);
+            delegate->remove_events(http_conn);
+            abort_connection(delegate, http_conn);
+        }
     } else if (http_conn->state == &connection_state_lingering_close) {
         if (current_time - last_activity > cfg->connection_timeout) {
             if (delegate->get_debug_mask() & protocol_debug_timeout) {
@@ -823,9 +1221,18 @@ void http_server::handle_state_tls_handshake(protocol_thread_delegate *delegate,
     auto http_conn = static_cast<http_server_connection*>(obj);
     auto &conn = http_conn->conn;
     
-    int ret = conn.sock->do_handshake();
+    int ret = conn.do_handshake();
     switch (ret) {
         case socket_error_none:
+            // hand the write side to the kernel, falling back to the library path
+            if (delegate->get_config()->tls_ktls &&
+                static_cast<tls_connected_socket*>(conn.sock.get())->enable_ktls())
+            {
+                get_engine_state(delegate)->stats.tls_ktls++;
+                if (delegate->get_debug_mask() & protocol_debug_tls) {
+                    delegate->log_debug("%s: tls ktls enabled", obj->to_string().c_str());
+                }
+            }
             if (delegate->get_debug_mask() & protocol_debug_tls)
             {
                 int cipher_bits;
@@ -850,6 +1257,8 @@ void http_server::handle_state_tls_handshake(protocol_thread_delegate *delegate,
                 }
             }
             
+            finished_handshake(delegate, http_conn, true);
+            delegate->remove_events(http_conn);
             dispatch_connection(delegate, http_conn);
             break;
         case socket_error_want_write:
@@ -861,6 +1270,7 @@ void http_server::handle_state_tls_handshake(protocol_thread_delegate *delegate,
         default:
             delegate->log_error("%s: unknown tls handshake error %d: closing connection",
                                 obj->to_string().c_str(), ret);
+            finished_handshake(delegate, http_conn, false);
             delegate->remove_events(http_conn);
             close_connection(delegate, http_conn);
             break;
@@ -872,37 +1282,48 @@ void http_server::handle_state_client_request(protocol_thread_delegate *delegate
     auto http_conn = static_cast<http_server_connection*>(obj);
     auto &conn = http_conn->conn;
     auto &buffer = http_conn->buffer;
+    ssize_t length;
     
-    // read request and request headers
-    if (buffer.bytes_writable() <= 0) {
-        delegate->log_error("%s: header buffer full: aborting connection",
-                            obj->to_string().c_str());
-        delegate->remove_events(http_conn);
-        abort_connection(delegate, http_conn); // TODO - bad request or lingering close?
-        return;
-    }
-    io_result result = buffer.buffer_read(conn);
-    if (result.has_error()) {
-        delegate->log_error("%s: read exception: aborting connection: %s",
-                            obj->to_string().c_str(), result.error_string().c_str());
-        delegate->remove_events(http_conn);
-        abort_connection(delegate, http_conn);
-        return;
-    }
+    if (http_conn->request_pending) {
+        // pipelined request bytes that arrived with the previous request
+        http_conn->request_pending = false;
+        length = buffer.bytes_readable();
+    } else {
+        // read request and request headers
+        if (buffer.bytes_writable() <= 0) {
+            delegate->log_error("%s: header buffer full: aborting connection",
+                                obj->to_string().c_str());
+            delegate->remove_events(http_conn);
+            abort_connection(delegate, http_conn); // TODO - bad request or lingering close?
+            return;
+        }
+        io_result result = buffer.buffer_read(conn);
+        if (result.would_block()) {
+            return;
+        } else if (result.has_error()) {
+            delegate->log_error("%s: read exception: aborting connection: %s",
+                                obj->to_string().c_str(), result.error_string().c_str());
+            delegate->remove_events(http_conn);
+            abort_connection(delegate, http_conn);
+            return;
+        }
 
-    // Close connection if we get EOF reading headers
-    if (result.size() == 0 && buffer.back == 0) {
-        delegate->remove_events(http_conn);
-        close_connection(delegate, http_conn);
-        return;
+        // Close connection if we get EOF reading headers
+        if (result.size() == 0) {
+            delegate->remove_events(http_conn);
+            close_connection(delegate, http_conn);
+            return;
+        }
+        length = result.size();
     }
     
     // incrementally parse headers
-    /* size_t bytes_parsed = */ http_conn->request.parse(buffer.data() + buffer.back - result.size(), result.size());
-    buffer.front += result.size();
+    /* size_t bytes_parsed = */ http_conn->request.parse(buffer.data() + buffer.back - length, length);
+    buffer.front += length;
     
     // switch state if request processing is finished
     if (http_conn->request.is_finished()) {
+        http_conn->request_headers_usecs = os::current_time_usecs();
         if (!process_request_headers(delegate, http_conn)) {
             delegate->remove_events(http_conn);
             abort_connection(delegate, http_conn); // TODO - bad request or lingering close?
@@ -924,20 +1345,16 @@ void http_server::handle_state_client_body(protocol_thread_delegate *delegate, p
     
     // read request body e.g. POST
     io_result result = http_conn->handler->read_request_body();
-    if (result.has_error()) {
+    if (result.would_block()) {
+        return;
+    } else if (result.has_error()) {
         delegate->log_error("%s: handler read_request_body failed: aborting connection: %s",
                             obj->to_string().c_str(), result.error_string().c_str());
         delegate->remove_events(http_conn);
         abort_connection(delegate, http_conn); // TODO - bad request or lingering close?
     } else if (result.size() == 0) {
-        populate_response_headers(delegate, http_conn);
-        // if response has a body then enter connection_state_server_body
-        if (http_conn->response_has_body) {
-            http_conn->state = &connection_state_server_body;
-        } else {
-            http_conn->state = &connection_state_server_response;
-        }
-        delegate->add_events(obj, poll_event_out);
+        delegate->remove_events(http_conn);
+        start_response(delegate, http_conn);
     }
 }
 
@@ -947,8 +1364,10 @@ void http_server::handle_state_server_response(protocol_thread_delegate *delegat
     
     // write buffer to socket
     if (http_conn->buffer.bytes_readable() > 0) {
-        io_result result = http_conn->buffer.buffer_write(http_conn->conn);
-        if (result.has_error()) {
+        io_result result = write_response_buffer(http_conn);
+        if (result.would_block()) {
+            return;
+        } else if (result.has_error()) {
             delegate->log_error("%s: buffer_write failed: aborting connection: %s",
                                 obj->to_string().c_str(), result.error_string().c_str());
             delegate->remove_events(http_conn);
@@ -969,11 +1388,11 @@ void http_server::handle_state_server_response(protocol_thread_delegate *delegat
         if (delegate->get_debug_mask() & protocol_debug_socket) {
             delegate->log_debug("%s: closing connection", obj->to_string().c_str());
         }
-        get_engine_state(delegate)->stats.requests_processed++;
+        finished_request(delegate, obj);
         delegate->remove_events(http_conn);
         close_connection(delegate, http_conn);
     } else {
-        get_engine_state(delegate)->stats.requests_processed++;
+        finished_request(delegate, obj);
         delegate->remove_events(http_conn);
         keepalive_connection(delegate, http_conn);
     }
@@ -987,7 +1406,9 @@ void http_server::handle_state_server_body(protocol_thread_delegate *delegate, p
     // or forward the connection to the keepalive thread
     if (http_conn->response_has_body) {
         io_result body_result = http_conn->handler->write_response_body();
-        if (body_result.has_error()) {
+        if (body_result.would_block()) {
+            return;
+        } else if (body_result.has_error()) {
             delegate->log_error("%s: handler write_response_body failed: aborting connection: %s",
                                 obj->to_string().c_str(), body_result.error_string().c_str());
             delegate->remove_events(http_conn);
@@ -998,8 +1419,10 @@ void http_server::handle_state_server_body(protocol_thread_delegate *delegate, p
     
     // write buffer to socket
     if (http_conn->buffer.bytes_readable() > 0) {
-        io_result result = http_conn->buffer.buffer_write(http_conn->conn);
-        if (result.has_error()) {
+        io_result result = write_response_buffer(http_conn);
+        if (result.would_block()) {
+            return;
+        } else if (result.has_error()) {
             delegate->log_error("%s: buffer_write failed: aborting connection: %s",
                                 obj->to_string().c_str(), result.error_string().c_str());
             delegate->remove_events(http_conn);
@@ -1035,20 +1458,49 @@ void http_server::finished_request(protocol_thread_delegate *delegate, protocol_
     auto engine_state = get_engine_state(delegate);
     engine_state->stats.requests_processed++;
 
+    // store a response captured in full, a successful unsafe request invalidates it
     auto http_conn = static_cast<http_server_connection*>(obj);
-    if (http_conn->handler && http_conn->handler->vhost && http_conn->handler->vhost->access_log_thread)
+    if (http_conn->cache_fill) {
+        if (http_conn->cache_fill->complete()) {
+            engine_state->cache->store(http_conn->cache_fill->entry);
+        }
+        http_conn->cache_fill = http_server_cache_fill_ptr();
+    } else if (http_conn->cache_invalidate && http_conn->response.get_status_code() < 400) {
+        engine_state->cache->invalidate(http_conn->cache_key);
+    }
+
+    if (http_conn->handler && http_conn->handler->vhost && http_conn->handler->vhost->access_log_sink)
     {
-        auto &access_log_thread = http_conn->handler->vhost->access_log_thread;
+        auto &access_log_sink = http_conn->handler->vhost->access_log_sink;
+        time_t current_time = delegate->get_current_time();
+        
+        // decide whether to log before doing any formatting
+        uint64_t finish_usecs = 0;
+        if (!finished_request_sampled(http_conn, finish_usecs)) {
+            engine_state->stats.requests_unlogged++;
+            return;
+        }
+        
+        // binary records are formatted offline by netl
+        if (http_conn->handler->vhost->access_log_binary) {
+            char record_buffer[HTTP_ACCESS_LOG_RECORD_MAX];
+            if (finish_usecs == 0) {
+                finish_usecs = os::current_time_usecs();
+            }
+            size_t len = finished_request_record(http_conn, finish_usecs, record_buffer, sizeof(record_buffer));
+            if (len > 0) {
+                access_log_sink->log(current_time, record_buffer, len);
+            }
+            return;
+        }
         
         char date_buf[32], addr_buf[32];
         char log_buffer[LOG_BUFFER_SIZE];
         
         // format date
-        time_t current_time = delegate->get_current_time();
         http_date(current_time).to_log_string(date_buf, sizeof(date_buf));
 
         // format address
-        auto http_conn = static_cast<http_server_connection*>(obj);
         socket_addr &addr = http_conn->conn.get_peer_addr();
         if (addr.saddr.sa_family == AF_INET) {
             inet_ntop(addr.saddr.sa_family, (void*)&addr.ip4addr.sin_addr, addr_buf, sizeof(addr_buf));
@@ -1065,13 +1517,76 @@ void http_server::finished_request(protocol_thread_delegate *delegate, protocol_
         std::string request_path(request.request_path.data, request.request_path.length);
         std::string http_version(request.http_version.data, request.http_version.length);
         int status_code = response.status_code;
-        size_t bytes_transferred = 0; // todo
-        snprintf(log_buffer, sizeof(log_buffer) - 1, "%s - %s %s \"%s %s %s\" %d %lu\n",
-                 addr_buf, user.c_str(), date_buf, request_method.c_str(), request_path.c_str(),
-                 http_version.c_str(), status_code, bytes_transferred);
-        log_buffer[sizeof(log_buffer) - 1] = '\0';
-        access_log_thread->log(current_time, log_buffer);
+        size_t bytes_transferred = http_conn->conn.bytes_written - http_conn->request_bytes_written;
+        int len = snprintf(log_buffer, sizeof(log_buffer), "%s - %s %s \"%s %s %s\" %d %lu\n",
+                           addr_buf, user.c_str(), date_buf, request_method.c_str(), request_path.c_str(),
+                           http_version.c_str(), status_code, bytes_transferred);
+        if (len < 0) return;
+        access_log_sink->log(current_time, log_buffer, std::min((size_t)len, sizeof(log_buffer) - 1));
+    }
+}
+
+bool http_server::finished_request_sampled(http_server_connection *http_conn, uint64_t &finish_usecs)
+{
+    auto location = http_conn->handler->location;
+    auto &policy = location ? location->access_log_policy : http_conn->handler->vhost->access_log_policy;
+    if (policy.sample <= 1) {
+        return true;
+    }
+    int status_code = http_conn->response.status_code;
+    if (policy.errors > 0 && (status_code < 200 || status_code >= 400)) {
+        return true;
+    }
+    if (policy.slow_msecs > 0) {
+        finish_usecs = os::current_time_usecs();
+        if (finish_usecs - http_conn->request_start_usecs >= (uint64_t)policy.slow_msecs * 1000) {
+            return true;
+        }
+    }
+    
+    // xorshift so sampling is not correlated with connection or thread
+    static thread_local uint64_t sample_state = 0;
+    if (sample_state == 0) {
+        sample_state = (uint64_t)(uintptr_t)&sample_state ^ os::current_time_usecs();
+        if (sample_state == 0) sample_state = 1;
     }
+    sample_state ^= sample_state << 13;
+    sample_state ^= sample_state >> 7;
+    sample_state ^= sample_state << 17;
+    return sample_state % (uint64_t)policy.sample == 0;
+}
+
+size_t http_server::finished_request_record(http_server_connection *http_conn, uint64_t finish_usecs,
+                                            char *buf, size_t buf_len)
+{
+    auto &request = http_conn->request;
+    uint64_t start_usecs = http_conn->request_start_usecs;
+    uint64_t headers_usecs = std::max(http_conn->request_headers_usecs, start_usecs);
+    uint64_t response_usecs = std::max(http_conn->response_start_usecs, headers_usecs);
+    
+    http_access_log_record hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.time_usecs = start_usecs;
+    hdr.bytes_read = http_conn->conn.bytes_read - http_conn->request_bytes_read;
+    hdr.bytes_written = http_conn->conn.bytes_written - http_conn->request_bytes_written;
+    hdr.header_usecs = (uint32_t)(headers_usecs - start_usecs);
+    hdr.handler_usecs = (uint32_t)(response_usecs - headers_usecs);
+    hdr.total_usecs = (uint32_t)(finish_usecs - start_usecs);
+    hdr.status_code = (uint16_t)http_conn->response.status_code;
+    hdr.set_peer_addr(http_conn->conn.get_peer_addr());
+    
+    const char *referer = request.get_header_string(kHTTPHeaderReferer);
+    const char *user_agent = request.get_header_string(kHTTPHeaderUserAgent);
+    const char *host = request.get_header_string(kHTTPHeaderHost);
+    http_header_string strings[http_access_log_string_count];
+    strings[http_access_log_string_method] = request.request_method;
+    strings[http_access_log_string_uri] = request.request_uri;
+    strings[http_access_log_string_version] = request.http_version;
+    strings[http_access_log_string_referer] = referer ? http_header_string(referer) : http_header_string();
+    strings[http_access_log_string_user_agent] = user_agent ? http_header_string(user_agent) : http_header_string();
+    strings[http_access_log_string_host] = host ? http_header_string(host) : http_header_string();
+    
+    return http_access_log_record::encode(buf, buf_len, hdr, strings);
 }
     
 void http_server::handle_state_waiting(protocol_thread_delegate *delegate, protocol_object *obj)
@@ -1089,7 +1604,9 @@ void http_server::handle_state_lingering_close(protocol_thread_delegate *delegat
 
     buffer.reset();
     io_result result = buffer.buffer_read(conn);
-    if (result.has_error()) {
+    if (result.would_block()) {
+        return;
+    } else if (result.has_error() || result.size() == 0) {
         delegate->remove_events(http_conn);
         close_connection(delegate, http_conn);
     }
@@ -1097,7 +1614,7 @@ void http_server::handle_state_lingering_close(protocol_thread_delegate *delegat
 
 /* http_server messages */
 
-void http_server::router_tls_handshake(protocol_thread_delegate *delegate, protocol_object *obj)
+void http_server::tls_handshake_start(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     auto http_conn = static_cast<http_server_connection*>(obj);
     
@@ -1110,8 +1627,14 @@ void http_server::router_process_headers(protocol_thread_delegate *delegate, pro
     auto http_conn = static_cast<http_server_connection*>(obj);
 
     http_conn->request.reset();
+    http_conn->request_start_usecs = os::current_time_usecs();
+    http_conn->request_bytes_read = http_conn->conn.bytes_read;
+    http_conn->request_bytes_written = http_conn->conn.bytes_written;
     http_conn->state = &connection_state_client_request;
     delegate->add_events(obj, poll_event_in);
+    if (http_conn->request_pending) {
+        get_proto()->handle_connection(delegate, obj, poll_event_in); // parse the buffered request
+    }
 }
 
 void http_server::keepalive_wait_connection(protocol_thread_delegate *delegate, protocol_object *obj)
@@ -1131,23 +1654,42 @@ void http_server::worker_process_request(protocol_thread_delegate *delegate, pro
     if (!http_conn->handler->handle_request()) {
         delegate->log_debug("%s: request handler failed", obj->to_string().c_str());
         abort_connection(delegate, http_conn);
+        return;
     } else if (http_conn->request_has_body) {
         // copy body fragment to start of buffer
         // Note: body_start is stored in the io_buffer not the header_buffer so this results in a memmove
         buffer.set(http_conn->request.body_start.data, http_conn->request.body_start.length);
         http_conn->state = &connection_state_client_body;
         delegate->add_events(obj, poll_event_in);
-    } else if (populate_response_headers(delegate, http_conn) > 0) {
-        // if response has a body then enter connection_state_server_body
-        if (http_conn->response_has_body) {
-            http_conn->state = &connection_state_server_body;
-        } else {
-            http_conn->state = &connection_state_server_response;
+        get_proto()->handle_connection(delegate, obj, poll_event_in); // the body may already be buffered
+        return;
+    }
+    
+    // bytes after the headers are pipelined requests, keep them as the buffer is reused for the response
+    if (http_conn->request.body_start.length > 0) {
+        auto &pipeline_buffer = http_conn->pipeline_buffer;
+        if (pipeline_buffer.size() == 0) {
+            pipeline_buffer.resize(delegate->get_config()->io_buffer_size);
         }
+        pipeline_buffer.set(http_conn->request.body_start.data, http_conn->request.body_start.length);
+    }
+    
+    start_response(delegate, http_conn);
+}
+
+void http_server::worker_resume_connection(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    auto http_conn = static_cast<http_server_connection*>(obj);
+    
+    // a handler that parked its connection has something to do again
+    if (http_conn->state == &connection_state_handler_wait) {
+        start_response(delegate, http_conn);
+    } else if (http_conn->state == &connection_state_client_body) {
+        delegate->add_events(obj, poll_event_in);
+        get_proto()->handle_connection(delegate, obj, poll_event_in);
+    } else if (http_conn->state == &connection_state_server_body) {
         delegate->add_events(obj, poll_event_out);
-    } else {
-        delegate->log_debug("%s: response buffer full", obj->to_string().c_str());
-        abort_connection(delegate, http_conn);
+        get_proto()->handle_connection(delegate, obj, poll_event_out);
     }
 }
 
@@ -1161,6 +1703,21 @@ void http_server::linger_read_connection(protocol_thread_delegate *delegate, pro
     delegate->add_events(obj, poll_event_in);
 }
 
+void http_server::listener_resume(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    const auto &cfg = delegate->get_config();
+    auto server_cfg = cfg->get_config<http_server>();
+    auto pollset = delegate->get_pollset();
+    
+    for (auto &listen : server_cfg->listens) {
+        poll_object listen_obj(server_sock_tcp_listen.type, listen.get(), listen->get_fd());
+        if (!pollset->has_object(listen_obj)) {
+            pollset->add_object(listen_obj, poll_event_in);
+        }
+    }
+    get_engine_state(delegate)->stats.accept_resumes++;
+}
+
 /* http_server internal */
 
 bool http_server::process_request_headers(protocol_thread_delegate *delegate, protocol_object *obj)
@@ -1186,8 +1743,9 @@ bool http_server::process_request_headers(protocol_thread_delegate *delegate, pr
     // TODO - null check on request path dereference
     // TODO - handle authorization
 
-    // lookup handler
+    // lookup handler, a fresh cached response replaces it
     http_conn->handler = translate_path(delegate, http_conn);
+    cache_request(delegate, http_conn);
     http_conn->handler->init();
     http_conn->handler->set_delegate(delegate);
     http_conn->handler->set_connection(http_conn);
@@ -1269,6 +1827,55 @@ http_server_handler_ptr http_server::translate_path(protocol_thread_delegate *de
     return handler;
 }
 
+void http_server::cache_request(protocol_thread_delegate *delegate, http_server_connection *http_conn)
+{
+    auto &request = http_conn->request;
+    auto handler = http_conn->handler;
+    auto cache = get_engine_state(delegate)->cache.get();
+
+    http_conn->cache_store = false;
+    http_conn->cache_invalidate = false;
+    http_conn->cache_key.clear();
+    http_conn->cache_fill = http_server_cache_fill_ptr();
+    if (!cache || !handler->location->cache) {
+        return;
+    }
+
+    // GET responses are stored, HEAD is answered from them and other methods invalidate them
+    HTTPMethod method = http_constants::get_method_type(request.get_request_method());
+    http_conn->cache_key = http_server_cache::make_key(handler->vhost->server_names[0], kHTTPMethodGET,
+                                                       request.get_request_path(), request.get_query_string());
+    if (method != HTTPMethodGET && method != HTTPMethodHEAD) {
+        http_conn->cache_invalidate = true;
+        return;
+    }
+
+    // requests with credentials or a body bypass the cache, no-cache skips the lookup
+    http_server_cache_control cache_control;
+    cache_control.parse(http_server_cache::find_header(request.header_map, kHTTPHeaderCacheControl));
+    const char *pragma_str = http_server_cache::find_header(request.header_map, kHTTPHeaderPragma);
+    if (cache_control.no_store ||
+        http_server_cache::find_header(request.header_map, kHTTPHeaderAuthorization) ||
+        http_server_cache::find_header(request.header_map, kHTTPHeaderContentLength) ||
+        http_server_cache::find_header(request.header_map, kHTTPHeaderTransferEncoding))
+    {
+        return;
+    }
+    http_conn->cache_store = (method == HTTPMethodGET);
+    if (cache_control.no_cache || cache_control.max_age == 0 || (pragma_str && strcasecmp(pragma_str, "no-cache") == 0)) {
+        return;
+    }
+    auto entry = cache->lookup(http_conn->cache_key, request, delegate->get_current_time());
+    if (entry) {
+        auto cache_handler = std::make_shared<http_server_handler_cache>(entry);
+        cache_handler->vhost = handler->vhost;
+        cache_handler->location = handler->location;
+        cache_handler->path_translated = handler->path_translated;
+        http_conn->handler = cache_handler;
+        http_conn->cache_store = false;
+    }
+}
+
 ssize_t http_server::populate_response_headers(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     auto http_conn = static_cast<http_server_connection*>(obj);
@@ -1277,11 +1884,28 @@ ssize_t http_server::populate_response_headers(protocol_thread_delegate *delegat
     if (!http_conn->handler->populate_response()) {
         abort_connection(delegate, http_conn);
     }
+
+    // a response that may be stored is captured as it is written
+    if (http_conn->cache_store) {
+        http_conn->cache_fill = get_engine_state(delegate)->cache->begin_fill(http_conn->cache_key,
+            http_conn->request, http_conn->response, http_conn->handler->location->cache_valid,
+            delegate->get_current_time());
+        http_conn->response.set_header_field("X-Cache", "MISS");
+    }
+    http_conn->response_start_usecs = os::current_time_usecs();
+    
+    // each response starts with small tls records
+    if (http_conn->conn.sock->get_mode() == socket_mode_tls) {
+        static_cast<tls_connected_socket*>(http_conn->conn.sock.get())->reset_record_size();
+    }
     
     // copy headers to io buffer
     buffer.reset();
     ssize_t length = http_conn->response.to_buffer(buffer.data(), buffer.size());
     http_conn->handler->set_header_length(length);
+    if (http_conn->cache_fill) {
+        http_conn->cache_fill->header_skip = length;
+    }
     
     // check headers fit into available buffer space
     if (length < 0) {
@@ -1301,6 +1925,42 @@ ssize_t http_server::populate_response_headers(protocol_thread_delegate *delegat
     return length;
 }
 
+void http_server::start_response(protocol_thread_delegate *delegate, protocol_object *obj)
+{
+    auto http_conn = static_cast<http_server_connection*>(obj);
+    
+    // wait without events until the handler resumes the connection
+    if (!http_conn->handler->response_ready()) {
+        http_conn->state = &connection_state_handler_wait;
+        return;
+    }
+    
+    if (populate_response_headers(delegate, http_conn) > 0) {
+        // if response has a body then enter connection_state_server_body
+        if (http_conn->response_has_body) {
+            http_conn->state = &connection_state_server_body;
+        } else {
+            http_conn->state = &connection_state_server_response;
+        }
+        delegate->add_events(obj, poll_event_out);
+    } else {
+        delegate->log_debug("%s: response buffer full", obj->to_string().c_str());
+        abort_connection(delegate, http_conn);
+    }
+}
+
+io_result http_server::write_response_buffer(http_server_connection *http_conn)
+{
+    // a response being stored is copied as it is written
+    auto &buffer = http_conn->buffer;
+    const char *data = buffer.data() + (buffer.front & buffer.mask);
+    io_result result = buffer.buffer_write(http_conn->conn);
+    if (http_conn->cache_fill && result.size() > 0) {
+        http_conn->cache_fill->write(data, result.size());
+    }
+    return result;
+}
+
 void http_server::dispatch_connection(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     forward_connection(delegate, obj, thread_mask_router, action_router_process_headers);
@@ -1308,7 +1968,44 @@ void http_server::dispatch_connection(protocol_thread_delegate *delegate, protoc
 
 void http_server::dispatch_connection_tls(protocol_thread_delegate *delegate, protocol_object *obj)
 {
-    forward_connection(delegate, obj, thread_mask_router, action_router_tls_handshake);
+    auto http_conn = static_cast<http_server_connection*>(obj);
+    auto engine_state = get_engine_state(delegate);
+    
+    http_conn->handshake_start_usecs = os::current_time_usecs();
+    long queue = ++engine_state->stats.tls_handshake_queue;
+    long queue_max = engine_state->stats.tls_handshake_queue_max;
+    while (queue > queue_max &&
+           !engine_state->stats.tls_handshake_queue_max.compare_exchange_weak(queue_max, queue)) {}
+    
+    // handshake on the tls_handshake threads, or on the routers if none are configured
+    protocol_thread_delegate *destination_thread = delegate->choose_thread(thread_mask_tls_handshake.mask);
+    if (!destination_thread) {
+        destination_thread = delegate->choose_thread(thread_mask_router.mask);
+    }
+    if (destination_thread) {
+        delegate->send_message(destination_thread, protocol_message(action_tls_handshake_start.action, http_conn->conn.get_id()));
+    } else {
+        delegate->log_error("%s: no thread available: %s", obj->to_string().c_str(), thread_mask_tls_handshake.name.c_str());
+        finished_handshake(delegate, http_conn, false);
+        abort_connection(delegate, http_conn);
+    }
+}
+
+void http_server::finished_handshake(protocol_thread_delegate *delegate, http_server_connection *http_conn, bool completed)
+{
+    auto engine_state = get_engine_state(delegate);
+    
+    engine_state->stats.tls_handshake_queue--;
+    if (!completed) {
+        engine_state->stats.tls_handshake_failures++;
+        return;
+    }
+    unsigned long usecs = (unsigned long)(os::current_time_usecs() - http_conn->handshake_start_usecs);
+    engine_state->stats.tls_handshakes++;
+    engine_state->stats.tls_handshake_usecs += usecs;
+    unsigned long usecs_max = engine_state->stats.tls_handshake_usecs_max;
+    while (usecs > usecs_max &&
+           !engine_state->stats.tls_handshake_usecs_max.compare_exchange_weak(usecs_max, usecs)) {}
 }
 
 void http_server::work_connection(protocol_thread_delegate *delegate, protocol_object *obj)
@@ -1321,6 +2018,16 @@ void http_server::keepalive_connection(protocol_thread_delegate *delegate, proto
     auto http_conn = static_cast<http_server_connection*>(obj);
     auto &conn = http_conn->conn;
     auto &buffer = http_conn->buffer;
+    auto &pipeline_buffer = http_conn->pipeline_buffer;
+    
+    // a pipelined request is already buffered so go straight to the router
+    if (pipeline_buffer.bytes_readable() > 0) {
+        buffer.set(pipeline_buffer.pos(), pipeline_buffer.bytes_readable());
+        pipeline_buffer.reset();
+        http_conn->request_pending = true;
+        dispatch_connection(delegate, obj);
+        return;
+    }
     
     buffer.reset();
 #if defined (USE_NODELAY)
@@ -1366,15 +2073,68 @@ void http_server::abort_connection(protocol_thread_delegate *delegate, protocol_
 {
     get_engine_state(delegate)->stats.connections_aborted++;
     get_engine_state(delegate)->abort_connection(delegate->get_engine_delegate(), obj);
+    wake_listeners(delegate);
 }
 
 void http_server::close_connection(protocol_thread_delegate *delegate, protocol_object *obj)
 {
     get_engine_state(delegate)->stats.connections_closed++;
     get_engine_state(delegate)->close_connection(delegate->get_engine_delegate(), obj);
+    wake_listeners(delegate);
 }
 
-void http_server_engine_state::bind_function(config_ptr cfg, std::string path, typename http_server::function_type fn)
+void http_server::pause_listeners(protocol_thread_delegate *delegate, bool fd_exhausted)
+{
+    const auto &cfg = delegate->get_config();
+    auto server_cfg = cfg->get_config<http_server>();
+    auto engine_state = get_engine_state(delegate);
+    auto pollset = delegate->get_pollset();
+    
+    // stop polling the listen sockets on this thread
+    bool paused = false;
+    for (auto &listen : server_cfg->listens) {
+        poll_object listen_obj(server_sock_tcp_listen.type, listen.get(), listen->get_fd());
+        if (pollset->has_object(listen_obj)) {
+            pollset->remove_object(listen_obj);
+            paused = true;
+        }
+    }
+    if (!paused) return;
+    engine_state->stats.accept_pauses++;
+    
+    // queue this thread to be woken when a connection is freed
+    engine_state->listeners_mutex.lock();
+    engine_state->listeners_paused.push_back(delegate);
+    engine_state->listeners_paused_count++;
+    engine_state->listeners_mutex.unlock();
+    
+    // a connection may have been freed before we were queued, a free slot
+    // doesn't mean a free fd so out of fds we wait for a connection to close
+    if (!fd_exhausted && engine_state->has_free_connections()) {
+        wake_listeners(delegate);
+    }
+}
+
+void http_server::wake_listeners(protocol_thread_delegate *delegate)
+{
+    auto engine_state = get_engine_state(delegate);
+    if (engine_state->listeners_paused_count == 0) return;
+    
+    protocol_thread_delegate *listener_thread = nullptr;
+    engine_state->listeners_mutex.lock();
+    if (engine_state->listeners_paused.size() > 0) {
+        listener_thread = engine_state->listeners_paused.back();
+        engine_state->listeners_paused.pop_back();
+        engine_state->listeners_paused_count--;
+    }
+    engine_state->listeners_mutex.unlock();
+    
+    if (listener_thread) {
+        delegate->send_message(listener_thread, protocol_message(action_listener_resume.action, -1));
+    }
+}
+
+void http_server_engine_state::bind_function(config_ptr cfg, std::string path, typename http_server::function_type fn, int cache_valid)
 {
     auto server_cfg = cfg->get_config<http_server>();
     if (server_cfg->vhost_list.size() == 0) {
@@ -1382,12 +2142,24 @@ void http_server_engine_state::bind_function(config_ptr cfg, std::string path, t
     }
     auto default_vhost = server_cfg->vhost_list[0];
     
-    // bind function to location in default vhost
+    // bind function to location in default vhost, a configured location keeps its settings
     std::string handler_name = std::string("bind_function(") + path + std::string(")");
-    auto bind_location = std::make_shared<http_server_location>(default_vhost.get());
-    bind_location->uri = path;
-    bind_location->root = cfg->root;
+    http_server_location_ptr bind_location;
+    for (auto &location : default_vhost->location_list) {
+        if (location->uri == path) {
+            bind_location = location;
+        }
+    }
+    if (!bind_location) {
+        bind_location = std::make_shared<http_server_location>(default_vhost.get());
+        bind_location->uri = path;
+        bind_location->root = cfg->root;
+        default_vhost->location_list.push_back(bind_location);
+    }
     bind_location->handler = handler_name;
     bind_location->handler_factory = std::make_shared<http_server_handler_factory_func>(handler_name, fn);
-    default_vhost->location_list.push_back(bind_location);
+    if (cache_valid > 0) {
+        bind_location->cache = true;
+        bind_location->cache_valid = cache_valid;
+    }
 }
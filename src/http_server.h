@@ -28,12 +28,21 @@ typedef std::vector<http_server_location_ptr> http_server_location_list;
 typedef trie<http_server_location*> http_server_location_trie;
 
 struct http_server_vhost;
-typedef std::pair<socket_addr,socket_mode> http_server_listen_spec;
+typedef std::tuple<socket_addr,socket_mode,socket_listen_options> http_server_listen_spec;
 typedef std::shared_ptr<http_server_vhost> http_server_vhost_ptr;
 typedef std::vector<http_server_vhost_ptr> http_server_vhost_list;
 typedef std::map<std::string,http_server_vhost*> http_server_vhost_map;
 typedef std::pair<std::string,http_server_vhost*> http_server_vhost_entry;
 
+struct http_server_upstream;
+typedef std::shared_ptr<http_server_upstream> http_server_upstream_ptr;
+typedef std::map<std::string,http_server_upstream_ptr> http_server_upstream_map;
+
+struct http_server_cache;
+typedef std::shared_ptr<http_server_cache> http_server_cache_ptr;
+struct http_server_cache_fill;
+typedef std::shared_ptr<http_server_cache_fill> http_server_cache_fill_ptr;
+
 struct http_server_config;
 
 
@@ -79,6 +88,7 @@ struct http_server_handler
     virtual void init() = 0;
     virtual bool handle_request() = 0;
     virtual io_result read_request_body() = 0;
+    virtual bool response_ready() { return true; }     /* false parks the connection until resumed */
     virtual bool populate_response() = 0;
     virtual io_result write_response_body() = 0;
     virtual bool end_request() = 0;
@@ -91,15 +101,25 @@ struct http_server_connection : protocol_object
 {
     connection                  conn;
     io_ring_buffer              buffer;
+    io_buffer                   pipeline_buffer;    /* pipelined requests read with the current one */
     protocol_state              *state;
     http_request                request;
     http_response               response;
     http_server_handler_ptr     handler;
     unsigned int                request_has_body : 1;
     unsigned int                response_has_body : 1;
+    unsigned int                request_pending : 1;    /* buffer holds unparsed pipelined request bytes */
     unsigned int                connection_close : 1;
-
-    // TODO add stats
+    unsigned int                cache_store : 1;        /* the response may be stored under cache_key */
+    unsigned int                cache_invalidate : 1;   /* a successful response invalidates cache_key */
+    std::string                 cache_key;
+    http_server_cache_fill_ptr  cache_fill;
+    uint64_t                    handshake_start_usecs;
+    uint64_t                    request_start_usecs;
+    uint64_t                    request_headers_usecs;
+    uint64_t                    response_start_usecs;
+    uint64_t                    request_bytes_read;
+    uint64_t                    request_bytes_written;
 
     http_server_connection() : state(nullptr) {}
     http_server_connection(const http_server_connection&) : state(nullptr) {}
@@ -111,6 +131,20 @@ struct http_server_connection : protocol_object
 };
 
 
+/* http_server_log_policy */
+
+struct http_server_log_policy
+{
+    int                                         sample;         /* log 1 in sample requests, 0 if unset */
+    int                                         slow_msecs;     /* always log slower requests, 0 is off, -1 if unset */
+    int                                         errors;         /* always log non 2xx/3xx responses, -1 if unset */
+    
+    http_server_log_policy() : sample(0), slow_msecs(-1), errors(-1) {}
+    
+    void inherit(const http_server_log_policy &parent);
+};
+
+
 /* http_server_location */
 
 struct http_server_location
@@ -118,13 +152,19 @@ struct http_server_location
     http_server_vhost*                          vhost;
     
     http_server_location() = delete;
-    http_server_location(http_server_vhost *vhost) : vhost(vhost) {}
+    http_server_location(http_server_vhost *vhost) : vhost(vhost), cache(false), cache_valid(0) {}
     
     std::string                                 uri;
     std::string                                 root;
     std::string                                 handler;
     std::vector<std::string>                    index_files;
+    http_server_log_policy                      access_log_policy;
     http_server_handler_factory_ptr             handler_factory;
+    std::string                                 proxy_pass;
+    std::string                                 proxy_uri;      /* replaces the location uri, empty to pass it unchanged */
+    http_server_upstream_ptr                    upstream;
+    bool                                        cache;
+    int                                         cache_valid;    /* seconds for responses without Cache-Control or Expires */
 };
 
 
@@ -135,23 +175,26 @@ struct http_server_vhost
     http_server_config*                         server_cfg;
     
     http_server_vhost() = delete;
-    http_server_vhost(http_server_config *server_cfg) : server_cfg(server_cfg), ssl_ctx(nullptr) {}
+    http_server_vhost(http_server_config *server_cfg) : server_cfg(server_cfg), tls_prefer_server_ciphers(-1), ssl_ctx(nullptr), access_log_binary(false) {}
     
     std::vector<http_server_listen_spec>        listens;
     std::vector<std::string>                    server_names;
     std::string                                 access_log;
+    std::string                                 access_log_format;
+    http_server_log_policy                      access_log_policy;
     std::string                                 error_log;
     std::string                                 tls_key_file;
     std::string                                 tls_cert_file;
     std::string                                 tls_cipher_list;
+    std::string                                 tls_curves;
+    int                                         tls_prefer_server_ciphers;  /* -1 if unset */
     http_server_location_list                   location_list;
     SSL_CTX*                                    ssl_ctx;
     
     http_server_location_trie                   location_trie;
-    io_file                                     access_log_file;
-    log_thread_ptr                              access_log_thread;
-    io_file                                     error_log_file;
-    log_thread_ptr                              error_log_thread;
+    log_sink_ptr                                access_log_sink;
+    bool                                        access_log_binary;
+    log_sink_ptr                                error_log_sink;
 };
 
 
@@ -161,12 +204,16 @@ struct http_server_config : protocol_config
 {
     http_server_vhost_ptr                       current_vhost;
     http_server_location_ptr                    current_location;
+    http_server_upstream_ptr                    current_upstream;
     
     http_server_vhost_list                      vhost_list;
     http_server_vhost_map                       vhost_map;
+    http_server_upstream_map                    upstream_map;
 
     connected_socket_list                       listens;
+    std::vector<connected_socket*>              listens_by_fd;
     SSL_CTX*                                    ssl_ctx;
+    log_writer_pool_ptr                         log_pool;
 
     http_server_config();
     
@@ -188,14 +235,17 @@ struct http_server : protocol
     static protocol_sock server_sock_tcp_connection;
     
     /* actions */
-    static protocol_action action_router_tls_handshake;
+    static protocol_action action_tls_handshake_start;
     static protocol_action action_router_process_headers;
     static protocol_action action_worker_process_request;
     static protocol_action action_keepalive_wait_connection;
     static protocol_action action_linger_read_connection;
+    static protocol_action action_listener_resume;
+    static protocol_action action_worker_resume_connection;
     
     /* threads */
     static protocol_mask thread_mask_listener;
+    static protocol_mask thread_mask_tls_handshake;
     static protocol_mask thread_mask_router;
     static protocol_mask thread_mask_keepalive;
     static protocol_mask thread_mask_worker;
@@ -207,6 +257,7 @@ struct http_server : protocol
     static protocol_state connection_state_client_body;
     static protocol_state connection_state_server_response;
     static protocol_state connection_state_server_body;
+    static protocol_state connection_state_handler_wait;
     static protocol_state connection_state_waiting;
     static protocol_state connection_state_lingering_close;
 
@@ -263,11 +314,13 @@ struct http_server : protocol
 
     /* http_server messages */
     
-    static void router_tls_handshake(protocol_thread_delegate *, protocol_object *);
+    static void tls_handshake_start(protocol_thread_delegate *, protocol_object *);
     static void router_process_headers(protocol_thread_delegate *, protocol_object *);
     static void keepalive_wait_connection(protocol_thread_delegate *, protocol_object *);
     static void worker_process_request(protocol_thread_delegate *, protocol_object *);
     static void linger_read_connection(protocol_thread_delegate *, protocol_object *);
+    static void listener_resume(protocol_thread_delegate *, protocol_object *);
+    static void worker_resume_connection(protocol_thread_delegate *, protocol_object *);
 
     /* http_server state handlers */
 
@@ -284,14 +337,22 @@ struct http_server : protocol
     static bool process_request_headers(protocol_thread_delegate *, protocol_object *);
     static http_server_vhost* lookup_vhost(config *cfg, const char *host_name);
     static http_server_handler_ptr translate_path(protocol_thread_delegate *, http_server_connection *);
+    static void cache_request(protocol_thread_delegate *, http_server_connection *);
     static ssize_t populate_response_headers(protocol_thread_delegate *, protocol_object *);
+    static void start_response(protocol_thread_delegate *, protocol_object *);
+    static io_result write_response_buffer(http_server_connection *);
     static void finished_request(protocol_thread_delegate *, protocol_object *);
+    static bool finished_request_sampled(http_server_connection *, uint64_t &finish_usecs);
+    static size_t finished_request_record(http_server_connection *, uint64_t finish_usecs, char *buf, size_t buf_len);
     static void dispatch_connection(protocol_thread_delegate *, protocol_object *);
     static void dispatch_connection_tls(protocol_thread_delegate *, protocol_object *);
+    static void finished_handshake(protocol_thread_delegate *, http_server_connection *, bool completed);
     static void work_connection(protocol_thread_delegate *, protocol_object *);
     static void keepalive_connection(protocol_thread_delegate *, protocol_object *);
     static void linger_connection(protocol_thread_delegate *, protocol_object *);
     static void forward_connection(protocol_thread_delegate*, protocol_object *, const protocol_mask &proto_mask, const protocol_action &proto_action);
+    static void pause_listeners(protocol_thread_delegate *, bool fd_exhausted = false);
+    static void wake_listeners(protocol_thread_delegate *);
     static http_server_connection* new_connection(protocol_thread_delegate *);
     static http_server_connection* get_connection(protocol_thread_delegate *, int conn_id);
     static void abort_connection(protocol_thread_delegate*, protocol_object *);
@@ -309,7 +370,19 @@ struct http_server_engine_stats
         connections_closed(0),
         connections_keepalive(0),
         connections_linger(0),
-        requests_processed(0) {}
+        requests_processed(0),
+        requests_unlogged(0),
+        tls_ktls(0),
+        tls_handshakes(0),
+        tls_handshake_failures(0),
+        tls_handshake_usecs(0),
+        tls_handshake_usecs_max(0),
+        tls_handshake_queue(0),
+        tls_handshake_queue_max(0),
+        accept_bursts(0),
+        accept_burst_max(0),
+        accept_pauses(0),
+        accept_resumes(0) {}
     
     std::atomic<unsigned long> connections_accepted;
     std::atomic<unsigned long> connections_aborted;
@@ -317,6 +390,18 @@ struct http_server_engine_stats
     std::atomic<unsigned long> connections_keepalive;
     std::atomic<unsigned long> connections_linger;
     std::atomic<unsigned long> requests_processed;
+    std::atomic<unsigned long> requests_unlogged;
+    std::atomic<unsigned long> tls_ktls;
+    std::atomic<unsigned long> tls_handshakes;
+    std::atomic<unsigned long> tls_handshake_failures;
+    std::atomic<unsigned long> tls_handshake_usecs;       /* total, accept to handshake complete */
+    std::atomic<unsigned long> tls_handshake_usecs_max;
+    std::atomic<long> tls_handshake_queue;                /* connections accepted and not yet handshaken */
+    std::atomic<long> tls_handshake_queue_max;
+    std::atomic<unsigned long> accept_bursts;
+    std::atomic<unsigned long> accept_burst_max;
+    std::atomic<unsigned long> accept_pauses;
+    std::atomic<unsigned long> accept_resumes;
 };
 
 /* http_server_engine_state */
@@ -325,12 +410,16 @@ struct http_server_engine_state : protocol_engine_state, protocol_connection_sta
 {
     config_ptr                                  cfg;
     http_server_engine_stats                    stats;
+    std::mutex                                  listeners_mutex;
+    std::vector<protocol_thread_delegate*>      listeners_paused;
+    std::atomic<int>                            listeners_paused_count;
+    http_server_cache_ptr                       cache;              /* created when a location has cache on */
     
-    http_server_engine_state(config_ptr cfg) : cfg(cfg) {}
+    http_server_engine_state(config_ptr cfg) : cfg(cfg), listeners_paused_count(0) {}
     
     protocol* get_proto() const { return http_server::get_proto(); }
     
-    void bind_function(config_ptr cfg, std::string path, typename http_server::function_type);
+    void bind_function(config_ptr cfg, std::string path, typename http_server::function_type, int cache_valid = 0);
 };
 
 #endif
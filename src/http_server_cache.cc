@@ -0,0 +1,506 @@
+//
+//  http_server_cache.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "io.h"
+#include "url.h"
+#include "log.h"
+#include "log_thread.h"
+#include "trie.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_date.h"
+#include "http_server.h"
+#include "http_server_cache.h"
+
+
+/* hop-by-hop and per-response headers are not stored */
+
+static const char* http_server_cache_skip[] = {
+    kHTTPHeaderConnection, "Keep-Alive", "Proxy-Connection", kHTTPHeaderTransferEncoding,
+    kHTTPHeaderDate, kHTTPHeaderServer, kHTTPHeaderAge, "X-Cache", nullptr
+};
+
+static bool http_server_cache_skip_header(const http_header_string &name)
+{
+    for (const char **skip = http_server_cache_skip; *skip; skip++) {
+        if (strlen(*skip) == name.length && strncasecmp(*skip, name.data, name.length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool http_server_cache_token(const char *token, size_t len, const char *name)
+{
+    return strlen(name) == len && strncasecmp(token, name, len) == 0;
+}
+
+
+/* http_server_cache_control */
+
+void http_server_cache_control::parse(const char *str)
+{
+    // comma separated directives, some with a value e.g. max-age=60
+    const char *p = str;
+    while (p && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != '=' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = p - name;
+        while (*p == ' ' || *p == '\t') p++;
+        long value = -1;
+        if (*p == '=') {
+            p++;
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p == '"') {
+                // quoted field lists e.g. no-cache="Set-Cookie" are treated as unqualified
+                const char *quote_end = strchr(p + 1, '"');
+                if (isdigit(p[1])) value = strtol(p + 1, nullptr, 10);
+                p = quote_end ? quote_end + 1 : p + strlen(p);
+            } else if (isdigit(*p)) {
+                value = strtol(p, nullptr, 10);
+            }
+            while (*p && *p != ',') p++;
+        }
+        if (http_server_cache_token(name, name_len, "no-store")) {
+            no_store = true;
+        } else if (http_server_cache_token(name, name_len, "no-cache")) {
+            no_cache = true;
+        } else if (http_server_cache_token(name, name_len, "private")) {
+            is_private = true;
+        } else if (http_server_cache_token(name, name_len, "max-age") && value >= 0) {
+            max_age = value;
+        } else if (http_server_cache_token(name, name_len, "s-maxage") && value >= 0) {
+            s_maxage = value;
+        }
+    }
+}
+
+
+/* http_server_cache_entry */
+
+size_t http_server_cache_entry::size() const
+{
+    size_t total = sizeof(http_server_cache_entry) + key.length() + reason_phrase.length() + body.length();
+    for (auto &header : headers) {
+        total += header.first.length() + header.second.length();
+    }
+    for (auto &header : vary) {
+        total += header.first.length() + header.second.length();
+    }
+    return total;
+}
+
+const char* http_server_cache_entry::get_header(const char *name) const
+{
+    for (auto &header : headers) {
+        if (strcasecmp(header.first.c_str(), name) == 0) {
+            return header.second.c_str();
+        }
+    }
+    return nullptr;
+}
+
+bool http_server_cache_entry::matches(const http_request &request) const
+{
+    for (auto &header : vary) {
+        const char *value = http_server_cache::find_header(request.header_map, header.first.c_str());
+        if (header.second != (value ? value : "")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* http_server_cache_fill */
+
+void http_server_cache_fill::write(const char *data, size_t len)
+{
+    if (header_skip > 0) {
+        size_t skip = std::min(header_skip, len);
+        header_skip -= skip;
+        data += skip;
+        len -= skip;
+    }
+    if (len == 0 || overflow) {
+        return;
+    }
+    if (entry->body.length() + len > content_length) {
+        overflow = true;
+        return;
+    }
+    entry->body.append(data, len);
+}
+
+
+/* http_server_cache */
+
+http_server_cache::http_server_cache(size_t max_size, size_t max_entry_size) :
+    max_size(max_size),
+    shard_size(std::max(max_size / HTTP_SERVER_CACHE_SHARDS, (size_t)1)),
+    max_entry_size(std::min(max_entry_size, shard_size)),
+    hits(0), misses(0), stores(0), evictions(0), expirations(0), invalidations(0) {}
+
+std::string http_server_cache::normalize_path(const char *path)
+{
+    // decode escaped unreserved characters and upper case the remaining escapes
+    static const char *hex_digits = "0123456789ABCDEF";
+    std::string normalized;
+    for (const char *p = path; *p; p++) {
+        if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            int c = (int)strtol(std::string(p + 1, 2).c_str(), nullptr, 16);
+            if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+                normalized.push_back((char)c);
+            } else {
+                normalized.push_back('%');
+                normalized.push_back(hex_digits[c >> 4]);
+                normalized.push_back(hex_digits[c & 0xf]);
+            }
+            p += 2;
+        } else {
+            normalized.push_back(*p);
+        }
+    }
+
+    // decoding can expose dot segments so sanitize again
+    std::vector<char> buf(normalized.begin(), normalized.end());
+    buf.push_back('\0');
+    if (http_common::sanitize_path(buf.data()) < 0) {
+        return path;
+    }
+    return buf.data();
+}
+
+std::string http_server_cache::make_key(std::string vhost, const char *method, const char *path, const char *query)
+{
+    std::string key = vhost + " " + method + " " + normalize_path(path);
+    if (query && *query) {
+        key = key + "?" + query;
+    }
+    return key;
+}
+
+const char* http_server_cache::find_header(const http_header_map &header_map, const char *name)
+{
+    // header names keep the case they were sent with
+    size_t name_len = strlen(name);
+    auto hi = header_map.find(http_header_string(name, name_len));
+    if (hi != header_map.end()) {
+        return hi->second.data;
+    }
+    for (auto &header : header_map) {
+        if (header.first.length == name_len && strncasecmp(header.first.data, name, name_len) == 0) {
+            return header.second.data;
+        }
+    }
+    return nullptr;
+}
+
+time_t http_server_cache::freshness_lifetime(const http_response &response, int cache_valid, time_t now)
+{
+    // explicit freshness from the upstream or handler wins over cache_valid
+    http_server_cache_control cache_control;
+    cache_control.parse(find_header(response.header_map, kHTTPHeaderCacheControl));
+    if (cache_control.no_store || cache_control.no_cache || cache_control.is_private) {
+        return 0;
+    } else if (cache_control.s_maxage >= 0) {
+        return cache_control.s_maxage;
+    } else if (cache_control.max_age >= 0) {
+        return cache_control.max_age;
+    }
+    const char *expires_str = find_header(response.header_map, kHTTPHeaderExpires);
+    if (expires_str) {
+        const char *date_str = find_header(response.header_map, kHTTPHeaderDate);
+        time_t date = date_str ? http_date(date_str).tod : 0;
+        if (date <= 0) {
+            date = now;
+        }
+        return std::max(http_date(expires_str).tod - date, (time_t)0);
+    }
+    switch (response.get_status_code()) {
+        case HTTPStatusCodeOK:
+        case HTTPStatusCodeNonAuthoritativeInformation:
+        case HTTPStatusCodeMovedPermanently:
+            return cache_valid;
+        default:
+            return 0;
+    }
+}
+
+http_server_cache_shard& http_server_cache::get_shard(const std::string &key)
+{
+    return shards[std::hash<std::string>()(key) % HTTP_SERVER_CACHE_SHARDS];
+}
+
+http_server_cache_entry_ptr http_server_cache::lookup(const std::string &key, const http_request &request, time_t now)
+{
+    auto &shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto ii = shard.items.find(key);
+    if (ii != shard.items.end()) {
+        auto &item = ii->second;
+        for (auto vi = item.variants.begin(); vi != item.variants.end(); vi++) {
+            if (!(*vi)->matches(request)) {
+                continue;
+            }
+            if (now >= (*vi)->expires) {
+                // stale variants are dropped when they are next requested
+                size_t entry_size = (*vi)->size();
+                item.size -= entry_size;
+                shard.size -= entry_size;
+                if (item.is_protected) {
+                    shard.protected_size -= entry_size;
+                }
+                item.variants.erase(vi);
+                if (item.variants.size() == 0) {
+                    remove(shard, item);
+                }
+                expirations++;
+                break;
+            }
+            touch(shard, item);
+            hits++;
+            return *vi;
+        }
+    }
+    misses++;
+    return http_server_cache_entry_ptr();
+}
+
+http_server_cache_fill_ptr http_server_cache::begin_fill(const std::string &key, const http_request &request,
+                                                         const http_response &response, int cache_valid, time_t now)
+{
+    switch (response.get_status_code()) {
+        case HTTPStatusCodeOK:
+        case HTTPStatusCodeNonAuthoritativeInformation:
+        case HTTPStatusCodeMovedPermanently:
+        case HTTPStatusCodeNotFound:
+        case HTTPStatusCodeGone:
+            break;
+        default:
+            return http_server_cache_fill_ptr();
+    }
+
+    // the body is captured up to its length so it must have one
+    const char *length_str = find_header(response.header_map, kHTTPHeaderContentLength);
+    char *length_end = nullptr;
+    size_t content_length = length_str ? strtoull(length_str, &length_end, 10) : 0;
+    if (!length_str || length_end == length_str || content_length > max_entry_size ||
+        find_header(response.header_map, kHTTPHeaderSetCookie))
+    {
+        return http_server_cache_fill_ptr();
+    }
+    const char *age_str = find_header(response.header_map, kHTTPHeaderAge);
+    time_t initial_age = age_str ? std::max(atol(age_str), 0L) : 0;
+    time_t lifetime = freshness_lifetime(response, cache_valid, now);
+    if (lifetime <= initial_age) {
+        return http_server_cache_fill_ptr();
+    }
+
+    // record the request headers named by Vary, Vary: * matches no later request
+    auto entry = std::make_shared<http_server_cache_entry>();
+    const char *p = find_header(response.header_map, kHTTPHeaderVary);
+    while (p && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ' ' && *p != '\t') p++;
+        if (p == name) {
+            continue;
+        }
+        std::string vary_name(name, p - name);
+        if (vary_name == "*") {
+            return http_server_cache_fill_ptr();
+        }
+        const char *value = find_header(request.header_map, vary_name.c_str());
+        entry->vary.push_back(std::pair<std::string,std::string>(vary_name, value ? value : ""));
+    }
+
+    entry->key = key;
+    entry->status_code = response.get_status_code();
+    entry->reason_phrase = response.get_reason_phrase() ? response.get_reason_phrase() : "";
+    for (auto &header : response.header_list) {
+        if (!http_server_cache_skip_header(header.first)) {
+            entry->headers.push_back(std::pair<std::string,std::string>(
+                std::string(header.first.data, header.first.length),
+                std::string(header.second.data, header.second.length)));
+        }
+    }
+    entry->body.reserve(content_length);
+    entry->stored_time = now;
+    entry->expires = now + lifetime - initial_age;
+    entry->initial_age = initial_age;
+
+    auto fill = std::make_shared<http_server_cache_fill>();
+    fill->entry = entry;
+    fill->content_length = content_length;
+    return fill;
+}
+
+void http_server_cache::store(http_server_cache_entry_ptr entry)
+{
+    size_t entry_size = entry->size();
+    if (entry_size > shard_size) {
+        return;
+    }
+    auto &shard = get_shard(entry->key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    http_server_cache_item *item;
+    auto ii = shard.items.find(entry->key);
+    if (ii == shard.items.end()) {
+        item = &shard.items[entry->key];
+        item->key = entry->key;
+        shard.probation.push_front(item);
+        item->lru_pos = shard.probation.begin();
+    } else {
+        // a response replaces the variant stored for the same request headers or else the oldest
+        item = &ii->second;
+        auto vi = std::find_if(item->variants.begin(), item->variants.end(),
+                               [&] (const http_server_cache_entry_ptr &variant) { return variant->vary == entry->vary; });
+        if (vi == item->variants.end() && item->variants.size() >= HTTP_SERVER_CACHE_VARIANTS_MAX) {
+            vi = item->variants.begin();
+        }
+        if (vi != item->variants.end()) {
+            size_t old_size = (*vi)->size();
+            item->size -= old_size;
+            shard.size -= old_size;
+            if (item->is_protected) {
+                shard.protected_size -= old_size;
+            }
+            item->variants.erase(vi);
+        }
+    }
+    item->variants.push_back(entry);
+    item->size += entry_size;
+    shard.size += entry_size;
+    if (item->is_protected) {
+        shard.protected_size += entry_size;
+    }
+    stores++;
+    evict(shard);
+}
+
+void http_server_cache::invalidate(const std::string &key)
+{
+    auto &shard = get_shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto ii = shard.items.find(key);
+    if (ii != shard.items.end()) {
+        remove(shard, ii->second);
+        invalidations++;
+    }
+}
+
+size_t http_server_cache::entries()
+{
+    size_t total = 0;
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto &ent : shard.items) {
+            total += ent.second.variants.size();
+        }
+    }
+    return total;
+}
+
+size_t http_server_cache::bytes()
+{
+    size_t total = 0;
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total += shard.size;
+    }
+    return total;
+}
+
+void http_server_cache::touch(http_server_cache_shard &shard, http_server_cache_item &item)
+{
+    if (item.is_protected) {
+        shard.protected_lru.splice(shard.protected_lru.begin(), shard.protected_lru, item.lru_pos);
+        return;
+    }
+
+    // a hit promotes a key from probation, demoting the oldest protected keys when over its share
+    shard.probation.erase(item.lru_pos);
+    shard.protected_lru.push_front(&item);
+    item.lru_pos = shard.protected_lru.begin();
+    item.is_protected = true;
+    shard.protected_size += item.size;
+    size_t protected_max = shard_size / 100 * HTTP_SERVER_CACHE_PROTECTED_PERCENT;
+    while (shard.protected_size > protected_max && shard.protected_lru.size() > 1) {
+        auto demoted = shard.protected_lru.back();
+        shard.protected_lru.pop_back();
+        shard.protected_size -= demoted->size;
+        demoted->is_protected = false;
+        shard.probation.push_front(demoted);
+        demoted->lru_pos = shard.probation.begin();
+    }
+}
+
+void http_server_cache::evict(http_server_cache_shard &shard)
+{
+    while (shard.size > shard_size) {
+        auto &lru = shard.probation.size() > 0 ? shard.probation : shard.protected_lru;
+        if (lru.size() == 0) {
+            break;
+        }
+        remove(shard, *lru.back());
+        evictions++;
+    }
+}
+
+void http_server_cache::remove(http_server_cache_shard &shard, http_server_cache_item &item)
+{
+    shard.size -= item.size;
+    if (item.is_protected) {
+        shard.protected_size -= item.size;
+        shard.protected_lru.erase(item.lru_pos);
+    } else {
+        shard.probation.erase(item.lru_pos);
+    }
+    std::string key = item.key;
+    shard.items.erase(key);
+}
@@ -0,0 +1,158 @@
+//
+//  http_server_cache.h
+//
+
+#ifndef http_server_cache_h
+#define http_server_cache_h
+
+#define HTTP_SERVER_CACHE_SHARDS            16
+#define HTTP_SERVER_CACHE_PROTECTED_PERCENT 80      /* share of a shard kept for keys hit since they were stored */
+#define HTTP_SERVER_CACHE_VARIANTS_MAX      8       /* Vary variants kept per key */
+
+struct http_server_cache_entry;
+typedef std::shared_ptr<const http_server_cache_entry> http_server_cache_entry_ptr;
+typedef std::vector<std::pair<std::string,std::string>> http_server_cache_header_list;
+
+
+/* http_server_cache_control */
+
+struct http_server_cache_control
+{
+    bool                                        no_store;
+    bool                                        no_cache;
+    bool                                        is_private;
+    long                                        max_age;            /* -1 if absent */
+    long                                        s_maxage;           /* -1 if absent */
+
+    http_server_cache_control() : no_store(false), no_cache(false), is_private(false), max_age(-1), s_maxage(-1) {}
+
+    void parse(const char *str);
+};
+
+
+/*
+ * http_server_cache_entry
+ *
+ * A complete response, headers and body. Entries are immutable once stored
+ * and connections writing a hit hold a reference, so eviction and expiry
+ * never wait for a slow client.
+ */
+
+struct http_server_cache_entry
+{
+    std::string                                 key;
+    http_server_cache_header_list               vary;               /* request headers this variant was stored for */
+    int                                         status_code;
+    std::string                                 reason_phrase;
+    http_server_cache_header_list               headers;
+    std::string                                 body;
+    time_t                                      stored_time;
+    time_t                                      expires;
+    time_t                                      initial_age;        /* Age sent with the response */
+
+    http_server_cache_entry() : status_code(0), stored_time(0), expires(0), initial_age(0) {}
+
+    size_t size() const;
+    time_t age(time_t now) const { return initial_age + std::max(now - stored_time, (time_t)0); }
+    const char* get_header(const char *name) const;
+    bool matches(const http_request &request) const;
+};
+
+
+/*
+ * http_server_cache_fill
+ *
+ * A response being captured as it is written to the client. The header
+ * bytes written first are skipped and a body longer than its Content-Length
+ * is not stored.
+ */
+
+struct http_server_cache_fill
+{
+    std::shared_ptr<http_server_cache_entry>    entry;
+    size_t                                      header_skip;
+    size_t                                      content_length;
+    bool                                        overflow;
+
+    http_server_cache_fill() : header_skip(0), content_length(0), overflow(false) {}
+
+    void write(const char *data, size_t len);
+    bool complete() const { return !overflow && entry->body.size() == content_length; }
+};
+
+
+/*
+ * http_server_cache
+ *
+ * Responses shared by all connections of an engine, keyed by vhost, method
+ * and normalized path with a variant per distinct value of the headers
+ * named by Vary. Keys are spread over shards with their own mutex.
+ *
+ * Each shard is a segmented LRU bounded by its share of cache_size. New
+ * keys enter probation and a hit moves them to the protected segment, which
+ * holds at most HTTP_SERVER_CACHE_PROTECTED_PERCENT of the shard and demotes
+ * its least recently used keys back to probation. Eviction takes probation
+ * first so a scan of keys requested once doesn't flush frequently hit ones.
+ */
+
+struct http_server_cache_item;
+typedef std::list<http_server_cache_item*> http_server_cache_lru;
+
+struct http_server_cache_item
+{
+    std::string                                 key;
+    std::vector<http_server_cache_entry_ptr>    variants;
+    size_t                                      size;
+    bool                                        is_protected;
+    http_server_cache_lru::iterator             lru_pos;
+
+    http_server_cache_item() : size(0), is_protected(false) {}
+};
+
+struct http_server_cache_shard
+{
+    std::mutex                                  mutex;
+    std::unordered_map<std::string,http_server_cache_item> items;
+    http_server_cache_lru                       probation;
+    http_server_cache_lru                       protected_lru;
+    size_t                                      size;
+    size_t                                      protected_size;
+
+    http_server_cache_shard() : size(0), protected_size(0) {}
+};
+
+struct http_server_cache
+{
+    size_t                                      max_size;
+    size_t                                      shard_size;
+    size_t                                      max_entry_size;
+    http_server_cache_shard                     shards[HTTP_SERVER_CACHE_SHARDS];
+    std::atomic<unsigned long>                  hits;
+    std::atomic<unsigned long>                  misses;
+    std::atomic<unsigned long>                  stores;
+    std::atomic<unsigned long>                  evictions;
+    std::atomic<unsigned long>                  expirations;
+    std::atomic<unsigned long>                  invalidations;
+
+    http_server_cache(size_t max_size, size_t max_entry_size);
+
+    static std::string normalize_path(const char *path);
+    static std::string make_key(std::string vhost, const char *method, const char *path, const char *query);
+    static const char* find_header(const http_header_map &header_map, const char *name);
+    static time_t freshness_lifetime(const http_response &response, int cache_valid, time_t now);
+
+    http_server_cache_entry_ptr lookup(const std::string &key, const http_request &request, time_t now);
+    http_server_cache_fill_ptr begin_fill(const std::string &key, const http_request &request,
+                                          const http_response &response, int cache_valid, time_t now);
+    void store(http_server_cache_entry_ptr entry);
+    void invalidate(const std::string &key);
+    size_t entries();
+    size_t bytes();
+
+    http_server_cache_shard& get_shard(const std::string &key);
+    void touch(http_server_cache_shard &shard, http_server_cache_item &item);
+    void evict(http_server_cache_shard &shard);
+    void remove(http_server_cache_shard &shard, http_server_cache_item &item);
+};
+
+#endif
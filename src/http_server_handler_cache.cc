@@ -0,0 +1,217 @@
+//
+//  http_server_handler_cache.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "io.h"
+#include "url.h"
+#include "log.h"
+#include "log_thread.h"
+#include "trie.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_date.h"
+#include "http_server.h"
+#include "http_server_cache.h"
+#include "http_server_handler_cache.h"
+
+
+/* http_server_handler_cache */
+
+static bool etag_list_matches(const char *list_str, const char *etag_str)
+{
+    // weak comparison of each entity tag in a comma separated list
+    if (etag_str && strncmp(etag_str, "W/", 2) == 0) etag_str += 2;
+    const char *p = list_str;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p) break;
+        const char *tag = p;
+        if (*p == '*') {
+            p++;
+        } else {
+            if (strncmp(p, "W/", 2) == 0) tag = p += 2;
+            if (*p == '"') {
+                p = strchr(p + 1, '"');
+                p = p ? p + 1 : tag + strlen(tag);
+            } else {
+                while (*p && *p != ',' && *p != ' ' && *p != '\t') p++;
+            }
+        }
+        size_t tag_len = p - tag;
+        if (tag_len == 1 && *tag == '*') return true;
+        if (etag_str && tag_len == strlen(etag_str) && strncmp(tag, etag_str, tag_len) == 0) return true;
+        while (*p && *p != ',') p++;
+    }
+    return false;
+}
+
+http_server_handler_cache::http_server_handler_cache(http_server_cache_entry_ptr entry) : entry(entry) {}
+
+http_server_handler_cache::~http_server_handler_cache() {}
+
+void http_server_handler_cache::init()
+{
+    status_code = 0;
+    total_written = 0;
+}
+
+bool http_server_handler_cache::handle_request()
+{
+    // get request http version and request method
+    http_version = http_constants::get_version_type(http_conn->request.get_http_version());
+    request_method = http_constants::get_method_type(http_conn->request.get_request_method());
+
+    // conditional requests are answered from the stored validators
+    status_code = entry->status_code;
+    if (status_code == HTTPStatusCodeOK) {
+        const char *etag_str = entry->get_header(kHTTPHeaderETAG);
+        const char *if_none_match_str = http_conn->request.get_header_string(kHTTPHeaderIfNoneMatch);
+        const char *last_modified_str = entry->get_header(kHTTPHeaderLastModified);
+        const char *if_modified_since_str = http_conn->request.get_header_string(kHTTPHeaderIfModifiedSince);
+        if (if_none_match_str) {
+            if (etag_list_matches(if_none_match_str, etag_str)) {
+                status_code = HTTPStatusCodeNotModified;
+            }
+        } else if (last_modified_str && if_modified_since_str &&
+                   http_date(last_modified_str).tod <= http_date(if_modified_since_str).tod)
+        {
+            status_code = HTTPStatusCodeNotModified;
+        }
+    }
+    http_conn->request_has_body = false;
+
+    if (delegate->get_debug_mask() & protocol_debug_handler) {
+        log_debug("handle_request: status_code=%d cache_key=%s", status_code, entry->key.c_str());
+    }
+
+    return true;
+}
+
+io_result http_server_handler_cache::read_request_body()
+{
+    return io_result(0);
+}
+
+bool http_server_handler_cache::populate_response()
+{
+    char age_buf[32];
+
+    // set request body presence
+    http_conn->response_has_body = (request_method == HTTPMethodGET && status_code != HTTPStatusCodeNotModified);
+
+    // set connection close
+    const char* connection_str = http_conn->request.get_header_string(kHTTPHeaderConnection);
+    bool connection_keepalive_present = (connection_str && strcasecmp(connection_str, kHTTPTokenKeepalive) == 0);
+    bool connection_close_present = (connection_str && strcasecmp(connection_str, kHTTPTokenClose) == 0);
+    switch (http_version) {
+        case HTTPVersion10:
+            http_conn->connection_close = !connection_keepalive_present;
+            break;
+        case HTTPVersion11:
+            http_conn->connection_close = connection_close_present;
+            break;
+        default:
+            http_conn->connection_close = true;
+            break;
+    }
+
+    // set response headers, Server and Date are already set for every response
+    // and the stored copies are dropped so they aren't repeated
+    http_conn->response.set_status_code(status_code);
+    if (status_code == entry->status_code) {
+        http_conn->response.set_reason_phrase(entry->reason_phrase);
+    } else {
+        http_conn->response.set_reason_phrase(http_constants::get_status_text(status_code));
+    }
+    for (auto &header : entry->headers) {
+        if (status_code == HTTPStatusCodeNotModified && strcasecmp(header.first.c_str(), kHTTPHeaderContentLength) == 0) {
+            continue;
+        }
+        http_conn->response.set_header_field(header.first, header.second);
+    }
+    snprintf(age_buf, sizeof(age_buf), "%ld", (long)entry->age(current_time));
+    http_conn->response.set_header_field(kHTTPHeaderAge, age_buf);
+    http_conn->response.set_header_field("X-Cache", "HIT");
+    switch (http_version) {
+        case HTTPVersion10:
+            if (connection_keepalive_present) {
+                http_conn->response.set_header_field(kHTTPHeaderConnection, kHTTPTokenKeepalive);
+            }
+            break;
+        case HTTPVersion11:
+            http_conn->response.set_header_field(kHTTPHeaderConnection, http_conn->connection_close ? kHTTPTokenClose : kHTTPTokenKeepalive);
+            break;
+        default:
+            http_conn->connection_close = true;
+            break;
+    }
+
+    return true;
+}
+
+io_result http_server_handler_cache::write_response_body()
+{
+    // flush the headers then write the body without copying it to the buffer
+    auto &buffer = http_conn->buffer;
+    while (buffer.bytes_readable() > 0) {
+        io_result result = buffer.buffer_write(http_conn->conn);
+        if (result.has_error()) return result;
+        if (result.size() == 0) return io_result(io_error(EAGAIN));
+    }
+    auto &body = entry->body;
+    while (total_written < body.length()) {
+        io_result result = http_conn->conn.write((void*)(body.data() + total_written), body.length() - total_written);
+        if (result.has_error()) return result;
+        if (result.size() == 0) return io_result(io_error(EIO));
+        total_written += result.size();
+    }
+    return io_result(0);
+}
+
+bool http_server_handler_cache::end_request()
+{
+    entry = http_server_cache_entry_ptr();
+    return true;
+}
@@ -0,0 +1,35 @@
+//
+//  http_server_handler_cache.h
+//
+
+#ifndef http_server_handler_cache_h
+#define http_server_handler_cache_h
+
+
+/*
+ * http_server_handler_cache
+ *
+ * Answers a request from a cached response in place of the location
+ * handler. The body is written straight from the shared entry.
+ */
+
+struct http_server_handler_cache : http_server_handler
+{
+    http_server_cache_entry_ptr entry;
+    HTTPVersion     http_version;
+    HTTPMethod      request_method;
+    int             status_code;
+    size_t          total_written;
+
+    http_server_handler_cache(http_server_cache_entry_ptr entry);
+    ~http_server_handler_cache();
+
+    virtual void init();
+    virtual bool handle_request();
+    virtual io_result read_request_body();
+    virtual bool populate_response();
+    virtual io_result write_response_body();
+    virtual bool end_request();
+};
+
+#endif
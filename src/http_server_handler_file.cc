@@ -170,6 +170,7 @@ void http_server_handler_file::init()
     status_code = 0;
     content_length = 0;
     total_written = 0;
+    use_sendfile = false;
     last_modified = http_date();
     if_modified_since = http_date();
 }
@@ -206,6 +207,9 @@ bool http_server_handler_file::handle_request()
         mime_type = ext_mime_type.second;
         content_length = stat_result.st_size;
         reader = &file_resource;
+        // a response that may be cached is written through the buffer to be captured
+        bool cache_fill = http_conn->cache_store && (size_t)content_length <= delegate->get_config()->cache_max_entry_size;
+        use_sendfile = delegate->get_config()->sendfile && http_conn->conn.can_sendfile() && !cache_fill;
     } else if (status_code == HTTPStatusCodeNotModified) {
         content_length = 0;
         reader = nullptr;
@@ -296,6 +300,23 @@ bool http_server_handler_file::populate_response()
 
 io_result http_server_handler_file::write_response_body()
 {
+    // flush the headers then send the file straight from the page cache
+    if (use_sendfile) {
+        auto &buffer = http_conn->buffer;
+        while (buffer.bytes_readable() > 0) {
+            io_result result = buffer.buffer_write(http_conn->conn);
+            if (result.has_error()) return result;
+            if (result.size() == 0) return io_result(io_error(EAGAIN));
+        }
+        while (total_written < content_length) {
+            io_result result = http_conn->conn.sendfile(file_resource.fd, total_written, content_length - total_written);
+            if (result.has_error()) return result;
+            if (result.size() == 0) return io_result(io_error(EIO));
+            total_written += result.size();
+        }
+        return io_result(0);
+    }
+    
     // refill buffer
     if (reader) {
         return http_conn->buffer.buffer_read(*reader);
@@ -23,6 +23,7 @@ struct http_server_handler_file : http_server_handler
     int             status_code;
     ssize_t         content_length;
     ssize_t         total_written;
+    bool            use_sendfile;
     struct stat     stat_result;
     http_date       last_modified;
     http_date       if_modified_since;
@@ -0,0 +1,1324 @@
+//
+//  http_server_handler_proxy.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "io.h"
+#include "os.h"
+#include "url.h"
+#include "log.h"
+#include "log_thread.h"
+#include "hdr_histogram.h"
+#include "alias_sampler.h"
+#include "trie.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_date.h"
+#include "http_server.h"
+#include "http_client.h"
+#include "http_server_handler_proxy.h"
+
+
+/* hop-by-hop headers are not forwarded, Host and User-Agent are set by http_client */
+
+static const char* http_proxy_request_skip[] = {
+    kHTTPHeaderConnection, "Keep-Alive", "Proxy-Connection", kHTTPHeaderTE, "Trailer",
+    kHTTPHeaderUpgrade, kHTTPHeaderHost, kHTTPHeaderUserAgent, kHTTPHeaderExpect, nullptr
+};
+
+static const char* http_proxy_response_skip[] = {
+    kHTTPHeaderConnection, "Keep-Alive", "Proxy-Connection", kHTTPHeaderTE, "Trailer",
+    kHTTPHeaderUpgrade, kHTTPHeaderTransferEncoding, kHTTPHeaderServer, kHTTPHeaderDate, nullptr
+};
+
+static bool http_proxy_skip_header(const char **skip, const http_header_string &name)
+{
+    for (; *skip; skip++) {
+        if (strlen(*skip) == name.length && strncasecmp(*skip, name.data, name.length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* http_server_upstream_server */
+
+http_server_upstream_server::http_server_upstream_server(url_ptr url)
+    : url(url), name(url->host + ":" + std::to_string(url->port)),
+      requests(0), failures(0), active(0), bytes_read(0), ewma_usecs(0),
+      consecutive_failures(0), backoff(0), ejected_until_usecs(0), ejections(0),
+      header_usecs(HTTP_PROXY_LATENCY_MAX, 3), response_usecs(HTTP_PROXY_LATENCY_MAX, 3) {}
+
+uint64_t http_server_upstream_server::load_score() const
+{
+    // expected wait, unmeasured servers score as fast so they get tried
+    uint64_t outstanding = (uint64_t)std::max(active.load(std::memory_order_relaxed), 0L);
+    return (uint64_t)(ewma_usecs.load(std::memory_order_relaxed) + 1) * (outstanding + 1);
+}
+
+void http_server_upstream_server::record_latency(int64_t header_usecs, int64_t response_usecs)
+{
+    std::lock_guard<std::mutex> lock(latency_mutex);
+    this->header_usecs.record(header_usecs);
+    this->response_usecs.record(response_usecs);
+}
+
+void http_server_upstream_server::record_success(int64_t response_usecs)
+{
+    int64_t old_ewma = ewma_usecs.load(std::memory_order_relaxed), new_ewma;
+    do {
+        new_ewma = old_ewma == 0 ? std::max(response_usecs, (int64_t)1) :
+            old_ewma + ((response_usecs - old_ewma) >> HTTP_PROXY_EWMA_SHIFT);
+    } while (!ewma_usecs.compare_exchange_weak(old_ewma, new_ewma, std::memory_order_relaxed));
+    if (consecutive_failures.load(std::memory_order_relaxed) != 0) {
+        consecutive_failures.store(0, std::memory_order_relaxed);
+    }
+    if (backoff.load(std::memory_order_relaxed) != 0) {
+        backoff.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool http_server_upstream_server::record_failure(uint64_t now_usecs, int max_fails, int fail_timeout)
+{
+    // after an ejection one more failure ejects it again for twice as long,
+    // requests that were in flight when it was ejected don't extend it
+    if (max_fails <= 0 || !available(now_usecs) ||
+        (consecutive_failures.fetch_add(1) + 1 < max_fails && backoff.load(std::memory_order_relaxed) == 0)) {
+        return false;
+    }
+    consecutive_failures.store(0, std::memory_order_relaxed);
+    int level = std::min(backoff.fetch_add(1), 16);
+    int64_t secs = std::min((int64_t)fail_timeout << level, (int64_t)std::max(fail_timeout, HTTP_PROXY_FAIL_TIMEOUT_MAX));
+    ejected_until_usecs.store(now_usecs + secs * 1000000, std::memory_order_relaxed);
+    ejections++;
+    log_info("upstream server %s: ejected for %d seconds", name.c_str(), (int)secs);
+    return true;
+}
+
+
+/* http_server_upstream */
+
+http_server_upstream::http_server_upstream(std::string name)
+    : name(name), policy(http_upstream_policy_round_robin), hash_key(http_upstream_hash_key_path),
+      max_fails(HTTP_PROXY_MAX_FAILS_DEFAULT), fail_timeout(HTTP_PROXY_FAIL_TIMEOUT_DEFAULT), next_server(0) {}
+
+uint64_t http_server_upstream::hash(const char *data, size_t len)
+{
+    // FNV-1a with a final mix so nearby keys spread around the ring
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bool http_server_upstream::parse_policy(std::string policy, http_upstream_policy &result)
+{
+    if (policy == "round_robin") {
+        result = http_upstream_policy_round_robin;
+    } else if (policy == "least_outstanding") {
+        result = http_upstream_policy_least_outstanding;
+    } else if (policy == "p2c_ewma") {
+        result = http_upstream_policy_p2c_ewma;
+    } else if (policy == "hash") {
+        result = http_upstream_policy_hash;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string http_server_upstream::policy_to_string(http_upstream_policy policy)
+{
+    switch (policy) {
+        case http_upstream_policy_round_robin: return "round_robin";
+        case http_upstream_policy_least_outstanding: return "least_outstanding";
+        case http_upstream_policy_p2c_ewma: return "p2c_ewma";
+        case http_upstream_policy_hash: return "hash";
+    }
+    return "unknown";
+}
+
+void http_server_upstream::init()
+{
+    // ring points are placed by server name so the ring survives reordering
+    hash_ring.clear();
+    for (size_t i = 0; i < servers.size(); i++) {
+        for (int point = 0; point < HTTP_PROXY_HASH_POINTS; point++) {
+            std::string point_key = servers[i]->name + "-" + std::to_string(point);
+            hash_ring.push_back(ring_point(hash(point_key.data(), point_key.length()), i));
+        }
+    }
+    std::sort(hash_ring.begin(), hash_ring.end());
+}
+
+http_server_upstream_server* http_server_upstream::choose_server(uint64_t key_hash, uint64_t now_usecs)
+{
+    if (servers.size() == 1) {
+        return servers[0].get();
+    }
+    switch (policy) {
+        case http_upstream_policy_least_outstanding: return choose_least_outstanding(now_usecs);
+        case http_upstream_policy_p2c_ewma: return choose_p2c(now_usecs);
+        case http_upstream_policy_hash: return choose_hash(key_hash, now_usecs);
+        case http_upstream_policy_round_robin:
+        default: return choose_round_robin(now_usecs);
+    }
+}
+
+http_server_upstream_server* http_server_upstream::choose_round_robin(uint64_t now_usecs)
+{
+    size_t start = next_server++;
+    for (size_t i = 0; i < servers.size(); i++) {
+        auto server = servers[(start + i) % servers.size()].get();
+        if (server->available(now_usecs)) {
+            return server;
+        }
+    }
+    return servers[start % servers.size()].get();
+}
+
+http_server_upstream_server* http_server_upstream::choose_least_outstanding(uint64_t now_usecs)
+{
+    // rotate the scan start so ties don't all land on the first server
+    size_t start = next_server++;
+    http_server_upstream_server *best = nullptr;
+    long best_active = 0;
+    for (size_t i = 0; i < servers.size(); i++) {
+        auto server = servers[(start + i) % servers.size()].get();
+        long active = server->active.load(std::memory_order_relaxed);
+        if (server->available(now_usecs) && (!best || active < best_active)) {
+            best = server;
+            best_active = active;
+        }
+    }
+    return best ? best : servers[start % servers.size()].get();
+}
+
+http_server_upstream_server* http_server_upstream::choose_p2c(uint64_t now_usecs)
+{
+    static thread_local xorshift64star rng(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    uint64_t r = rng.next();
+    size_t a = r % servers.size();
+    size_t b = (a + 1 + (r >> 32) % (servers.size() - 1)) % servers.size();
+    auto server_a = servers[a].get(), server_b = servers[b].get();
+    bool available_a = server_a->available(now_usecs), available_b = server_b->available(now_usecs);
+    if (available_a && available_b) {
+        return server_a->load_score() <= server_b->load_score() ? server_a : server_b;
+    } else if (available_a) {
+        return server_a;
+    } else if (available_b) {
+        return server_b;
+    }
+    return choose_round_robin(now_usecs);
+}
+
+http_server_upstream_server* http_server_upstream::choose_hash(uint64_t key_hash, uint64_t now_usecs)
+{
+    // walk clockwise from the key to the first available server
+    auto ri = std::lower_bound(hash_ring.begin(), hash_ring.end(), ring_point(key_hash, 0));
+    for (size_t i = 0; i < hash_ring.size(); i++, ri++) {
+        if (ri == hash_ring.end()) {
+            ri = hash_ring.begin();
+        }
+        auto server = servers[ri->second].get();
+        if (server->available(now_usecs)) {
+            return server;
+        }
+    }
+    if (ri == hash_ring.end()) {
+        ri = hash_ring.begin();
+    }
+    return servers[ri->second].get();
+}
+
+
+/* http_proxy_pipe */
+
+struct http_proxy_splice_pipe
+{
+    int                                         fds[2];
+    size_t                                      size;
+};
+
+static std::mutex                               http_proxy_splice_pool_mutex;
+static std::vector<http_proxy_splice_pipe>      http_proxy_splice_pool;
+
+http_proxy_pipe::~http_proxy_pipe()
+{
+    close_splice();
+}
+
+size_t http_proxy_pipe::write(const char *buf, size_t len)
+{
+    // compact before appending, the reader usually drains the pipe
+    len = std::min(len, bytes_writable());
+    if (back + len > data.size()) {
+        memmove(data.data(), data.data() + front, back - front);
+        back -= front;
+        front = 0;
+    }
+    memcpy(data.data() + back, buf, len);
+    back += len;
+    return len;
+}
+
+io_result http_proxy_pipe::read(void *buf, size_t len)
+{
+    len = std::min(len, bytes_readable());
+    memcpy(buf, data.data() + front, len);
+    front += len;
+    if (front == back) {
+        front = back = 0;
+    }
+    return io_result(len);
+}
+
+bool http_proxy_pipe::open_splice(size_t size)
+{
+#if defined(__linux__)
+    // pipes are only pooled once empty so a pooled one can be used as is
+    {
+        std::lock_guard<std::mutex> lock(http_proxy_splice_pool_mutex);
+        if (http_proxy_splice_pool.size() > 0) {
+            auto &pooled = http_proxy_splice_pool.back();
+            splice_fds[0] = pooled.fds[0];
+            splice_fds[1] = pooled.fds[1];
+            splice_size = pooled.size;
+            splice_bytes = 0;
+            http_proxy_splice_pool.pop_back();
+            return true;
+        }
+    }
+    if (pipe2(splice_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_error("pipe2 failed: %s", strerror(errno));
+        splice_fds[0] = splice_fds[1] = -1;
+        return false;
+    }
+
+    // the kernel rounds the size up to pages and caps it at fs.pipe-max-size
+    int pipe_size = fcntl(splice_fds[1], F_SETPIPE_SZ, (int)size);
+    if (pipe_size < 0) {
+        pipe_size = fcntl(splice_fds[1], F_GETPIPE_SZ);
+    }
+    if (pipe_size <= 0) {
+        log_error("fcntl(F_GETPIPE_SZ) failed: %s", strerror(errno));
+        close(splice_fds[0]);
+        close(splice_fds[1]);
+        splice_fds[0] = splice_fds[1] = -1;
+        return false;
+    }
+    splice_size = pipe_size;
+    splice_bytes = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void http_proxy_pipe::close_splice()
+{
+    if (!is_spliced()) {
+        return;
+    }
+
+    // a pipe still holding part of an aborted body is closed rather than reused
+    bool pooled = false;
+    if (splice_bytes == 0) {
+        std::lock_guard<std::mutex> lock(http_proxy_splice_pool_mutex);
+        if (http_proxy_splice_pool.size() < HTTP_PROXY_SPLICE_POOL_MAX) {
+            http_proxy_splice_pipe pipe = { { splice_fds[0], splice_fds[1] }, splice_size };
+            http_proxy_splice_pool.push_back(pipe);
+            pooled = true;
+        }
+    }
+    if (!pooled) {
+        close(splice_fds[0]);
+        close(splice_fds[1]);
+    }
+    splice_fds[0] = splice_fds[1] = -1;
+    splice_bytes = 0;
+}
+
+io_result http_proxy_pipe::splice_in(connection &conn, io_ring_buffer &buffer, size_t len)
+{
+    // body bytes read along with the headers go in ahead of the socket
+    if (buffer.bytes_readable() > 0) {
+        len = std::min(len, buffer.bytes_readable());
+        ssize_t nbytes = ::write(splice_fds[1], buffer.data() + (buffer.front & buffer.mask), len);
+        if (nbytes < 0) {
+            return io_result(io_error(errno));
+        }
+        buffer.front += nbytes;
+        if (buffer.bytes_readable() == 0) {
+            buffer.reset();
+        }
+        return io_result(nbytes);
+    }
+    return conn.splice_in(splice_fds[1], len);
+}
+
+io_result http_proxy_pipe::splice_out(connection &conn, size_t len)
+{
+    return conn.splice_out(splice_fds[0], len);
+}
+
+
+/* http_proxy_channel */
+
+http_proxy_channel::http_proxy_channel()
+    : upstream(nullptr), server(nullptr), splice(false), cache_store(false), request_has_body(false),
+      response_ready(false), status_code(0), response_has_body(false),
+      response_chunked(false), response_length(-1), decode_chunked(false),
+      failed(false), server_gone(false),
+      server_thread(nullptr), server_conn_id(-1), server_waiting(false),
+      upstream_thread(nullptr), upstream_conn_id(-1), upstream_waiting(false) {}
+
+void http_proxy_channel::wake_server()
+{
+    if (server_waiting) {
+        server_waiting = false;
+        server_thread->post_message(protocol_message(http_server::action_worker_resume_connection.action, server_conn_id));
+    }
+}
+
+void http_proxy_channel::wake_upstream()
+{
+    if (upstream_waiting) {
+        upstream_waiting = false;
+        upstream_thread->post_message(protocol_message(http_client::action_resume_connection.action, upstream_conn_id));
+    }
+}
+
+
+/* http_client_handler_proxy */
+
+http_client_handler_proxy::http_client_handler_proxy(http_proxy_channel_ptr channel, HTTPMethod request_method)
+    : channel(channel), request_method(request_method), completed(false), start_usecs(os::current_time_usecs())
+{
+    http_conn = nullptr;
+    init();
+}
+
+void http_client_handler_proxy::init()
+{
+    content_length = -1;
+    total_read = 0;
+    chunked = false;
+    chunked_decoder.reset();
+    header_usecs = 0;
+}
+
+bool http_client_handler_proxy::populate_request()
+{
+    for (auto &header : channel->request_headers) {
+        http_conn->request.set_header_field(header.first, header.second);
+    }
+    http_conn->request_has_body = channel->request_has_body;
+    http_conn->response_has_body = request_method != HTTPMethodHEAD;
+
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    channel->upstream_thread = delegate;
+    channel->upstream_conn_id = http_conn->conn.get_id();
+
+    return true;
+}
+
+io_result http_client_handler_proxy::write_request_body()
+{
+    auto &request_buffer = http_conn->request_buffer;
+
+    if (channel->request_pipe.is_spliced()) {
+        return splice_request_body();
+    }
+
+    while (true) {
+
+        // write out what was taken from the pipe before taking more
+        if (request_buffer.bytes_readable() > 0) {
+            io_result result = request_buffer.buffer_write(http_conn->conn);
+            if (result.has_error()) {
+                return result;
+            }
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        auto &pipe = channel->request_pipe;
+        if (channel->server_gone) {
+            return io_result(io_error(ECANCELED));
+        } else if (pipe.bytes_readable() == 0) {
+            if (pipe.eof) {
+                return io_result(0);
+            }
+            channel->upstream_thread = delegate;
+            channel->upstream_waiting = true;
+            delegate->remove_events(http_conn);
+            return io_result(io_error(EAGAIN));
+        }
+        request_buffer.reset();
+        request_buffer.buffer_read(pipe);
+        channel->wake_server();
+    }
+}
+
+bool http_client_handler_proxy::handle_response()
+{
+    auto &response = http_conn->response;
+    int status_code = response.get_status_code();
+
+    // set connection close
+    HTTPVersion http_version = http_constants::get_version_type(response.get_http_version());
+    const char* connection_str = response.get_header_string(kHTTPHeaderConnection);
+    bool connection_keepalive_present = (connection_str && strcasecmp(connection_str, kHTTPTokenKeepalive) == 0);
+    bool connection_close_present = (connection_str && strcasecmp(connection_str, kHTTPTokenClose) == 0);
+    switch (http_version) {
+        case HTTPVersion10:
+            http_conn->connection_close = !connection_keepalive_present;
+            break;
+        case HTTPVersion11:
+            http_conn->connection_close = connection_close_present;
+            break;
+        default:
+            http_conn->connection_close = true;
+            break;
+    }
+
+    // chunked takes precedence over content length, without either the body ends at close
+    http_conn->response_has_body = request_method != HTTPMethodHEAD && status_code >= HTTPStatusCodeOK &&
+        status_code != HTTPStatusCodeNoContent && status_code != HTTPStatusCodeNotModified;
+    const char* transfer_encoding_str = response.get_header_string(kHTTPHeaderTransferEncoding);
+    const char* content_length_str = response.get_header_string(kHTTPHeaderContentLength);
+    if (transfer_encoding_str) {
+        size_t len = strlen(transfer_encoding_str);
+        chunked = len >= 7 && strcasecmp(transfer_encoding_str + len - 7, "chunked") == 0;
+        content_length = -1;
+    } else {
+        content_length = content_length_str ? strtoll(content_length_str, NULL, 10) : -1;
+    }
+    if (http_conn->response_has_body && !chunked && content_length < 0) {
+        http_conn->connection_close = true;
+    }
+    total_read = 0;
+    chunked_decoder.reset();
+    header_usecs = os::current_time_usecs();
+
+    // hand the response headers to the server connection
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    channel->status_code = status_code;
+    channel->reason_phrase = response.get_reason_phrase();
+    for (auto &header : response.header_map) {
+        if (!http_proxy_skip_header(http_proxy_response_skip, header.first)) {
+            channel->response_headers.push_back(std::pair<std::string,std::string>(
+                std::string(header.first.data, header.first.length),
+                std::string(header.second.data, header.second.length)));
+        }
+    }
+    channel->response_has_body = http_conn->response_has_body;
+    channel->response_chunked = chunked;
+    channel->response_length = chunked ? -1 : content_length;
+    if (http_conn->response_has_body) {
+        // chunked bodies are decoded to find their end so only other large bodies are spliced,
+        // and one the server connection may cache is copied through its buffer to be captured
+        size_t pipe_size = delegate->get_config()->proxy_buffer_size;
+        bool cache_fill = channel->cache_store && !chunked && content_length >= 0 &&
+            (size_t)content_length <= delegate->get_config()->cache_max_entry_size;
+        bool splice = channel->splice && http_conn->conn.can_splice() && !chunked && !cache_fill &&
+            (content_length < 0 || content_length >= HTTP_PROXY_SPLICE_MIN);
+        if (!splice || !channel->response_pipe.open_splice(pipe_size)) {
+            if (!chunked && content_length >= 0) {
+                pipe_size = std::min(pipe_size, (size_t)std::max(content_length, (ssize_t)1));
+            }
+            channel->response_pipe.resize(pipe_size);
+        }
+    }
+    channel->response_ready = true;
+    channel->wake_server();
+
+    return true;
+}
+
+io_result http_client_handler_proxy::read_response_body()
+{
+    auto &buffer = http_conn->buffer;
+
+    if (channel->response_pipe.is_spliced()) {
+        return splice_response_body();
+    }
+
+    while (!body_finished()) {
+
+        // read data from socket once the body fragment in the buffer is consumed
+        if (buffer.bytes_readable() == 0) {
+            io_result result = buffer.buffer_read(http_conn->conn);
+            if (result.has_error()) {
+                return result;
+            } else if (result.size() == 0) {
+                // EOF ends a body delimited by connection close, otherwise it is truncated
+                return !chunked && content_length < 0 ? io_result(0) : io_result(io_error(ECONNRESET));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        auto &pipe = channel->response_pipe;
+        size_t space = pipe.bytes_writable();
+        if (channel->server_gone) {
+            return io_result(io_error(ECANCELED));
+        } else if (space == 0) {
+            channel->upstream_thread = delegate;
+            channel->upstream_waiting = true;
+            delegate->remove_events(http_conn);
+            return io_result(io_error(EAGAIN));
+        }
+
+        // move no more than the pipe holds or the rest of this body
+        const char *buf = buffer.data() + (buffer.front & buffer.mask);
+        size_t len = std::min(buffer.bytes_readable(), space), consumed = 0;
+        if (chunked) {
+            while (consumed < len && !chunked_decoder.is_done()) {
+                const char *data;
+                size_t data_len;
+                size_t framed = chunked_decoder.decode(buf + consumed, len - consumed, data, data_len);
+                if (chunked_decoder.has_error()) {
+                    return io_result(io_error(EPROTO));
+                }
+                if (channel->decode_chunked) {
+                    pipe.write(data, data_len);
+                } else {
+                    pipe.write(buf + consumed, framed);
+                }
+                consumed += framed;
+            }
+        } else {
+            consumed = content_length >= 0 ? std::min((ssize_t)len, content_length - total_read) : len;
+            pipe.write(buf, consumed);
+        }
+        total_read += consumed;
+        channel->server->bytes_read += consumed;
+        channel->wake_server();
+        buffer.front += consumed;
+        if (buffer.bytes_readable() == 0) {
+            buffer.reset();
+        }
+    }
+
+    return io_result(0);
+}
+
+io_result http_client_handler_proxy::splice_request_body()
+{
+    auto &pipe = channel->request_pipe;
+
+    while (true) {
+        size_t queued;
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            queued = pipe.bytes_readable();
+            if (channel->server_gone) {
+                return io_result(io_error(ECANCELED));
+            } else if (queued == 0) {
+                if (pipe.eof) {
+                    return io_result(0);
+                }
+                channel->upstream_thread = delegate;
+                channel->upstream_waiting = true;
+                delegate->remove_events(http_conn);
+                return io_result(io_error(EAGAIN));
+            }
+        }
+
+        // would block leaves the poll waiting for the socket to drain
+        io_result result = pipe.splice_out(http_conn->conn, queued);
+        if (result.has_error()) {
+            return result;
+        }
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        pipe.splice_bytes -= result.size();
+        channel->wake_server();
+    }
+}
+
+io_result http_client_handler_proxy::splice_response_body()
+{
+    auto &buffer = http_conn->buffer;
+    auto &pipe = channel->response_pipe;
+
+    while (!body_finished()) {
+        size_t queued, space;
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            queued = pipe.bytes_readable();
+            space = pipe.bytes_writable();
+            if (channel->server_gone) {
+                return io_result(io_error(ECANCELED));
+            } else if (space == 0) {
+                channel->upstream_thread = delegate;
+                channel->upstream_waiting = true;
+                delegate->remove_events(http_conn);
+                return io_result(io_error(EAGAIN));
+            }
+        }
+
+        // move no more than the pipe holds or the rest of this body
+        size_t len = content_length >= 0 ? std::min(space, (size_t)(content_length - total_read)) : space;
+        io_result result = pipe.splice_in(http_conn->conn, buffer, len);
+        if (result.would_block()) {
+            // the kernel pipe can fill before its byte count does, the server wakes us as it drains
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            if (pipe.bytes_readable() > 0) {
+                channel->upstream_thread = delegate;
+                channel->upstream_waiting = true;
+                delegate->remove_events(http_conn);
+                return result;
+            } else if (queued > 0) {
+                continue;
+            }
+            return result;
+        } else if (result.has_error()) {
+            return result;
+        } else if (result.size() == 0) {
+            // EOF ends a body delimited by connection close, otherwise it is truncated
+            return content_length < 0 ? io_result(0) : io_result(io_error(ECONNRESET));
+        }
+
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        pipe.splice_bytes += result.size();
+        total_read += result.size();
+        channel->server->bytes_read += result.size();
+        channel->wake_server();
+    }
+
+    return io_result(0);
+}
+
+bool http_client_handler_proxy::end_request()
+{
+    complete(true);
+    return true;
+}
+
+void http_client_handler_proxy::abort_request()
+{
+    complete(false);
+}
+
+bool http_client_handler_proxy::body_finished() const
+{
+    return chunked ? chunked_decoder.is_done() : total_read == content_length;
+}
+
+void http_client_handler_proxy::complete(bool success)
+{
+    // a request completes once, a response that closed its connection is not aborted again
+    if (completed) {
+        return;
+    }
+    completed = true;
+
+    auto upstream = channel->upstream;
+    auto server = channel->server;
+    uint64_t now_usecs = os::current_time_usecs();
+    server->active--;
+    std::lock_guard<std::mutex> lock(channel->mutex);
+
+    // 5xx responses count against the server's health but are still delivered
+    if (success) {
+        server->record_latency(header_usecs - start_usecs, now_usecs - start_usecs);
+    } else {
+        server->failures++;
+    }
+    if (success && channel->status_code < HTTPStatusCodeInternalServerError) {
+        server->record_success(now_usecs - start_usecs);
+    } else if (!channel->server_gone) {
+        server->record_failure(now_usecs, upstream->max_fails, upstream->fail_timeout);
+    }
+    if (success) {
+        channel->response_pipe.eof = true;
+    } else {
+        channel->failed = true;
+    }
+    channel->upstream_waiting = false;
+    channel->wake_server();
+}
+
+
+/* http_server_handler_proxy */
+
+http_server_handler_proxy::http_server_handler_proxy()
+{
+    error_buffer.resize(1024);
+}
+
+http_server_handler_proxy::~http_server_handler_proxy()
+{
+    end_request();
+}
+
+void http_server_handler_proxy::init_handler()
+{
+    http_server::register_handler<http_server_handler_proxy>("http_server_handler_proxy");
+}
+
+size_t http_server_handler_proxy::create_error_response()
+{
+    char error_fmt[] =
+        "<html>\r\n"
+        "<head><title>%d %s</title></head>\r\n"
+        "<body>\r\n"
+        "<h1>%d %s</h1>\r\n"
+        "</body>\r\n"
+        "</html>\r\n";
+    error_buffer.reset();
+    size_t error_len = snprintf(error_buffer.data(), error_buffer.size(), error_fmt,
+                                status_code, status_text.c_str(),
+                                status_code, status_text.c_str());
+    error_buffer.set_length(error_len);
+    return error_len;
+}
+
+void http_server_handler_proxy::init()
+{
+    channel = http_proxy_channel_ptr();
+    status_code = 0;
+    status_text.clear();
+    error_buffer.reset();
+    request_length = 0;
+    request_read = 0;
+    request_chunked = false;
+    discard_body = false;
+    close_connection = false;
+    chunked_decoder.reset();
+}
+
+bool http_server_handler_proxy::handle_request()
+{
+    // get request http version and request method
+    http_version = http_constants::get_version_type(http_conn->request.get_http_version());
+    request_method = http_constants::get_method_type(http_conn->request.get_request_method());
+
+    // chunked takes precedence over content length, bodies are forwarded with their framing
+    const char* transfer_encoding_str = http_conn->request.get_header_string(kHTTPHeaderTransferEncoding);
+    const char* content_length_str = http_conn->request.get_header_string(kHTTPHeaderContentLength);
+    if (transfer_encoding_str) {
+        size_t len = strlen(transfer_encoding_str);
+        request_chunked = len >= 7 && strcasecmp(transfer_encoding_str + len - 7, "chunked") == 0;
+        request_length = request_chunked ? 0 : -1;
+    } else {
+        request_length = content_length_str ? strtoll(content_length_str, NULL, 10) : 0;
+    }
+    http_conn->request_has_body = request_chunked || request_length > 0;
+
+    if (request_length < 0) {
+        // the body can't be framed so the connection can't be reused
+        status_code = HTTPStatusCodeBadRequest;
+        http_conn->request_has_body = false;
+        close_connection = true;
+    } else if (request_method == HTTPMethodNone || request_method == HTTPMethodCONNECT) {
+        status_code = HTTPStatusCodeNotImplemented;
+        discard_body = true;
+    } else if (!submit_request()) {
+        status_code = HTTPStatusCodeServiceUnavailable;
+        discard_body = true;
+    }
+
+    if (status_code != 0) {
+        status_text = http_constants::get_status_text(status_code);
+    }
+
+    if (delegate->get_debug_mask() & protocol_debug_handler) {
+        log_debug("handle_request: status_code=%d upstream=%s path=%s",
+                  status_code, location->upstream->name.c_str(), upstream_path().c_str());
+    }
+
+    return true;
+}
+
+io_result http_server_handler_proxy::read_request_body()
+{
+    auto &buffer = http_conn->buffer;
+
+    // a spliced body stops at the end of its length or when the upstream fails
+    if (channel && channel->request_pipe.is_spliced() && !discard_body) {
+        io_result result = splice_request_body();
+        if (result.has_error()) {
+            return result;
+        }
+    }
+
+    while (!request_body_finished()) {
+
+        // read data from socket once the body fragment in the buffer is consumed
+        if (buffer.bytes_readable() == 0) {
+            buffer.reset();
+            io_result result = buffer.buffer_read(http_conn->conn);
+            if (result.has_error()) {
+                return result;
+            } else if (result.size() == 0) {
+                return io_result(io_error(ECONNRESET));
+            }
+        }
+        const char *buf = buffer.data() + (buffer.front & buffer.mask);
+        size_t len = buffer.bytes_readable();
+
+        // a request the upstream will not take is read and dropped
+        if (discard_body) {
+            size_t consumed = frame_request_body(buf, len);
+            if (chunked_decoder.has_error()) {
+                return io_result(io_error(EPROTO));
+            }
+            buffer.front += consumed;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        auto &pipe = channel->request_pipe;
+        size_t space = pipe.bytes_writable();
+        if (channel->failed) {
+            discard_body = true;
+            continue;
+        } else if (space == 0) {
+            channel->server_thread = delegate;
+            channel->server_waiting = true;
+            delegate->remove_events(http_conn);
+            return io_result(io_error(EAGAIN));
+        }
+        size_t consumed = frame_request_body(buf, std::min(len, space));
+        if (chunked_decoder.has_error()) {
+            return io_result(io_error(EPROTO));
+        }
+        pipe.write(buf, consumed);
+        pipe.eof = request_body_finished();
+        channel->wake_upstream();
+        buffer.front += consumed;
+    }
+
+    // bytes after the body are pipelined requests, keep them as the buffer is reused for the response
+    if (buffer.bytes_readable() > 0) {
+        auto &pipeline_buffer = http_conn->pipeline_buffer;
+        if (pipeline_buffer.size() == 0) {
+            pipeline_buffer.resize(delegate->get_config()->io_buffer_size);
+        }
+        pipeline_buffer.set(buffer.data() + (buffer.front & buffer.mask), buffer.bytes_readable());
+    }
+    buffer.reset();
+
+    return io_result(0);
+}
+
+bool http_server_handler_proxy::response_ready()
+{
+    if (!channel) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    if (channel->response_ready || channel->failed) {
+        return true;
+    }
+    channel->server_thread = delegate;
+    channel->server_waiting = true;
+    return false;
+}
+
+bool http_server_handler_proxy::populate_response()
+{
+    char content_length_buf[32];
+    bool upstream_response = false;
+    bool length_known = true;
+
+    // a channel that failed before the response headers arrived is a bad gateway
+    if (channel) {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        if (channel->response_ready) {
+            upstream_response = true;
+        } else {
+            status_code = HTTPStatusCodeBadGateway;
+            status_text = http_constants::get_status_text(status_code);
+        }
+    }
+
+    if (upstream_response) {
+        http_conn->response.set_status_code(channel->status_code);
+        http_conn->response.set_reason_phrase(channel->reason_phrase);
+        for (auto &header : channel->response_headers) {
+            http_conn->response.set_header_field(header.first, header.second);
+        }
+        if (channel->response_chunked && !channel->decode_chunked) {
+            http_conn->response.set_header_field(kHTTPHeaderTransferEncoding, "chunked");
+        }
+        http_conn->response_has_body = channel->response_has_body;
+        length_known = channel->response_length >= 0 ||
+            (channel->response_chunked && !channel->decode_chunked);
+    } else {
+        size_t content_length = create_error_response();
+        snprintf(content_length_buf, sizeof(content_length_buf), "%lu", content_length);
+        http_conn->response.set_status_code(status_code);
+        http_conn->response.set_reason_phrase(status_text);
+        http_conn->response.set_header_field(kHTTPHeaderContentType, "text/html");
+        http_conn->response.set_header_field(kHTTPHeaderContentLength, content_length_buf);
+        http_conn->response_has_body = request_method != HTTPMethodHEAD;
+    }
+
+    // set connection close, a body without a length ends at close
+    const char* connection_str = http_conn->request.get_header_string(kHTTPHeaderConnection);
+    bool connection_keepalive_present = (connection_str && strcasecmp(connection_str, kHTTPTokenKeepalive) == 0);
+    bool connection_close_present = (connection_str && strcasecmp(connection_str, kHTTPTokenClose) == 0);
+    switch (http_version) {
+        case HTTPVersion10:
+            http_conn->connection_close = !connection_keepalive_present;
+            break;
+        case HTTPVersion11:
+            http_conn->connection_close = connection_close_present;
+            break;
+        default:
+            http_conn->connection_close = true;
+            break;
+    }
+    if (close_connection || (http_conn->response_has_body && !length_known)) {
+        http_conn->connection_close = true;
+    }
+    switch (http_version) {
+        case HTTPVersion10:
+            if (connection_keepalive_present && !http_conn->connection_close) {
+                http_conn->response.set_header_field(kHTTPHeaderConnection, kHTTPTokenKeepalive);
+            }
+            break;
+        case HTTPVersion11:
+            http_conn->response.set_header_field(kHTTPHeaderConnection, http_conn->connection_close ? kHTTPTokenClose : kHTTPTokenKeepalive);
+            break;
+        default:
+            break;
+    }
+    if (!upstream_response) {
+        channel = http_proxy_channel_ptr();
+    }
+
+    return true;
+}
+
+io_result http_server_handler_proxy::write_response_body()
+{
+    auto &buffer = http_conn->buffer;
+
+    if (!channel) {
+        return buffer.buffer_read(error_buffer);
+    } else if (channel->response_pipe.is_spliced()) {
+        return splice_response_body();
+    }
+
+    // only refill at the end of the buffer or once it has been written
+    if (buffer.bytes_readable() > 0 && (buffer.back & buffer.mask) == 0) {
+        return io_result(0);
+    } else if (buffer.bytes_readable() == 0) {
+        buffer.reset();
+    }
+
+    std::lock_guard<std::mutex> lock(channel->mutex);
+    auto &pipe = channel->response_pipe;
+    if (pipe.bytes_readable() > 0) {
+        io_result result = buffer.buffer_read(pipe);
+        channel->wake_upstream();
+        return result;
+    } else if (pipe.eof || buffer.bytes_readable() > 0) {
+        return io_result(0);
+    } else if (channel->failed) {
+        return io_result(io_error(ECONNRESET));
+    }
+    channel->server_thread = delegate;
+    channel->server_waiting = true;
+    delegate->remove_events(http_conn);
+    return io_result(io_error(EAGAIN));
+}
+
+bool http_server_handler_proxy::end_request()
+{
+    // let an upstream connection still streaming to this one give up
+    if (channel) {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        channel->server_gone = true;
+        channel->server_waiting = false;
+        channel->wake_upstream();
+    }
+    channel = http_proxy_channel_ptr();
+    return true;
+}
+
+bool http_server_handler_proxy::submit_request()
+{
+    auto upstream = location->upstream;
+    uint64_t key_hash = upstream->policy == http_upstream_policy_hash ? request_hash() : 0;
+    auto server = upstream->choose_server(key_hash, os::current_time_usecs());
+
+    // request line and headers are set before the channel is shared
+    channel = std::make_shared<http_proxy_channel>();
+    channel->upstream = upstream.get();
+    channel->server = server;
+    channel->request_method = http_conn->request.get_request_method();
+    for (auto &header : http_conn->request.header_map) {
+        if (!http_proxy_skip_header(http_proxy_request_skip, header.first)) {
+            channel->request_headers.push_back(std::pair<std::string,std::string>(
+                std::string(header.first.data, header.first.length),
+                std::string(header.second.data, header.second.length)));
+        }
+    }
+    char addr_buf[64] = "";
+    socket_addr &addr = http_conn->conn.get_peer_addr();
+    if (addr.saddr.sa_family == AF_INET) {
+        inet_ntop(addr.saddr.sa_family, (void*)&addr.ip4addr.sin_addr, addr_buf, sizeof(addr_buf));
+    }
+    if (addr.saddr.sa_family == AF_INET6) {
+        inet_ntop(addr.saddr.sa_family, (void*)&addr.ip6addr.sin6_addr, addr_buf, sizeof(addr_buf));
+    }
+    const char* forwarded_for_str = http_conn->request.get_header_string("X-Forwarded-For");
+    if (forwarded_for_str) {
+        for (auto &header : channel->request_headers) {
+            if (strcasecmp(header.first.c_str(), "X-Forwarded-For") == 0) {
+                header.second = header.second + ", " + addr_buf;
+            }
+        }
+    } else {
+        channel->request_headers.push_back(std::pair<std::string,std::string>("X-Forwarded-For", addr_buf));
+    }
+    channel->request_has_body = http_conn->request_has_body;
+    channel->decode_chunked = http_version != HTTPVersion11;
+    channel->splice = delegate->get_config()->proxy_splice && http_conn->conn.can_splice() &&
+        server->url->scheme == "http";
+    channel->cache_store = http_conn->cache_store;
+    channel->server_thread = delegate;
+    channel->server_conn_id = http_conn->conn.get_id();
+    if (http_conn->request_has_body) {
+        size_t pipe_size = delegate->get_config()->proxy_buffer_size;
+        bool splice = channel->splice && !request_chunked && request_length >= HTTP_PROXY_SPLICE_MIN;
+        if (!splice || !channel->request_pipe.open_splice(pipe_size)) {
+            if (!request_chunked) {
+                pipe_size = std::min(pipe_size, (size_t)request_length);
+            }
+            channel->request_pipe.resize(pipe_size);
+        }
+    }
+
+    auto handler = std::make_shared<http_client_handler_proxy>(channel, request_method);
+    auto req = std::make_shared<http_client_request>(request_method, server->url, handler);
+    req->path = upstream_path();
+    req->host = server->url->port == 80 ? server->url->host : server->name;
+
+    // one request per upstream connection, idle connections are reused from the host pool
+    server->requests++;
+    server->active++;
+    if (!http_client::submit_request(delegate->get_engine_delegate(), req, 1)) {
+        log_error("%s: no connection available for upstream %s",
+                  http_server::get_proto()->name.c_str(), server->name.c_str());
+        server->active--;
+        server->failures++;
+        channel = http_proxy_channel_ptr();
+        return false;
+    }
+
+    return true;
+}
+
+io_result http_server_handler_proxy::splice_request_body()
+{
+    auto &buffer = http_conn->buffer;
+    auto &pipe = channel->request_pipe;
+
+    while (!request_body_finished()) {
+        size_t queued, space;
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            queued = pipe.bytes_readable();
+            space = pipe.bytes_writable();
+            if (channel->failed) {
+                discard_body = true;
+                return io_result(0);
+            } else if (space == 0) {
+                channel->server_thread = delegate;
+                channel->server_waiting = true;
+                delegate->remove_events(http_conn);
+                return io_result(io_error(EAGAIN));
+            }
+        }
+
+        // consume no more than the rest of this body, a pipelined request may follow it
+        size_t len = std::min(space, (size_t)(request_length - request_read));
+        io_result result = pipe.splice_in(http_conn->conn, buffer, len);
+        if (result.would_block()) {
+            // the kernel pipe can fill before its byte count does, the upstream wakes us as it drains
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            if (pipe.bytes_readable() > 0) {
+                channel->server_thread = delegate;
+                channel->server_waiting = true;
+                delegate->remove_events(http_conn);
+                return result;
+            } else if (queued > 0) {
+                continue;
+            }
+            return result;
+        } else if (result.has_error()) {
+            return result;
+        } else if (result.size() == 0) {
+            return io_result(io_error(ECONNRESET));
+        }
+
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        request_read += result.size();
+        pipe.splice_bytes += result.size();
+        pipe.eof = request_body_finished();
+        channel->wake_upstream();
+    }
+
+    return io_result(0);
+}
+
+io_result http_server_handler_proxy::splice_response_body()
+{
+    auto &buffer = http_conn->buffer;
+    auto &pipe = channel->response_pipe;
+
+    // the response headers go out before any of the body is spliced after them
+    while (buffer.bytes_readable() > 0) {
+        io_result result = buffer.buffer_write(http_conn->conn);
+        if (result.has_error()) {
+            return result;
+        }
+    }
+    buffer.reset();
+
+    while (true) {
+        size_t queued;
+        {
+            std::lock_guard<std::mutex> lock(channel->mutex);
+            queued = pipe.bytes_readable();
+            if (queued == 0) {
+                if (pipe.eof) {
+                    return io_result(0);
+                } else if (channel->failed) {
+                    return io_result(io_error(ECONNRESET));
+                }
+                channel->server_thread = delegate;
+                channel->server_waiting = true;
+                delegate->remove_events(http_conn);
+                return io_result(io_error(EAGAIN));
+            }
+        }
+
+        // would block leaves the poll waiting for the socket to drain
+        io_result result = pipe.splice_out(http_conn->conn, queued);
+        if (result.has_error()) {
+            return result;
+        }
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        pipe.splice_bytes -= result.size();
+        channel->wake_upstream();
+    }
+}
+
+uint64_t http_server_handler_proxy::request_hash()
+{
+    auto upstream = location->upstream;
+    switch (upstream->hash_key) {
+        case http_upstream_hash_key_header:
+            for (auto &header : http_conn->request.header_map) {
+                if (header.first.length == upstream->hash_header.length() &&
+                    strncasecmp(header.first.data, upstream->hash_header.c_str(), header.first.length) == 0) {
+                    return http_server_upstream::hash(header.second.data, header.second.length);
+                }
+            }
+            return 0;
+        case http_upstream_hash_key_ip:
+        {
+            socket_addr &addr = http_conn->conn.get_peer_addr();
+            if (addr.saddr.sa_family == AF_INET6) {
+                return http_server_upstream::hash((const char*)&addr.ip6addr.sin6_addr, sizeof(addr.ip6addr.sin6_addr));
+            }
+            return http_server_upstream::hash((const char*)&addr.ip4addr.sin_addr, sizeof(addr.ip4addr.sin_addr));
+        }
+        case http_upstream_hash_key_path:
+        default:
+        {
+            const char *path = http_conn->request.get_request_path();
+            return http_server_upstream::hash(path, strlen(path));
+        }
+    }
+}
+
+std::string http_server_handler_proxy::upstream_path()
+{
+    // the location uri is replaced by the proxy_pass uri when one is given
+    std::string path = http_conn->request.get_request_path();
+    if (location->proxy_uri.length() > 0 && path.compare(0, location->uri.length(), location->uri) == 0) {
+        path = location->proxy_uri + path.substr(location->uri.length());
+    }
+    const char *query_str = http_conn->request.get_query_string();
+    if (query_str && *query_str) {
+        path = path + "?" + query_str;
+    }
+    return path;
+}
+
+size_t http_server_handler_proxy::frame_request_body(const char *buf, size_t len)
+{
+    // consume no more than the rest of this body, a pipelined request may follow it
+    size_t consumed = 0;
+    if (request_chunked) {
+        while (consumed < len && !chunked_decoder.is_done()) {
+            const char *data;
+            size_t data_len;
+            consumed += chunked_decoder.decode(buf + consumed, len - consumed, data, data_len);
+            if (chunked_decoder.has_error()) {
+                break;
+            }
+        }
+    } else {
+        consumed = std::min((ssize_t)len, request_length - request_read);
+    }
+    request_read += consumed;
+    return consumed;
+}
+
+bool http_server_handler_proxy::request_body_finished() const
+{
+    return request_chunked ? chunked_decoder.is_done() : request_read == request_length;
+}
@@ -0,0 +1,283 @@
+//
+//  http_server_handler_proxy.h
+//
+
+#ifndef http_server_handler_proxy_h
+#define http_server_handler_proxy_h
+
+#define HTTP_PROXY_LATENCY_MAX          (3600LL * 1000000LL)   /* histogram range in microseconds */
+#define HTTP_PROXY_MAX_FAILS_DEFAULT    3       /* consecutive failures before a server is ejected */
+#define HTTP_PROXY_FAIL_TIMEOUT_DEFAULT 10      /* first ejection in seconds, doubled while failures continue */
+#define HTTP_PROXY_FAIL_TIMEOUT_MAX     300
+#define HTTP_PROXY_HASH_POINTS          160     /* consistent hash ring points per server */
+#define HTTP_PROXY_EWMA_SHIFT           3       /* latency ewma weight is 1/8 */
+#define HTTP_PROXY_SPLICE_MIN           32768   /* smaller bodies are copied */
+#define HTTP_PROXY_SPLICE_POOL_MAX      256     /* idle kernel pipes kept for reuse */
+
+struct http_server_upstream_server;
+typedef std::shared_ptr<http_server_upstream_server> http_server_upstream_server_ptr;
+struct http_proxy_channel;
+typedef std::shared_ptr<http_proxy_channel> http_proxy_channel_ptr;
+typedef std::vector<std::pair<std::string,std::string>> http_proxy_header_list;
+
+
+/*
+ * http_server_upstream
+ *
+ * A named group of servers that locations proxy to. A proxy_pass to a
+ * host that is not an upstream gets an upstream with that one server.
+ * Servers keep request counts and header and response latency histograms
+ * for the stats handler.
+ *
+ * Selection reads only atomics and the hash ring, which is built before
+ * the engine starts. A server with max_fails consecutive failures is
+ * ejected for fail_timeout seconds, doubling while it keeps failing after
+ * each ejection, and when every server is ejected they are all eligible.
+ */
+
+enum http_upstream_policy {
+    http_upstream_policy_round_robin,
+    http_upstream_policy_least_outstanding,
+    http_upstream_policy_p2c_ewma,
+    http_upstream_policy_hash,
+};
+
+enum http_upstream_hash_key {
+    http_upstream_hash_key_path,
+    http_upstream_hash_key_header,
+    http_upstream_hash_key_ip,
+};
+
+struct http_server_upstream_server
+{
+    url_ptr                                     url;
+    std::string                                 name;
+    std::atomic<unsigned long>                  requests;
+    std::atomic<unsigned long>                  failures;
+    std::atomic<long>                           active;
+    std::atomic<unsigned long>                  bytes_read;
+    std::atomic<int64_t>                        ewma_usecs;         /* response latency, 0 until measured */
+    std::atomic<int>                            consecutive_failures;
+    std::atomic<int>                            backoff;            /* ejections since the last success */
+    std::atomic<uint64_t>                       ejected_until_usecs;
+    std::atomic<unsigned long>                  ejections;
+    std::mutex                                  latency_mutex;
+    hdr_histogram                               header_usecs;       /* request start to response headers */
+    hdr_histogram                               response_usecs;     /* request start to end of response body */
+
+    http_server_upstream_server(url_ptr url);
+
+    bool available(uint64_t now_usecs) const { return ejected_until_usecs.load(std::memory_order_relaxed) <= now_usecs; }
+    uint64_t load_score() const;
+
+    void record_latency(int64_t header_usecs, int64_t response_usecs);
+    void record_success(int64_t response_usecs);
+    bool record_failure(uint64_t now_usecs, int max_fails, int fail_timeout);
+};
+
+struct http_server_upstream
+{
+    typedef std::pair<uint64_t,size_t>          ring_point;
+
+    std::string                                 name;
+    http_upstream_policy                        policy;
+    http_upstream_hash_key                      hash_key;
+    std::string                                 hash_header;
+    int                                         max_fails;          /* 0 never ejects */
+    int                                         fail_timeout;
+    std::vector<http_server_upstream_server_ptr> servers;
+    std::vector<ring_point>                     hash_ring;
+    std::atomic<size_t>                         next_server;
+
+    http_server_upstream(std::string name);
+
+    static uint64_t hash(const char *data, size_t len);
+    static bool parse_policy(std::string policy, http_upstream_policy &result);
+    static std::string policy_to_string(http_upstream_policy policy);
+
+    void init();
+    http_server_upstream_server* choose_server(uint64_t key_hash, uint64_t now_usecs);
+    http_server_upstream_server* choose_round_robin(uint64_t now_usecs);
+    http_server_upstream_server* choose_least_outstanding(uint64_t now_usecs);
+    http_server_upstream_server* choose_p2c(uint64_t now_usecs);
+    http_server_upstream_server* choose_hash(uint64_t key_hash, uint64_t now_usecs);
+};
+
+
+/*
+ * http_proxy_pipe
+ *
+ * Bounded byte queue carrying a body between a server connection and an
+ * upstream client connection. A full pipe parks the writer and an empty
+ * one parks the reader, which is the backpressure in both directions.
+ * Access is guarded by the channel mutex.
+ *
+ * A body passed through unchanged between two plain TCP sockets instead
+ * goes through a kernel pipe taken from a shared pool and is moved with
+ * splice, so it is never copied to user space. Each end of the kernel pipe
+ * is used by one side and only the byte count is guarded by the mutex.
+ */
+
+struct http_proxy_pipe : io_reader
+{
+    std::vector<char>                           data;
+    size_t                                      front;
+    size_t                                      back;
+    bool                                        eof;
+    int                                         splice_fds[2];      /* kernel pipe, -1 when copying */
+    size_t                                      splice_size;
+    size_t                                      splice_bytes;       /* spliced in and not yet out */
+
+    http_proxy_pipe() : front(0), back(0), eof(false), splice_fds{-1, -1}, splice_size(0), splice_bytes(0) {}
+    ~http_proxy_pipe();
+
+    void resize(size_t size) { data.resize(size); }
+    bool is_spliced() const { return splice_fds[0] >= 0; }
+    size_t bytes_readable() const { return is_spliced() ? splice_bytes : back - front; }
+    size_t bytes_writable() const { return is_spliced() ? splice_size - std::min(splice_size, splice_bytes) : data.size() - (back - front); }
+
+    size_t write(const char *buf, size_t len);
+    io_result read(void *buf, size_t len);
+
+    bool open_splice(size_t size);
+    void close_splice();
+    io_result splice_in(connection &conn, io_ring_buffer &buffer, size_t len);
+    io_result splice_out(connection &conn, size_t len);
+};
+
+
+/*
+ * http_proxy_channel
+ *
+ * State shared by the server handler and the upstream client handler of
+ * one proxied request. The request line and headers are written before
+ * the request is submitted and the response headers before response_ready
+ * is set, everything else is guarded by the mutex. A side that has to wait
+ * for the other parks its connection and is woken with a resume message
+ * posted to the thread it parked on.
+ */
+
+struct http_proxy_channel
+{
+    std::mutex                                  mutex;
+
+    /* request */
+    http_server_upstream                        *upstream;
+    http_server_upstream_server                 *server;
+    bool                                        splice;             /* proxy_splice on, plain downstream, http upstream */
+    bool                                        cache_store;        /* the server connection may cache the response */
+    std::string                                 request_method;
+    http_proxy_header_list                      request_headers;
+    bool                                        request_has_body;
+    http_proxy_pipe                             request_pipe;
+
+    /* response */
+    bool                                        response_ready;
+    int                                         status_code;
+    std::string                                 reason_phrase;
+    http_proxy_header_list                      response_headers;
+    bool                                        response_has_body;
+    bool                                        response_chunked;
+    ssize_t                                     response_length;    /* -1 if not known */
+    bool                                        decode_chunked;     /* downstream can't take chunked */
+    http_proxy_pipe                             response_pipe;
+
+    /* completion */
+    bool                                        failed;
+    bool                                        server_gone;
+
+    /* parked connections */
+    protocol_thread_delegate                    *server_thread;
+    int                                         server_conn_id;
+    bool                                        server_waiting;
+    protocol_thread_delegate                    *upstream_thread;
+    int                                         upstream_conn_id;
+    bool                                        upstream_waiting;
+
+    http_proxy_channel();
+
+    void wake_server();
+    void wake_upstream();
+};
+
+
+/* http_client_handler_proxy */
+
+struct http_client_handler_proxy : http_client_handler
+{
+    http_proxy_channel_ptr                      channel;
+    HTTPMethod                                  request_method;
+    ssize_t                                     content_length;
+    ssize_t                                     total_read;
+    bool                                        chunked;
+    bool                                        completed;
+    http_chunked_decoder                        chunked_decoder;
+    uint64_t                                    start_usecs;
+    uint64_t                                    header_usecs;
+
+    http_client_handler_proxy(http_proxy_channel_ptr channel, HTTPMethod request_method);
+
+    virtual void init();
+    virtual bool populate_request();
+    virtual io_result write_request_body();
+    virtual bool handle_response();
+    virtual io_result read_response_body();
+    virtual bool end_request();
+    virtual void abort_request();
+
+    io_result splice_request_body();
+    io_result splice_response_body();
+    bool body_finished() const;
+    void complete(bool success);
+};
+
+
+/*
+ * http_server_handler_proxy
+ *
+ * Forwards requests to an upstream with the http_client protocol running
+ * in the same engine, over keepalive connections from its host pools.
+ * Request and response bodies are streamed through bounded pipes so a slow
+ * client or upstream holds at most proxy_buffer_size bytes per direction.
+ */
+
+struct http_server_handler_proxy : http_server_handler
+{
+    HTTPVersion                                 http_version;
+    HTTPMethod                                  request_method;
+    http_proxy_channel_ptr                      channel;
+    int                                         status_code;        /* set for locally generated responses */
+    std::string                                 status_text;
+    io_buffer                                   error_buffer;
+    ssize_t                                     request_length;
+    ssize_t                                     request_read;
+    bool                                        request_chunked;
+    bool                                        discard_body;       /* read the request body and drop it */
+    bool                                        close_connection;
+    http_chunked_decoder                        chunked_decoder;
+
+    http_server_handler_proxy();
+    ~http_server_handler_proxy();
+
+    static void init_handler();
+
+    virtual size_t create_error_response();
+
+    virtual void init();
+    virtual bool handle_request();
+    virtual io_result read_request_body();
+    virtual bool response_ready();
+    virtual bool populate_response();
+    virtual io_result write_response_body();
+    virtual bool end_request();
+
+    bool submit_request();
+    io_result splice_request_body();
+    io_result splice_response_body();
+    uint64_t request_hash();
+    std::string upstream_path();
+    size_t frame_request_body(const char *buf, size_t len);
+    bool request_body_finished() const;
+};
+
+#endif
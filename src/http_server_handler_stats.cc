@@ -20,7 +20,9 @@
 #include <algorithm>
 #include <functional>
 #include <deque>
+#include <list>
 #include <map>
+#include <unordered_map>
 #include <atomic>
 #include <memory>
 #include <thread>
@@ -30,7 +32,9 @@
 #include "io.h"
 #include "url.h"
 #include "log.h"
+#include "os.h"
 #include "log_thread.h"
+#include "hdr_histogram.h"
 #include "trie.h"
 #include "socket.h"
 #include "socket_unix.h"
@@ -52,7 +56,10 @@
 #include "http_response.h"
 #include "http_date.h"
 #include "http_server.h"
+#include "http_server_cache.h"
+#include "http_client.h"
 #include "http_server_handler_stats.h"
+#include "http_server_handler_proxy.h"
 
 
 /* http_server_handler_stats */
@@ -106,6 +113,10 @@ bool http_server_handler_stats::handle_request()
     auto server_cfg = cfg->get_config<http_server>();
 
     std::stringstream ss;
+    ss << "process" << std::endl;
+    ss << "  rss        " << os::resident_set_size() << std::endl;
+    ss << std::endl;
+
     size_t engine_num = 0;
     for (auto engine : protocol_engine::engine_list)
     {
@@ -128,11 +139,38 @@ bool http_server_handler_stats::handle_request()
         ss << "    free       " << connections_free << std::endl;
         ss << "    inuse      " << (connections_total - connections_free) << std::endl;
         ss << "    accepts    " << http_engine_state->stats.connections_accepted << std::endl;
+        ss << "    bursts     " << http_engine_state->stats.accept_bursts << std::endl;
+        ss << "    burstmax   " << http_engine_state->stats.accept_burst_max << std::endl;
+        ss << "    pauses     " << http_engine_state->stats.accept_pauses << std::endl;
+        ss << "    resumes    " << http_engine_state->stats.accept_resumes << std::endl;
         ss << "    closes     " << http_engine_state->stats.connections_closed << std::endl;
         ss << "    aborts     " << http_engine_state->stats.connections_aborted << std::endl;
         ss << "    keepalives " << http_engine_state->stats.connections_keepalive << std::endl;
         ss << "    lingers    " << http_engine_state->stats.connections_linger << std::endl;
         ss << "    requests   " << http_engine_state->stats.requests_processed << std::endl;
+        ss << "    unlogged   " << http_engine_state->stats.requests_unlogged << std::endl;
+        ss << "    ktls       " << http_engine_state->stats.tls_ktls << std::endl;
+        unsigned long handshakes = http_engine_state->stats.tls_handshakes;
+        ss << "  tls_handshakes" << std::endl;
+        ss << "    completed  " << handshakes << std::endl;
+        ss << "    failed     " << http_engine_state->stats.tls_handshake_failures << std::endl;
+        ss << "    avgusecs   " << (handshakes ? http_engine_state->stats.tls_handshake_usecs / handshakes : 0) << std::endl;
+        ss << "    maxusecs   " << http_engine_state->stats.tls_handshake_usecs_max << std::endl;
+        ss << "    queue      " << http_engine_state->stats.tls_handshake_queue << std::endl;
+        ss << "    queuemax   " << http_engine_state->stats.tls_handshake_queue_max << std::endl;
+        auto cache = http_engine_state->cache;
+        if (cache) {
+            ss << "  cache" << std::endl;
+            ss << "    entries    " << cache->entries() << std::endl;
+            ss << "    bytes      " << cache->bytes() << std::endl;
+            ss << "    maxbytes   " << cache->max_size << std::endl;
+            ss << "    hits       " << cache->hits << std::endl;
+            ss << "    misses     " << cache->misses << std::endl;
+            ss << "    stores     " << cache->stores << std::endl;
+            ss << "    evictions  " << cache->evictions << std::endl;
+            ss << "    expired    " << cache->expirations << std::endl;
+            ss << "    invalidated " << cache->invalidations << std::endl;
+        }
     }
     ss << std::endl;
 
@@ -144,6 +182,12 @@ bool http_server_handler_stats::handle_request()
         for (auto server_name : vhost->server_names) {
             ss << "    " << server_name << std::endl;
         }
+        if (vhost->access_log_sink) {
+            ss << "  access_log" << std::endl;
+            ss << "    written    " << vhost->access_log_sink->records_written << std::endl;
+            ss << "    dropped    " << vhost->access_log_sink->records_dropped << std::endl;
+            ss << "    stalls     " << vhost->access_log_sink->writer_stalls << std::endl;
+        }
         ss << "  locations" << std::endl;
         size_t location_num = 0;
         for (auto location : vhost->location_list) {
@@ -158,10 +202,42 @@ bool http_server_handler_stats::handle_request()
             if (location->index_files.size() > 0) {
                 ss << "      index   " << config::join(location->index_files) << std::endl;
             }
+            if (location->proxy_pass.length() > 0) {
+                ss << "      proxy   " << location->proxy_pass << std::endl;
+            }
         }
     }
     ss << std::endl;
 
+    for (auto &upstream_ent : server_cfg->upstream_map)
+    {
+        auto upstream = upstream_ent.second;
+        uint64_t now_usecs = os::current_time_usecs();
+        ss << "http-upstream-" << upstream->name << std::endl;
+        ss << "  balance      " << http_server_upstream::policy_to_string(upstream->policy) << std::endl;
+        for (auto server : upstream->servers) {
+            ss << "  " << server->name << std::endl;
+            ss << "    requests   " << server->requests << std::endl;
+            ss << "    failures   " << server->failures << std::endl;
+            ss << "    active     " << server->active << std::endl;
+            ss << "    bytes      " << server->bytes_read << std::endl;
+            ss << "    ewmausecs  " << server->ewma_usecs << std::endl;
+            ss << "    ejections  " << server->ejections << std::endl;
+            ss << "    ejected    " << (server->available(now_usecs) ? 0 :
+                (server->ejected_until_usecs - now_usecs + 999999) / 1000000) << std::endl;
+            std::lock_guard<std::mutex> lock(server->latency_mutex);
+            ss << "    header     p50=" << server->header_usecs.value_at_percentile(50.0)
+               << " p90=" << server->header_usecs.value_at_percentile(90.0)
+               << " p99=" << server->header_usecs.value_at_percentile(99.0) << std::endl;
+            ss << "    response   p50=" << server->response_usecs.value_at_percentile(50.0)
+               << " p90=" << server->response_usecs.value_at_percentile(90.0)
+               << " p99=" << server->response_usecs.value_at_percentile(99.0) << std::endl;
+        }
+    }
+    if (server_cfg->upstream_map.size() > 0) {
+        ss << std::endl;
+    }
+
     std::string str = ss.str();;
     if (response_buffer.size() < str.length()) {
         response_buffer.resize(str.length());
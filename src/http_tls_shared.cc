@@ -20,12 +20,15 @@
 #include <atomic>
 #include <deque>
 #include <map>
+#include <unordered_map>
 #include <chrono>
 #include <condition_variable>
 
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
 
 #include "io.h"
 #include "hex.h"
@@ -75,13 +78,41 @@ static unsigned char dh1024_p[] = {
 
 static unsigned char dh1024_g[] = { 0x02 };
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L || defined(OPENSSL_IS_BORINGSSL)
+#define tls_session_up_ref(sess) SSL_SESSION_up_ref(sess)
+#else
+#define tls_session_up_ref(sess) CRYPTO_add(&(sess)->references, 1, CRYPTO_LOCK_SSL_SESSION)
+#endif
+
+
+/* http_tls_session_id_hash */
+
+uint64_t http_tls_session_id_hash::seed = 0;
+
+size_t http_tls_session_id_hash::operator()(const http_tls_session_id &id) const
+{
+    // seeded so peers can't choose ids that collide
+    uint64_t h = seed ^ id.len;
+    for (size_t i = 0; i < id.len; i += 8) {
+        uint64_t v = 0;
+        memcpy(&v, id.data + i, std::min((size_t)8, (size_t)id.len - i));
+        h ^= v;
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (size_t)h;
+}
+
+
 /* http_tls_shared */
 
 bool http_tls_shared::tls_session_debug = false;
-const int http_tls_shared::max_session_count = 32768;
-std::mutex http_tls_shared::session_mutex;
-http_tls_session_map http_tls_shared::session_map;
-http_tls_session_dequeue http_tls_shared::session_deque;
+http_tls_session_shard http_tls_shared::session_shards[HTTP_TLS_SESSION_SHARDS];
+http_tls_ticket_key http_tls_shared::ticket_keys[HTTP_TLS_TICKET_KEYS];
+std::atomic<unsigned long> http_tls_shared::ticket_key_generation(0);
+std::atomic<time_t> http_tls_shared::ticket_key_rotate_time(0);
+std::mutex http_tls_shared::ticket_key_mutex;
+std::once_flag http_tls_shared::session_init_flag;
 std::once_flag http_tls_shared::lock_init_flag;
 std::vector<std::shared_ptr<std::mutex>> http_tls_shared::locks;
 
@@ -113,35 +144,41 @@ int http_tls_shared::tls_log_errors(const char *str, size_t len, void *bio)
     return 0;
 }
 
-void http_tls_shared::tls_expire_sessions(SSL_CTX *ctx)
+http_tls_session_shard& http_tls_shared::tls_session_shard(const http_tls_session_id &id)
+{
+    // the map uses the low bits of the same hash
+    size_t h = http_tls_session_id_hash()(id);
+    return session_shards[(h >> 32) & (HTTP_TLS_SESSION_SHARDS - 1)];
+}
+
+void http_tls_shared::tls_expire_sessions(http_tls_session_shard &shard, config *cfg, time_t current_time)
 {
     // Notes on expiring sessions
     //
-    // 1. To be called with session_mutex held
-    // 2. Called when fetching a new session
+    // 1. To be called with the shard mutex held
+    // 2. Called when adding a new session so the cost is amortized
     // 3. Dequeue is in FIFO order, oldest session first
-    // 4. tls_remove_session_cb does not remove items from
-    //    the dequeue as this would require a linear scan,
-    //    so not all sessions exist in the id to session map.
-    
-    config *cfg = static_cast<config*>(SSL_CTX_get_ex_data(ctx, 0));
-    time_t current_time = time(nullptr);
-    for (auto si = session_deque.begin(); si != session_deque.end(); ) {
-        auto &tls_sess = *si;
-        // expire sessions that are older than the timeout value
-        // or if the number of sessions is larger than max_session_count
-        if (tls_sess->sess_time < current_time - cfg->tls_session_timeout ||
-            session_deque.size() > (size_t)cfg->tls_session_count)
-        {
+    // 4. tls_remove_session_cb does not remove items from the dequeue
+    //    so entries whose session has been removed or replaced are skipped
+    
+    size_t shard_limit = std::max(cfg->tls_session_count / HTTP_TLS_SESSION_SHARDS, 1);
+    while (shard.session_deque.size() > 0) {
+        auto &ent = shard.session_deque.front();
+        auto si = shard.session_map.find(ent.first);
+        if (si != shard.session_map.end() && si->second.sess == ent.second) {
+            if (si->second.sess_time >= current_time - cfg->tls_session_timeout &&
+                shard.session_map.size() < shard_limit)
+            {
+                break;
+            }
             if (tls_session_debug) {
-                log_debug("%s: expiring session: id=%s", __func__, tls_sess->sess_key.c_str());
+                log_debug("%s: expiring session: id=%s", __func__,
+                          hex::encode(ent.first.data, ent.first.len).c_str());
             }
-            
-            session_map.erase(tls_sess->sess_key);
-            si = session_deque.erase(si);
-        } else {
-            break;
+            SSL_SESSION_free(si->second.sess);
+            shard.session_map.erase(si);
         }
+        shard.session_deque.pop_front();
     }
 }
 
@@ -149,78 +186,156 @@ int http_tls_shared::tls_new_session_cb(struct ssl_st *ssl, SSL_SESSION *sess)
 {
     unsigned int sess_id_len;
     const unsigned char *sess_id = SSL_SESSION_get_id(sess, &sess_id_len);
-    std::string sess_key = hex::encode(sess_id, sess_id_len);
-    
-    session_mutex.lock();
-    size_t sess_der_len = i2d_SSL_SESSION(sess, NULL);
-    unsigned char *sess_der = new unsigned char[sess_der_len];
+    http_tls_session_id id(sess_id, sess_id_len);
+    config *cfg = static_cast<config*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), 0));
     time_t current_time = time(nullptr);
-    if (sess_der) {
-        unsigned char *p = sess_der;
-        i2d_SSL_SESSION(sess, &p);
-        auto si = session_map.insert(http_tls_session_entry
-            (sess_key, std::make_shared<http_tls_session>(sess_key, current_time, sess_der, sess_der_len)));
-        auto &tls_sess = *si.first->second;
-        session_deque.push_back(si.first->second);
-        session_mutex.unlock();
-        
-        if (tls_session_debug) {
-            log_debug("%s: added session: id=%s len=%lu", __func__, sess_key.c_str(), tls_sess.sess_der_len);
-        }
-        
-        return 0;
+    
+    // the cache keeps the reference passed to us
+    auto &shard = tls_session_shard(id);
+    shard.mutex.lock();
+    tls_expire_sessions(shard, cfg, current_time);
+    auto si = shard.session_map.find(id);
+    if (si != shard.session_map.end()) {
+        SSL_SESSION_free(si->second.sess);
+        si->second.sess = sess;
+        si->second.sess_time = current_time;
     } else {
-        session_mutex.unlock();
-        
-        if (tls_session_debug) {
-            log_debug("%s: failed to add session: id=%s", __func__, sess_key.c_str());
-        }
-        
-        return -1;
+        shard.session_map.insert(std::pair<http_tls_session_id,http_tls_session>(id, http_tls_session{sess, current_time}));
     }
+    shard.session_deque.push_back(std::pair<http_tls_session_id,SSL_SESSION*>(id, sess));
+    shard.mutex.unlock();
+    
+    if (tls_session_debug) {
+        log_debug("%s: added session: id=%s", __func__, hex::encode(sess_id, sess_id_len).c_str());
+    }
+    
+    return 1;
 }
 
 void http_tls_shared::tls_remove_session_cb(struct ssl_ctx_st *ctx, SSL_SESSION *sess)
 {
     unsigned int sess_id_len;
     const unsigned char *sess_id = SSL_SESSION_get_id(sess, &sess_id_len);
-    std::string sess_key = hex::encode(sess_id, sess_id_len);
-    
-    session_mutex.lock();
-    session_map.erase(sess_key);
-    session_mutex.unlock();
+    http_tls_session_id id(sess_id, sess_id_len);
+    
+    auto &shard = tls_session_shard(id);
+    shard.mutex.lock();
+    auto si = shard.session_map.find(id);
+    if (si != shard.session_map.end()) {
+        SSL_SESSION_free(si->second.sess);
+        shard.session_map.erase(si);
+    }
+    shard.mutex.unlock();
     
     if (tls_session_debug) {
-        log_debug("%s: removed session: id=%s", __func__, sess_key.c_str());
+        log_debug("%s: removed session: id=%s", __func__, hex::encode(sess_id, sess_id_len).c_str());
     }
 }
 
 SSL_SESSION * http_tls_shared::tls_get_session_cb(struct ssl_st *ssl, unsigned char *sess_id, int sess_id_len, int *copy)
 {
     *copy = 0;
-    std::string sess_key = hex::encode(sess_id, sess_id_len);
-    
-    session_mutex.lock();
-    tls_expire_sessions(ssl->ctx);
-    auto si = session_map.find(sess_key);
-    if (si != session_map.end()) {
-        auto &tls_sess = *si->second;
-        session_mutex.unlock();
-        
-        if (tls_session_debug) {
-            log_debug("%s: lookup session: cache hit: id=%s len=%lu", __func__, sess_key.c_str(), tls_sess.sess_der_len);
+    if (sess_id_len <= 0 || sess_id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return nullptr;
+    }
+    http_tls_session_id id(sess_id, sess_id_len);
+    config *cfg = static_cast<config*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), 0));
+    time_t current_time = time(nullptr);
+    
+    // take a reference for the caller while the shard is locked
+    SSL_SESSION *sess = nullptr;
+    auto &shard = tls_session_shard(id);
+    shard.mutex.lock();
+    auto si = shard.session_map.find(id);
+    if (si != shard.session_map.end() && si->second.sess_time >= current_time - cfg->tls_session_timeout) {
+        sess = si->second.sess;
+        tls_session_up_ref(sess);
+    }
+    shard.mutex.unlock();
+    
+    if (tls_session_debug) {
+        log_debug("%s: lookup session: cache %s: id=%s", __func__, sess ? "hit" : "miss",
+                  hex::encode(sess_id, sess_id_len).c_str());
+    }
+    
+    return sess;
+}
+
+void http_tls_shared::tls_flush_sessions()
+{
+    for (auto &shard : session_shards) {
+        shard.mutex.lock();
+        for (auto &ent : shard.session_map) {
+            SSL_SESSION_free(ent.second.sess);
         }
-        
-        unsigned const char *p = tls_sess.sess_der;
-        return d2i_SSL_SESSION(NULL, &p, tls_sess.sess_der_len);
+        shard.session_map.clear();
+        shard.session_deque.clear();
+        shard.mutex.unlock();
+    }
+}
+
+void http_tls_shared::tls_rotate_ticket_keys(config *cfg, time_t current_time)
+{
+    // readers use the current and previous slots, the next slot is
+    // the oldest key and is only overwritten at rotation
+    unsigned long generation = ticket_key_generation.load();
+    http_tls_ticket_key &key = ticket_keys[(generation + 1) % HTTP_TLS_TICKET_KEYS];
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1 ||
+        RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1)
+    {
+        log_error("%s: RAND_bytes failed", __func__);
+        return;
+    }
+    ticket_key_generation.store(generation + 1);
+    ticket_key_rotate_time.store(current_time + cfg->tls_ticket_rotation);
+    
+    if (tls_session_debug) {
+        log_debug("%s: rotated ticket key: name=%s", __func__, hex::encode(key.name, sizeof(key.name)).c_str());
+    }
+}
+
+int http_tls_shared::tls_ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                       EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+{
+    config *cfg = static_cast<config*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), 0));
+    time_t current_time = time(nullptr);
+    
+    // rotate lazily, one thread wins and the others continue with the current key
+    if (current_time >= ticket_key_rotate_time.load(std::memory_order_relaxed) && ticket_key_mutex.try_lock()) {
+        if (current_time >= ticket_key_rotate_time.load()) {
+            tls_rotate_ticket_keys(cfg, current_time);
+        }
+        ticket_key_mutex.unlock();
+    }
+    
+    unsigned long generation = ticket_key_generation.load();
+    if (enc) {
+        http_tls_ticket_key &key = ticket_keys[generation % HTTP_TLS_TICKET_KEYS];
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+            return -1;
+        }
+        memcpy(key_name, key.name, sizeof(key.name));
+        EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv);
+        HMAC_Init_ex(hmac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL);
+        return 1;
+    }
+    
+    // accept the current and previous keys, renewing tickets from the previous key.
+    // generation 0 is the unused zero key
+    for (unsigned long i = 0; i < 2 && i < generation; i++) {
+        http_tls_ticket_key &key = ticket_keys[(generation - i) % HTTP_TLS_TICKET_KEYS];
+        if (memcmp(key_name, key.name, sizeof(key.name)) != 0) continue;
+        HMAC_Init_ex(hmac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL);
+        EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv);
+        return i == 0 ? 1 : 2;
     }
-    session_mutex.unlock();
     
     if (tls_session_debug) {
-        log_debug("%s: lookup session: cache miss: id=%s", __func__, sess_key.c_str());
+        log_debug("%s: unknown ticket key: name=%s", __func__, hex::encode(key_name, 16).c_str());
     }
     
-    return nullptr;
+    return 0;
 }
 
 int http_tls_shared::tls_servername_cb(SSL *ssl, int *ad, void *arg)
@@ -232,6 +347,21 @@ int http_tls_shared::tls_servername_cb(SSL *ssl, int *ad, void *arg)
         
         if (vhost && vhost->ssl_ctx) {
             SSL_set_SSL_CTX(ssl, vhost->ssl_ctx);
+            
+            // ciphers and curves are copied at SSL_new so apply the vhost's before negotiation
+            if (vhost->tls_cipher_list.length() > 0) {
+                SSL_set_cipher_list(ssl, vhost->tls_cipher_list.c_str());
+            }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L || defined(OPENSSL_IS_BORINGSSL)
+            if (vhost->tls_curves.length() > 0) {
+                SSL_set1_curves_list(ssl, vhost->tls_curves.c_str());
+            }
+#endif
+            if (vhost->tls_prefer_server_ciphers) {
+                SSL_set_options(ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+            } else {
+                SSL_clear_options(ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+            }
         }
     }
     
@@ -246,13 +376,21 @@ void http_tls_shared::init_dh(SSL_CTX *ctx)
         log_fatal_exit("%s: DH_new failed", __func__);
     }
     
-    dh->p = BN_bin2bn(dh1024_p, sizeof(dh1024_p), NULL);
-    dh->g = BN_bin2bn(dh1024_g, sizeof(dh1024_g), NULL);
+    BIGNUM *p = BN_bin2bn(dh1024_p, sizeof(dh1024_p), NULL);
+    BIGNUM *g = BN_bin2bn(dh1024_g, sizeof(dh1024_g), NULL);
 
-    if (dh->p == NULL || dh->g == NULL) {
+    if (p == NULL || g == NULL) {
+        BN_free(p);
+        BN_free(g);
         DH_free(dh);
         log_fatal_exit("%s: BN_bin2bn failed", __func__);
     }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L || defined(OPENSSL_IS_BORINGSSL)
+    DH_set0_pqg(dh, p, NULL, g);
+#else
+    dh->p = p;
+    dh->g = g;
+#endif
     
     SSL_CTX_set_options(ctx, SSL_OP_SINGLE_DH_USE);
     
@@ -276,6 +414,25 @@ void http_tls_shared::init_ecdh(SSL_CTX *ctx, int curve)
     EC_KEY_free(ecdh);
 }
 
+void http_tls_shared::init_curves(SSL_CTX *ctx, std::string tls_curves)
+{
+    // ECDHE with the first mutually supported curve in the list, P-256 if the list is unusable
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L || defined(OPENSSL_IS_BORINGSSL)
+    if (tls_curves.length() > 0) {
+        if (SSL_CTX_set1_curves_list(ctx, tls_curves.c_str()) == 1) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(OPENSSL_IS_BORINGSSL)
+            SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+            SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
+            return;
+        }
+        ERR_print_errors_cb(http_tls_shared::tls_log_errors, NULL);
+        log_error("%s: unsupported curve list: %s: using P-256", __func__, tls_curves.c_str());
+    }
+#endif
+    init_ecdh(ctx, NID_X9_62_prime256v1);
+}
+
 SSL_CTX* http_tls_shared::init_client(protocol *proto, config_ptr cfg,
                                       std::string tls_cipher_list,
                                       std::string tls_ca_file)
@@ -295,8 +452,7 @@ SSL_CTX* http_tls_shared::init_client(protocol *proto, config_ptr cfg,
     SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
     SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
     
-    init_dh(ctx);
-    init_ecdh(ctx, NID_secp384r1);
+    init_curves(ctx, cfg->tls_curves);
     
     if (tls_cipher_list.length() > 0) {
         SSL_CTX_set_cipher_list(ctx, tls_cipher_list.c_str());
@@ -321,6 +477,8 @@ SSL_CTX* http_tls_shared::init_client(protocol *proto, config_ptr cfg,
 
 SSL_CTX* http_tls_shared::init_server(protocol *proto, config_ptr cfg,
                                       std::string tls_cipher_list,
+                                      std::string tls_curves,
+                                      bool tls_prefer_server_ciphers,
                                       std::string tls_key_file,
                                       std::string tls_cert_file)
 {
@@ -337,14 +495,35 @@ SSL_CTX* http_tls_shared::init_server(protocol *proto, config_ptr cfg,
     SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2);
     SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv3);
     SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
-    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
     
-    init_dh(ctx);
-    init_ecdh(ctx, NID_secp384r1);
+    // seed the session id hash and create the first ticket key
+    std::call_once(session_init_flag, [&](){
+        RAND_bytes((unsigned char*)&http_tls_session_id_hash::seed, sizeof(http_tls_session_id_hash::seed));
+        if (cfg->tls_session_tickets) {
+            tls_rotate_ticket_keys(cfg.get(), time(nullptr));
+        }
+    });
+    
+    // stateless session tickets with shared rotating keys
+    if (cfg->tls_session_tickets) {
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, http_tls_shared::tls_ticket_key_cb);
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+    SSL_CTX_set_timeout(ctx, cfg->tls_session_timeout);
+    
+    // DHE costs a modular exponentiation per full handshake so it is opt in
+    if (cfg->tls_dhe) {
+        init_dh(ctx);
+    }
+    init_curves(ctx, tls_curves);
     
     if (tls_cipher_list.length() > 0) {
         SSL_CTX_set_cipher_list(ctx, tls_cipher_list.c_str());
     }
+    if (tls_prefer_server_ciphers) {
+        SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    }
 
     SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_NO_INTERNAL |
                                         SSL_SESS_CACHE_NO_AUTO_CLEAR |
@@ -391,6 +570,7 @@ void http_tls_shared::thread_cleanup()
 
 void http_tls_shared::cleanup()
 {
+    tls_flush_sessions();
     ERR_remove_thread_state(nullptr);
     ERR_free_strings();
     EVP_cleanup();
@@ -5,47 +5,98 @@
 #ifndef http_tls_shared_h
 #define http_tls_shared_h
 
+#define HTTP_TLS_SESSION_SHARDS 64
+#define HTTP_TLS_TICKET_KEYS 3
+
+struct http_tls_session_id;
+struct http_tls_session_id_hash;
 struct http_tls_session;
-typedef std::shared_ptr<http_tls_session> http_tls_session_ptr;
-typedef std::map<std::string,http_tls_session_ptr> http_tls_session_map;
-typedef std::deque<http_tls_session_ptr> http_tls_session_dequeue;
-typedef std::pair<std::string,http_tls_session_ptr> http_tls_session_entry;
+struct http_tls_session_shard;
+struct http_tls_ticket_key;
+typedef std::unordered_map<http_tls_session_id,http_tls_session,http_tls_session_id_hash> http_tls_session_map;
+typedef std::deque<std::pair<http_tls_session_id,SSL_SESSION*>> http_tls_session_dequeue;
 
-struct http_tls_session
+
+/* http_tls_session_id */
+
+struct http_tls_session_id
 {
-    std::string sess_key;
-    time_t sess_time;
-    unsigned char *sess_der;
-    size_t sess_der_len;
-    
-    http_tls_session()
-        : sess_key(), sess_time(0), sess_der(nullptr), sess_der_len(0) {}
+    unsigned char len;
+    unsigned char data[SSL_MAX_SSL_SESSION_ID_LENGTH];
     
-    http_tls_session(std::string sess_key, time_t sess_time, unsigned char *sess_der, size_t sess_der_len)
-        : sess_key(sess_key), sess_time(sess_time), sess_der(sess_der), sess_der_len(sess_der_len) {}
-    
-    http_tls_session(const http_tls_session &o)
-        : sess_key(o.sess_key), sess_time(o.sess_time), sess_der(nullptr), sess_der_len(o.sess_der_len)
+    http_tls_session_id(const unsigned char *id, size_t id_len)
+        : len((unsigned char)std::min(id_len, sizeof(data)))
     {
-        if (o.sess_der && o.sess_der_len) {
-            sess_der = new unsigned char[sess_der_len];
-            memcpy(sess_der, o.sess_der, sess_der_len);
-        }
+        memcpy(data, id, len);
     }
     
-    ~http_tls_session()
+    bool operator==(const http_tls_session_id &o) const
     {
-        if (sess_der) delete [] sess_der;
+        return len == o.len && memcmp(data, o.data, len) == 0;
     }
 };
 
+struct http_tls_session_id_hash
+{
+    static uint64_t seed;
+    
+    size_t operator()(const http_tls_session_id &id) const;
+};
+
+
+/* http_tls_session */
+
+struct http_tls_session
+{
+    SSL_SESSION *sess;
+    time_t sess_time;
+};
+
+
+/*
+ * http_tls_session_shard
+ *
+ * Server side sessions are spread over shards by a seeded hash of the
+ * raw session id. Each shard has its own lock and a FIFO of insertions
+ * used to expire sessions by age or when the shard is over its share
+ * of tls_session_count. Cached SSL_SESSION objects are reference
+ * counted so a cache hit does not need to deserialize the session.
+ */
+
+struct http_tls_session_shard
+{
+    std::mutex mutex;
+    http_tls_session_map session_map;
+    http_tls_session_dequeue session_deque;
+    char pad[64];
+};
+
+
+/*
+ * http_tls_ticket_key
+ *
+ * Session ticket keys are shared by all server contexts so tickets are
+ * valid across SNI vhosts. Keys live in a small ring and rotate every
+ * tls_ticket_rotation seconds. The current key encrypts new tickets and
+ * the previous key is still accepted, in which case the ticket is renewed.
+ */
+
+struct http_tls_ticket_key
+{
+    unsigned char name[16];
+    unsigned char hmac_key[16];
+    unsigned char aes_key[16];
+};
+
 struct http_tls_shared
 {
     static bool tls_session_debug;
-    static const int max_session_count;
-    static std::mutex session_mutex;
-    static http_tls_session_map session_map;
-    static http_tls_session_dequeue session_deque;
+    static http_tls_session_shard session_shards[HTTP_TLS_SESSION_SHARDS];
+    static http_tls_ticket_key ticket_keys[HTTP_TLS_TICKET_KEYS];
+    static std::atomic<unsigned long> ticket_key_generation;
+    static std::atomic<time_t> ticket_key_rotate_time;
+    static std::mutex ticket_key_mutex;
+    static std::once_flag session_init_flag;
     static std::once_flag lock_init_flag;
     static std::vector<std::shared_ptr<std::mutex>> locks;
 
@@ -53,20 +104,29 @@ struct http_tls_shared
     static void tls_locking_function(int mode, int n, const char *file, int line);
     static int tls_log_errors(const char *str, size_t len, void *bio);
     
-    static void tls_expire_sessions(SSL_CTX *ctx);
+    static http_tls_session_shard& tls_session_shard(const http_tls_session_id &id);
+    static void tls_expire_sessions(http_tls_session_shard &shard, config *cfg, time_t current_time);
     static int tls_new_session_cb(struct ssl_st *ssl, SSL_SESSION *sess);
     static void tls_remove_session_cb(struct ssl_ctx_st *ctx, SSL_SESSION *sess);
     static SSL_SESSION * tls_get_session_cb(struct ssl_st *ssl, unsigned char *data, int len, int *copy);
+    static void tls_flush_sessions();
+    
+    static void tls_rotate_ticket_keys(config *cfg, time_t current_time);
+    static int tls_ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                 EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc);
 
     static int tls_servername_cb(SSL *ssl, int *ad, void *arg);
 
     static void init_dh(SSL_CTX *ctx);
     static void init_ecdh(SSL_CTX *ctx, int curve);
+    static void init_curves(SSL_CTX *ctx, std::string tls_curves);
     static SSL_CTX* init_client(protocol *proto, config_ptr cfg,
                                 std::string tls_cipher_list,
                                 std::string tls_ca_file);
     static SSL_CTX* init_server(protocol *proto, config_ptr cfg,
                                 std::string tls_cipher_list,
+                                std::string tls_curves,
+                                bool tls_prefer_server_ciphers,
                                 std::string tls_key_file,
                                 std::string tls_cert_file);
     static void thread_cleanup();
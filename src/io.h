@@ -43,6 +43,7 @@ struct io_result : std::pair<const ssize_t,const io_error>
     const ssize_t& size() const { return first; }
     const io_error& error() const { return second; }
     const bool has_error() const { return second.errcode != 0; }
+    const bool would_block() const { return second.errcode == EAGAIN; }
     std::string error_string() const { return second.to_string(); }
 };
 
@@ -28,6 +28,7 @@
 #include <functional>
 #include <map>
 #include <deque>
+#include <list>
 #include <vector>
 #include <unordered_map>
 #include <chrono>
@@ -35,12 +36,15 @@
 #include <mutex>
 #include <thread>
 #include <condition_variable>
+#include <future>
 
 #include "os.h"
 #include "io.h"
 #include "url.h"
 #include "log.h"
 #include "log_thread.h"
+#include "hdr_histogram.h"
+#include "alias_sampler.h"
 #include "trie.h"
 #include "socket.h"
 #include "socket_tcp.h"
@@ -55,6 +59,7 @@
 #include "pollset_poll.h"
 #include "pollset_epoll.h"
 #include "pollset_kqueue.h"
+#include "pollset_uring.h"
 #include "protocol.h"
 #include "connection.h"
 #include "connection.h"
@@ -68,11 +73,16 @@
 #include "http_request.h"
 #include "http_response.h"
 #include "http_date.h"
+#include "http_access_log.h"
 #include "http_server.h"
+#include "http_server_cache.h"
+#include "http_server_handler_cache.h"
 #include "http_server_handler_file.h"
 #include "http_server_handler_func.h"
 #include "http_server_handler_stats.h"
 #include "http_client.h"
 #include "http_client_handler_file.h"
+#include "http_client_handler_memory.h"
+#include "http_server_handler_proxy.h"
 
 #endif
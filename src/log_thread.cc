@@ -8,128 +8,301 @@
 #include <cassert>
 #include <cstring>
 #include <cerrno>
+#include <climits>
 #include <string>
 #include <vector>
-#include <queue>
+#include <map>
 #include <atomic>
 #include <thread>
 #include <mutex>
 #include <chrono>
 #include <condition_variable>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
 #include "io.h"
 #include "log.h"
-#include "queue_atomic.h"
 
 #include "log_thread.h"
 
-/* log_thread */
+#if !defined(IOV_MAX)
+#define IOV_MAX 1024
+#endif
 
-const bool log_thread::debug = false;
-const int log_thread::flush_interval_msecs = 100;
 
-log_thread::log_thread(int fd, size_t num_buffers) :
-    file(fdopen(fd, "w")),
-    num_buffers(num_buffers),
-    log_buffers_free(num_buffers),
-    log_buffers_inuse(num_buffers),
-    last_time(0),
-    running(true),
-    writer_waiting(false),
-    thread(&log_thread::mainloop, this)
+/* log_ring */
+
+static size_t log_ring_round_size(size_t size)
 {
-    create_buffers();
+    size_t ring_size = 4096;
+    while (ring_size < size) ring_size <<= 1;
+    return ring_size;
 }
 
-log_thread::~log_thread()
+log_ring::log_ring(size_t size) :
+    size(log_ring_round_size(size)),
+    mask(this->size - 1),
+    buffer(new char[this->size]),
+    head(0),
+    tail(0) {}
+
+log_ring::~log_ring()
 {
-    shutdown();
-    write_logs();
-    delete_buffers();
-    fclose(file);
+    delete [] buffer;
 }
 
-void log_thread::shutdown()
+bool log_ring::push(const char *data, size_t len)
 {
-    bool val = true;
-    if (running.compare_exchange_strong(val, false)) {
-        log_cond.notify_one();
-        thread.join();
-    }
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    if (size - (t - h) < len) return false;
+
+    size_t offset = t & mask;
+    size_t first = std::min(len, size - offset);
+    memcpy(buffer + offset, data, first);
+    memcpy(buffer, data + first, len - first);
+    tail.store(t + len, std::memory_order_release);
+    return true;
 }
 
-void log_thread::create_buffers()
+int log_ring::peek(struct iovec *iov)
 {
-    // create buffers
-    for (size_t i = 0; i < num_buffers; i++) {
-        char *buffer = new char[LOG_BUFFER_SIZE];
-        if (!buffer || !log_buffers_free.push_back(buffer)) {
-            log_error("%s: error creating log buffer", __func__);
-        }
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t len = t - h;
+    if (len == 0) return 0;
+
+    size_t offset = h & mask;
+    size_t first = std::min(len, size - offset);
+    iov[0].iov_base = buffer + offset;
+    iov[0].iov_len = first;
+    if (first == len) return 1;
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+
+/* log_sink */
+
+std::atomic<size_t> log_sink::next_id(0);
+
+log_sink::log_sink(int fd, size_t num_buffers, log_overflow_policy overflow) :
+    id(++next_id),
+    fd(fd),
+    owns_fd(false),
+    ring_size(log_ring_round_size(num_buffers * LOG_BUFFER_SIZE)),
+    overflow(overflow),
+    writer(nullptr),
+    last_time(0),
+    records_written(0),
+    records_dropped(0),
+    writer_stalls(0) {}
+
+log_sink::log_sink(std::string path, int fd, size_t num_buffers, log_overflow_policy overflow) :
+    id(++next_id),
+    path(path),
+    fd(fd),
+    owns_fd(true),
+    ring_size(log_ring_round_size(num_buffers * LOG_BUFFER_SIZE)),
+    overflow(overflow),
+    writer(nullptr),
+    last_time(0),
+    records_written(0),
+    records_dropped(0),
+    writer_stalls(0) {}
+
+log_sink::~log_sink()
+{
+    write_logs();
+    if (owns_fd && fd >= 0) {
+        close(fd);
     }
-    if (debug) {
-        log_debug("log_thread created %d buffers, %d bytes per buffer", num_buffers, LOG_BUFFER_SIZE);
+    for (auto ring : rings) {
+        delete ring;
     }
 }
 
-void log_thread::delete_buffers()
+log_ring* log_sink::get_ring()
 {
-    // delete buffers
-    for (size_t i = 0; i < num_buffers; i++) {
-        char *buffer = log_buffers_free.pop_front();
-        if (buffer) {
-            delete [] buffer;
-        } else {
-            log_error("%s: error deleting log buffer", __func__);
-        }
+    // indexed by sink id, ids are never reused so stale entries are harmless
+    static thread_local std::vector<log_ring*> ring_cache;
+    if (id < ring_cache.size() && ring_cache[id]) {
+        return ring_cache[id];
     }
+    log_ring *ring = new log_ring(ring_size);
+    rings_mutex.lock();
+    rings.push_back(ring);
+    rings_mutex.unlock();
+    if (id >= ring_cache.size()) {
+        ring_cache.resize(id + 1, nullptr);
+    }
+    ring_cache[id] = ring;
+    return ring;
 }
 
-void log_thread::write_logs()
+void log_sink::write_logs()
 {
-    char *buffer = nullptr;
-    while((buffer = log_buffers_inuse.pop_front())) {
-        io_result result = fwrite(buffer, 1, strlen(buffer), file);
-        if (result.has_error()) {
-            log_error("%s: error writing log entry", __func__);
+    std::lock_guard<std::mutex> drain_lock(drain_mutex);
+    std::vector<struct iovec> iov;
+    std::vector<std::pair<log_ring*,size_t>> pending;
+
+    rings_mutex.lock();
+    for (auto ring : rings) {
+        struct iovec ring_iov[2];
+        int n = ring->peek(ring_iov);
+        if (n == 0) continue;
+        iov.insert(iov.end(), ring_iov, ring_iov + n);
+        pending.push_back(std::pair<log_ring*,size_t>(ring, ring_iov[0].iov_len + (n == 2 ? ring_iov[1].iov_len : 0)));
+    }
+    rings_mutex.unlock();
+
+    // write in batches of up to IOV_MAX, consuming from each ring as it completes
+    size_t iov_offset = 0, ring_offset = 0, ring_written = 0;
+    while (iov_offset < iov.size()) {
+        int iovcnt = (int)std::min(iov.size() - iov_offset, (size_t)IOV_MAX);
+        ssize_t ret = writev(fd, &iov[iov_offset], iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            log_error("%s: error writing log: %s", __func__, strerror(errno));
+            break;
         }
-        if (!log_buffers_free.push_back(buffer)) {
-            log_error("%s: error returning log buffer", __func__);
+        size_t len = (size_t)ret;
+        while (len > 0) {
+            size_t n = std::min(len, iov[iov_offset].iov_len);
+            iov[iov_offset].iov_base = (char*)iov[iov_offset].iov_base + n;
+            iov[iov_offset].iov_len -= n;
+            if (iov[iov_offset].iov_len == 0) iov_offset++;
+            len -= n;
+            ring_written += n;
+            while (ring_offset < pending.size() && ring_written >= pending[ring_offset].second) {
+                auto &ent = pending[ring_offset++];
+                ent.first->consume(ent.second);
+                ring_written -= ent.second;
+            }
         }
     }
-    fflush(file);
+    // release whatever was written of a partially written ring
+    if (ring_offset < pending.size() && ring_written > 0) {
+        pending[ring_offset].first->consume(ring_written);
+    }
 }
 
-void log_thread::log(time_t current_time, const char* message)
+bool log_sink::reopen()
 {
-retry:
-    char *buffer = log_buffers_free.pop_front();
-    if (!buffer) {
-        // TODO add statistics on log_thread stalls
-        if (debug) {
-            log_debug("%s: no log buffers, waiting", __func__);
+    if (!owns_fd || path.length() == 0) return false;
+
+    // drain into the old file then switch, records logged meanwhile wait in the rings
+    write_logs();
+    int new_fd = open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0755);
+    if (new_fd < 0) {
+        log_error("%s: unable to reopen log file: %s: %s", __func__, path.c_str(), strerror(errno));
+        return false;
+    }
+    std::lock_guard<std::mutex> drain_lock(drain_mutex);
+    close(fd);
+    fd = new_fd;
+    if (log_writer::debug) {
+        log_debug("%s: reopened log file: %s", __func__, path.c_str());
+    }
+    return true;
+}
+
+void log_sink::log(time_t current_time, const char* message)
+{
+    log(current_time, message, strlen(message));
+}
+
+void log_sink::log(time_t current_time, const char* message, size_t len)
+{
+    log_ring *ring = get_ring();
+    if (len > ring->size) {
+        records_dropped++;
+        return;
+    }
+    bool notify = ring->used() < (ring->size >> 1);
+    while (!ring->push(message, len)) {
+        if (overflow == log_overflow_drop || !writer || !writer->running) {
+            records_dropped++;
+            return;
         }
-        std::unique_lock<std::mutex> lock(log_mutex);
-        writer_waiting.store(true);
-        writer_cond.wait(lock);
-        if (debug) {
-            log_debug("%s: client thread woke up", __func__);
+        writer_stalls++;
+        if (log_writer::debug) {
+            log_debug("%s: log ring full, waiting", __func__);
         }
-        goto retry;
+        std::unique_lock<std::mutex> lock(writer->log_mutex);
+        writer->writer_waiting.store(true);
+        writer->log_cond.notify_one();
+        writer->writer_cond.wait_for(lock, std::chrono::milliseconds(log_writer::flush_interval_msecs));
+        notify = false;
     }
-    strncpy(buffer, message, LOG_BUFFER_SIZE - 1);
-    buffer[LOG_BUFFER_SIZE - 1] = '\0';
-    if (!log_buffers_inuse.push_back(buffer)) {
-        log_error("%s: error pushing log buffer", __func__);
-        return;
+    records_written++;
+
+    // wake the writer once a second or when the ring passes half full
+    if (writer && (current_time != last_time.load(std::memory_order_relaxed) ||
+                   (notify && ring->used() >= (ring->size >> 1))))
+    {
+        last_time.store(current_time, std::memory_order_relaxed);
+        writer->log_cond.notify_one();
     }
-    if (current_time != last_time) {
-        last_time = current_time;
+}
+
+
+/* log_writer */
+
+const bool log_writer::debug = false;
+const int log_writer::flush_interval_msecs = 100;
+
+log_writer::log_writer() :
+    running(true),
+    writer_waiting(false),
+    rotate_generation(log_writer_pool::rotate_generation),
+    thread(&log_writer::mainloop, this) {}
+
+log_writer::~log_writer()
+{
+    shutdown();
+    write_logs();
+    for (auto &sink : sinks) {
+        sink->writer = nullptr;
+    }
+}
+
+void log_writer::add_sink(log_sink_ptr sink)
+{
+    std::lock_guard<std::mutex> lock(sinks_mutex);
+    sink->writer = this;
+    sinks.push_back(sink);
+}
+
+void log_writer::shutdown()
+{
+    bool val = true;
+    if (running.compare_exchange_strong(val, false)) {
         log_cond.notify_one();
+        thread.join();
+        writer_cond.notify_all();
+    }
+}
+
+void log_writer::write_logs()
+{
+    std::lock_guard<std::mutex> lock(sinks_mutex);
+    unsigned long generation = log_writer_pool::rotate_generation;
+    bool rotate = (generation != rotate_generation);
+    rotate_generation = generation;
+    for (auto &sink : sinks) {
+        if (rotate) {
+            sink->reopen();
+        } else {
+            sink->write_logs();
+        }
     }
 }
 
-void log_thread::mainloop()
+void log_writer::mainloop()
 {
     // mainloop
     while (running) {
@@ -137,11 +310,61 @@ void log_thread::mainloop()
         {
             std::unique_lock<std::mutex> lock(log_mutex);
             log_cond.wait_for(lock, std::chrono::milliseconds(flush_interval_msecs));
-            write_logs();
         }
+        write_logs();
         bool val = true;
         if (writer_waiting.compare_exchange_strong(val, false)) {
             writer_cond.notify_all();
         }
     }
 }
+
+
+/* log_writer_pool */
+
+std::atomic<unsigned long> log_writer_pool::rotate_generation(0);
+
+log_writer_pool::log_writer_pool(size_t num_writers) : next_writer(0)
+{
+    for (size_t i = 0; i < std::max(num_writers, (size_t)1); i++) {
+        writers.push_back(new log_writer());
+    }
+}
+
+log_writer_pool::~log_writer_pool()
+{
+    shutdown();
+    for (auto writer : writers) {
+        delete writer;
+    }
+}
+
+log_sink_ptr log_writer_pool::open_sink(std::string path, size_t num_buffers, log_overflow_policy overflow)
+{
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    auto si = sink_map.find(path);
+    if (si != sink_map.end()) {
+        return si->second;
+    }
+    int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0755);
+    if (fd < 0) {
+        return log_sink_ptr();
+    }
+    log_sink_ptr sink = std::make_shared<log_sink>(path, fd, num_buffers, overflow);
+    sink_map.insert(std::pair<std::string,log_sink_ptr>(path, sink));
+    writers[next_writer++ % writers.size()]->add_sink(sink);
+    return sink;
+}
+
+void log_writer_pool::add_sink(log_sink_ptr sink)
+{
+    std::lock_guard<std::mutex> lock(sink_mutex);
+    writers[next_writer++ % writers.size()]->add_sink(sink);
+}
+
+void log_writer_pool::shutdown()
+{
+    for (auto writer : writers) {
+        writer->shutdown();
+    }
+}
@@ -5,39 +5,148 @@
 #ifndef log_thread_h
 #define log_thread_h
 
-#include "queue_atomic.h"
-
-struct log_thread;
-typedef std::shared_ptr<log_thread> log_thread_ptr;
+struct log_ring;
+struct log_sink;
+struct log_writer;
+struct log_writer_pool;
+typedef std::shared_ptr<log_sink> log_sink_ptr;
+typedef std::shared_ptr<log_writer_pool> log_writer_pool_ptr;
 
 #define LOG_BUFFER_SIZE 1024
 
-struct log_thread : std::thread
+enum log_overflow_policy
+{
+    log_overflow_drop,
+    log_overflow_block
+};
+
+
+/*
+ * log_ring
+ *
+ * Single producer single consumer byte ring holding variable length
+ * records. A record is either copied in whole or not at all. The
+ * consumer may drain partial records as they are written in order.
+ */
+
+struct log_ring
+{
+    const size_t                    size;
+    const size_t                    mask;
+    char*                           buffer;
+    std::atomic<size_t>             head;
+    char                            pad[64];
+    std::atomic<size_t>             tail;
+
+    log_ring(size_t size);
+    ~log_ring();
+
+    size_t used() { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+    bool push(const char *data, size_t len);
+    int peek(struct iovec *iov);
+    void consume(size_t len) { head.store(head.load(std::memory_order_relaxed) + len, std::memory_order_release); }
+};
+
+
+/*
+ * log_sink
+ *
+ * A log destination. Each producer thread appends to its own log_ring,
+ * found through a thread local cache, and the log_writer that owns the
+ * sink drains all rings with writev. When a ring is full the record is
+ * dropped and counted or the producer waits for the writer, depending
+ * on the overflow policy. Sinks opened by path are reopened on rotate.
+ */
+
+struct log_sink
+{
+    static std::atomic<size_t>      next_id;
+
+    const size_t                    id;
+    const std::string               path;
+    int                             fd;
+    const bool                      owns_fd;
+    const size_t                    ring_size;
+    const log_overflow_policy       overflow;
+    log_writer*                     writer;
+    std::vector<log_ring*>          rings;
+    std::mutex                      rings_mutex;
+    std::mutex                      drain_mutex;
+    std::atomic<time_t>             last_time;
+    std::atomic<unsigned long>      records_written;
+    std::atomic<unsigned long>      records_dropped;
+    std::atomic<unsigned long>      writer_stalls;
+
+    log_sink(int fd, size_t num_buffers, log_overflow_policy overflow = log_overflow_drop);
+    log_sink(std::string path, int fd, size_t num_buffers, log_overflow_policy overflow);
+    virtual ~log_sink();
+
+    log_ring* get_ring();
+    void log(time_t current_time, const char* message);
+    void log(time_t current_time, const char* message, size_t len);
+    void write_logs();
+    bool reopen();
+};
+
+
+/*
+ * log_writer
+ *
+ * Thread draining a set of sinks. Writers check the rotate generation
+ * each time they wake and reopen their sinks after draining them, so
+ * producers neither drop nor block while logs are rotated.
+ */
+
+struct log_writer
 {
     static const bool               debug;
     static const int                flush_interval_msecs;
-    
-    FILE*                           file;
-    const size_t                    num_buffers;
-    queue_atomic<char*>             log_buffers_free;
-    queue_atomic<char*>             log_buffers_inuse;
-    time_t                          last_time;
+
+    std::vector<log_sink_ptr>       sinks;
+    std::mutex                      sinks_mutex;
     std::atomic<bool>               running;
     std::atomic<bool>               writer_waiting;
+    unsigned long                   rotate_generation;
     std::mutex                      log_mutex;
     std::condition_variable         log_cond;
     std::condition_variable         writer_cond;
     std::thread                     thread;
 
-    log_thread(int fd, size_t num_buffers);
-    virtual ~log_thread();
-    
+    log_writer();
+    virtual ~log_writer();
+
+    void add_sink(log_sink_ptr sink);
     void shutdown();
-    void create_buffers();
-    void delete_buffers();
-    void log(time_t current_time, const char* message);
     void write_logs();
     void mainloop();
 };
 
+
+/*
+ * log_writer_pool
+ *
+ * Fixed set of log writers shared by every sink. Sinks are deduplicated
+ * by path and assigned to writers round robin. rotate() only bumps an
+ * atomic generation so it is safe to call from a signal handler.
+ */
+
+struct log_writer_pool
+{
+    static std::atomic<unsigned long> rotate_generation;
+
+    std::vector<log_writer*>        writers;
+    std::map<std::string,log_sink_ptr> sink_map;
+    std::mutex                      sink_mutex;
+    size_t                          next_writer;
+
+    log_writer_pool(size_t num_writers);
+    virtual ~log_writer_pool();
+
+    static void rotate() { rotate_generation++; }
+
+    log_sink_ptr open_sink(std::string path, size_t num_buffers, log_overflow_policy overflow);
+    void add_sink(log_sink_ptr sink);
+    void shutdown();
+};
+
 #endif
@@ -8,8 +8,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <chrono>
 #include <string>
 
+#include <sys/resource.h>
+#if defined (__APPLE__)
+#include <mach/mach.h>
+#endif
+
 #include "log.h"
 #include "os.h"
 
@@ -122,3 +128,41 @@ void os::set_user(std::string os_user)
     }
     delete [] passwd_buf;
 }
+
+uint64_t os::current_time_usecs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+size_t os::resident_set_size()
+{
+#if defined (__linux__)
+    // second field of statm is resident pages
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        unsigned long size, resident;
+        int ret = fscanf(file, "%lu %lu", &size, &resident);
+        fclose(file);
+        if (ret == 2) {
+            return (size_t)resident * sysconf(_SC_PAGESIZE);
+        }
+    }
+#elif defined (__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) == KERN_SUCCESS) {
+        return info.resident_size;
+    }
+#endif
+    // fall back to the peak resident size
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return 0;
+    }
+#if defined (__APPLE__)
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
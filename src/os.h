@@ -10,6 +10,8 @@ struct os
     static void daemonize(std::string pid_file, std::string log_file);
     static void set_group(std::string os_group);
     static void set_user(std::string os_user);
+    static uint64_t current_time_usecs();
+    static size_t resident_set_size();
 };
 
 #endif
@@ -14,6 +14,12 @@
 
 #if defined(__linux__)
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
 #endif
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__DragonFly__) || defined(__OpenBSD__) || defined(__APPLE__)
 #include <sys/event.h>
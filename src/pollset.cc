@@ -26,7 +26,9 @@
 #include "config.h"
 #include "pollset.h"
 #include "pollset_poll.h"
+#include "pollset_epoll.h"
 #include "pollset_kqueue.h"
+#include "pollset_uring.h"
 #include "protocol.h"
 
 
@@ -50,3 +52,29 @@ std::string poll_object::to_string()
 /* pollset */
 
 pollset::~pollset() {}
+
+pollset* pollset::create(std::string type)
+{
+    if (type.length() == 0) {
+        return new pollset_platform_type();
+    } else if (type == "poll") {
+        return new pollset_poll();
+#if defined(__linux__)
+    } else if (type == "epoll") {
+        return new pollset_epoll();
+#endif
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__DragonFly__) || defined(__OpenBSD__) || defined(__APPLE__)
+    } else if (type == "kqueue") {
+        return new pollset_kqueue();
+#endif
+#if defined(HAVE_IO_URING)
+    } else if (type == "uring_poll") {
+        if (!pollset_uring::is_supported()) {
+            log_fatal_exit("pollset: io_uring is not available: %s", strerror(errno));
+        }
+        return new pollset_uring();
+#endif
+    }
+    log_fatal_exit("pollset: unsupported pollset type: %s", type.c_str());
+    return nullptr;
+}
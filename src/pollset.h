@@ -30,6 +30,7 @@ enum {
     poll_event_err =        POLLERR,    /* 0x008 */
     poll_event_hup =        POLLHUP,    /* 0x010 */
     poll_event_invalid =    POLLNVAL,   /* 0x020 */
+    poll_event_edge =       0x8000,     /* edge triggered (where supported) */
 };
 
 typedef int poll_event_mask;
@@ -56,10 +57,13 @@ struct pollset
 {
     virtual ~pollset();
     
+    static pollset* create(std::string type);
+    
     virtual const std::vector<poll_object>& get_objects() = 0;
     virtual bool add_object(poll_object obj, int events) = 0;
     virtual bool remove_object(poll_object obj) = 0;
-    virtual const std::vector<poll_object>& do_poll(int timeout) = 0;
+    virtual bool has_object(poll_object obj) = 0;
+    virtual const std::vector<poll_object>& do_poll(int timeout) = 0; /* milliseconds */
 };
 
 #endif
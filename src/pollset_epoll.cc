@@ -15,8 +15,6 @@
 #include <vector>
 #include <unordered_map>
 
-#include <sys/resource.h>
-
 #include "io.h"
 #include "log.h"
 #include "socket.h"
@@ -29,13 +27,6 @@ pollset_epoll::pollset_epoll()
 {
     epoll_fd = epoll_create(max_events);
     eevents.resize(max_events);
-    
-    struct rlimit rlimit_nofile;
-    if (getrlimit(RLIMIT_NOFILE, &rlimit_nofile) < 0) {
-        log_fatal_exit("getrlimit(RLIMIT_NOFILE): %s", strerror(errno));
-    }
-    
-    pollobjects_map.resize(rlimit_nofile.rlim_max);
 }
 
 pollset_epoll::~pollset_epoll()
@@ -43,56 +34,100 @@ pollset_epoll::~pollset_epoll()
     close(epoll_fd);
 }
 
+/*
+ * pollobjects holds the dense list of live objects and pollobjects_index
+ * maps an fd to its position in pollobjects (-1 if absent). The index
+ * grows on demand so memory scales with the highest fd seen rather than
+ * with RLIMIT_NOFILE.
+ */
+
+int pollset_epoll::find_index(int fd)
+{
+    if (fd < 0 || fd >= (int)pollobjects_index.size()) return -1;
+    return pollobjects_index[fd];
+}
+
 const std::vector<poll_object>& pollset_epoll::get_objects()
 {
-    pollobjects.resize(0);
-    for (auto &ent : pollobjects_map) {
-        if (ent.fd != -1) pollobjects.push_back(ent);
-    }
     return pollobjects;
 }
 
 bool pollset_epoll::add_object(poll_object obj, int events)
 {
-    int epoll_op;
-    auto &ent = pollobjects_map[obj.fd];
-    if (ent.fd != -1) {
-        epoll_op = EPOLL_CTL_MOD;
-    } else {
-        epoll_op = EPOLL_CTL_ADD;
-        pollobjects_map[obj.fd] = obj;
+    if (obj.fd < 0) {
+        log_error("pollset_epoll:::add_object: invalid fd obj=%p", obj.ptr);
+        return false;
+    }
+    
+    // the registered interest mask is cached in event_mask so that
+    // re-adding an object with an unchanged mask skips epoll_ctl
+    int idx = find_index(obj.fd);
+    if (idx != -1 && pollobjects[idx].event_mask == (unsigned short)events) {
+        pollobjects[idx] = poll_object(obj, (unsigned short)events);
+        return true;
     }
     
     struct epoll_event eevt;
     memset(&eevt, 0, sizeof(eevt));
-    eevt.events = events;
+    eevt.events = (events & ~poll_event_edge) | (events & poll_event_edge ? EPOLLET : 0);
     eevt.data.fd = obj.fd;
 
+    int epoll_op = idx != -1 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     if (epoll_ctl(epoll_fd, epoll_op, obj.fd, &eevt) < 0) {
         log_error("pollset_epoll:::add_object: obj=%p: %s", obj.ptr, strerror(errno));
         return false;
     }
+    
+    if (idx == -1) {
+        if (obj.fd >= (int)pollobjects_index.size()) {
+            size_t new_size = std::max((size_t)64, pollobjects_index.size());
+            while (new_size <= (size_t)obj.fd) new_size <<= 1;
+            pollobjects_index.resize(new_size, -1);
+        }
+        idx = (int)pollobjects.size();
+        pollobjects_index[obj.fd] = idx;
+        pollobjects.push_back(obj);
+    }
+    pollobjects[idx] = poll_object(obj, (unsigned short)events);
     return true;
 }
 
 bool pollset_epoll::remove_object(poll_object obj)
 {
-    auto &ent = pollobjects_map[obj.fd];
-    if (ent.fd == -1) {
+    int idx = find_index(obj.fd);
+    if (idx == -1) {
         log_error("pollset_epoll:::remove_object: object not found obj=%p", obj.ptr);
         return false;
     }
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, obj.fd, nullptr) < 0) {
-        log_error("pollset_epoll:::add_object: obj=%p: %s", obj.ptr, strerror(errno));
-        return false;
+    
+    // EBADF or ENOENT mean the fd was closed before it was removed
+    // and the kernel has already dropped it from the epoll set
+    bool result = true;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, obj.fd, nullptr) < 0 && errno != EBADF && errno != ENOENT) {
+        log_error("pollset_epoll:::remove_object: obj=%p: %s", obj.ptr, strerror(errno));
+        result = false;
     }
-    pollobjects_map[obj.fd] = poll_object();
-    return true;
+    
+    /* swap the last object into the vacated slot to keep the list dense */
+    int last = (int)pollobjects.size() - 1;
+    if (idx != last) {
+        pollobjects[idx] = pollobjects[last];
+        pollobjects_index[pollobjects[idx].fd] = idx;
+    }
+    pollobjects.pop_back();
+    pollobjects_index[obj.fd] = -1;
+    return result;
+}
+
+bool pollset_epoll::has_object(poll_object obj)
+{
+    int idx = find_index(obj.fd);
+    return idx != -1 && pollobjects[idx] == obj;
 }
 
 const std::vector<poll_object>& pollset_epoll::do_poll(int timeout)
 {
-    int nevents = epoll_wait(epoll_fd, &eevents[0], (int)eevents.size(), timeout * 1000);
+    int nevents = epoll_wait(epoll_fd, &eevents[0], (int)eevents.size(), timeout);
     
     if (nevents < 0 && errno != EAGAIN) {
         log_error("pollset_epoll:::do_poll: epoll_wait: %s", strerror(errno));
@@ -100,10 +135,12 @@ const std::vector<poll_object>& pollset_epoll::do_poll(int timeout)
         return events;
     }
     
-    events.resize(nevents);
+    events.resize(0);
     for (int i = 0; i < nevents; i++) {
         struct epoll_event *eevt = &eevents[i];
-        events[i] = poll_object(pollobjects_map[eevt->data.fd], eevt->events);
+        int idx = find_index(eevt->data.fd);
+        if (idx == -1) continue;
+        events.push_back(poll_object(pollobjects[idx], eevt->events));
     }
     return events;
 }
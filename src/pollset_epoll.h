@@ -14,15 +14,18 @@ struct pollset_epoll : pollset
     int                         epoll_fd;
     std::vector<struct epoll_event>  eevents;
     std::vector<poll_object>    pollobjects;
-    std::vector<poll_object>    pollobjects_map;
+    std::vector<int>            pollobjects_index;
     std::vector<poll_object>    events;
     
     pollset_epoll();
     ~pollset_epoll();
     
+    int find_index(int fd);
+    
     const std::vector<poll_object>& get_objects();
     bool add_object(poll_object obj, int events);
     bool remove_object(poll_object obj);
+    bool has_object(poll_object obj);
     const std::vector<poll_object>& do_poll(int timeout);
 };
 
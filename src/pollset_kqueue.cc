@@ -78,11 +78,16 @@ bool pollset_kqueue::remove_object(poll_object obj)
     return true;
 }
 
+bool pollset_kqueue::has_object(poll_object obj)
+{
+    return std::find(pollobjects.begin(), pollobjects.end(), obj) != pollobjects.end();
+}
+
 const std::vector<poll_object>& pollset_kqueue::do_poll(int timeout)
 {
     struct timespec ts;
-    ts.tv_sec = timeout;
-    ts.tv_nsec = 0;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
 
     int nevents = kevent(kevent_fd, NULL, 0, &kevents[0], (int)kevents.size(), &ts);    
     if (nevents < 0 && errno != EAGAIN) {
@@ -37,7 +37,7 @@ bool pollset_poll::add_object(poll_object obj, int events)
         pollfds.resize(pi + 1);
         pollfds[pi].fd = obj.fd;
     }
-    pollfds[pi].events = events;
+    pollfds[pi].events = events & ~poll_event_edge;
     pollfds[pi].revents = 0;
     return true;
 }
@@ -55,12 +55,17 @@ bool pollset_poll::remove_object(poll_object obj)
     return true;
 }
 
+bool pollset_poll::has_object(poll_object obj)
+{
+    return std::find(pollobjects.begin(), pollobjects.end(), obj) != pollobjects.end();
+}
+
 const std::vector<poll_object>& pollset_poll::do_poll(int timeout)
 {
     events.resize(0);
     
     unsigned int pollset_size = (unsigned int)pollobjects.size();
-    int ret = poll(&pollfds[0], pollset_size, timeout * 1000);
+    int ret = poll(&pollfds[0], pollset_size, timeout);
     
     if (ret < 0 && errno != EAGAIN) {
         log_error("pollset_poll:::do_poll: poll: %s", strerror(errno));
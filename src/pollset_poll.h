@@ -16,6 +16,7 @@ struct pollset_poll : pollset
     const std::vector<poll_object>& get_objects();
     bool add_object(poll_object obj, int events);
     bool remove_object(poll_object obj);
+    bool has_object(poll_object obj);
     const std::vector<poll_object>& do_poll(int timeout);
 };
 
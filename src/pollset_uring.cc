@@ -0,0 +1,297 @@
+//
+//  pollset_uring.cc
+//
+
+#include "plat_poll.h"
+
+#if defined(HAVE_IO_URING)
+
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "io.h"
+#include "log.h"
+#include "socket.h"
+#include "pollset.h"
+#include "pollset_uring.h"
+
+const int pollset_uring::max_entries = 1024;
+const uint64_t pollset_uring::timeout_user_data = ~0ULL;
+const uint64_t pollset_uring::remove_user_data = ~0ULL - 1;
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static inline uint64_t poll_user_data(unsigned int gen, int fd)
+{
+    return ((uint64_t)gen << 32) | (uint32_t)fd;
+}
+
+pollset_uring::pollset_uring() : gen_counter(0), sq_pending(0)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = io_uring_setup(max_entries, &params);
+    if (ring_fd < 0) {
+        log_fatal_exit("pollset_uring: io_uring_setup: %s", strerror(errno));
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = (std::max)(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        log_fatal_exit("pollset_uring: mmap sq ring: %s", strerror(errno));
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            log_fatal_exit("pollset_uring: mmap cq ring: %s", strerror(errno));
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        log_fatal_exit("pollset_uring: mmap sqes: %s", strerror(errno));
+    }
+
+    char *sq = (char*)sq_ring, *cq = (char*)cq_ring;
+    sq_head = (unsigned int*)(sq + params.sq_off.head);
+    sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    sq_entries = (unsigned int*)(sq + params.sq_off.ring_entries);
+    sq_array = (unsigned int*)(sq + params.sq_off.array);
+    cq_head = (unsigned int*)(cq + params.cq_off.head);
+    cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+pollset_uring::~pollset_uring()
+{
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+bool pollset_uring::is_supported()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = io_uring_setup(1, &params);
+    if (fd < 0) return false;
+    close(fd);
+    return true;
+}
+
+int pollset_uring::find_index(int fd)
+{
+    if (fd < 0 || fd >= (int)pollobjects_index.size()) return -1;
+    return pollobjects_index[fd];
+}
+
+/*
+ * Without SQPOLL the kernel only reads the submission ring inside
+ * io_uring_enter, so entries are published by bumping the tail and
+ * are submitted in one batch by the next call to submit.
+ */
+
+struct io_uring_sqe* pollset_uring::get_sqe()
+{
+    unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *sq_tail;
+    if (tail - head >= *sq_entries) {
+        submit(0);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+    unsigned int index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    sq_pending++;
+    return sqe;
+}
+
+bool pollset_uring::submit(unsigned int wait_nr)
+{
+    int ret;
+    do {
+        ret = io_uring_enter(ring_fd, sq_pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        log_error("pollset_uring:::submit: io_uring_enter: %s", strerror(errno));
+        return false;
+    }
+    sq_pending -= std::min((unsigned int)ret, sq_pending);
+    return true;
+}
+
+void pollset_uring::queue_poll_add(int idx)
+{
+    auto &obj = pollobjects[idx];
+    auto &slot = pollslots[idx];
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = obj.fd;
+    sqe->poll32_events = obj.event_mask;
+    sqe->user_data = poll_user_data(slot.gen, obj.fd);
+    slot.armed = true;
+}
+
+void pollset_uring::queue_poll_remove(int idx)
+{
+    auto &obj = pollobjects[idx];
+    auto &slot = pollslots[idx];
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = poll_user_data(slot.gen, obj.fd);
+    sqe->user_data = remove_user_data;
+    slot.armed = false;
+}
+
+const std::vector<poll_object>& pollset_uring::get_objects()
+{
+    return pollobjects;
+}
+
+bool pollset_uring::add_object(poll_object obj, int events)
+{
+    if (obj.fd < 0) {
+        log_error("pollset_uring:::add_object: invalid fd obj=%p", obj.ptr);
+        return false;
+    }
+
+    // io_uring polls are one shot and re-armed by do_poll so the
+    // edge triggered flag has no meaning here
+    unsigned short mask = (unsigned short)(events & ~poll_event_edge);
+
+    int idx = find_index(obj.fd);
+    if (idx != -1) {
+        bool changed = pollobjects[idx].event_mask != mask;
+        pollobjects[idx] = poll_object(obj, mask);
+        if (changed) {
+            if (pollslots[idx].armed) {
+                queue_poll_remove(idx);
+                pollslots[idx].gen = ++gen_counter & 0x7fffffff;
+            }
+            queue_poll_add(idx);
+        }
+        return true;
+    }
+
+    if (obj.fd >= (int)pollobjects_index.size()) {
+        size_t new_size = std::max((size_t)64, pollobjects_index.size());
+        while (new_size <= (size_t)obj.fd) new_size <<= 1;
+        pollobjects_index.resize(new_size, -1);
+    }
+    idx = (int)pollobjects.size();
+    pollobjects_index[obj.fd] = idx;
+    pollobjects.push_back(poll_object(obj, mask));
+    pollslots.push_back(pollset_uring_slot());
+    pollslots[idx].gen = ++gen_counter & 0x7fffffff;
+    queue_poll_add(idx);
+    return true;
+}
+
+bool pollset_uring::remove_object(poll_object obj)
+{
+    int idx = find_index(obj.fd);
+    if (idx == -1) {
+        log_error("pollset_uring:::remove_object: object not found obj=%p", obj.ptr);
+        return false;
+    }
+    if (pollslots[idx].armed) {
+        queue_poll_remove(idx);
+    }
+
+    /* swap the last object into the vacated slot to keep the list dense */
+    int last = (int)pollobjects.size() - 1;
+    if (idx != last) {
+        pollobjects[idx] = pollobjects[last];
+        pollslots[idx] = pollslots[last];
+        pollobjects_index[pollobjects[idx].fd] = idx;
+    }
+    pollobjects.pop_back();
+    pollslots.pop_back();
+    pollobjects_index[obj.fd] = -1;
+    return true;
+}
+
+bool pollset_uring::has_object(poll_object obj)
+{
+    int idx = find_index(obj.fd);
+    return idx != -1 && pollobjects[idx] == obj;
+}
+
+const std::vector<poll_object>& pollset_uring::do_poll(int timeout)
+{
+    // re-arm objects that fired on the previous call and are still registered
+    for (auto &obj : events) {
+        int idx = find_index(obj.fd);
+        if (idx != -1 && !pollslots[idx].armed) {
+            queue_poll_add(idx);
+        }
+    }
+    events.resize(0);
+
+    // the timeout completes on expiry or after any other completion
+    timeout_ts.tv_sec = timeout / 1000;
+    timeout_ts.tv_nsec = (timeout % 1000) * 1000000;
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&timeout_ts;
+    sqe->len = 1;
+    sqe->off = 1;
+    sqe->user_data = timeout_user_data;
+
+    if (!submit(1)) {
+        return events;
+    }
+
+    unsigned int head = *cq_head;
+    unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        uint64_t user_data = cqe->user_data;
+        if (user_data == timeout_user_data || user_data == remove_user_data) continue;
+        int fd = (int)(uint32_t)user_data;
+        unsigned int gen = (unsigned int)(user_data >> 32);
+        int idx = find_index(fd);
+        if (idx == -1 || pollslots[idx].gen != gen || cqe->res == -ECANCELED) continue;
+        pollslots[idx].armed = false;
+        unsigned short revents = cqe->res < 0 ? poll_event_err : (unsigned short)cqe->res;
+        events.push_back(poll_object(pollobjects[idx], revents));
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    return events;
+}
+
+#endif
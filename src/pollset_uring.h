@@ -0,0 +1,81 @@
+//
+//  pollset_uring.h
+//
+
+#if defined(HAVE_IO_URING)
+
+#ifndef pollset_uring_h
+#define pollset_uring_h
+
+/* pollset_uring
+ *
+ * Readiness only pollset using io_uring poll requests, selected with
+ * pollset_type uring_poll. Socket I/O is still read and write after a
+ * readiness event, accepts, receives and sends are not submitted to the
+ * ring. Registrations and removals are queued on the submission ring and
+ * submitted in one batch together with the wait for completions. io_uring
+ * polls are one shot so objects that fired are re-armed on the next call
+ * to do_poll unless they were removed.
+ */
+
+struct pollset_uring_slot
+{
+    unsigned int                gen;
+    bool                        armed;
+
+    pollset_uring_slot() : gen(0), armed(false) {}
+};
+
+struct pollset_uring : pollset
+{
+    static const int            max_entries;
+    static const uint64_t       timeout_user_data;
+    static const uint64_t       remove_user_data;
+
+    int                         ring_fd;
+    unsigned int                gen_counter;
+    unsigned int                sq_pending;
+
+    void                        *sq_ring;
+    void                        *cq_ring;
+    size_t                      sq_ring_size;
+    size_t                      cq_ring_size;
+    struct io_uring_sqe         *sqes;
+    size_t                      sqes_size;
+    unsigned int                *sq_head;
+    unsigned int                *sq_tail;
+    unsigned int                *sq_mask;
+    unsigned int                *sq_entries;
+    unsigned int                *sq_array;
+    unsigned int                *cq_head;
+    unsigned int                *cq_tail;
+    unsigned int                *cq_mask;
+    struct io_uring_cqe         *cqes;
+    struct __kernel_timespec    timeout_ts;
+
+    std::vector<poll_object>    pollobjects;
+    std::vector<pollset_uring_slot> pollslots;
+    std::vector<int>            pollobjects_index;
+    std::vector<poll_object>    events;
+
+    pollset_uring();
+    ~pollset_uring();
+
+    static bool is_supported();
+
+    int find_index(int fd);
+    struct io_uring_sqe* get_sqe();
+    bool submit(unsigned int wait_nr);
+    void queue_poll_add(int idx);
+    void queue_poll_remove(int idx);
+
+    const std::vector<poll_object>& get_objects();
+    bool add_object(poll_object obj, int events);
+    bool remove_object(poll_object obj);
+    bool has_object(poll_object obj);
+    const std::vector<poll_object>& do_poll(int timeout);
+};
+
+#endif
+
+#endif
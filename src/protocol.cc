@@ -242,6 +242,7 @@ bool protocol_config::lookup_block_end_fn(std::string key, block_record &record)
 protocol        protocol::proto_none("none");
 protocol_sock   protocol::sock_none(nullptr, "none", protocol_sock_none);
 protocol_sock   protocol::sock_ipc(nullptr, "ipc", protocol_sock_unix_ipc);
+protocol_sock   protocol::sock_dns(nullptr, "dns", protocol_sock_udp);
 protocol_action protocol::action_none(nullptr, "none");
 protocol_state  protocol::state_none(nullptr, "none");
 
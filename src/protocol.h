@@ -224,6 +224,7 @@ struct protocol_thread_delegate
     virtual pollset_ptr get_pollset() const = 0;
     virtual resolver_ptr get_resolver() const = 0;
     virtual std::thread::id get_thread_id() const = 0;
+    virtual int get_thread_num() const = 0;
     virtual std::string get_thread_string() const = 0;
     virtual int get_thread_mask() const = 0;
     virtual int get_debug_mask() const = 0;
@@ -234,8 +235,10 @@ struct protocol_thread_delegate
     virtual protocol_thread_delegate* choose_thread(int mask) = 0;
     virtual void send_message(protocol_thread_delegate *to_thread, protocol_message msg) = 0;
     virtual void queue_message(protocol_thread_delegate *to_thread, protocol_message msg) = 0;
+    virtual void post_message(protocol_message msg) = 0;
     virtual void add_events(protocol_object *, int events) = 0;
     virtual void remove_events(protocol_object *) = 0;
+    virtual bool has_events(protocol_object *) = 0;
 };
 
 
@@ -264,6 +267,7 @@ struct protocol
     static protocol                 proto_none;
     static protocol_sock            sock_none;
     static protocol_sock            sock_ipc;
+    static protocol_sock            sock_dns;
     static protocol_action          action_none;
     static protocol_state           state_none;
 
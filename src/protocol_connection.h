@@ -6,70 +6,127 @@
 #define protocol_connection_h
 
 
+/*
+ * protocol_connection_stack
+ *
+ * Lock-free stack of connection ids. The head packs a version with the top
+ * id so a pop racing with a pop and push of the same id fails its compare
+ * and swap. Links are shared by all stacks over one connection table as a
+ * connection is on at most one stack at a time.
+ */
+
+struct protocol_connection_stack
+{
+    enum : uint32_t { none = UINT32_MAX };
+
+    std::atomic<uint64_t>                           head;
+    std::atomic<size_t>                             count;
+    std::atomic<uint32_t>                           *links;
+
+    protocol_connection_stack() : head(none), count(0), links(nullptr) {}
+
+    void init(std::atomic<uint32_t> *links) { this->links = links; }
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+    void push(uint32_t id)
+    {
+        uint64_t old_head = head.load(std::memory_order_relaxed), new_head;
+        do {
+            links[id].store((uint32_t)old_head, std::memory_order_relaxed);
+            new_head = (((old_head >> 32) + 1) << 32) | id;
+        } while (!head.compare_exchange_weak(old_head, new_head, std::memory_order_release, std::memory_order_relaxed));
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool pop(uint32_t &id)
+    {
+        uint64_t old_head = head.load(std::memory_order_acquire), new_head;
+        do {
+            if ((uint32_t)old_head == none) return false;
+            uint32_t next = links[(uint32_t)old_head].load(std::memory_order_relaxed);
+            new_head = (((old_head >> 32) + 1) << 32) | next;
+        } while (!head.compare_exchange_weak(old_head, new_head, std::memory_order_acquire, std::memory_order_acquire));
+        count.fetch_sub(1, std::memory_order_relaxed);
+        id = (uint32_t)old_head;
+        return true;
+    }
+
+    /* detach the whole stack, returns the top id to walk with next */
+    uint32_t take_all()
+    {
+        uint64_t old_head = head.load(std::memory_order_acquire), new_head;
+        do {
+            new_head = (((old_head >> 32) + 1) << 32) | none;
+        } while (!head.compare_exchange_weak(old_head, new_head, std::memory_order_acquire, std::memory_order_acquire));
+        return (uint32_t)old_head;
+    }
+
+    uint32_t next(uint32_t id) { return links[id].load(std::memory_order_relaxed); }
+
+    void taken(size_t n) { count.fetch_sub(n, std::memory_order_relaxed); }
+};
+
+
 /* protocol_connection_state */
 
 template <typename ProtocolConnection>
 struct protocol_connection_state
 {
     typedef std::vector<ProtocolConnection>         connection_table;
-    typedef std::vector<ProtocolConnection*>        connection_list;
-    typedef std::deque<ProtocolConnection*>         connection_queue;
-    typedef std::map<std::string,connection_queue>  connection_host_map;
-    typedef std::pair<std::string,connection_queue> connection_host_entry;
-    
-    std::mutex                                      connections_mutex;
+
     connection_table                                connections_all;
-    connection_list                                 connections_free;
-    connection_host_map                             connections_host_map;
-    
+    std::unique_ptr<std::atomic<uint32_t>[]>        connections_links;
+    protocol_connection_stack                       connections_free;
+
     void init(protocol_engine_delegate *delegate, int num_connections)
     {
         // initialize connection table
         connections_all.resize(num_connections);
-        connections_free.resize(num_connections);
-        for (int i = 0; i < num_connections; i++) {
+        connections_links.reset(new std::atomic<uint32_t>[num_connections]);
+        connections_free.init(connections_links.get());
+        for (int i = num_connections - 1; i >= 0; i--) {
             connections_all[i].conn.set_id(i);
             connections_all[i].init(delegate);
-            connections_free[i] = &connections_all[i];
+            connections_free.push(i);
         }
     }
-    
+
     ProtocolConnection* new_connection(protocol_engine_delegate *delegate)
     {
-        ProtocolConnection *conn = nullptr;
-        connections_mutex.lock();
-        if (connections_free.size() > 0) {
-            conn = connections_free.back();
-            connections_free.pop_back();
-        }
-        connections_mutex.unlock();
-        if (conn) {
-            conn->init(delegate);
+        uint32_t conn_id;
+        if (!connections_free.pop(conn_id)) {
+            return nullptr;
         }
+        ProtocolConnection *conn = &connections_all[conn_id];
+        conn->init(delegate);
         return conn;
     }
-    
+
+    bool has_free_connections()
+    {
+        return connections_free.size() > 0;
+    }
+
     ProtocolConnection* get_connection(protocol_engine_delegate *delegate, int conn_id)
     {
         return &connections_all[conn_id];
     }
-    
+
     void free_connection(protocol_engine_delegate *delegate, protocol_object *obj)
     {
         auto conn = static_cast<ProtocolConnection*>(obj);
         conn->free(delegate);
-        connections_mutex.lock();
-        connections_free.push_back(conn);
-        connections_mutex.unlock();
+        connections_free.push((uint32_t)conn->conn.get_id());
     }
-    
+
     void abort_connection(protocol_engine_delegate *delegate, protocol_object *obj)
     {
         auto conn = static_cast<ProtocolConnection*>(obj);
         conn->conn.close();
         free_connection(delegate, conn);
     }
-    
+
     void close_connection(protocol_engine_delegate *delegate, protocol_object *obj)
     {
         auto conn = static_cast<ProtocolConnection*>(obj);
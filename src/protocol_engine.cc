@@ -25,6 +25,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 
 #include "os.h"
 #include "io.h"
@@ -39,6 +40,7 @@
 #include "protocol.h"
 #include "protocol_thread.h"
 #include "protocol_engine.h"
+#include "log_thread.h"
 
 
 /* protocol_engine */
@@ -47,7 +49,7 @@ protocol_config_factory_map protocol_engine::config_factory_map;
 std::vector<protocol_engine*> protocol_engine::engine_list;
 std::mutex protocol_engine::engine_lock;
 
-protocol_engine::protocol_engine() : debug_mask(0)
+protocol_engine::protocol_engine() : debug_mask(0), stopping(false)
 {
     protocol::init();
     
@@ -111,6 +113,9 @@ void protocol_engine::signal_handler(int signum, siginfo_t *info, void *)
                 engine->stop();
             }
             break;
+        case SIGHUP:
+            log_writer_pool::rotate();
+            break;
         default:
             break;
     }
@@ -171,6 +176,8 @@ void protocol_engine::run()
 
 void protocol_engine::stop()
 {
+    // stop may come before join or from a signal handler so it can't lock
+    stopping = true;
     threads_cond.notify_one();
 }
 
@@ -179,7 +186,9 @@ void protocol_engine::join()
     // wait on condition
     {
         std::unique_lock<std::mutex> lock(threads_mutex);
-        threads_cond.wait(lock);
+        while (!stopping) {
+            threads_cond.wait_for(lock, std::chrono::milliseconds(100));
+        }
         if (debug_mask & protocol_debug_engine) {
             log_debug("protocol_engine: shutting down");
         }
@@ -21,6 +21,7 @@ struct protocol_engine : protocol_engine_delegate
     protocol_thread_map             threads_map;
     protocol_thread_next_map        threads_next;
     std::condition_variable         threads_cond;
+    std::atomic<bool>               stopping;
     
     static protocol_config_factory_map config_factory_map;
     static std::vector<protocol_engine*> engine_list;
@@ -28,9 +29,9 @@ struct protocol_engine : protocol_engine_delegate
     
     static void signal_handler(int signum, siginfo_t *info, void *);
     
-    template <typename T> void bind_function(config_ptr cfg, std::string path, typename T::function_type fn)
+    template <typename T, typename... Args> void bind_function(config_ptr cfg, std::string path, typename T::function_type fn, Args... args)
     {
-        static_cast<typename T::engine_state_type*>(get_engine_state(T::get_proto()))->bind_function(cfg, path, fn);
+        static_cast<typename T::engine_state_type*>(get_engine_state(T::get_proto()))->bind_function(cfg, path, fn, args...);
     }
 
     template <typename T> config_ptr default_config() { return default_config(T::get_proto()); }
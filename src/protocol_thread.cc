@@ -56,10 +56,12 @@ protocol_thread::protocol_thread(protocol_engine *engine, int thread_mask)
     thread_num(++thread_counter),
     thread_mask(thread_mask),
     notify(engine->cfg->ipc_buffer_size),
-    pollset(new pollset_platform_type()),
+    pollset(pollset::create(engine->cfg->pollset_type)),
     running(true),
     current_time(0),
     timeout_check(0),
+    pending_obj(nullptr),
+    pending_events(0),
     dns(new resolver),
     thread(&protocol_thread::mainloop, this)
 {}
@@ -182,6 +184,8 @@ void protocol_thread::send_message(protocol_thread_delegate *to_thread, protocol
     if (this == to_thread) {
         (*protocol_action::get_table())[msg.action]->proto->handle_message(this, msg);
     } else {
+        // the destination thread owns the connection from here on
+        flush_events();
         // TODO - change to lock free message queues and use notify socket for wakeup
         io_result result = dest_thread->notify.send_message(unix_socketpair_client, &msg, sizeof(msg));
         if (result.has_error()) {
@@ -196,6 +200,21 @@ void protocol_thread::send_message(protocol_thread_delegate *to_thread, protocol
     }
 }
 
+void protocol_thread::post_message(protocol_message msg)
+{
+    // deliver to this thread from a thread outside the engine
+    io_result result = notify.send_message(unix_socketpair_client, &msg, sizeof(msg));
+    if (result.has_error()) {
+        if (result.error().errcode != EAGAIN && result.error().errcode != ENOBUFS) {
+            log_error("protocol_thread::post_message: %s", result.error_string().c_str());
+        } else {
+            queue_message(this, msg);
+        }
+    } else if (result.size() != sizeof(msg)) {
+        log_error("protocol_thread::post_message: short write");
+    }
+}
+
 void protocol_thread::queue_message(protocol_thread_delegate *to_thread, protocol_message msg)
 {
     auto dest_thread = static_cast<protocol_thread*>(to_thread);
@@ -204,14 +223,56 @@ void protocol_thread::queue_message(protocol_thread_delegate *to_thread, protoco
     dest_thread->message_lock.unlock();
 }
 
+/*
+ * Event changes for the object being processed are held back until the
+ * handler returns, or until another object or thread is involved, so a
+ * remove_events followed by add_events during a same-thread state change
+ * collapses into at most one pollset update, and into none if the mask
+ * is unchanged.
+ */
+
 void protocol_thread::add_events(protocol_object *obj, int events)
 {
-    pollset->add_object(poll_object(obj->get_poll_type(), obj, obj->get_poll_fd()), events);
+    if (pending_obj && pending_obj != obj) {
+        flush_events();
+    }
+    if (engine->cfg->edge_triggered) {
+        events |= poll_event_edge;
+    }
+    pending_obj = obj;
+    pending_pollobj = poll_object(obj->get_poll_type(), obj, obj->get_poll_fd());
+    pending_events = events;
 }
 
 void protocol_thread::remove_events(protocol_object *obj)
 {
-    pollset->remove_object(poll_object(obj->get_poll_type(), obj, obj->get_poll_fd()));
+    if (pending_obj && pending_obj != obj) {
+        flush_events();
+    }
+    if (pending_obj != obj) {
+        pending_pollobj = poll_object(obj->get_poll_type(), obj, obj->get_poll_fd());
+    }
+    pending_obj = obj;
+    pending_events = -1;
+}
+
+bool protocol_thread::has_events(protocol_object *obj)
+{
+    if (pending_obj == obj) {
+        return pending_events >= 0;
+    }
+    return pollset->has_object(poll_object(obj->get_poll_type(), obj, obj->get_poll_fd()));
+}
+
+void protocol_thread::flush_events()
+{
+    if (!pending_obj) return;
+    if (pending_events >= 0) {
+        pollset->add_object(pending_pollobj, pending_events);
+    } else if (pollset->has_object(pending_pollobj)) {
+        pollset->remove_object(pending_pollobj);
+    }
+    pending_obj = nullptr;
 }
 
 void protocol_thread::receive_message()
@@ -226,12 +287,14 @@ void protocol_thread::receive_message()
         // wake up
     } else {
         (*protocol_action::get_table())[msg.action]->proto->handle_message(this, msg);
+        flush_events();
     }
     message_lock.lock();
     while (message_queue.begin() != message_queue.end()) {
         protocol_message msg = message_queue.front();
         message_queue.pop_front();
         (*protocol_action::get_table())[msg.action]->proto->handle_message(this, msg);
+        flush_events();
     }
     message_lock.unlock();
 }
@@ -254,6 +317,15 @@ void protocol_thread::mainloop()
     
     // add notify socket pair to pollset
     pollset->add_object(poll_object(protocol::sock_ipc.type, &notify, notify.owner.get_fd()), poll_event_in);
+
+    // resolver sockets are added to the pollset on first use
+    config_ptr cfg = get_config();
+    std::vector<socket_addr> nameservers;
+    for (auto &spec : cfg->resolver_nameservers) {
+        socket_addr addr;
+        if (resolver::parse_nameserver(spec, addr)) nameservers.push_back(addr);
+    }
+    dns->init(nameservers, cfg->resolver_timeout, cfg->resolver_ipv6, pollset, protocol::sock_dns.type);
     
     // run thread init for each protocol handled by this thread
     // TODO - handle bad_alloc exceptions
@@ -270,7 +342,10 @@ void protocol_thread::mainloop()
 
     // poll
     while (running) {
-        const std::vector<poll_object> &events = pollset->do_poll(timeout_min);
+        int timeout_msecs = timeout_min * 1000;
+        int dns_timeout_msecs = dns->next_timeout_msecs();
+        if (dns_timeout_msecs >= 0) timeout_msecs = (std::min)(timeout_msecs, dns_timeout_msecs);
+        const std::vector<poll_object> &events = pollset->do_poll(timeout_msecs);
         current_time = time(nullptr);
         for (auto obj : events) {
             if (engine->debug_mask & protocol_debug_event) {
@@ -279,6 +354,9 @@ void protocol_thread::mainloop()
             }
             if (obj.type == protocol::sock_ipc.type) {
                 receive_message();
+            } else if (obj.type == protocol::sock_dns.type) {
+                dns->handle_events();
+                flush_events();
             } else {
                 if (obj.type < proto_sock_table->size()) {
                     const protocol_sock *proto_sock = (*proto_sock_table)[obj.type];
@@ -286,8 +364,10 @@ void protocol_thread::mainloop()
                         // TODO - handle TLS connections
                         if (proto_sock->flags & protocol_sock_tcp_listen) {
                             proto_sock->proto->handle_accept(this, proto_sock, obj.fd);
+                            flush_events();
                         } else if (proto_sock->flags & protocol_sock_tcp_connection) {
                             proto_sock->proto->handle_connection(this, static_cast<protocol_object*>(obj.ptr), obj.event_mask);
+                            flush_events();
                         } else {
                             log_error("unknown flags: %s", obj.to_string().c_str());
                         }
@@ -299,6 +379,8 @@ void protocol_thread::mainloop()
                 }
             }
         }
+        dns->handle_timeouts();
+        flush_events();
         if (current_time - timeout_check > timeout_min) {
             timeout_check = current_time;
             auto pollobjects_copy = pollset->get_objects();
@@ -309,6 +391,7 @@ void protocol_thread::mainloop()
                         // TODO - handle TLS connections
                         if (proto_sock->flags & protocol_sock_tcp_connection) {
                             proto_sock->proto->timeout_connection(this, static_cast<protocol_object*>(obj.ptr));
+                            flush_events();
                         }
                     }
                 } else {
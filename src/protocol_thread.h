@@ -29,6 +29,9 @@ struct protocol_thread : protocol_thread_delegate
     time_t                          current_time;
     time_t                          timeout_check;
     std::vector<int>                fd_lingering_close;
+    protocol_object                 *pending_obj;
+    poll_object                     pending_pollobj;
+    int                             pending_events;
     std::mutex                      message_lock;
     protocol_message_list           message_queue;
     resolver_ptr                    dns;
@@ -59,8 +62,11 @@ struct protocol_thread : protocol_thread_delegate
     protocol_thread_delegate* choose_thread(int mask);
     void send_message(protocol_thread_delegate *to_thread, protocol_message msg);
     void queue_message(protocol_thread_delegate *to_thread, protocol_message msg);
+    void post_message(protocol_message msg);
     void add_events(protocol_object *, int events);
     void remove_events(protocol_object *);
+    bool has_events(protocol_object *);
+    void flush_events();
     
     void receive_message();
     void mainloop();
@@ -6,9 +6,18 @@
 #include "plat_net.h"
 
 #include <cstring>
+#include <cstdint>
 #include <cassert>
+#include <ctime>
 #include <memory>
 #include <deque>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <functional>
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -16,16 +25,363 @@
 #include "log.h"
 #include "io.h"
 #include "socket.h"
+#include "socket_udp.h"
+#include "pollset.h"
 #include "resolver.h"
 
+
+/* resolver_query */
+
+enum resolver_state {
+    resolver_state_none,        /* not asked, answered from the cache */
+    resolver_state_pending,
+    resolver_state_positive,
+    resolver_state_negative,
+    resolver_state_failed,
+};
+
+struct resolver_waiter
+{
+    int                         port;
+    resolver_callback           cb;
+};
+
+/* index 0 asks AAAA and index 1 asks A, AAAA is preferred when both answer */
+static const int resolver_qtypes[2] = { resolver_qtype_aaaa, resolver_qtype_a };
+static const int resolver_families[2] = { AF_INET6, AF_INET };
+
+struct resolver_query
+{
+    std::string                 host;
+    std::vector<resolver_waiter> waiters;
+    uint16_t                    id[2];
+    int                         state[2];
+    int                         attempts[2];
+    uint64_t                    deadline_usecs[2];
+    std::vector<socket_addr>    addrs[2];
+    uint64_t                    delay_usecs;
+};
+
+static uint64_t resolver_now_usecs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint16_t resolver_query_id()
+{
+    // unpredictable ids make off-path answer spoofing harder
+    static thread_local std::mt19937 rng{std::random_device{}()};
+    return (uint16_t)rng();
+}
+
+static std::string resolver_lowercase(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+    return str;
+}
+
+static void resolver_set_port(socket_addr &addr, int port)
+{
+    if (addr.saddr.sa_family == AF_INET6) {
+        addr.ip6addr.sin6_port = htons(port);
+    } else {
+        addr.ip4addr.sin_port = htons(port);
+    }
+}
+
+
+/* resolver_cache */
+
+bool resolver_cache::find(std::string host, int family, time_t now, resolver_cache_entry &entry)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto ei = entries.find(key_type(host, family));
+    if (ei == entries.end()) {
+        return false;
+    }
+    if (ei->second.expires <= now) {
+        entries.erase(ei);
+        return false;
+    }
+    entry = ei->second;
+    return true;
+}
+
+void resolver_cache::insert(std::string host, int family, const std::vector<socket_addr> &addrs, time_t ttl, time_t now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.size() >= RESOLVER_CACHE_MAX) {
+        // drop expired entries, or everything if they are all live
+        for (auto ei = entries.begin(); ei != entries.end(); ) {
+            if (ei->second.expires <= now) ei = entries.erase(ei);
+            else ei++;
+        }
+        if (entries.size() >= RESOLVER_CACHE_MAX) {
+            entries.clear();
+        }
+    }
+    resolver_cache_entry &entry = entries[key_type(host, family)];
+    entry.addrs = addrs;
+    entry.expires = now + std::min(ttl, (time_t)RESOLVER_TTL_MAX);
+}
+
+bool resolver_cache::find_host(std::string host, socket_addr &addr)
+{
+    // hosts file entries never expire, the first address for a name wins
+    std::call_once(hosts_once, [&] {
+        std::ifstream file("/etc/hosts");
+        std::string line;
+        while (std::getline(file, line)) {
+            line = line.substr(0, line.find('#'));
+            std::stringstream ss(line);
+            std::string addr_str, name;
+            if (!(ss >> addr_str)) continue;
+            socket_addr host_addr;
+            memset(&host_addr, 0, sizeof(host_addr));
+            if (inet_pton(AF_INET, addr_str.c_str(), &host_addr.ip4addr.sin_addr) == 1) {
+                host_addr.saddr.sa_family = AF_INET;
+            } else if (inet_pton(AF_INET6, addr_str.c_str(), &host_addr.ip6addr.sin6_addr) == 1) {
+                host_addr.saddr.sa_family = AF_INET6;
+            } else {
+                continue;
+            }
+            while (ss >> name) {
+                hosts.insert(std::pair<std::string,socket_addr>(resolver_lowercase(name), host_addr));
+            }
+        }
+    });
+    auto hi = hosts.find(host);
+    if (hi == hosts.end()) {
+        return false;
+    }
+    addr = hi->second;
+    return true;
+}
+
+void resolver_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+
 /* resolver */
 
+resolver::resolver() : timeout_msecs(1000), ipv6(true), poll_type(0) {}
+
+resolver::~resolver()
+{
+    for (udp_datagram_socket *sock : { sock4.get(), sock6.get() }) {
+        if (sock) sock->close_connection();
+    }
+}
+
+resolver_cache& resolver::get_cache()
+{
+    static resolver_cache cache;
+    return cache;
+}
+
+bool resolver::parse_nameserver(std::string spec, socket_addr &addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    int port = RESOLVER_PORT;
+    std::string host = spec;
+    size_t close_bracket = spec.find(']');
+    if (spec.size() > 0 && spec[0] == '[' && close_bracket != std::string::npos) {
+        host = spec.substr(1, close_bracket - 1);
+        if (close_bracket + 1 < spec.size()) {
+            if (spec[close_bracket + 1] != ':') return false;
+            port = atoi(spec.substr(close_bracket + 2).c_str());
+        }
+    } else if (std::count(spec.begin(), spec.end(), ':') == 1) {
+        host = spec.substr(0, spec.find(':'));
+        port = atoi(spec.substr(spec.find(':') + 1).c_str());
+    }
+    if (port <= 0 || port > 65535) {
+        return false;
+    }
+    if (inet_pton(AF_INET, host.c_str(), &addr.ip4addr.sin_addr) == 1) {
+        addr.saddr.sa_family = AF_INET;
+    } else if (inet_pton(AF_INET6, host.c_str(), &addr.ip6addr.sin6_addr) == 1) {
+        addr.saddr.sa_family = AF_INET6;
+    } else {
+        return false;
+    }
+    resolver_set_port(addr, port);
+    return true;
+}
+
+std::vector<socket_addr> resolver::system_nameservers()
+{
+    std::vector<socket_addr> addrs;
+    std::ifstream file("/etc/resolv.conf");
+    std::string line;
+    while (std::getline(file, line)) {
+        std::stringstream ss(line);
+        std::string keyword, value;
+        socket_addr addr;
+        if (ss >> keyword >> value && keyword == "nameserver" && parse_nameserver(value, addr)) {
+            addrs.push_back(addr);
+        }
+    }
+    if (addrs.size() == 0) {
+        // same default as the system resolver
+        socket_addr addr;
+        parse_nameserver("127.0.0.1", addr);
+        addrs.push_back(addr);
+    }
+    return addrs;
+}
+
+size_t resolver::encode_query(char *buf, size_t len, uint16_t id, std::string host, int qtype)
+{
+    uint8_t *p = (uint8_t*)buf, *end = (uint8_t*)buf + len;
+    if (host.size() > 0 && host.back() == '.') {
+        host.pop_back();
+    }
+    if (len < 12 + host.size() + 2 + 4 || host.size() == 0 || host.size() > 253) {
+        return 0;
+    }
+
+    // header with recursion desired and one question
+    const uint8_t header[12] = { (uint8_t)(id >> 8), (uint8_t)id, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+    memcpy(p, header, sizeof(header));
+    p += sizeof(header);
+    size_t start = 0;
+    while (start <= host.size()) {
+        size_t dot = host.find('.', start);
+        if (dot == std::string::npos) dot = host.size();
+        size_t label_len = dot - start;
+        if (label_len == 0 || label_len > 63) {
+            return 0;
+        }
+        *p++ = (uint8_t)label_len;
+        memcpy(p, host.data() + start, label_len);
+        p += label_len;
+        start = dot + 1;
+    }
+    *p++ = 0;
+    *p++ = (uint8_t)(qtype >> 8);
+    *p++ = (uint8_t)qtype;
+    *p++ = 0;
+    *p++ = 1; // IN
+    assert(p <= end);
+    return p - (uint8_t*)buf;
+}
+
+static bool resolver_read_name(const uint8_t *msg, size_t len, size_t &offset, std::string *name)
+{
+    // follow compression pointers, bounding the jumps so loops terminate
+    size_t pos = offset;
+    bool jumped = false;
+    for (int jumps = 0; jumps < 64; ) {
+        if (pos >= len) return false;
+        uint8_t label_len = msg[pos];
+        if ((label_len & 0xc0) == 0xc0) {
+            if (pos + 1 >= len) return false;
+            if (!jumped) offset = pos + 2;
+            pos = ((label_len & 0x3f) << 8) | msg[pos + 1];
+            jumped = true;
+            jumps++;
+        } else if (label_len & 0xc0) {
+            return false;
+        } else if (label_len == 0) {
+            if (!jumped) offset = pos + 1;
+            return true;
+        } else {
+            if (pos + 1 + label_len > len) return false;
+            if (name) {
+                if (name->size() > 0) name->push_back('.');
+                name->append((const char*)msg + pos + 1, label_len);
+            }
+            pos += 1 + label_len;
+        }
+    }
+    return false;
+}
+
+static uint16_t resolver_get16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t resolver_get32(const uint8_t *p) { return ((uint32_t)resolver_get16(p) << 16) | resolver_get16(p + 2); }
+
+bool resolver::decode_response(const char *buf, size_t len, resolver_answer &answer)
+{
+    const uint8_t *msg = (const uint8_t*)buf;
+    if (len < 12 || !(msg[2] & 0x80)) {
+        return false;
+    }
+    answer.id = resolver_get16(msg);
+    answer.truncated = (msg[2] & 0x02) != 0;
+    answer.rcode = msg[3] & 0x0f;
+    answer.qname.clear();
+    answer.addrs.clear();
+    answer.ttl = RESOLVER_TTL_MAX;
+    answer.negative_ttl = -1;
+    uint16_t qdcount = resolver_get16(msg + 4);
+    uint16_t ancount = resolver_get16(msg + 6);
+    uint16_t nscount = resolver_get16(msg + 8);
+    if (qdcount != 1) {
+        return false;
+    }
+    size_t offset = 12;
+    if (!resolver_read_name(msg, len, offset, &answer.qname) || offset + 4 > len) {
+        return false;
+    }
+    answer.qtype = resolver_get16(msg + offset);
+    offset += 4;
+
+    // addresses from the answer section, negative ttl from an SOA in the authority section
+    for (int i = 0; i < ancount + nscount; i++) {
+        if (!resolver_read_name(msg, len, offset, nullptr) || offset + 10 > len) {
+            return false;
+        }
+        uint16_t type = resolver_get16(msg + offset);
+        uint16_t rclass = resolver_get16(msg + offset + 2);
+        uint32_t ttl = resolver_get32(msg + offset + 4);
+        uint16_t rdlength = resolver_get16(msg + offset + 8);
+        offset += 10;
+        if (offset + rdlength > len) {
+            return false;
+        }
+        if (rclass == 1 && i < ancount && type == answer.qtype) {
+            socket_addr addr;
+            memset(&addr, 0, sizeof(addr));
+            if (type == resolver_qtype_a && rdlength == 4) {
+                addr.saddr.sa_family = AF_INET;
+                memcpy(&addr.ip4addr.sin_addr, msg + offset, 4);
+            } else if (type == resolver_qtype_aaaa && rdlength == 16) {
+                addr.saddr.sa_family = AF_INET6;
+                memcpy(&addr.ip6addr.sin6_addr, msg + offset, 16);
+            } else {
+                return false;
+            }
+            answer.addrs.push_back(addr);
+            answer.ttl = std::min(answer.ttl, ttl);
+        } else if (i >= ancount && type == 6) {
+            // SOA rdata is two names then serial, refresh, retry, expire and minimum
+            size_t soa_offset = offset;
+            if (resolver_read_name(msg, len, soa_offset, nullptr) &&
+                resolver_read_name(msg, len, soa_offset, nullptr) &&
+                soa_offset + 20 <= offset + rdlength)
+            {
+                answer.negative_ttl = std::min(ttl, resolver_get32(msg + soa_offset + 16));
+            }
+        }
+        offset += rdlength;
+    }
+    if (answer.addrs.size() == 0) {
+        answer.ttl = 0;
+    }
+    return true;
+}
+
 bool resolver::lookup(socket_addr &addr, std::string host, int port)
 {
     memset(&addr, 0, sizeof(addr));
     addr.saddr.sa_family = AF_INET;
     addr.ip4addr.sin_port = htons(port);
-    
+
     // parse host:port
     if (port == 0) {
         size_t host_colon_pos = host.find_last_of(':');
@@ -34,7 +390,7 @@ bool resolver::lookup(socket_addr &addr, std::string host, int port)
             host = host.substr(0, host_colon_pos);
         }
     }
-    
+
     // gethostbyname on BSD uses thread local storage
     // TODO - use getaddrinfo or gethostbyname_r (on linux)
     struct hostent *he = gethostbyname(host.c_str());
@@ -55,6 +411,269 @@ bool resolver::lookup(socket_addr &addr, std::string host, int port)
         log_error("resolver::lookup: %s: %s", host.c_str(), hstrerror(h_errno));
         return false;
     }
-    
+
     return true;
 }
+
+void resolver::init(std::vector<socket_addr> nameservers, int timeout_msecs, bool ipv6,
+                    pollset_ptr pollset, int poll_type)
+{
+    this->nameservers = nameservers.size() > 0 ? nameservers : system_nameservers();
+    this->timeout_msecs = std::max(timeout_msecs, 1);
+    this->ipv6 = ipv6;
+    this->pollset = pollset;
+    this->poll_type = poll_type;
+}
+
+void resolver::lookup_async(std::string host, int port, resolver_callback cb)
+{
+    socket_addr addr;
+    memset(&addr, 0, sizeof(addr));
+
+    // numeric addresses and the hosts file need no query
+    if (inet_pton(AF_INET, host.c_str(), &addr.ip4addr.sin_addr) == 1) {
+        addr.saddr.sa_family = AF_INET;
+        resolver_set_port(addr, port);
+        cb(true, addr);
+        return;
+    }
+    if (inet_pton(AF_INET6, host.c_str(), &addr.ip6addr.sin6_addr) == 1) {
+        addr.saddr.sa_family = AF_INET6;
+        resolver_set_port(addr, port);
+        cb(true, addr);
+        return;
+    }
+    host = resolver_lowercase(host);
+    resolver_cache &cache = get_cache();
+    if (cache.find_host(host, addr)) {
+        resolver_set_port(addr, port);
+        cb(true, addr);
+        return;
+    }
+
+    // join a query already in flight for this host
+    auto qi = queries.find(host);
+    if (qi != queries.end()) {
+        qi->second->waiters.push_back(resolver_waiter{port, cb});
+        return;
+    }
+
+    // answer from the cache, or ask for the families it does not have
+    resolver_query_ptr query = std::make_shared<resolver_query>();
+    query->host = host;
+    query->waiters.push_back(resolver_waiter{port, cb});
+    query->delay_usecs = 0;
+    time_t now = time(nullptr);
+    bool ask = false;
+    for (int i = 0; i < 2; i++) {
+        query->id[i] = 0;
+        query->attempts[i] = 0;
+        query->deadline_usecs[i] = 0;
+        resolver_cache_entry entry;
+        if (i == 0 && !ipv6) {
+            query->state[i] = resolver_state_none;
+        } else if (cache.find(host, resolver_families[i], now, entry)) {
+            query->state[i] = entry.addrs.size() > 0 ? resolver_state_positive : resolver_state_negative;
+            query->addrs[i] = entry.addrs;
+        } else {
+            query->state[i] = resolver_state_pending;
+            ask = true;
+        }
+    }
+    if (query->state[0] == resolver_state_positive || query->state[1] == resolver_state_positive) {
+        // a cached address is used rather than waiting for the other family
+        for (int i = 0; i < 2; i++) {
+            if (query->state[i] == resolver_state_pending) query->state[i] = resolver_state_none;
+        }
+        ask = false;
+    }
+    if (ask) {
+        queries[host] = query;
+        for (int i = 0; i < 2; i++) {
+            if (query->state[i] == resolver_state_pending) send_query(query, i);
+        }
+    }
+    process_query(query, resolver_now_usecs());
+}
+
+udp_datagram_socket* resolver::get_socket(int family)
+{
+    udp_datagram_socket_ptr &sock = (family == AF_INET6) ? sock6 : sock4;
+    if (!sock) {
+        sock = udp_datagram_socket_ptr(new udp_datagram_socket(family));
+        if (sock->get_fd() >= 0 && pollset) {
+            pollset->add_object(poll_object(poll_type, this, sock->get_fd()), poll_event_in);
+        }
+    }
+    return sock->get_fd() >= 0 ? sock.get() : nullptr;
+}
+
+void resolver::send_query(resolver_query_ptr query, int index)
+{
+    char buf[512];
+    query->id[index] = resolver_query_id();
+    query->deadline_usecs[index] = resolver_now_usecs() + (uint64_t)timeout_msecs * 1000;
+    const socket_addr &server = nameservers[query->attempts[index]++ % nameservers.size()];
+    size_t len = encode_query(buf, sizeof(buf), query->id[index], query->host, resolver_qtypes[index]);
+    udp_datagram_socket *sock = get_socket(server.saddr.sa_family);
+    if (len == 0 || !sock) {
+        query->state[index] = resolver_state_failed;
+        return;
+    }
+    io_result result = sock->sendto(buf, len, server);
+    if (result.has_error()) {
+        // the timeout retries on the next nameserver
+        log_error("resolver: sendto %s: %s", socket_addr::addr_to_string(server).c_str(),
+                  result.error_string().c_str());
+    }
+}
+
+void resolver::handle_events()
+{
+    char buf[1500];
+    for (udp_datagram_socket *sock : { sock4.get(), sock6.get() }) {
+        if (!sock) continue;
+        for (;;) {
+            socket_addr src;
+            io_result result = sock->recvfrom(buf, sizeof(buf), src);
+            if (result.has_error()) break;
+            handle_answer(src, buf, result.size());
+        }
+    }
+}
+
+void resolver::handle_answer(const socket_addr &src, const char *buf, size_t len)
+{
+    resolver_answer answer;
+    if (!decode_response(buf, len, answer)) {
+        return;
+    }
+
+    // accept only answers from our nameservers to a question we asked
+    bool from_nameserver = std::any_of(nameservers.begin(), nameservers.end(), [&](const socket_addr &ns) {
+        return socket_addr::addr_to_string(ns) == socket_addr::addr_to_string(src);
+    });
+    auto qi = queries.find(resolver_lowercase(answer.qname));
+    if (!from_nameserver || qi == queries.end()) {
+        return;
+    }
+    resolver_query_ptr query = qi->second;
+    int index = answer.qtype == resolver_qtype_aaaa ? 0 : 1;
+    if (answer.qtype != resolver_qtypes[index] || query->id[index] != answer.id ||
+        query->state[index] != resolver_state_pending)
+    {
+        return;
+    }
+
+    time_t now = time(nullptr);
+    resolver_cache &cache = get_cache();
+    time_t negative_ttl = answer.negative_ttl >= 0 ? (time_t)answer.negative_ttl : RESOLVER_NEGATIVE_TTL;
+    if (answer.rcode == 0 && answer.addrs.size() > 0) {
+        query->state[index] = resolver_state_positive;
+        query->addrs[index] = answer.addrs;
+        cache.insert(query->host, resolver_families[index], answer.addrs, answer.ttl, now);
+    } else if (answer.rcode == 0 && !answer.truncated) {
+        query->state[index] = resolver_state_negative;
+        cache.insert(query->host, resolver_families[index], answer.addrs, negative_ttl, now);
+    } else if (answer.rcode == 3) {
+        // the name does not exist so neither family will answer
+        for (int i = 0; i < 2; i++) {
+            if (i == index || query->state[i] == resolver_state_pending) {
+                query->state[i] = resolver_state_negative;
+                cache.insert(query->host, resolver_families[i], std::vector<socket_addr>(), negative_ttl, now);
+            }
+        }
+    } else if (query->attempts[index] < RESOLVER_ATTEMPTS * (int)nameservers.size()) {
+        send_query(query, index);
+    } else {
+        query->state[index] = resolver_state_failed;
+    }
+    process_query(query, resolver_now_usecs());
+}
+
+void resolver::process_query(resolver_query_ptr query, uint64_t now_usecs)
+{
+    int aaaa = query->state[0], a = query->state[1];
+    const socket_addr *addr = nullptr;
+    if (aaaa == resolver_state_positive) {
+        addr = &query->addrs[0][0];
+    } else if (a == resolver_state_positive) {
+        // give AAAA a moment to answer before settling for A
+        if (aaaa != resolver_state_pending || (query->delay_usecs != 0 && now_usecs >= query->delay_usecs)) {
+            addr = &query->addrs[1][0];
+        } else if (query->delay_usecs == 0) {
+            query->delay_usecs = now_usecs + RESOLVER_RESOLUTION_DELAY_MSECS * 1000;
+            return;
+        } else {
+            return;
+        }
+    } else if (aaaa == resolver_state_pending || a == resolver_state_pending) {
+        return;
+    }
+
+    // finished, callbacks may start new lookups so remove the query first
+    auto qi = queries.find(query->host);
+    if (qi != queries.end() && qi->second == query) {
+        queries.erase(qi);
+    }
+    for (auto &waiter : query->waiters) {
+        if (addr) {
+            socket_addr result = *addr;
+            resolver_set_port(result, waiter.port);
+            waiter.cb(true, result);
+        } else {
+            socket_addr result;
+            memset(&result, 0, sizeof(result));
+            waiter.cb(false, result);
+        }
+    }
+}
+
+void resolver::handle_timeouts()
+{
+    if (queries.size() == 0) return;
+    uint64_t now_usecs = resolver_now_usecs();
+    std::vector<resolver_query_ptr> expired;
+    for (auto &ent : queries) {
+        resolver_query_ptr query = ent.second;
+        bool due = query->delay_usecs != 0 && now_usecs >= query->delay_usecs;
+        for (int i = 0; i < 2; i++) {
+            if (query->state[i] == resolver_state_pending && now_usecs >= query->deadline_usecs[i]) {
+                due = true;
+            }
+        }
+        if (due) expired.push_back(query);
+    }
+    for (auto &query : expired) {
+        for (int i = 0; i < 2; i++) {
+            if (query->state[i] != resolver_state_pending || now_usecs < query->deadline_usecs[i]) continue;
+            if (query->attempts[i] < RESOLVER_ATTEMPTS * (int)nameservers.size()) {
+                send_query(query, i);
+            } else {
+                log_error("resolver: %s: timed out", query->host.c_str());
+                query->state[i] = resolver_state_failed;
+            }
+        }
+        process_query(query, now_usecs);
+    }
+}
+
+int resolver::next_timeout_msecs()
+{
+    if (queries.size() == 0) return -1;
+    uint64_t now_usecs = resolver_now_usecs();
+    uint64_t next_usecs = UINT64_MAX;
+    for (auto &ent : queries) {
+        resolver_query_ptr query = ent.second;
+        if (query->delay_usecs != 0) {
+            next_usecs = std::min(next_usecs, query->delay_usecs);
+        }
+        for (int i = 0; i < 2; i++) {
+            if (query->state[i] == resolver_state_pending) {
+                next_usecs = std::min(next_usecs, query->deadline_usecs[i]);
+            }
+        }
+    }
+    if (next_usecs <= now_usecs) return 0;
+    return (int)std::min((next_usecs - now_usecs + 999) / 1000, (uint64_t)INT32_MAX);
+}
@@ -5,12 +5,121 @@
 #ifndef resolver_h
 #define resolver_h
 
+#define RESOLVER_PORT                   53
+#define RESOLVER_ATTEMPTS               2       /* sends per family before failing */
+#define RESOLVER_RESOLUTION_DELAY_MSECS 50      /* wait for AAAA after A answers (RFC 8305) */
+#define RESOLVER_NEGATIVE_TTL           30      /* negative ttl when there is no SOA */
+#define RESOLVER_TTL_MAX                86400
+#define RESOLVER_CACHE_MAX              65536
+
 struct resolver;
 typedef std::shared_ptr<resolver> resolver_ptr;
+struct pollset;
+typedef std::shared_ptr<pollset> pollset_ptr;
+struct udp_datagram_socket;
+typedef std::unique_ptr<udp_datagram_socket> udp_datagram_socket_ptr;
+typedef std::function<void(bool,const socket_addr&)> resolver_callback;
+
+enum resolver_qtype {
+    resolver_qtype_a = 1,
+    resolver_qtype_aaaa = 28,
+};
+
+
+/*
+ * resolver_answer
+ *
+ * Decoded answer to a single A or AAAA question.
+ */
+
+struct resolver_answer
+{
+    uint16_t                    id;
+    int                         rcode;
+    bool                        truncated;
+    std::string                 qname;
+    int                         qtype;
+    std::vector<socket_addr>    addrs;
+    uint32_t                    ttl;            /* lowest ttl of the addresses */
+    int64_t                     negative_ttl;   /* from the SOA, -1 if absent */
+};
+
+
+/*
+ * resolver_cache
+ *
+ * Addresses by host and family, shared by every resolver. An entry
+ * without addresses records a negative answer.
+ */
+
+struct resolver_cache_entry
+{
+    std::vector<socket_addr>    addrs;
+    time_t                      expires;
+};
+
+struct resolver_cache
+{
+    typedef std::pair<std::string,int> key_type;
+
+    std::mutex                              mutex;
+    std::map<key_type,resolver_cache_entry> entries;
+    std::map<std::string,socket_addr>       hosts;
+    std::once_flag                          hosts_once;
+
+    bool find(std::string host, int family, time_t now, resolver_cache_entry &entry);
+    void insert(std::string host, int family, const std::vector<socket_addr> &addrs, time_t ttl, time_t now);
+    bool find_host(std::string host, socket_addr &addr);
+    void clear();
+};
+
+
+/*
+ * resolver
+ *
+ * lookup is a blocking call. lookup_async is a stub resolver that sends
+ * A and AAAA questions together over UDP and answers from the shared
+ * cache when it can. Its sockets are registered with the owning thread's
+ * pollset, and callbacks run on that thread, possibly before lookup_async
+ * returns.
+ */
+
+struct resolver_query;
+typedef std::shared_ptr<resolver_query> resolver_query_ptr;
 
 struct resolver
 {
+    std::vector<socket_addr>                nameservers;
+    int                                     timeout_msecs;
+    bool                                    ipv6;
+    pollset_ptr                             pollset;
+    int                                     poll_type;
+    udp_datagram_socket_ptr                 sock4;
+    udp_datagram_socket_ptr                 sock6;
+    std::map<std::string,resolver_query_ptr> queries;
+
+    resolver();
+    ~resolver();
+
+    static resolver_cache& get_cache();
+    static bool parse_nameserver(std::string spec, socket_addr &addr);
+    static std::vector<socket_addr> system_nameservers();
+    static size_t encode_query(char *buf, size_t len, uint16_t id, std::string host, int qtype);
+    static bool decode_response(const char *buf, size_t len, resolver_answer &answer);
+
     bool lookup(socket_addr &addr, std::string host, int port = 0);
+
+    void init(std::vector<socket_addr> nameservers, int timeout_msecs, bool ipv6,
+              pollset_ptr pollset = pollset_ptr(), int poll_type = 0);
+    void lookup_async(std::string host, int port, resolver_callback cb);
+    void handle_events();
+    void handle_timeouts();
+    int next_timeout_msecs();
+
+    udp_datagram_socket* get_socket(int family);
+    void send_query(resolver_query_ptr query, int index);
+    void handle_answer(const socket_addr &src, const char *buf, size_t len);
+    void process_query(resolver_query_ptr query, uint64_t now_usecs);
 };
 
 #endif
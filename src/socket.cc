@@ -114,6 +114,108 @@ int socket_addr::string_to_addr(std::string addr_spec, socket_addr &addr)
 }
 
 
+/* socket_listen_options */
+
+bool socket_listen_options::parse(std::string option)
+{
+    size_t eq = option.find("=");
+    std::string name = option.substr(0, eq);
+    int value = eq == std::string::npos ? -1 : atoi(option.substr(eq + 1).c_str());
+    if (eq != std::string::npos && value <= 0) return false;
+    
+    if (name == "defer_accept") {
+        defer_accept = value < 0 ? 1 : value;
+    } else if (name == "fastopen") {
+        fastopen = value < 0 ? 16 : value;
+    } else if (name == "reuseport" && value < 0) {
+        reuseport = true;
+    } else if (name == "backlog" && value > 0) {
+        backlog = value;
+    } else if (name == "rcvbuf" && value > 0) {
+        rcvbuf = value;
+    } else if (name == "sndbuf" && value > 0) {
+        sndbuf = value;
+    } else if (name == "notsent_lowat" && value > 0) {
+        notsent_lowat = value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool socket_listen_options::apply(int fd) const
+{
+    // buffer sizes and notsent_lowat are inherited by accepted sockets
+    if (reuseport) {
+#if defined(SO_REUSEPORT)
+        int reuse = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(reuse)) < 0) {
+            log_error("setsockopt(SOL_SOCKET, SO_REUSEPORT) failed: %s", strerror(errno));
+            return false;
+        }
+#else
+        log_error("reuseport is not supported on this platform");
+#endif
+    }
+    if (rcvbuf > 0) {
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf, sizeof(rcvbuf)) < 0) {
+            log_error("setsockopt(SOL_SOCKET, SO_RCVBUF) failed: %s", strerror(errno));
+            return false;
+        }
+    }
+    if (sndbuf > 0) {
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, sizeof(sndbuf)) < 0) {
+            log_error("setsockopt(SOL_SOCKET, SO_SNDBUF) failed: %s", strerror(errno));
+            return false;
+        }
+    }
+    if (defer_accept > 0) {
+#if defined(TCP_DEFER_ACCEPT)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (void *)&defer_accept, sizeof(defer_accept)) < 0) {
+            log_error("setsockopt(IPPROTO_TCP, TCP_DEFER_ACCEPT) failed: %s", strerror(errno));
+            return false;
+        }
+#else
+        log_error("defer_accept is not supported on this platform");
+#endif
+    }
+    if (fastopen > 0) {
+#if defined(TCP_FASTOPEN)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (void *)&fastopen, sizeof(fastopen)) < 0) {
+            log_error("setsockopt(IPPROTO_TCP, TCP_FASTOPEN) failed: %s", strerror(errno));
+            return false;
+        }
+#else
+        log_error("fastopen is not supported on this platform");
+#endif
+    }
+    if (notsent_lowat > 0) {
+#if defined(TCP_NOTSENT_LOWAT)
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&notsent_lowat, sizeof(notsent_lowat)) < 0) {
+            log_error("setsockopt(IPPROTO_TCP, TCP_NOTSENT_LOWAT) failed: %s", strerror(errno));
+            return false;
+        }
+#else
+        log_error("notsent_lowat is not supported on this platform");
+#endif
+    }
+    return true;
+}
+
+std::string socket_listen_options::to_string() const
+{
+    std::stringstream ss;
+    if (backlog > 0) ss << " backlog=" << backlog;
+    if (defer_accept > 0) ss << " defer_accept=" << defer_accept;
+    if (fastopen > 0) ss << " fastopen=" << fastopen;
+    if (reuseport) ss << " reuseport";
+    if (rcvbuf > 0) ss << " rcvbuf=" << rcvbuf;
+    if (sndbuf > 0) ss << " sndbuf=" << sndbuf;
+    if (notsent_lowat > 0) ss << " notsent_lowat=" << notsent_lowat;
+    return ss.str();
+}
+
+
 /* generic_socket */
 
 generic_socket::generic_socket() : fd(-1) {}
@@ -162,3 +264,28 @@ connected_socket::connected_socket() : generic_socket(-1) {}
 connected_socket::connected_socket(int fd) : generic_socket(fd) {}
 connected_socket::~connected_socket() {}
 
+bool connected_socket::can_sendfile()
+{
+    return false;
+}
+
+io_result connected_socket::sendfile(int in_fd, off_t offset, size_t len)
+{
+    return io_result(io_error(ENOTSUP));
+}
+
+bool connected_socket::can_splice()
+{
+    return false;
+}
+
+io_result connected_socket::splice_in(int pipe_fd, size_t len)
+{
+    return io_result(io_error(ENOTSUP));
+}
+
+io_result connected_socket::splice_out(int pipe_fd, size_t len)
+{
+    return io_result(io_error(ENOTSUP));
+}
+
@@ -49,6 +49,36 @@ union socket_addr {
 };
 
 
+/* socket listen options
+ *
+ * per listener socket tuning, applied before bind
+ */
+struct socket_listen_options
+{
+    int backlog;            /* listen backlog, -1 uses listen_backlog */
+    int defer_accept;       /* seconds to wait for data before accept, 0 to disable */
+    int fastopen;           /* TCP fast open queue length, 0 to disable */
+    int rcvbuf;             /* SO_RCVBUF, 0 uses the system default */
+    int sndbuf;             /* SO_SNDBUF, 0 uses the system default */
+    int notsent_lowat;      /* TCP_NOTSENT_LOWAT, 0 uses the system default */
+    bool reuseport;         /* SO_REUSEPORT */
+    
+    socket_listen_options() :
+        backlog(-1), defer_accept(0), fastopen(0), rcvbuf(0), sndbuf(0), notsent_lowat(0), reuseport(false) {}
+    
+    bool parse(std::string option);
+    bool apply(int fd) const;
+    std::string to_string() const;
+    
+    inline bool operator==(const socket_listen_options &o) const {
+        return backlog == o.backlog && defer_accept == o.defer_accept && fastopen == o.fastopen &&
+            rcvbuf == o.rcvbuf && sndbuf == o.sndbuf && notsent_lowat == o.notsent_lowat &&
+            reuseport == o.reuseport;
+    }
+    inline bool operator!=(const socket_listen_options &o) const { return !(*this == o); }
+};
+
+
 /* generic socket
  *
  * base class for all sockets
@@ -86,7 +116,7 @@ struct connected_socket : generic_socket, io_reader, io_writer
     virtual socket_mode get_mode() = 0;
     virtual int do_handshake() = 0;
     virtual bool accept(int fd) = 0;
-    virtual bool start_listening(socket_addr addr, int backlog) = 0;
+    virtual bool start_listening(socket_addr addr, const socket_listen_options &opts) = 0;
     virtual socket_addr get_addr() = 0;
     virtual std::string to_string() = 0;
 
@@ -94,6 +124,12 @@ struct connected_socket : generic_socket, io_reader, io_writer
     virtual bool set_nopush(bool nopush) = 0;
     virtual bool set_nodelay(bool nodelay) = 0;
     virtual bool start_lingering_close() = 0;
+
+    virtual bool can_sendfile();
+    virtual io_result sendfile(int in_fd, off_t offset, size_t len);
+    virtual bool can_splice();
+    virtual io_result splice_in(int pipe_fd, size_t len);
+    virtual io_result splice_out(int pipe_fd, size_t len);
 };
 
 #endif
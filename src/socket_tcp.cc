@@ -17,6 +17,10 @@
 #include "socket.h"
 #include "socket_tcp.h"
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
 #if defined(TCP_CORK) && !defined(TCP_NOPUSH)
 #define TCP_NOPUSH TCP_CORK
 #endif
@@ -58,7 +62,7 @@ int tcp_connected_socket::do_handshake()
     return 0;
 }
 
-bool tcp_connected_socket::start_listening(socket_addr addr, int backlog)
+bool tcp_connected_socket::start_listening(socket_addr addr, const socket_listen_options &opts)
 {
     int fd = socket(addr.saddr.sa_family, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -68,7 +72,7 @@ bool tcp_connected_socket::start_listening(socket_addr addr, int backlog)
 
     set_fd(fd);
     this->addr = addr;
-    this->backlog = backlog;
+    this->backlog = opts.backlog;
     
     if (addr.saddr.sa_family == AF_INET6) {
         int ipv6only = 1;
@@ -90,6 +94,9 @@ bool tcp_connected_socket::start_listening(socket_addr addr, int backlog)
         log_error("fcntl(F_SETFL, O_NONBLOCK) failed: %s", strerror(errno));
         return false;
     }
+    if (!opts.apply(fd)) {
+        return false;
+    }
     
     socklen_t addr_size = 0;
     if (addr.saddr.sa_family == AF_INET) addr_size = sizeof(addr.ip4addr);
@@ -198,41 +205,80 @@ bool tcp_connected_socket::start_lingering_close()
 
 io_result tcp_connected_socket::read(void *buf, size_t len)
 {
-    ssize_t nbytes;
-    do {
-        nbytes = ::read(fd, buf, len);
-    } while (nbytes < 0 && errno == EAGAIN);
+    ssize_t nbytes = ::read(fd, buf, len);
     
     return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
 }
 
 io_result tcp_connected_socket::readv(const struct iovec *iov, int iovcnt)
 {
-    ssize_t nbytes;
-    do {
-        nbytes = ::readv(fd, iov, iovcnt);
-    } while (nbytes < 0 && errno == EAGAIN);
+    ssize_t nbytes = ::readv(fd, iov, iovcnt);
     
     return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
 }
 
 io_result tcp_connected_socket::write(void *buf, size_t len)
 {
-    ssize_t nbytes;
-    do {
-        nbytes = ::write(fd, buf, len);
-    } while (nbytes < 0 && errno == EAGAIN);
+    ssize_t nbytes = ::write(fd, buf, len);
     
     return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
 }
 
 io_result tcp_connected_socket::writev(const struct iovec *iov, int iovcnt)
 {
-    ssize_t nbytes;
-    do {
-        nbytes = ::writev(fd, iov, iovcnt);
-    } while (nbytes < 0 && errno == EAGAIN);
+    ssize_t nbytes = ::writev(fd, iov, iovcnt);
+    
+    return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+}
+
+bool tcp_connected_socket::can_sendfile()
+{
+#if defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+io_result tcp_connected_socket::sendfile(int in_fd, off_t offset, size_t len)
+{
+#if defined(__linux__)
+    ssize_t nbytes = ::sendfile(fd, in_fd, &offset, len);
+    
+    return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+#else
+    return io_result(io_error(ENOTSUP));
+#endif
+}
+
+bool tcp_connected_socket::can_splice()
+{
+#if defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+io_result tcp_connected_socket::splice_in(int pipe_fd, size_t len)
+{
+#if defined(__linux__)
+    ssize_t nbytes = ::splice(fd, NULL, pipe_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    
+    return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+#else
+    return io_result(io_error(ENOTSUP));
+#endif
+}
+
+io_result tcp_connected_socket::splice_out(int pipe_fd, size_t len)
+{
+#if defined(__linux__)
+    ssize_t nbytes = ::splice(pipe_fd, NULL, fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
     
     return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+#else
+    return io_result(io_error(ENOTSUP));
+#endif
 }
 
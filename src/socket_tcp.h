@@ -25,7 +25,7 @@ struct tcp_connected_socket : connected_socket
     socket_mode get_mode();
     int do_handshake();
     bool accept(int fd);
-    bool start_listening(socket_addr addr, int backlog);
+    bool start_listening(socket_addr addr, const socket_listen_options &opts);
     socket_addr get_addr();
     std::string to_string();
     bool connect_to_host(socket_addr addr);
@@ -37,6 +37,12 @@ struct tcp_connected_socket : connected_socket
     io_result readv(const struct iovec *iov, int iovcnt);
     io_result write(void *buf, size_t len);
     io_result writev(const struct iovec *iov, int iovcnt);
+
+    bool can_sendfile();
+    io_result sendfile(int in_fd, off_t offset, size_t len);
+    bool can_splice();
+    io_result splice_in(int pipe_fd, size_t len);
+    io_result splice_out(int pipe_fd, size_t len);
 };
 
 #endif
@@ -7,28 +7,54 @@
 
 #include <cassert>
 #include <cstring>
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include "os.h"
 #include "log.h"
 #include "io.h"
 #include "socket.h"
 #include "socket_tls.h"
 
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/tls.h>
+#endif
+
 #if defined(TCP_CORK) && !defined(TCP_NOPUSH)
 #define TCP_NOPUSH TCP_CORK
 #endif
 
+#if defined(__linux__) && !defined(TCP_ULP)
+#define TCP_ULP 31
+#endif
+
+#if defined(__linux__) && !defined(SOL_TLS)
+#define SOL_TLS 282
+#endif
+
+// kernel TLS needs the negotiated keys, which only BoringSSL exports
+#if defined(__linux__) && defined(TLS_TX) && defined(OPENSSL_IS_BORINGSSL)
+#define USE_KTLS 1
+#else
+#define USE_KTLS 0
+#endif
+
+#define TLS_RECORD_TYPE_ALERT 21
+
 
 /* tls_connected_socket */
 
 tls_connected_socket::tls_connected_socket()
-    : connected_socket(-1), addr(), backlog(0), ctx(nullptr), ssl(nullptr),lingering_close(0), nopush(0), nodelay(0) {}
+    : connected_socket(-1), addr(), backlog(0), ctx(nullptr), ssl(nullptr),lingering_close(0), nopush(0), nodelay(0), ktls_tx(0),
+      record_sizing(), record_bytes(0), record_pending(0), last_write_usecs(0) {}
 
 tls_connected_socket::tls_connected_socket(int fd)
-    : connected_socket(fd), addr(), backlog(0), ctx(nullptr), ssl(nullptr), lingering_close(0), nopush(0), nodelay(0)
+    : connected_socket(fd), addr(), backlog(0), ctx(nullptr), ssl(nullptr), lingering_close(0), nopush(0), nodelay(0), ktls_tx(0),
+      record_sizing(), record_bytes(0), record_pending(0), last_write_usecs(0)
 {
     if (fd < 0) return;
     if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
@@ -57,6 +83,14 @@ socket_mode tls_connected_socket::get_mode()
     return socket_mode_tls;
 }
 
+int tls_connected_socket::ssl_error(int ret)
+{
+    // report want read/write as EAGAIN so callers can treat TLS and
+    // plain sockets alike when a non-blocking operation would block
+    int err = SSL_get_error(ssl, ret);
+    return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? EAGAIN : err;
+}
+
 int tls_connected_socket::do_handshake()
 {
     assert(ssl != nullptr);
@@ -64,7 +98,7 @@ int tls_connected_socket::do_handshake()
     return ret < 0 ? SSL_get_error(ssl, ret) : 0;
 }
 
-bool tls_connected_socket::start_listening(socket_addr addr, int backlog)
+bool tls_connected_socket::start_listening(socket_addr addr, const socket_listen_options &opts)
 {
     int fd = socket(addr.saddr.sa_family, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -74,7 +108,7 @@ bool tls_connected_socket::start_listening(socket_addr addr, int backlog)
     
     set_fd(fd);
     this->addr = addr;
-    this->backlog = backlog;
+    this->backlog = opts.backlog;
     
     if (addr.saddr.sa_family == AF_INET6) {
         int ipv6only = 1;
@@ -96,6 +130,9 @@ bool tls_connected_socket::start_listening(socket_addr addr, int backlog)
         log_error("fcntl(F_SETFL, O_NONBLOCK) failed: %s", strerror(errno));
         return false;
     }
+    if (!opts.apply(fd)) {
+        return false;
+    }
     
     socklen_t addr_size = 0;
     if (addr.saddr.sa_family == AF_INET) addr_size = sizeof(addr.ip4addr);
@@ -124,6 +161,28 @@ std::string tls_connected_socket::to_string()
 
 void tls_connected_socket::close_connection()
 {
+#if USE_KTLS
+    if (ktls_tx) {
+        // the library write state is stale once the kernel owns the keys
+        // so send close_notify as a kernel alert record
+        unsigned char alert[2] = { 1, 0 };
+        char cmsg_buf[CMSG_SPACE(sizeof(unsigned char))];
+        struct iovec iov = { alert, sizeof(alert) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = sizeof(cmsg_buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+        *CMSG_DATA(cmsg) = TLS_RECORD_TYPE_ALERT;
+        sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        ktls_tx = 0;
+    } else
+#endif
     if (ssl) {
         SSL_shutdown(ssl);
     }
@@ -146,6 +205,8 @@ bool tls_connected_socket::accept(int fd)
     }
 
     set_fd(fd);
+    ktls_tx = 0;
+    record_bytes = record_pending = 0;
     
     SSL_clear(ssl);
     SSL_set_fd(ssl, fd);
@@ -176,6 +237,7 @@ bool tls_connected_socket::connect_to_host(socket_addr addr)
     }
     
     set_fd(fd);
+    ktls_tx = 0;
     
     SSL_clear(ssl);
     SSL_set_fd(ssl, fd);
@@ -251,7 +313,7 @@ io_result tls_connected_socket::read(void *buf, size_t len)
 {
     assert(ssl != nullptr);
     int ret = SSL_read(ssl, buf, (int)len);
-    return ret < 0 ? io_result(io_error(SSL_get_error(ssl, ret))) : io_result(ret);
+    return ret < 0 ? io_result(io_error(ssl_error(ret))) : io_result(ret);
 }
 
 io_result tls_connected_socket::readv(const struct iovec *iov, int iovcnt)
@@ -259,20 +321,185 @@ io_result tls_connected_socket::readv(const struct iovec *iov, int iovcnt)
     assert(iovcnt > 0);
     assert(ssl != nullptr);
     int ret = SSL_read(ssl, iov[0].iov_base, (int)iov[0].iov_len);
-    return ret < 0 ? io_result(io_error(SSL_get_error(ssl, ret))) : io_result(ret);
+    return ret < 0 ? io_result(io_error(ssl_error(ret))) : io_result(ret);
 }
 
 io_result tls_connected_socket::write(void *buf, size_t len)
 {
+    if (ktls_tx) {
+        ssize_t nbytes = ::write(fd, buf, len);
+        return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+    }
     assert(ssl != nullptr);
-    int ret = SSL_write(ssl, buf, (int)len);
-    return ret < 0 ? io_result(io_error(SSL_get_error(ssl, ret))) : io_result(ret);
+    if (record_sizing.small_size == 0) {
+        int ret = SSL_write(ssl, buf, (int)len);
+        return ret < 0 ? io_result(io_error(ssl_error(ret))) : io_result(ret);
+    }
+    
+    // start small again after an idle period
+    uint64_t current_usecs = os::current_time_usecs();
+    if (current_usecs - last_write_usecs > (uint64_t)record_sizing.idle_msecs * 1000) {
+        record_bytes = 0;
+    }
+    
+    // one record per SSL_write while ramping up, a blocked write
+    // must be retried with the same length so it is remembered
+    size_t total = 0;
+    while (total < len) {
+        size_t chunk = len - total;
+        if (record_pending > 0) {
+            chunk = std::min(chunk, record_pending);
+        } else if (record_bytes < record_sizing.boost_bytes) {
+            chunk = std::min(chunk, record_sizing.small_size);
+        }
+        int ret = SSL_write(ssl, (char*)buf + total, (int)chunk);
+        if (ret <= 0) {
+            int err = ssl_error(ret);
+            record_pending = (err == EAGAIN) ? chunk : 0;
+            if (total > 0) break;
+            return io_result(io_error(err));
+        }
+        record_pending = 0;
+        record_bytes += ret;
+        total += ret;
+    }
+    last_write_usecs = current_usecs;
+    return io_result(total);
 }
 
 io_result tls_connected_socket::writev(const struct iovec *iov, int iovcnt)
 {
     assert(iovcnt > 0);
-    assert(ssl != nullptr);
-    int ret = SSL_write(ssl, iov[0].iov_base, (int)iov[0].iov_len);
-    return ret < 0 ? io_result(io_error(SSL_get_error(ssl, ret))) : io_result(ret);
+    if (ktls_tx) {
+        ssize_t nbytes = ::writev(fd, iov, iovcnt);
+        return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+    }
+    return write(iov[0].iov_base, iov[0].iov_len);
+}
+
+void tls_connected_socket::set_record_sizing(const tls_record_sizing &sizing)
+{
+    record_sizing = sizing;
+    record_bytes = record_pending = 0;
+}
+
+void tls_connected_socket::reset_record_size()
+{
+    record_bytes = 0;
+}
+
+bool tls_connected_socket::can_sendfile()
+{
+    return ktls_tx;
+}
+
+io_result tls_connected_socket::sendfile(int in_fd, off_t offset, size_t len)
+{
+#if USE_KTLS
+    if (ktls_tx) {
+        ssize_t nbytes = ::sendfile(fd, in_fd, &offset, len);
+        return nbytes < 0 ? io_result(io_error(errno)) : io_result(nbytes);
+    }
+#endif
+    return io_result(io_error(ENOTSUP));
+}
+
+bool tls_connected_socket::enable_ktls()
+{
+    /* install the negotiated TLS 1.2 AEAD write key into the kernel so
+     * writes and sendfile bypass the library. reads stay in the library
+     * so alerts and other non data records are still handled there */
+#if USE_KTLS
+    if (ktls_tx) return true;
+    const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+    if (!cipher || SSL_version(ssl) != TLS1_2_VERSION) return false;
+    
+    size_t key_len, iv_len;
+    int nid = SSL_CIPHER_get_cipher_nid(cipher);
+    switch (nid) {
+        case NID_aes_128_gcm: key_len = 16; iv_len = 4; break;
+#if defined(TLS_CIPHER_AES_GCM_256)
+        case NID_aes_256_gcm: key_len = 32; iv_len = 4; break;
+#endif
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        case NID_chacha20_poly1305: key_len = 32; iv_len = 12; break;
+#endif
+        default: return false;
+    }
+    
+    // AEAD key block is client key, server key, client iv, server iv
+    unsigned char key_block[2 * (32 + 12)];
+    int key_block_len = SSL_get_key_block_len(ssl);
+    if (key_block_len != (int)(2 * (key_len + iv_len)) ||
+        !SSL_generate_key_block(ssl, key_block, key_block_len))
+    {
+        return false;
+    }
+    bool is_server = SSL_is_server(ssl);
+    const unsigned char *key = key_block + (is_server ? key_len : 0);
+    const unsigned char *iv = key_block + 2 * key_len + (is_server ? iv_len : 0);
+    unsigned char rec_seq[8];
+    uint64_t seq = SSL_get_write_sequence(ssl);
+    for (int i = 7; i >= 0; i--) {
+        rec_seq[i] = (unsigned char)(seq & 0xff);
+        seq >>= 8;
+    }
+    
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+#if defined(TLS_CIPHER_AES_GCM_256)
+        struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#endif
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+    } crypto_info;
+    memset(&crypto_info, 0, sizeof(crypto_info));
+    socklen_t crypto_info_len = 0;
+    switch (nid) {
+        case NID_aes_128_gcm:
+            crypto_info.aes_gcm_128.info.version = TLS_1_2_VERSION;
+            crypto_info.aes_gcm_128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(crypto_info.aes_gcm_128.key, key, key_len);
+            memcpy(crypto_info.aes_gcm_128.salt, iv, iv_len);
+            memcpy(crypto_info.aes_gcm_128.iv, rec_seq, sizeof(rec_seq));
+            memcpy(crypto_info.aes_gcm_128.rec_seq, rec_seq, sizeof(rec_seq));
+            crypto_info_len = sizeof(crypto_info.aes_gcm_128);
+            break;
+#if defined(TLS_CIPHER_AES_GCM_256)
+        case NID_aes_256_gcm:
+            crypto_info.aes_gcm_256.info.version = TLS_1_2_VERSION;
+            crypto_info.aes_gcm_256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(crypto_info.aes_gcm_256.key, key, key_len);
+            memcpy(crypto_info.aes_gcm_256.salt, iv, iv_len);
+            memcpy(crypto_info.aes_gcm_256.iv, rec_seq, sizeof(rec_seq));
+            memcpy(crypto_info.aes_gcm_256.rec_seq, rec_seq, sizeof(rec_seq));
+            crypto_info_len = sizeof(crypto_info.aes_gcm_256);
+            break;
+#endif
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        case NID_chacha20_poly1305:
+            crypto_info.chacha20_poly1305.info.version = TLS_1_2_VERSION;
+            crypto_info.chacha20_poly1305.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(crypto_info.chacha20_poly1305.key, key, key_len);
+            memcpy(crypto_info.chacha20_poly1305.iv, iv, iv_len);
+            memcpy(crypto_info.chacha20_poly1305.rec_seq, rec_seq, sizeof(rec_seq));
+            crypto_info_len = sizeof(crypto_info.chacha20_poly1305);
+            break;
+#endif
+    }
+    
+    // a failure here leaves the library path in use
+    bool installed = (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+                      setsockopt(fd, SOL_TLS, TLS_TX, &crypto_info, crypto_info_len) == 0);
+    if (!installed) {
+        log_debug("kTLS unavailable: %s", strerror(errno));
+    }
+    OPENSSL_cleanse(key_block, sizeof(key_block));
+    OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+    ktls_tx = installed;
+    return installed;
+#else
+    return false;
+#endif
 }
@@ -10,6 +10,21 @@
 #include <openssl/err.h>
 
 
+/* tls_record_sizing
+ *
+ * Small records at the start of each response and after idle periods so
+ * the client can decrypt the first bytes without waiting for every TCP
+ * segment of a full 16KB record, then full size records for bulk data.
+ */
+
+struct tls_record_sizing
+{
+    size_t small_size;      /* payload per record while ramping up, 0 disables */
+    size_t boost_bytes;     /* bytes sent in small records before full size records */
+    int idle_msecs;         /* idle time after which records start small again */
+};
+
+
 /* tls_connected_socket */
 
 struct tls_connected_socket : connected_socket
@@ -22,17 +37,23 @@ struct tls_connected_socket : connected_socket
     unsigned int lingering_close : 1;
     unsigned int nopush : 1;
     unsigned int nodelay : 1;
+    unsigned int ktls_tx : 1;
+    tls_record_sizing record_sizing;
+    size_t record_bytes;
+    size_t record_pending;
+    uint64_t last_write_usecs;
     
     tls_connected_socket();
     tls_connected_socket(int fd);
     virtual ~tls_connected_socket();
     
-    bool start_listening(socket_addr addr, int backlog);
+    bool start_listening(socket_addr addr, const socket_listen_options &opts);
     socket_addr get_addr();
     std::string to_string();
 
     void set_context(void *context);
     socket_mode get_mode();
+    int ssl_error(int ret);
     int do_handshake();
     void close_connection();
     bool accept(int fd);
@@ -40,11 +61,17 @@ struct tls_connected_socket : connected_socket
     bool set_nopush(bool nopush);
     bool set_nodelay(bool nodelay);
     bool start_lingering_close();
+    bool enable_ktls();
+    void set_record_sizing(const tls_record_sizing &sizing);
+    void reset_record_size();
     
     io_result read(void *buf, size_t len);
     io_result readv(const struct iovec *iov, int iovcnt);
     io_result write(void *buf, size_t len);
     io_result writev(const struct iovec *iov, int iovcnt);
+
+    bool can_sendfile();
+    io_result sendfile(int in_fd, off_t offset, size_t len);
 };
 
 #endif
@@ -20,12 +20,12 @@
 
 /* udp_datagram_socket */
 
-udp_datagram_socket::udp_datagram_socket()
+udp_datagram_socket::udp_datagram_socket(int family)
 : bind_addr(), connect_addr()
 {
-    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((fd = socket(family, SOCK_DGRAM, 0)) < 0)
     {
-        log_error("socket(AF_INET, SOCK_DGRAM): %s", strerror(errno));
+        log_error("socket(%s, SOCK_DGRAM): %s", family == AF_INET6 ? "AF_INET6" : "AF_INET", strerror(errno));
         return;
     }
     
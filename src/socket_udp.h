@@ -14,7 +14,7 @@ struct udp_datagram_socket : generic_socket
     socket_addr bind_addr;
     socket_addr connect_addr;
     
-    udp_datagram_socket();
+    udp_datagram_socket(int family = AF_INET);
     virtual ~udp_datagram_socket();
     
     bool setIPV6only(int ipv6only = 1);
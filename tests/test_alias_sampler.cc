@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "alias_sampler.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+
+static const size_t test_samples = 1000000;
+
+class test_alias_sampler : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_alias_sampler);
+    CPPUNIT_TEST(test_distribution);
+    CPPUNIT_TEST(test_zero_weight);
+    CPPUNIT_TEST(test_invalid);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+
+    void setUp() {}
+    void tearDown() {}
+
+    std::vector<size_t> histogram(const alias_sampler &sampler)
+    {
+        std::vector<size_t> counts(sampler.size());
+        xorshift64star rng;
+        for (size_t i = 0; i < test_samples; i++) {
+            counts[sampler.sample(rng.next())]++;
+        }
+        return counts;
+    }
+
+    void test_distribution()
+    {
+        std::vector<double> weights = { 50, 25, 15, 7, 2, 1 };
+        alias_sampler sampler;
+        CPPUNIT_ASSERT(sampler.init(weights));
+        CPPUNIT_ASSERT(sampler.size() == weights.size());
+        auto counts = histogram(sampler);
+        for (size_t i = 0; i < weights.size(); i++) {
+            double expected = test_samples * weights[i] / 100.0;
+            CPPUNIT_ASSERT(fabs(counts[i] - expected) < expected * 0.05 + 100);
+        }
+    }
+
+    void test_zero_weight()
+    {
+        std::vector<double> weights = { 0, 3, 0, 1 };
+        alias_sampler sampler;
+        CPPUNIT_ASSERT(sampler.init(weights));
+        auto counts = histogram(sampler);
+        CPPUNIT_ASSERT(counts[0] == 0);
+        CPPUNIT_ASSERT(counts[2] == 0);
+        CPPUNIT_ASSERT(counts[1] > counts[3] * 2);
+
+        // a single entry is always chosen
+        CPPUNIT_ASSERT(sampler.init(std::vector<double>{ 1 }));
+        CPPUNIT_ASSERT(histogram(sampler)[0] == test_samples);
+    }
+
+    void test_invalid()
+    {
+        alias_sampler sampler;
+        CPPUNIT_ASSERT(!sampler.init(std::vector<double>()));
+        CPPUNIT_ASSERT(!sampler.init(std::vector<double>{ 0, 0 }));
+        CPPUNIT_ASSERT(!sampler.init(std::vector<double>{ 1, -1 }));
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+
+    controller.addListener(&result);
+    runner.addTest(test_alias_sampler::suite());
+    runner.run(controller);
+    outputer.write();
+
+    return 0;
+}
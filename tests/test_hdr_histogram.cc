@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "hdr_histogram.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+
+static const int64_t test_highest_trackable = 3600LL * 1000000LL; // one hour in microseconds
+
+static bool within(int64_t value, int64_t expected, double precision)
+{
+    return llabs(value - expected) <= (int64_t)(expected * precision) + 1;
+}
+
+class test_hdr_histogram : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_hdr_histogram);
+    CPPUNIT_TEST(test_index_roundtrip);
+    CPPUNIT_TEST(test_percentiles);
+    CPPUNIT_TEST(test_merge);
+    CPPUNIT_TEST(test_clamp);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+
+    void setUp() {}
+    void tearDown() {}
+
+    void test_index_roundtrip()
+    {
+        hdr_histogram h(test_highest_trackable, 3);
+        std::vector<int64_t> values = { 0, 1, 1023, 2047, 2048, 4095, 123456, 98765432, test_highest_trackable };
+        for (int64_t v : values) {
+            size_t index = h.counts_index(v);
+            CPPUNIT_ASSERT(index < h.counts.size());
+            CPPUNIT_ASSERT(h.value_at_index(index) <= v);
+            CPPUNIT_ASSERT(h.highest_equivalent_value(v) >= v);
+            CPPUNIT_ASSERT(within(h.highest_equivalent_value(v), v, 0.001));
+        }
+    }
+
+    void test_percentiles()
+    {
+        // 1..100000 microseconds uniformly
+        hdr_histogram h(test_highest_trackable, 3);
+        for (int64_t v = 1; v <= 100000; v++) {
+            h.record(v);
+        }
+        CPPUNIT_ASSERT(h.total_count == 100000);
+        CPPUNIT_ASSERT(h.min() == 1);
+        CPPUNIT_ASSERT(h.max() == 100000);
+        CPPUNIT_ASSERT(within(h.value_at_percentile(50.0), 50000, 0.001));
+        CPPUNIT_ASSERT(within(h.value_at_percentile(99.0), 99000, 0.001));
+        CPPUNIT_ASSERT(within(h.value_at_percentile(99.99), 99990, 0.001));
+        CPPUNIT_ASSERT(h.value_at_percentile(100.0) == 100000);
+        CPPUNIT_ASSERT(within((int64_t)h.mean(), 50000, 0.001));
+    }
+
+    void test_merge()
+    {
+        hdr_histogram a(test_highest_trackable, 3), b(test_highest_trackable, 3);
+        for (int64_t v = 1; v <= 1000; v++) {
+            a.record(v);
+            b.record(v * 1000);
+        }
+        a.merge(b);
+        CPPUNIT_ASSERT(a.total_count == 2000);
+        CPPUNIT_ASSERT(a.min() == 1);
+        CPPUNIT_ASSERT(a.max() == 1000000);
+        CPPUNIT_ASSERT(within(a.value_at_percentile(50.0), 1000, 0.001));
+        CPPUNIT_ASSERT(within(a.value_at_percentile(75.0), 500000, 0.001));
+
+        // extremes inside a bucket survive the merge exactly
+        hdr_histogram c(test_highest_trackable, 3), d(test_highest_trackable, 3);
+        d.record(123457);
+        d.record(98765433);
+        CPPUNIT_ASSERT(d.value_at_index(d.counts_index(123457)) != 123457);
+        c.merge(d);
+        CPPUNIT_ASSERT(c.total_count == 2);
+        CPPUNIT_ASSERT(c.min() == 123457);
+        CPPUNIT_ASSERT(c.max() == 98765433);
+    }
+
+    void test_clamp()
+    {
+        hdr_histogram h(1000, 2);
+        h.record(-5);
+        h.record(1000000);
+        CPPUNIT_ASSERT(h.total_count == 2);
+        CPPUNIT_ASSERT(h.min() == 0);
+        CPPUNIT_ASSERT(h.max() == 1000000);
+        CPPUNIT_ASSERT(h.value_at_percentile(100.0) >= 1000);
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+
+    controller.addListener(&result);
+    runner.addTest(test_hdr_histogram::suite());
+    runner.run(controller);
+    outputer.write();
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "plat_net.h"
+
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <sstream>
+
+#include "io.h"
+#include "socket.h"
+#include "http_common.h"
+#include "http_date.h"
+#include "http_access_log.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+
+static const uint64_t testrecord_time_usecs = 1382573517000000ULL; // Thu, 24 Oct 2013 00:11:57 GMT
+static const char* testrecord_common = "127.0.0.1 - - [24/Oct/2013:00:11:57 +0000] \"GET /index.html HTTP/1.1\" 200 1234";
+static const char* testrecord_combined = "127.0.0.1 - - [24/Oct/2013:00:11:57 +0000] \"GET /index.html HTTP/1.1\" 200 1234 \"-\" \"test \\\"agent\\\"\"";
+
+
+class test_http_access_log : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_http_access_log);
+    CPPUNIT_TEST(test_record_roundtrip);
+    CPPUNIT_TEST(test_record_truncate);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+
+    void setUp() {}
+    void tearDown() {}
+
+    size_t make_record(char *buf, size_t buf_len, const char *user_agent)
+    {
+        socket_addr addr;
+        socket_addr::string_to_addr("127.0.0.1:8080", addr);
+
+        http_access_log_record hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.time_usecs = testrecord_time_usecs;
+        hdr.bytes_read = 78;
+        hdr.bytes_written = 1234;
+        hdr.header_usecs = 10;
+        hdr.handler_usecs = 20;
+        hdr.total_usecs = 40;
+        hdr.status_code = 200;
+        hdr.set_peer_addr(addr);
+
+        http_header_string strings[http_access_log_string_count];
+        strings[http_access_log_string_method] = http_header_string("GET");
+        strings[http_access_log_string_uri] = http_header_string("/index.html");
+        strings[http_access_log_string_version] = http_header_string("HTTP/1.1");
+        strings[http_access_log_string_user_agent] = http_header_string(user_agent);
+        strings[http_access_log_string_host] = http_header_string("localhost");
+        return http_access_log_record::encode(buf, buf_len, hdr, strings);
+    }
+
+    void test_record_roundtrip()
+    {
+        char buf[HTTP_ACCESS_LOG_RECORD_MAX];
+        size_t len = make_record(buf, sizeof(buf), "test \"agent\"");
+        CPPUNIT_ASSERT(len > sizeof(http_access_log_record));
+        CPPUNIT_ASSERT(len % 8 == 0);
+
+        auto rec = http_access_log_record::decode(buf, len);
+        CPPUNIT_ASSERT(rec != nullptr);
+        CPPUNIT_ASSERT(rec->length == len);
+        CPPUNIT_ASSERT(rec->peer_port == 8080);
+        CPPUNIT_ASSERT(rec->get_string(http_access_log_string_host).length == 9);
+        CPPUNIT_ASSERT(rec->to_string(http_access_log_format_common) == testrecord_common);
+        CPPUNIT_ASSERT(rec->to_string(http_access_log_format_combined) == testrecord_combined);
+        CPPUNIT_ASSERT(rec->to_string(http_access_log_format_json).find("\"total_usecs\":40") != std::string::npos);
+
+        // records with a bad length are rejected
+        CPPUNIT_ASSERT(http_access_log_record::decode(buf, len - 8) == nullptr);
+    }
+
+    void test_record_truncate()
+    {
+        char buf[HTTP_ACCESS_LOG_RECORD_MAX];
+        std::string user_agent(HTTP_ACCESS_LOG_RECORD_MAX * 2, 'x');
+        size_t len = make_record(buf, sizeof(buf), user_agent.c_str());
+        CPPUNIT_ASSERT(len == HTTP_ACCESS_LOG_RECORD_MAX);
+
+        auto rec = http_access_log_record::decode(buf, len);
+        CPPUNIT_ASSERT(rec != nullptr);
+        CPPUNIT_ASSERT(rec->get_string(http_access_log_string_host).length == 0);
+        CPPUNIT_ASSERT(rec->get_string(http_access_log_string_user_agent).length < user_agent.length());
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+
+    controller.addListener(&result);
+    runner.addTest(test_http_access_log::suite());
+    runner.run(controller);
+    outputer.write();
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "http_common.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+static const char * chunked_1 = "5\r\nhello\r\n7;name=value\r\n, world\r\n0\r\n\r\n";
+static const char * chunked_2_trailers = "A\r\n0123456789\r\n0\r\nContent-MD5: abc\r\nX-Trailer: 1\r\n\r\nHTTP/1.1 200 OK\r\n";
+static const char * chunked_3_bad_size = "5\r\nhello\r\nzz\r\n";
+static const char * chunked_4_bad_data = "5\r\nhelloXX\r\n0\r\n\r\n";
+
+// feed the input in pieces of at most step bytes, returns bytes consumed
+static size_t decode(http_chunked_decoder &decoder, std::string in, size_t step, std::string &out)
+{
+    size_t offset = 0;
+    while (offset < in.size() && !decoder.is_done() && !decoder.has_error()) {
+        size_t len = std::min(step, in.size() - offset), consumed = 0;
+        while (consumed < len && !decoder.is_done() && !decoder.has_error()) {
+            const char *data;
+            size_t data_len;
+            consumed += decoder.decode(in.data() + offset + consumed, len - consumed, data, data_len);
+            out.append(data ? data : "", data_len);
+        }
+        offset += consumed;
+    }
+    return offset;
+}
+
+class test_http_chunked : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_http_chunked);
+    CPPUNIT_TEST(test_decode);
+    CPPUNIT_TEST(test_decode_split);
+    CPPUNIT_TEST(test_trailers_pipelined);
+    CPPUNIT_TEST(test_errors);
+    CPPUNIT_TEST_SUITE_END();
+    
+public:
+    
+    void setUp() {}
+    void tearDown() {}
+    
+    void test_decode()
+    {
+        http_chunked_decoder decoder;
+        std::string out;
+        CPPUNIT_ASSERT(decode(decoder, chunked_1, SIZE_MAX, out) == strlen(chunked_1));
+        CPPUNIT_ASSERT(decoder.is_done());
+        CPPUNIT_ASSERT(out == "hello, world");
+    }
+    
+    void test_decode_split()
+    {
+        // every split of the input must decode the same
+        for (size_t step = 1; step < strlen(chunked_1); step++) {
+            http_chunked_decoder decoder;
+            std::string out;
+            decode(decoder, chunked_1, step, out);
+            CPPUNIT_ASSERT(decoder.is_done());
+            CPPUNIT_ASSERT(out == "hello, world");
+        }
+    }
+    
+    void test_trailers_pipelined()
+    {
+        // decoding stops after the trailers, leaving the next response
+        http_chunked_decoder decoder;
+        std::string out;
+        size_t consumed = decode(decoder, chunked_2_trailers, SIZE_MAX, out);
+        CPPUNIT_ASSERT(decoder.is_done());
+        CPPUNIT_ASSERT(out == "0123456789");
+        CPPUNIT_ASSERT(std::string(chunked_2_trailers + consumed) == "HTTP/1.1 200 OK\r\n");
+        
+        decoder.reset();
+        out.clear();
+        decode(decoder, "0\r\n\r\n", 1, out);
+        CPPUNIT_ASSERT(decoder.is_done());
+        CPPUNIT_ASSERT(out.size() == 0);
+    }
+    
+    void test_errors()
+    {
+        http_chunked_decoder decoder;
+        std::string out;
+        decode(decoder, chunked_3_bad_size, SIZE_MAX, out);
+        CPPUNIT_ASSERT(decoder.has_error());
+        
+        decoder.reset();
+        decode(decoder, chunked_4_bad_data, SIZE_MAX, out);
+        CPPUNIT_ASSERT(decoder.has_error());
+        
+        decoder.reset();
+        decode(decoder, "fffffffffffffffff\r\n", SIZE_MAX, out);
+        CPPUNIT_ASSERT(decoder.has_error());
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+    
+    controller.addListener(&result);
+    runner.addTest(test_http_chunked::suite());
+    runner.run(controller);
+    outputer.write();
+    
+    return 0;
+}
@@ -0,0 +1,341 @@
+//
+//  test_http_server_cache.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+#include "io.h"
+#include "url.h"
+#include "log.h"
+#include "log_thread.h"
+#include "trie.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_date.h"
+#include "http_server.h"
+#include "http_server_cache.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+static const time_t now = 1000000000;
+
+static void make_request(http_request &request, const char *accept_language = nullptr)
+{
+    request.resize(4096, 64);
+    request.set_request_method(kHTTPMethodGET);
+    request.set_request_uri("/asset");
+    request.set_http_version(kHTTPVersion11);
+    if (accept_language) {
+        request.set_header_field("accept-language", accept_language);
+    }
+}
+
+static void make_response(http_response &response, int status_code, size_t content_length)
+{
+    response.resize(4096, 64);
+    response.set_http_version(kHTTPVersion11);
+    response.set_status_code(status_code);
+    response.set_reason_phrase(http_constants::get_status_text(status_code));
+    response.set_header_field(kHTTPHeaderDate, http_date(now).to_string().c_str());
+    response.set_header_field(kHTTPHeaderContentLength, std::to_string(content_length).c_str());
+}
+
+static bool fill_and_store(http_server_cache &cache, std::string key, const http_request &request,
+                           const http_response &response, std::string body, int cache_valid = 0)
+{
+    auto fill = cache.begin_fill(key, request, response, cache_valid, now);
+    if (!fill) return false;
+    std::string headers = "HTTP/1.1 200 OK\r\n\r\n";
+    fill->header_skip = headers.length();
+    std::string written = headers + body;
+    for (size_t i = 0; i < written.length(); i += 7) {
+        fill->write(written.data() + i, std::min((size_t)7, written.length() - i));
+    }
+    if (!fill->complete()) return false;
+    cache.store(fill->entry);
+    return true;
+}
+
+class test_http_server_cache : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_http_server_cache);
+    CPPUNIT_TEST(test_cache_control);
+    CPPUNIT_TEST(test_freshness);
+    CPPUNIT_TEST(test_normalize_path);
+    CPPUNIT_TEST(test_store_lookup);
+    CPPUNIT_TEST(test_vary);
+    CPPUNIT_TEST(test_not_stored);
+    CPPUNIT_TEST(test_segmented_lru);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+
+    void setUp() {}
+    void tearDown() {}
+
+    void test_cache_control()
+    {
+        http_server_cache_control cc1;
+        cc1.parse("public, max-age=60, s-maxage = 120");
+        CPPUNIT_ASSERT(!cc1.no_store && !cc1.no_cache && !cc1.is_private);
+        CPPUNIT_ASSERT(cc1.max_age == 60 && cc1.s_maxage == 120);
+
+        http_server_cache_control cc2;
+        cc2.parse("No-Cache=\"Set-Cookie, X-Foo\",private,max-age=\"30\"");
+        CPPUNIT_ASSERT(cc2.no_cache && cc2.is_private && !cc2.no_store && cc2.max_age == 30);
+
+        http_server_cache_control cc3;
+        cc3.parse(nullptr);
+        cc3.parse("no-store,,max-age=x");
+        CPPUNIT_ASSERT(cc3.no_store && cc3.max_age == -1 && cc3.s_maxage == -1);
+    }
+
+    void test_freshness()
+    {
+        http_response r1;
+        make_response(r1, HTTPStatusCodeOK, 0);
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r1, 0, now) == 0);
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r1, 30, now) == 30);
+        r1.set_header_field("expires", http_date(now + 90).to_string().c_str());
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r1, 30, now) == 90);
+        r1.set_header_field(kHTTPHeaderCacheControl, "max-age=10");
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r1, 30, now) == 10);
+
+        http_response r2;
+        make_response(r2, HTTPStatusCodeOK, 0);
+        r2.set_header_field(kHTTPHeaderCacheControl, "max-age=10, s-maxage=20");
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r2, 0, now) == 20);
+
+        http_response r3;
+        make_response(r3, HTTPStatusCodeOK, 0);
+        r3.set_header_field(kHTTPHeaderExpires, "0");
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r3, 30, now) == 0);
+
+        // cache_valid is only a default for successful responses
+        http_response r4;
+        make_response(r4, HTTPStatusCodeNotFound, 0);
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r4, 30, now) == 0);
+        r4.set_header_field(kHTTPHeaderCacheControl, "max-age=5");
+        CPPUNIT_ASSERT(http_server_cache::freshness_lifetime(r4, 30, now) == 5);
+    }
+
+    void test_normalize_path()
+    {
+        CPPUNIT_ASSERT(http_server_cache::normalize_path("/a/../b") == "/b");
+        CPPUNIT_ASSERT(http_server_cache::normalize_path("//b") == "/b");
+        CPPUNIT_ASSERT(http_server_cache::normalize_path("/%62") == "/b");
+        CPPUNIT_ASSERT(http_server_cache::normalize_path("/a/%2e%2E/b") == "/b");
+        CPPUNIT_ASSERT(http_server_cache::normalize_path("/a%2fb%3f%7E") == "/a%2Fb%3F~");
+        CPPUNIT_ASSERT(http_server_cache::normalize_path("/%zz%4") == "/%zz%4");
+
+        // equivalent spellings of a path share an entry
+        http_server_cache cache(1 << 20, 1 << 16);
+        http_request request;
+        make_request(request);
+        http_response response;
+        make_response(response, HTTPStatusCodeOK, 1);
+        CPPUNIT_ASSERT(fill_and_store(cache, http_server_cache::make_key("default", kHTTPMethodGET, "/b", nullptr),
+                                      request, response, "b", 60));
+        const char *paths[] = { "/b", "/a/../b", "//b", "/%62", "/./b" };
+        for (auto path : paths) {
+            auto entry = cache.lookup(http_server_cache::make_key("default", kHTTPMethodGET, path, nullptr), request, now);
+            CPPUNIT_ASSERT(entry && entry->body == "b");
+        }
+        CPPUNIT_ASSERT(cache.entries() == 1);
+    }
+
+    void test_store_lookup()
+    {
+        http_server_cache cache(1 << 20, 1 << 16);
+        std::string key = http_server_cache::make_key("default", kHTTPMethodGET, "/asset", "v=1");
+        CPPUNIT_ASSERT(key == "default GET /asset?v=1");
+
+        http_request request;
+        make_request(request);
+        http_response response;
+        make_response(response, HTTPStatusCodeOK, 11);
+        response.set_header_field(kHTTPHeaderCacheControl, "max-age=60");
+        response.set_header_field(kHTTPHeaderAge, "10");
+        response.set_header_field(kHTTPHeaderConnection, kHTTPTokenKeepalive);
+        CPPUNIT_ASSERT(fill_and_store(cache, key, request, response, "hello world"));
+
+        auto entry = cache.lookup(key, request, now + 5);
+        CPPUNIT_ASSERT(entry && entry->body == "hello world" && entry->status_code == HTTPStatusCodeOK);
+        CPPUNIT_ASSERT(entry->age(now + 5) == 15);
+        CPPUNIT_ASSERT(entry->get_header("cache-control") != nullptr);
+        CPPUNIT_ASSERT(entry->get_header(kHTTPHeaderConnection) == nullptr);
+        CPPUNIT_ASSERT(entry->get_header(kHTTPHeaderDate) == nullptr);
+
+        // the Age sent with the response counts against its lifetime
+        CPPUNIT_ASSERT(cache.lookup(key, request, now + 49));
+        CPPUNIT_ASSERT(!cache.lookup(key, request, now + 50));
+        CPPUNIT_ASSERT(cache.expirations == 1 && cache.entries() == 0 && cache.bytes() == 0);
+
+        // invalidation drops every variant of the key
+        CPPUNIT_ASSERT(fill_and_store(cache, key, request, response, "hello world"));
+        cache.invalidate(key);
+        CPPUNIT_ASSERT(!cache.lookup(key, request, now));
+        CPPUNIT_ASSERT(cache.invalidations == 1 && cache.hits == 2 && cache.misses == 2);
+
+        // a body longer or shorter than its length is not stored
+        CPPUNIT_ASSERT(!fill_and_store(cache, key, request, response, "hello world!"));
+        CPPUNIT_ASSERT(!fill_and_store(cache, key, request, response, "hello"));
+    }
+
+    void test_vary()
+    {
+        http_server_cache cache(1 << 20, 1 << 16);
+        std::string key = http_server_cache::make_key("default", kHTTPMethodGET, "/asset", nullptr);
+        http_request en, fr, none;
+        make_request(en, "en");
+        make_request(fr, "fr");
+        make_request(none);
+        http_response response;
+        make_response(response, HTTPStatusCodeOK, 2);
+        response.set_header_field(kHTTPHeaderVary, "Accept-Language");
+        CPPUNIT_ASSERT(fill_and_store(cache, key, en, response, "en", 60));
+        CPPUNIT_ASSERT(fill_and_store(cache, key, fr, response, "fr", 60));
+        CPPUNIT_ASSERT(cache.lookup(key, en, now)->body == "en");
+        CPPUNIT_ASSERT(cache.lookup(key, fr, now)->body == "fr");
+        CPPUNIT_ASSERT(!cache.lookup(key, none, now));
+
+        // a new response replaces the variant for the same request headers
+        CPPUNIT_ASSERT(fill_and_store(cache, key, en, response, "EN", 60));
+        CPPUNIT_ASSERT(cache.lookup(key, en, now)->body == "EN");
+        CPPUNIT_ASSERT(cache.entries() == 2);
+
+        http_response vary_all;
+        make_response(vary_all, HTTPStatusCodeOK, 2);
+        vary_all.set_header_field(kHTTPHeaderVary, "*");
+        CPPUNIT_ASSERT(!cache.begin_fill(key, en, vary_all, 60, now));
+    }
+
+    void test_not_stored()
+    {
+        http_server_cache cache(1 << 20, 1 << 10);
+        http_request request;
+        make_request(request);
+
+        http_response r1;
+        make_response(r1, HTTPStatusCodeOK, 2);
+        r1.set_header_field(kHTTPHeaderCacheControl, "no-store, max-age=60");
+        CPPUNIT_ASSERT(!cache.begin_fill("k", request, r1, 60, now));
+
+        http_response r2;
+        make_response(r2, HTTPStatusCodeOK, 2);
+        r2.set_header_field("set-cookie", "a=b");
+        CPPUNIT_ASSERT(!cache.begin_fill("k", request, r2, 60, now));
+
+        http_response r3;
+        make_response(r3, HTTPStatusCodeOK, 2048);
+        CPPUNIT_ASSERT(!cache.begin_fill("k", request, r3, 60, now));
+
+        http_response r4;
+        make_response(r4, HTTPStatusCodeFound, 2);
+        r4.set_header_field(kHTTPHeaderCacheControl, "max-age=60");
+        CPPUNIT_ASSERT(!cache.begin_fill("k", request, r4, 60, now));
+
+        http_response r5;
+        r5.resize(4096, 64);
+        r5.set_status_code(HTTPStatusCodeOK);
+        r5.set_header_field(kHTTPHeaderCacheControl, "max-age=60");
+        CPPUNIT_ASSERT(!cache.begin_fill("k", request, r5, 60, now));
+    }
+
+    void test_segmented_lru()
+    {
+        // one shard holds about 16 of these entries
+        size_t body_size = 4000;
+        http_server_cache cache(HTTP_SERVER_CACHE_SHARDS * 16 * (body_size + 300), body_size);
+        http_request request;
+        make_request(request);
+        http_response response;
+        make_response(response, HTTPStatusCodeOK, body_size);
+        std::string body(body_size, 'x');
+
+        // keys hit since they were stored survive a scan of keys requested once
+        std::vector<std::string> hot_keys;
+        for (int i = 0; i < 1000 && hot_keys.size() < 4; i++) {
+            std::string key = "hot " + std::to_string(i);
+            auto &shard = cache.get_shard(key);
+            if (&shard != &cache.shards[0]) continue;
+            CPPUNIT_ASSERT(fill_and_store(cache, key, request, response, body, 60));
+            CPPUNIT_ASSERT(cache.lookup(key, request, now));
+            hot_keys.push_back(key);
+        }
+        CPPUNIT_ASSERT(hot_keys.size() == 4);
+        for (int i = 0; i < 2000; i++) {
+            fill_and_store(cache, "cold " + std::to_string(i), request, response, body, 60);
+        }
+        CPPUNIT_ASSERT(cache.evictions > 0);
+        for (auto &key : hot_keys) {
+            CPPUNIT_ASSERT(cache.lookup(key, request, now));
+        }
+        for (auto &shard : cache.shards) {
+            CPPUNIT_ASSERT(shard.size <= cache.shard_size);
+            CPPUNIT_ASSERT(shard.protected_size <= cache.shard_size / 100 * HTTP_SERVER_CACHE_PROTECTED_PERCENT);
+            CPPUNIT_ASSERT(shard.items.size() == shard.probation.size() + shard.protected_lru.size());
+        }
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+
+    http_constants::init();
+
+    controller.addListener(&result);
+    runner.addTest(test_http_server_cache::suite());
+    runner.run(controller);
+    outputer.write();
+
+    return 0;
+}
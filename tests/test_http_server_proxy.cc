@@ -0,0 +1,547 @@
+//
+//  test_http_server_proxy.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <condition_variable>
+
+#include <sys/wait.h>
+
+#include "io.h"
+#include "url.h"
+#include "log.h"
+#include "log_thread.h"
+#include "trie.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_date.h"
+#include "http_server.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+static const char *index_html = "<html><body>latypus upstream</body></html>\n";
+
+
+/* helpers */
+
+static int free_port()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    int port = -1;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr*)&addr, &addrlen) == 0)
+    {
+        port = ntohs(addr.sin_port);
+    }
+    close(fd);
+    return port;
+}
+
+static int connect_port(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    struct timeval tv = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static bool wait_listening(int port)
+{
+    for (int i = 0; i < 500; i++) {
+        int fd = connect_port(port);
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+static bool send_all(int fd, const std::string &data)
+{
+    for (size_t off = 0; off < data.length(); ) {
+        ssize_t len = send(fd, data.data() + off, data.length() - off, MSG_NOSIGNAL);
+        if (len <= 0) return false;
+        off += len;
+    }
+    return true;
+}
+
+static void write_file(std::string path, std::string contents)
+{
+    std::ofstream out(path.c_str());
+    out << contents;
+}
+
+struct test_fd_reader
+{
+    int fd;
+    std::string buf;
+
+    test_fd_reader(int fd) : fd(fd) {}
+
+    bool fill()
+    {
+        char tmp[16384];
+        ssize_t len = recv(fd, tmp, sizeof(tmp), 0);
+        if (len <= 0) return false;
+        buf.append(tmp, len);
+        return true;
+    }
+
+    bool read_line(std::string &line)
+    {
+        size_t eol;
+        while ((eol = buf.find("\r\n")) == std::string::npos) {
+            if (!fill()) return false;
+        }
+        line = buf.substr(0, eol);
+        buf.erase(0, eol + 2);
+        return true;
+    }
+
+    bool read_bytes(std::string &out, size_t len)
+    {
+        while (buf.length() < len) {
+            if (!fill()) return false;
+        }
+        out.append(buf, 0, len);
+        buf.erase(0, len);
+        return true;
+    }
+
+    void read_to_eof(std::string &out)
+    {
+        while (fill());
+        out.append(buf);
+        buf.clear();
+    }
+};
+
+typedef std::map<std::string,std::string> test_header_map;
+
+static bool read_headers(test_fd_reader &reader, std::string &start_line, test_header_map &headers)
+{
+    if (!reader.read_line(start_line)) return false;
+    std::string line;
+    while (reader.read_line(line)) {
+        if (line.length() == 0) return true;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) return false;
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        size_t value = line.find_first_not_of(' ', colon + 1);
+        headers[name] = value == std::string::npos ? "" : line.substr(value);
+    }
+    return false;
+}
+
+static bool read_chunked(test_fd_reader &reader, std::string &body)
+{
+    std::string line;
+    while (reader.read_line(line)) {
+        size_t len = strtoul(line.c_str(), nullptr, 16);
+        if (len == 0) {
+            while (reader.read_line(line) && line.length() > 0);
+            return true;
+        }
+        if (!reader.read_bytes(body, len) || !reader.read_line(line)) return false;
+    }
+    return false;
+}
+
+struct test_response
+{
+    std::string status_line;
+    int status_code = 0;
+    test_header_map headers;
+    std::string body;
+};
+
+static test_response fetch(int port, std::string request)
+{
+    test_response response;
+    int fd = connect_port(port);
+    if (fd < 0) return response;
+    test_fd_reader reader(fd);
+    if (send_all(fd, request) && read_headers(reader, response.status_line, response.headers)) {
+        if (response.status_line.length() > 12) {
+            response.status_code = atoi(response.status_line.c_str() + 9);
+        }
+        auto cl = response.headers.find("content-length");
+        auto te = response.headers.find("transfer-encoding");
+        if (te != response.headers.end() && te->second == "chunked") {
+            if (!read_chunked(reader, response.body)) response.status_code = 0;
+        } else if (cl != response.headers.end()) {
+            if (!reader.read_bytes(response.body, strtoul(cl->second.c_str(), nullptr, 10))) response.status_code = 0;
+        } else {
+            reader.read_to_eof(response.body);
+        }
+    }
+    close(fd);
+    return response;
+}
+
+
+/*
+ * test_scripted_upstream
+ *
+ * latypus handlers don't consume request bodies or send chunked and
+ * close delimited responses, so those cases use a scripted upstream.
+ *
+ *   /echo      responds with "<method> <path> <body length>:<body>"
+ *   /chunked   responds with a chunked body
+ *   /close     responds with a close delimited body
+ */
+
+struct test_scripted_upstream
+{
+    int listen_fd = -1;
+    std::thread accept_thread;
+    std::mutex conn_mutex;
+    std::vector<int> conn_fds;
+    std::vector<std::thread> conn_threads;
+
+    bool start(int port)
+    {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+            return false;
+        }
+        accept_thread = std::thread(&test_scripted_upstream::accept_loop, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (!accept_thread.joinable()) return;
+        shutdown(listen_fd, SHUT_RDWR);
+        accept_thread.join();
+        close(listen_fd);
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            for (int fd : conn_fds) shutdown(fd, SHUT_RDWR);
+            threads.swap(conn_threads);
+        }
+        for (auto &thread : threads) thread.join();
+    }
+
+    void accept_loop()
+    {
+        int fd;
+        while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+            std::lock_guard<std::mutex> lock(conn_mutex);
+            conn_fds.push_back(fd);
+            conn_threads.push_back(std::thread(&test_scripted_upstream::serve, this, fd));
+        }
+    }
+
+    void serve(int fd)
+    {
+        test_fd_reader reader(fd);
+        std::string request_line;
+        test_header_map headers;
+        while (read_headers(reader, request_line, headers)) {
+            std::string method = request_line.substr(0, request_line.find(' '));
+            std::string path = request_line.substr(method.length() + 1);
+            path = path.substr(0, path.find(' '));
+            std::string body;
+            auto cl = headers.find("content-length");
+            auto te = headers.find("transfer-encoding");
+            if (te != headers.end() && te->second == "chunked") {
+                if (!read_chunked(reader, body)) break;
+            } else if (cl != headers.end()) {
+                if (!reader.read_bytes(body, strtoul(cl->second.c_str(), nullptr, 10))) break;
+            }
+            headers.clear();
+            if (path == "/chunked") {
+                send_all(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                             "6\r\nhello \r\n8\r\nchunked \r\n5\r\nworld\r\n0\r\n\r\n");
+            } else if (path == "/close") {
+                send_all(fd, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nclose delimited body");
+                break;
+            } else {
+                std::string out = method + " " + path + " " + std::to_string(body.length()) + ":" + body;
+                send_all(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(out.length()) + "\r\n\r\n" + out);
+            }
+        }
+        std::lock_guard<std::mutex> lock(conn_mutex);
+        conn_fds.erase(std::find(conn_fds.begin(), conn_fds.end(), fd));
+        close(fd);
+    }
+};
+
+
+/* proxy under test, a latypus upstream runs in a child process */
+
+static std::string test_dir;
+static int upstream_port, scripted_port, proxy_port;
+static pid_t upstream_pid = -1;
+static test_scripted_upstream scripted_upstream;
+static protocol_engine *proxy_engine;
+
+static void write_config(std::string path, int port, std::string name, std::string locations)
+{
+    write_file(path,
+        "proto_threads http_server/listener 1;\n"
+        "proto_threads http_server/router,http_server/worker,http_server/keepalive,"
+            "http_client/connect,http_client/worker,http_client/keepalive 2;\n"
+        "http_server {\n"
+        "    listen " + std::to_string(port) + ";\n"
+        "    server_name default;\n"
+        "    error_log " + test_dir + "/" + name + ".errors;\n"
+        "    access_log off;\n" + locations +
+        "}\n"
+        "mime_type text/html html;\n"
+        "mime_type application/octet-stream default;\n");
+}
+
+static bool start_servers()
+{
+    char dir_template[] = "/tmp/test_http_server_proxy.XXXXXX";
+    if (!mkdtemp(dir_template)) return false;
+    test_dir = dir_template;
+    mkdir((test_dir + "/html").c_str(), 0755);
+    write_file(test_dir + "/html/index.html", index_html);
+
+    upstream_port = free_port();
+    scripted_port = free_port();
+    proxy_port = free_port();
+    int down_port = free_port();
+
+    write_config(test_dir + "/upstream.cfg", upstream_port, "upstream",
+        "    location / {\n"
+        "        root " + test_dir + "/html;\n"
+        "        index index.html;\n"
+        "    }\n");
+    write_config(test_dir + "/proxy.cfg", proxy_port, "proxy",
+        "    location /lt/ {\n"
+        "        proxy_pass http://127.0.0.1:" + std::to_string(upstream_port) + "/;\n"
+        "    }\n"
+        "    location /raw/ {\n"
+        "        proxy_pass http://127.0.0.1:" + std::to_string(scripted_port) + "/;\n"
+        "    }\n"
+        "    location /down/ {\n"
+        "        proxy_pass http://127.0.0.1:" + std::to_string(down_port) + "/;\n"
+        "    }\n");
+
+    // fork the upstream before this process starts any threads
+    upstream_pid = fork();
+    if (upstream_pid == 0) {
+        protocol_engine engine;
+        engine.read_config(test_dir + "/upstream.cfg");
+        engine.bind_function<http_server>(engine.get_config(), "/echo", [](http_server_connection *conn) {
+            return std::string("echo ") + conn->request.get_request_path();
+        });
+        engine.run();
+        engine.join();
+        _exit(0);
+    }
+    if (upstream_pid < 0) return false;
+
+    if (!scripted_upstream.start(scripted_port)) return false;
+
+    proxy_engine = new protocol_engine();
+    proxy_engine->read_config(test_dir + "/proxy.cfg");
+    proxy_engine->run();
+
+    return wait_listening(upstream_port) && wait_listening(proxy_port);
+}
+
+static void stop_servers()
+{
+    if (proxy_engine) {
+        proxy_engine->stop();
+        proxy_engine->join();
+        delete proxy_engine;
+    }
+    scripted_upstream.stop();
+    if (upstream_pid > 0) {
+        kill(upstream_pid, SIGTERM);
+        waitpid(upstream_pid, nullptr, 0);
+    }
+    for (auto file : { "/html/index.html", "/upstream.cfg", "/proxy.cfg", "/upstream.errors", "/proxy.errors" }) {
+        unlink((test_dir + file).c_str());
+    }
+    rmdir((test_dir + "/html").c_str());
+    rmdir(test_dir.c_str());
+}
+
+class test_http_server_proxy : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_http_server_proxy);
+    CPPUNIT_TEST(test_get);
+    CPPUNIT_TEST(test_post_content_length);
+    CPPUNIT_TEST(test_post_chunked);
+    CPPUNIT_TEST(test_close_delimited);
+    CPPUNIT_TEST(test_http10_client);
+    CPPUNIT_TEST(test_upstream_failure);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+
+    void setUp() {}
+    void tearDown() {}
+
+    void test_get()
+    {
+        auto r1 = fetch(proxy_port, "GET /lt/index.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r1.status_code == 200);
+        CPPUNIT_ASSERT(r1.body == index_html);
+
+        auto r2 = fetch(proxy_port, "GET /lt/echo HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r2.status_code == 200);
+        CPPUNIT_ASSERT(r2.body == "echo /echo");
+
+        auto r3 = fetch(proxy_port, "GET /lt/missing.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r3.status_code == 404);
+    }
+
+    void test_post_content_length()
+    {
+        auto r1 = fetch(proxy_port, "POST /raw/echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 6\r\n"
+                                    "Connection: close\r\n\r\nabcdef");
+        CPPUNIT_ASSERT(r1.status_code == 200);
+        CPPUNIT_ASSERT(r1.body == "POST /echo 6:abcdef");
+
+        // larger than the proxy buffers so the body is streamed
+        std::string body;
+        for (size_t i = 0; body.length() < 300000; i++) body += std::to_string(i) + ",";
+        auto r2 = fetch(proxy_port, "POST /raw/echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+                                    std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body);
+        CPPUNIT_ASSERT(r2.status_code == 200);
+        CPPUNIT_ASSERT(r2.body == "POST /echo " + std::to_string(body.length()) + ":" + body);
+    }
+
+    void test_post_chunked()
+    {
+        auto r1 = fetch(proxy_port, "POST /raw/echo HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n"
+                                    "Connection: close\r\n\r\n5\r\nhello\r\n1\r\n \r\n7\r\nchunked\r\n0\r\n\r\n");
+        CPPUNIT_ASSERT(r1.status_code == 200);
+        CPPUNIT_ASSERT(r1.body == "POST /echo 13:hello chunked");
+    }
+
+    void test_close_delimited()
+    {
+        auto r1 = fetch(proxy_port, "GET /raw/close HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r1.status_code == 200);
+        CPPUNIT_ASSERT(r1.body == "close delimited body");
+    }
+
+    void test_http10_client()
+    {
+        auto r1 = fetch(proxy_port, "GET /raw/chunked HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r1.status_code == 200);
+        CPPUNIT_ASSERT(r1.headers["transfer-encoding"] == "chunked");
+        CPPUNIT_ASSERT(r1.body == "hello chunked world");
+
+        // an HTTP/1.0 client gets the body decoded and delimited by close
+        auto r2 = fetch(proxy_port, "GET /raw/chunked HTTP/1.0\r\nHost: localhost\r\n\r\n");
+        CPPUNIT_ASSERT(r2.status_code == 200);
+        CPPUNIT_ASSERT(r2.headers.find("transfer-encoding") == r2.headers.end());
+        CPPUNIT_ASSERT(r2.body == "hello chunked world");
+    }
+
+    void test_upstream_failure()
+    {
+        auto r1 = fetch(proxy_port, "GET /down/index.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r1.status_code == 502 || r1.status_code == 503);
+
+        // the proxy still serves after a failed upstream
+        auto r2 = fetch(proxy_port, "GET /lt/index.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+        CPPUNIT_ASSERT(r2.status_code == 200);
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+
+    http_constants::init();
+
+    if (!start_servers()) {
+        std::cerr << "test_http_server_proxy: failed to start servers" << std::endl;
+        stop_servers();
+        return 1;
+    }
+
+    controller.addListener(&result);
+    runner.addTest(test_http_server_proxy::suite());
+    runner.run(controller);
+    outputer.write();
+
+    stop_servers();
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+//
+//  test_http_upstream.cc
+//
+
+#include "plat_os.h"
+#include "plat_net.h"
+
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+#include "io.h"
+#include "url.h"
+#include "log.h"
+#include "log_thread.h"
+#include "hdr_histogram.h"
+#include "trie.h"
+#include "socket.h"
+#include "socket_unix.h"
+#include "resolver.h"
+#include "config_parser.h"
+#include "config.h"
+#include "pollset.h"
+#include "protocol.h"
+#include "connection.h"
+#include "protocol_thread.h"
+#include "protocol_engine.h"
+#include "protocol_connection.h"
+#include "http_common.h"
+#include "http_constants.h"
+#include "http_parser.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "http_server.h"
+#include "http_client.h"
+#include "http_server_handler_proxy.h"
+
+#include <cppunit/TestCase.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/TestSuite.h>
+#include <cppunit/TestResult.h>
+#include <cppunit/TestResultCollector.h>
+#include <cppunit/TestCaller.h>
+#include <cppunit/CompilerOutputter.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+static const uint64_t now = 1000000000ULL;
+
+static http_server_upstream_ptr make_upstream(http_upstream_policy policy, size_t num_servers)
+{
+    auto upstream = std::make_shared<http_server_upstream>("test");
+    upstream->policy = policy;
+    for (size_t i = 0; i < num_servers; i++) {
+        upstream->servers.push_back(std::make_shared<http_server_upstream_server>
+            (std::make_shared<url>("http://10.0.0." + std::to_string(i + 1) + ":8080/")));
+    }
+    upstream->init();
+    return upstream;
+}
+
+static size_t server_index(http_server_upstream_ptr upstream, http_server_upstream_server *server)
+{
+    for (size_t i = 0; i < upstream->servers.size(); i++) {
+        if (upstream->servers[i].get() == server) return i;
+    }
+    return (size_t)-1;
+}
+
+static uint64_t key(std::string str)
+{
+    return http_server_upstream::hash(str.data(), str.length());
+}
+
+class test_http_upstream : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(test_http_upstream);
+    CPPUNIT_TEST(test_round_robin);
+    CPPUNIT_TEST(test_least_outstanding);
+    CPPUNIT_TEST(test_p2c_ewma);
+    CPPUNIT_TEST(test_hash);
+    CPPUNIT_TEST(test_ejection);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+
+    void setUp() {}
+    void tearDown() {}
+
+    void test_round_robin()
+    {
+        auto upstream = make_upstream(http_upstream_policy_round_robin, 3);
+        std::vector<int> counts(3);
+        for (int i = 0; i < 300; i++) {
+            counts[server_index(upstream, upstream->choose_server(0, now))]++;
+        }
+        CPPUNIT_ASSERT(counts[0] == 100 && counts[1] == 100 && counts[2] == 100);
+    }
+
+    void test_least_outstanding()
+    {
+        auto upstream = make_upstream(http_upstream_policy_least_outstanding, 3);
+        upstream->servers[0]->active = 5;
+        upstream->servers[1]->active = 1;
+        upstream->servers[2]->active = 3;
+        for (int i = 0; i < 10; i++) {
+            CPPUNIT_ASSERT(upstream->choose_server(0, now) == upstream->servers[1].get());
+        }
+
+        // ties rotate between the least loaded servers
+        upstream->servers[2]->active = 1;
+        std::set<size_t> chosen;
+        for (int i = 0; i < 10; i++) {
+            chosen.insert(server_index(upstream, upstream->choose_server(0, now)));
+        }
+        CPPUNIT_ASSERT(chosen.size() == 2 && chosen.count(0) == 0);
+    }
+
+    void test_p2c_ewma()
+    {
+        auto upstream = make_upstream(http_upstream_policy_p2c_ewma, 2);
+        for (int i = 0; i < 20; i++) {
+            upstream->servers[0]->record_success(1000);
+            upstream->servers[1]->record_success(50000);
+        }
+        CPPUNIT_ASSERT(upstream->servers[0]->ewma_usecs == 1000);
+        CPPUNIT_ASSERT(upstream->servers[1]->ewma_usecs == 50000);
+        for (int i = 0; i < 20; i++) {
+            CPPUNIT_ASSERT(upstream->choose_server(0, now) == upstream->servers[0].get());
+        }
+
+        // enough outstanding requests outweigh the latency difference
+        upstream->servers[0]->active = 100;
+        CPPUNIT_ASSERT(upstream->choose_server(0, now) == upstream->servers[1].get());
+
+        // the ewma moves towards new samples
+        upstream->servers[1]->record_success(10000);
+        CPPUNIT_ASSERT(upstream->servers[1]->ewma_usecs == 45000);
+    }
+
+    void test_hash()
+    {
+        auto upstream = make_upstream(http_upstream_policy_hash, 4);
+        std::vector<int> counts(4);
+        std::map<std::string,size_t> placement;
+        for (int i = 0; i < 4000; i++) {
+            std::string path = "/asset/" + std::to_string(i);
+            size_t index = server_index(upstream, upstream->choose_server(key(path), now));
+            CPPUNIT_ASSERT(index == server_index(upstream, upstream->choose_server(key(path), now)));
+            placement[path] = index;
+            counts[index]++;
+        }
+        for (int count : counts) {
+            CPPUNIT_ASSERT(count > 600 && count < 1400);
+        }
+
+        // only keys of an ejected server move, and they return when it does
+        upstream->servers[2]->ejected_until_usecs = now + 1;
+        for (auto &ent : placement) {
+            size_t index = server_index(upstream, upstream->choose_server(key(ent.first), now));
+            CPPUNIT_ASSERT(index != 2);
+            CPPUNIT_ASSERT(ent.second == 2 || index == ent.second);
+        }
+        for (auto &ent : placement) {
+            CPPUNIT_ASSERT(ent.second == server_index(upstream, upstream->choose_server(key(ent.first), now + 1)));
+        }
+    }
+
+    void test_ejection()
+    {
+        auto upstream = make_upstream(http_upstream_policy_round_robin, 2);
+        auto server = upstream->servers[0];
+        CPPUNIT_ASSERT(!server->record_failure(now, 3, 10));
+        CPPUNIT_ASSERT(!server->record_failure(now, 3, 10));
+        CPPUNIT_ASSERT(server->record_failure(now, 3, 10));
+        CPPUNIT_ASSERT(!server->available(now));
+        CPPUNIT_ASSERT(server->ejected_until_usecs == now + 10000000);
+        for (int i = 0; i < 4; i++) {
+            CPPUNIT_ASSERT(upstream->choose_server(0, now) == upstream->servers[1].get());
+        }
+
+        // failures in flight while ejected are ignored, the next one after doubles it
+        CPPUNIT_ASSERT(!server->record_failure(now + 1, 3, 10));
+        uint64_t later = now + 10000000;
+        CPPUNIT_ASSERT(server->available(later));
+        CPPUNIT_ASSERT(server->record_failure(later, 3, 10));
+        CPPUNIT_ASSERT(server->ejected_until_usecs == later + 20000000);
+
+        // backoff is capped
+        for (int i = 0; i < 10; i++) {
+            later = server->ejected_until_usecs;
+            server->record_failure(later, 3, 10);
+        }
+        CPPUNIT_ASSERT(server->ejected_until_usecs == later + HTTP_PROXY_FAIL_TIMEOUT_MAX * 1000000ULL);
+
+        // a success resets it
+        later = server->ejected_until_usecs;
+        server->record_success(1000);
+        CPPUNIT_ASSERT(!server->record_failure(later, 3, 10));
+        CPPUNIT_ASSERT(server->ejections == 12);
+
+        // with every server ejected they are all eligible again
+        upstream->servers[0]->ejected_until_usecs = now + 1;
+        upstream->servers[1]->ejected_until_usecs = now + 1;
+        CPPUNIT_ASSERT(upstream->choose_server(0, now) != nullptr);
+
+        // max_fails 0 never ejects
+        CPPUNIT_ASSERT(!upstream->servers[1]->record_failure(now + 1, 0, 10));
+    }
+};
+
+int main(int argc, const char * argv[])
+{
+    CppUnit::TestResult controller;
+    CppUnit::TestResultCollector result;
+    CppUnit::TextUi::TestRunner runner;
+    CppUnit::CompilerOutputter outputer(&result, std::cerr);
+
+    controller.addListener(&result);
+    runner.addTest(test_http_upstream::suite());
+    runner.run(controller);
+    outputer.write();
+
+    return 0;
+}
@@ -5,10 +5,13 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdarg>
+#include <cstring>
 #include <cassert>
 #include <ctime>
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
 #include <queue>
 #include <atomic>
 #include <thread>
@@ -41,18 +44,20 @@ using namespace std::chrono;
 
 struct test_log_thread
 {
-    log_thread &logger;
+    log_sink &logger;
     const size_t items_per_thread;
+    const size_t thread_num;
     std::thread thread;
     
-    test_log_thread(log_thread &logger, const size_t items_per_thread)
-        : logger(logger), items_per_thread(items_per_thread), thread(&test_log_thread::mainloop, this) {}
+    test_log_thread(log_sink &logger, const size_t items_per_thread, const size_t thread_num = 0)
+        : logger(logger), items_per_thread(items_per_thread), thread_num(thread_num),
+          thread(&test_log_thread::mainloop, this) {}
     
     void mainloop()
     {
         for (size_t i = 0; i < items_per_thread; i++) {
-            char buf[16];
-            snprintf(buf, sizeof(buf), "%lu\n", i);
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%lu %lu\n", thread_num, i);
             time_t current_time = time(nullptr);
             logger.log(current_time, buf);
         }
@@ -70,6 +75,9 @@ class test_log : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(test_log);
     CPPUNIT_TEST(test_log_thread_1);
+    CPPUNIT_TEST(test_log_thread_multi_producer);
+    CPPUNIT_TEST(test_log_thread_drop);
+    CPPUNIT_TEST(test_log_writer_pool_rotate);
     CPPUNIT_TEST_SUITE_END();
     
 public:
@@ -85,31 +93,144 @@ public:
         memcpy(tmp_fname, tmp_tmpl, sizeof(tmp_fname));
         int fd = mkstemp(tmp_fname);
 
-        /* start logger thread */
-        log_thread logger(fd, 65536);
+        /* start log writer with a small ring so producers block */
+        log_writer_pool pool(1);
+        auto logger = std::make_shared<log_sink>(fd, 4, log_overflow_block);
+        pool.add_sink(logger);
         
         /* start log producer thread */
-        test_log_thread log_test(logger, 32768);
+        test_log_thread log_test(*logger, 32768);
         
         /* shutdown threads */
         log_test.thread.join();
-        logger.shutdown();
+        pool.shutdown();
+        logger->write_logs();
         
         /* close fd */
         close(fd);
         
         FILE *file = fopen(tmp_fname, "r");
         CPPUNIT_ASSERT(file != nullptr);
-        for (size_t i = 0; i < 1024; i++) {
-            char buf[16];
+        for (size_t i = 0; i < 32768; i++) {
+            char buf[32];
             char *line = fgets(buf, sizeof(buf), file);
             CPPUNIT_ASSERT(line != nullptr);
-            size_t s;
-            CPPUNIT_ASSERT(sscanf(line, "%lu", &s) == 1);
+            size_t t, s;
+            CPPUNIT_ASSERT(sscanf(line, "%lu %lu", &t, &s) == 2);
             CPPUNIT_ASSERT(s == i);
         }
         fclose(file);
         unlink(tmp_fname);
+        CPPUNIT_ASSERT(logger->records_dropped == 0);
+    }
+    
+    void test_log_thread_multi_producer()
+    {
+        char tmp_fname[FILENAME_MAX];
+        const size_t num_threads = 4, items_per_thread = 16384;
+        
+        /* create temporary file */
+        memcpy(tmp_fname, tmp_tmpl, sizeof(tmp_fname));
+        int fd = mkstemp(tmp_fname);
+        
+        /* start log writers and producer threads */
+        log_writer_pool pool(2);
+        auto logger = std::make_shared<log_sink>(fd, 4, log_overflow_block);
+        pool.add_sink(logger);
+        std::vector<std::unique_ptr<test_log_thread>> producers;
+        for (size_t t = 0; t < num_threads; t++) {
+            producers.push_back(std::unique_ptr<test_log_thread>(new test_log_thread(*logger, items_per_thread, t)));
+        }
+        for (auto &producer : producers) {
+            producer->thread.join();
+        }
+        pool.shutdown();
+        logger->write_logs();
+        close(fd);
+        
+        /* records from each producer are whole and in order */
+        std::vector<size_t> next(num_threads, 0);
+        FILE *file = fopen(tmp_fname, "r");
+        CPPUNIT_ASSERT(file != nullptr);
+        char buf[32];
+        while (fgets(buf, sizeof(buf), file)) {
+            size_t t, s;
+            CPPUNIT_ASSERT(sscanf(buf, "%lu %lu", &t, &s) == 2);
+            CPPUNIT_ASSERT(t < num_threads);
+            CPPUNIT_ASSERT(s == next[t]++);
+        }
+        fclose(file);
+        unlink(tmp_fname);
+        for (size_t t = 0; t < num_threads; t++) {
+            CPPUNIT_ASSERT(next[t] == items_per_thread);
+        }
+    }
+    
+    void test_log_thread_drop()
+    {
+        char tmp_fname[FILENAME_MAX];
+        
+        /* create temporary file */
+        memcpy(tmp_fname, tmp_tmpl, sizeof(tmp_fname));
+        int fd = mkstemp(tmp_fname);
+        
+        /* no writer so nothing drains the ring */
+        log_sink logger(fd, 4, log_overflow_drop);
+        
+        char line[64];
+        memset(line, 'x', sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\n';
+        size_t ring_records = logger.ring_size / sizeof(line);
+        for (size_t i = 0; i < ring_records + 16; i++) {
+            logger.log(0, line, sizeof(line));
+        }
+        CPPUNIT_ASSERT(logger.records_written == ring_records);
+        CPPUNIT_ASSERT(logger.records_dropped == 16);
+        
+        logger.write_logs();
+        close(fd);
+        unlink(tmp_fname);
+    }
+    
+    void test_log_writer_pool_rotate()
+    {
+        char tmp_fname[FILENAME_MAX];
+        
+        /* create temporary file */
+        memcpy(tmp_fname, tmp_tmpl, sizeof(tmp_fname));
+        close(mkstemp(tmp_fname));
+        std::string rotated_fname = std::string(tmp_fname) + ".1";
+        
+        /* sinks with the same path are shared */
+        log_writer_pool pool(2);
+        auto logger = pool.open_sink(tmp_fname, 4, log_overflow_block);
+        CPPUNIT_ASSERT(logger != nullptr);
+        CPPUNIT_ASSERT(pool.open_sink(tmp_fname, 4, log_overflow_block) == logger);
+        
+        /* log, move the file aside and rotate while producing */
+        test_log_thread log_before(*logger, 1024);
+        log_before.thread.join();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        rename(tmp_fname, rotated_fname.c_str());
+        log_writer_pool::rotate();
+        test_log_thread log_after(*logger, 1024, 1);
+        log_after.thread.join();
+        pool.shutdown();
+        logger->write_logs();
+        
+        /* every record is in one of the two files */
+        size_t lines = 0;
+        const char *fnames[] = { rotated_fname.c_str(), tmp_fname };
+        for (auto fname : fnames) {
+            FILE *file = fopen(fname, "r");
+            CPPUNIT_ASSERT(file != nullptr);
+            char buf[32];
+            while (fgets(buf, sizeof(buf), file)) lines++;
+            fclose(file);
+            unlink(fname);
+        }
+        CPPUNIT_ASSERT(lines == 2048);
+        CPPUNIT_ASSERT(logger->records_dropped == 0);
     }
 };
 
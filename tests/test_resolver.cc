@@ -15,9 +15,13 @@
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <ctime>
 #include <string>
 #include <vector>
 #include <memory>
+#include <functional>
+#include <mutex>
+#include <map>
 
 #include "log.h"
 #include "io.h"
@@ -34,6 +38,146 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include <cppunit/ui/text/TestRunner.h>
 
+/* fake nameserver answering from a table of host and qtype */
+
+struct fake_dns_record
+{
+    int rcode;
+    std::vector<std::string> addrs;
+    uint32_t ttl;
+    int64_t soa_minimum;    /* -1 omits the SOA */
+    bool drop;
+};
+
+struct fake_dns
+{
+    int fd;
+    socket_addr addr;
+    int queries;
+    std::map<std::pair<std::string,int>,fake_dns_record> records;
+
+    fake_dns() : queries(0)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.ip4addr.sin_family = AF_INET;
+        addr.ip4addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        socklen_t addrlen = sizeof(addr.ip4addr);
+        int bind_ret = bind(fd, &addr.saddr, addrlen);
+        int name_ret = getsockname(fd, &addr.saddr, &addrlen);
+        CPPUNIT_ASSERT(bind_ret == 0 && name_ret == 0);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+
+    ~fake_dns() { close(fd); }
+
+    void add(std::string host, int qtype, int rcode, std::vector<std::string> addrs,
+             uint32_t ttl = 300, int64_t soa_minimum = -1, bool drop = false)
+    {
+        records[std::pair<std::string,int>(host, qtype)] = fake_dns_record{rcode, addrs, ttl, soa_minimum, drop};
+    }
+
+    static void put16(std::string &out, uint16_t val) { out.push_back((char)(val >> 8)); out.push_back((char)val); }
+    static void put32(std::string &out, uint32_t val) { put16(out, (uint16_t)(val >> 16)); put16(out, (uint16_t)val); }
+
+    std::string answer(const char *query, size_t len)
+    {
+        // question name is uncompressed in queries
+        size_t offset = 12;
+        std::string host;
+        while (offset < len && query[offset]) {
+            if (host.size() > 0) host.push_back('.');
+            host.append(query + offset + 1, (uint8_t)query[offset]);
+            offset += (uint8_t)query[offset] + 1;
+        }
+        int qtype = ((uint8_t)query[offset + 1] << 8) | (uint8_t)query[offset + 2];
+        std::string question(query + 12, offset + 5 - 12);
+        auto ri = records.find(std::pair<std::string,int>(host, qtype));
+        if (ri == records.end() || ri->second.drop) {
+            return std::string();
+        }
+        const fake_dns_record &rec = ri->second;
+        std::string out(query, 2);
+        out.push_back((char)0x81);
+        out.push_back((char)(0x80 | rec.rcode));
+        put16(out, 1);
+        put16(out, (uint16_t)rec.addrs.size());
+        put16(out, rec.soa_minimum >= 0 ? 1 : 0);
+        put16(out, 0);
+        out.append(question);
+        for (auto &addr_str : rec.addrs) {
+            char buf[16];
+            bool v6 = inet_pton(AF_INET6, addr_str.c_str(), buf) == 1;
+            if (!v6) inet_pton(AF_INET, addr_str.c_str(), buf);
+            put16(out, 0xc00c);
+            put16(out, qtype);
+            put16(out, 1);
+            put32(out, rec.ttl);
+            put16(out, v6 ? 16 : 4);
+            out.append(buf, v6 ? 16 : 4);
+        }
+        if (rec.soa_minimum >= 0) {
+            put16(out, 0xc00c);
+            put16(out, 6);
+            put16(out, 1);
+            put32(out, 3600);
+            put16(out, 2 + 2 + 20);
+            put16(out, 0xc00c);
+            put16(out, 0xc00c);
+            put32(out, 1);
+            put32(out, 7200);
+            put32(out, 900);
+            put32(out, 86400);
+            put32(out, (uint32_t)rec.soa_minimum);
+        }
+        return out;
+    }
+
+    void serve()
+    {
+        char buf[512];
+        socket_addr src;
+        socklen_t srclen = sizeof(src);
+        ssize_t len;
+        while ((len = recvfrom(fd, buf, sizeof(buf), 0, &src.saddr, &srclen)) > 0) {
+            queries++;
+            std::string out = answer(buf, len);
+            if (out.size() > 0) {
+                sendto(fd, out.data(), out.size(), 0, &src.saddr, srclen);
+            }
+            srclen = sizeof(src);
+        }
+    }
+};
+
+struct fake_dns_result
+{
+    bool done;
+    bool found;
+    socket_addr addr;
+
+    fake_dns_result() : done(false), found(false) { memset(&addr, 0, sizeof(addr)); }
+
+    resolver_callback callback()
+    {
+        return [this] (bool found, const socket_addr &addr) {
+            this->done = true;
+            this->found = found;
+            this->addr = addr;
+        };
+    }
+};
+
+static void run_resolver(resolver &dns, fake_dns &server, fake_dns_result &result)
+{
+    for (int i = 0; i < 2000 && !result.done; i++) {
+        server.serve();
+        dns.handle_events();
+        dns.handle_timeouts();
+        usleep(1000);
+    }
+}
+
 class test_resolver : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(test_resolver);
@@ -41,11 +185,17 @@ class test_resolver : public CppUnit::TestFixture
     CPPUNIT_TEST(test_resolve_localhost_2_ok);
     CPPUNIT_TEST(test_resolve_hostname_ok);
     CPPUNIT_TEST(test_resolve_unknwonhost_4_err);
+    CPPUNIT_TEST(test_encode_decode);
+    CPPUNIT_TEST(test_async_a_cached);
+    CPPUNIT_TEST(test_async_prefer_aaaa);
+    CPPUNIT_TEST(test_async_nxdomain_cached);
+    CPPUNIT_TEST(test_async_timeout);
+    CPPUNIT_TEST(test_cache_ttl);
     CPPUNIT_TEST_SUITE_END();
     
 public:
     
-    void setUp() {}
+    void setUp() { resolver::get_cache().clear(); }
     void tearDown() {}
     
     void test_resolve_localhost_1_ok()
@@ -89,6 +239,126 @@ public:
         bool result = dns.lookup(addr, "unknown.host");
         CPPUNIT_ASSERT(result == false);
     }
+
+    void test_encode_decode()
+    {
+        fake_dns server;
+        server.add("www.example.com", resolver_qtype_a, 0, { "10.1.2.3", "10.1.2.4" }, 120);
+        char buf[512];
+        size_t len = resolver::encode_query(buf, sizeof(buf), 0x1234, "www.example.com.", resolver_qtype_a);
+        CPPUNIT_ASSERT(len == 12 + 17 + 4);
+        std::string response = server.answer(buf, len);
+        resolver_answer answer;
+        CPPUNIT_ASSERT(resolver::decode_response(response.data(), response.size(), answer));
+        CPPUNIT_ASSERT(answer.id == 0x1234);
+        CPPUNIT_ASSERT(answer.rcode == 0);
+        CPPUNIT_ASSERT(answer.qname == "www.example.com");
+        CPPUNIT_ASSERT(answer.qtype == resolver_qtype_a);
+        CPPUNIT_ASSERT(answer.addrs.size() == 2);
+        CPPUNIT_ASSERT(answer.ttl == 120);
+        CPPUNIT_ASSERT(answer.negative_ttl == -1);
+        CPPUNIT_ASSERT(resolver::decode_response(buf, len, answer) == false);
+        CPPUNIT_ASSERT(resolver::encode_query(buf, sizeof(buf), 1, "bad..name", resolver_qtype_a) == 0);
+    }
+
+    void test_async_a_cached()
+    {
+        // AAAA has no data so the A answer is used and both are cached
+        fake_dns server;
+        server.add("a.test", resolver_qtype_a, 0, { "10.0.0.1" });
+        server.add("a.test", resolver_qtype_aaaa, 0, {}, 0, 60);
+        resolver dns;
+        dns.init({ server.addr }, 1000, true);
+        fake_dns_result first;
+        dns.lookup_async("a.test", 80, first.callback());
+        run_resolver(dns, server, first);
+        CPPUNIT_ASSERT(first.found);
+        CPPUNIT_ASSERT(socket_addr::addr_to_string(first.addr) == "10.0.0.1:80");
+        CPPUNIT_ASSERT(server.queries == 2);
+
+        fake_dns_result second;
+        dns.lookup_async("A.Test", 8080, second.callback());
+        CPPUNIT_ASSERT(second.done && second.found);
+        CPPUNIT_ASSERT(socket_addr::addr_to_string(second.addr) == "10.0.0.1:8080");
+        server.serve();
+        CPPUNIT_ASSERT(server.queries == 2);
+    }
+
+    void test_async_prefer_aaaa()
+    {
+        fake_dns server;
+        server.add("both.test", resolver_qtype_a, 0, { "10.0.0.2" });
+        server.add("both.test", resolver_qtype_aaaa, 0, { "fd00::2" });
+        resolver dns;
+        dns.init({ server.addr }, 1000, true);
+        fake_dns_result result;
+        dns.lookup_async("both.test", 443, result.callback());
+        run_resolver(dns, server, result);
+        CPPUNIT_ASSERT(result.found);
+        CPPUNIT_ASSERT(result.addr.saddr.sa_family == AF_INET6);
+        CPPUNIT_ASSERT(result.addr.ip6addr.sin6_port == htons(443));
+
+        // with ipv6 off only A is asked
+        resolver::get_cache().clear();
+        resolver dns4;
+        dns4.init({ server.addr }, 1000, false);
+        fake_dns_result result4;
+        dns4.lookup_async("both.test", 443, result4.callback());
+        run_resolver(dns4, server, result4);
+        CPPUNIT_ASSERT(result4.found);
+        CPPUNIT_ASSERT(socket_addr::addr_to_string(result4.addr) == "10.0.0.2:443");
+        CPPUNIT_ASSERT(server.queries == 3);
+    }
+
+    void test_async_nxdomain_cached()
+    {
+        fake_dns server;
+        server.add("missing.test", resolver_qtype_a, 3, {}, 0, 60);
+        server.add("missing.test", resolver_qtype_aaaa, 3, {}, 0, 60);
+        resolver dns;
+        dns.init({ server.addr }, 1000, true);
+        fake_dns_result first;
+        dns.lookup_async("missing.test", 80, first.callback());
+        run_resolver(dns, server, first);
+        CPPUNIT_ASSERT(first.done && !first.found);
+        int queries = server.queries;
+
+        fake_dns_result second;
+        dns.lookup_async("missing.test", 80, second.callback());
+        CPPUNIT_ASSERT(second.done && !second.found);
+        server.serve();
+        CPPUNIT_ASSERT(server.queries == queries);
+    }
+
+    void test_async_timeout()
+    {
+        fake_dns server;
+        server.add("slow.test", resolver_qtype_a, 0, { "10.0.0.3" }, 300, -1, true);
+        resolver dns;
+        dns.init({ server.addr }, 20, false);
+        fake_dns_result result;
+        dns.lookup_async("slow.test", 80, result.callback());
+        CPPUNIT_ASSERT(dns.next_timeout_msecs() > 0);
+        run_resolver(dns, server, result);
+        CPPUNIT_ASSERT(result.done && !result.found);
+        CPPUNIT_ASSERT(server.queries == RESOLVER_ATTEMPTS);
+        CPPUNIT_ASSERT(dns.next_timeout_msecs() == -1);
+    }
+
+    void test_cache_ttl()
+    {
+        resolver_cache &cache = resolver::get_cache();
+        socket_addr addr;
+        CPPUNIT_ASSERT(resolver::parse_nameserver("10.0.0.4", addr));
+        cache.insert("ttl.test", AF_INET, { addr }, 10, 1000);
+        resolver_cache_entry entry;
+        CPPUNIT_ASSERT(cache.find("ttl.test", AF_INET, 1009, entry));
+        CPPUNIT_ASSERT(entry.addrs.size() == 1);
+        CPPUNIT_ASSERT(!cache.find("ttl.test", AF_INET6, 1009, entry));
+        CPPUNIT_ASSERT(!cache.find("ttl.test", AF_INET, 1010, entry));
+        cache.insert("ttl.test", AF_INET, { addr }, 1000000, 1000);
+        CPPUNIT_ASSERT(!cache.find("ttl.test", AF_INET, 1000 + RESOLVER_TTL_MAX, entry));
+    }
 };
 
 int main(int argc, const char * argv[])